@@ -24,9 +24,20 @@
 
 BaseApp *app = new App();
 
-#define SUBDIV_LEVEL 3
 #define POW4(x) (1 << (2 * (x)))
-#define SPHERE_SIZE (8 * 3 * POW4(SUBDIV_LEVEL))
+#define SPHERE_SIZE(level) (8 * 3 * POW4(level))
+
+// Largest distance in pixels a light volume may extend past the light sphere on screen
+#define SPHERE_LOD_PIXEL_ERROR 2.0f
+
+// Selects the compressed vertex decoding in the map shaders
+#define PACKED_VERTEX_DEFINE "#define PACKED_VERTEX\n"
+
+// Writes the defines of a map shader, with the compressed vertex decoding if the map is compressed
+static const char *getMapDefines(char *dest, const bool packed, const char *defines){
+  sprintf(dest, "%s%s", packed? PACKED_VERTEX_DEFINE : "", defines);
+  return dest;
+}
 
 enum LightCountPerFragment
 { 
@@ -36,38 +47,12 @@ enum LightCountPerFragment
   LCPF_Four  = 3   // Max of 4 lights per fragment supported
 };
 
-LightData App::lightDataArray[MAX_LIGHT_TOTAL] = {
-#include "LightPositions.h"
-};
-
-///////////////////////////////////////////////////////////////////////////////
-//
-LightData::LightData(const vec3& setColor, const vec3& setPosition, float setSize):
-  isEnabled(false),
-  screenX(0),
-  screenY(0),
-  screenWidth(0),
-  screenHeight(0),
-  color(setColor),
-  position(setPosition),
-  size(setSize)
-{
-}
-
 ///////////////////////////////////////////////////////////////////////////////
 //
 App::App():
-  bitMaskLightColors(TEXTURE_NONE),
-  bitMaskLightPos   (TEXTURE_NONE),
-  staticLightSceneSet(false)
+  staticLightSceneSet(false),
+  benchmarksPending(false)
 {
-  lightDataArray[0].color = vec3(1, 0.7f, 0.2f);
-  lightDataArray[1].color = vec3(0.8f, 1, 0.9f);
-  lightDataArray[2].color = vec3(1, 0.2f, 0.1f);
-
-  lightDataArray[0].size = 0.0f;
-  lightDataArray[1].size = 0.0f;
-  lightDataArray[2].size = 0.0f;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -93,27 +78,59 @@ void subDivide(vec3 *&dest, const vec3 &v0, const vec3 &v1, const vec3 &v2, int
 //
 void App::createSphereModel(){
 
-  // Do not like this - allocating an array of vec3's but Model class just calls delete, not delete [] (or for the right type)
-	vec3 *sphere = new vec3[SPHERE_SIZE];
-	vec3 *dest = sphere;
+  // Create a sphere for each subdivision level, with the lowest detail first
+  for(uint level=0; level<SPHERE_LOD_COUNT; level++){
+
+    // Do not like this - allocating an array of vec3's but Model class just calls delete, not delete [] (or for the right type)
+    vec3 *sphere = new vec3[SPHERE_SIZE(level)];
+    vec3 *dest = sphere;
+
+    subDivide(dest, vec3(0, 1,0), vec3( 0,0, 1), vec3( 1,0, 0), level);
+    subDivide(dest, vec3(0, 1,0), vec3( 1,0, 0), vec3( 0,0,-1), level);
+    subDivide(dest, vec3(0, 1,0), vec3( 0,0,-1), vec3(-1,0, 0), level);
+    subDivide(dest, vec3(0, 1,0), vec3(-1,0, 0), vec3( 0,0, 1), level);
+
+    subDivide(dest, vec3(0,-1,0), vec3( 1,0, 0), vec3( 0,0, 1), level);
+    subDivide(dest, vec3(0,-1,0), vec3( 0,0, 1), vec3(-1,0, 0), level);
+    subDivide(dest, vec3(0,-1,0), vec3(-1,0, 0), vec3( 0,0,-1), level);
+    subDivide(dest, vec3(0,-1,0), vec3( 0,0,-1), vec3( 1,0, 0), level);
+
+    // The vertices are on the unit sphere, so the faces cut inside it. Push the faces out
+    // until the closest one touches the sphere, so the volume never under-covers the light.
+    float minDist = 1.0f;
+    for(uint i=0; i<uint(SPHERE_SIZE(level)); i += 3){
+      vec3 normal = normalize(cross(sphere[i + 1] - sphere[i], sphere[i + 2] - sphere[i]));
+      minDist = min(minDist, fabsf(dot(normal, sphere[i])));
+    }
+    for(uint i=0; i<uint(SPHERE_SIZE(level)); i++){
+      sphere[i] /= minDist;
+    }
 
-	subDivide(dest, vec3(0, 1,0), vec3( 0,0, 1), vec3( 1,0, 0), SUBDIV_LEVEL);
-	subDivide(dest, vec3(0, 1,0), vec3( 1,0, 0), vec3( 0,0,-1), SUBDIV_LEVEL);
-	subDivide(dest, vec3(0, 1,0), vec3( 0,0,-1), vec3(-1,0, 0), SUBDIV_LEVEL);
-	subDivide(dest, vec3(0, 1,0), vec3(-1,0, 0), vec3( 0,0, 1), SUBDIV_LEVEL);
+    // Relative distance the faces can extend past the sphere (at the vertices)
+    sphereLODError[level] = 1.0f / minDist - 1.0f;
 
-	subDivide(dest, vec3(0,-1,0), vec3( 1,0, 0), vec3( 0,0, 1), SUBDIV_LEVEL);
-	subDivide(dest, vec3(0,-1,0), vec3( 0,0, 1), vec3(-1,0, 0), SUBDIV_LEVEL);
-	subDivide(dest, vec3(0,-1,0), vec3(-1,0, 0), vec3( 0,0,-1), SUBDIV_LEVEL);
-	subDivide(dest, vec3(0,-1,0), vec3( 0,0,-1), vec3( 1,0, 0), SUBDIV_LEVEL);
+    sphereModels[level] = new Model();
 
-	sphereModel = new Model();
+    sphereModels[level]->addStream(TYPE_VERTEX, 3, SPHERE_SIZE(level), (float*)sphere, NULL, false);
+    sphereModels[level]->setIndexCount(SPHERE_SIZE(level));
+    sphereModels[level]->addBatch(0, SPHERE_SIZE(level));
 
-	sphereModel->addStream(TYPE_VERTEX, 3, SPHERE_SIZE, (float*)sphere, NULL, false);
-  sphereModel->setIndexCount(SPHERE_SIZE);
-  sphereModel->addBatch(0, SPHERE_SIZE);
+    sphereModels[level]->cleanUp();
+  }
+}
 
-  sphereModel->cleanUp();
+///////////////////////////////////////////////////////////////////////////////
+//
+uint App::getSphereLOD(const uint lightIndex){
+
+  // Pick the lowest detail sphere that stays within the pixel error at the light's screen size
+  float screenRadius = 0.5f * (float) max(lightStore.getScreenWidth(lightIndex), lightStore.getScreenHeight(lightIndex));
+  for(uint level=0; level<SPHERE_LOD_COUNT - 1; level++){
+    if(sphereLODError[level] * screenRadius <= SPHERE_LOD_PIXEL_ERROR){
+      return level;
+    }
+  }
+  return SPHERE_LOD_COUNT - 1;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -140,8 +157,13 @@ void App::moveCamera(const vec3 &dir){
 }
 
 bool App::init(){
+
+  // Build the BSP, update the PFX lights and bin the light clusters on all cores (the main thread also does work)
+  workerPool.start(max(cpuCount - 1, 0));
+  cpuHz = getHz();
+
   map = new Model();
-  if (!map->loadObj("../Models/Room6/Map.obj")){
+  if (!map->loadObj("../Models/Room6/Map.obj", &workerPool)){
     delete map;
     return false;
   }
@@ -171,21 +193,34 @@ bool App::init(){
   horseModel->save("../Models/Horse.hmdl");
   //*/
 
-  if (!horseModel->load("../Models/Horse.hmdl")){
-		ErrorMsg("Couldn't load model file");
-		return false;
-	}
+  // The compiled model is mapped and uploaded as is, it's compiled again from the source model when that changes
+  if (!horseModel->loadCached("../Models/Horse.hmdl", "../Models/Horse.chmdl")){
+    ErrorMsg("Couldn't load model file");
+    return false;
+  }
   //*/
 
-  bsp.build();
+  // The compiled BSP is cached next to the map, a changed map gets rebuilt
+  bsp.buildCached("../Models/Room6/Map.cbsp", 3, 1, 0.001f, BSP_DEFAULT_SAMPLES, &workerPool);
 
-  map->computeTangentSpace(true);
+  // Weld the map streams in parallel before the tangent space assembles them
+  map->optimize(0, &workerPool);
+  map->computeTangentSpace(true, &workerPool);
   map->cleanUp();
-  map->changeAllGeneric(true);
 
   // Create the render sphere model
   createSphereModel();
 
+  // Start with the static light positions, the primary lights get animated
+  SetStaticLightScene();
+  lightStore.setColor(0, vec3(1, 0.7f, 0.2f));
+  lightStore.setColor(1, vec3(0.8f, 1, 0.9f));
+  lightStore.setColor(2, vec3(1, 0.2f, 0.1f));
+
+  lightStore.setSize(0, 0.0f);
+  lightStore.setSize(1, 0.0f);
+  lightStore.setSize(2, 0.0f);
+
   int tab = configDialog->addTab("Rendering");
   
   configDialog->addWidget(tab, animateLights = new CheckBox(0, 0, 350, 36, "Animate lights", true));
@@ -195,27 +230,45 @@ bool App::init(){
   configDialog->addWidget(tab, lightCountPerFragment = new DropDownList(0, 100, 350, 36));
   configDialog->addWidget(tab, useStencilMasking = new CheckBox(0, 140, 350, 36, "Use stencil volumes",  false));
   configDialog->addWidget(tab, useDepthBoundsTest = new CheckBox(0, 180, 350, 36, "Use depth bounds test",  true));
+  configDialog->addWidget(tab, use16BitIndices = new CheckBox(0, 220, 350, 36, "Use 16-bit light indices",  false));
+
+  configDialog->addWidget(tab, doPrecisionTest = new CheckBox(0, 260, 350, 36, "Precision Test",  false));
+
+  int optimizationTab = configDialog->addTab("Optimizations");
 
-  configDialog->addWidget(tab, doPrecisionTest = new CheckBox(0, 240, 350, 36, "Precision Test",  false));
+  configDialog->addWidget(optimizationTab, useLightClusters = new CheckBox(0, 0, 350, 36, "Use CPU light clusters",  false));
+  configDialog->addWidget(optimizationTab, useInstancedVolumes = new CheckBox(0, 40, 350, 36, "Use instanced light volumes",  true));
+  configDialog->addWidget(optimizationTab, compressMapVertices = new CheckBox(0, 80, 350, 36, "Compress map vertices",  false));
+  compressMapVertices->setListener(this);
 
   // Select the rendering tab as the active tab
   configDialog->setCurrentTab(tab);
 
   // Update the PFX moving lights into a stable starting condition
   // (spool up PFX)
+  seedLightParticles();
   for(uint i=0; i<240; i++)
   {
     updateLights(1.0f/30.0f);
   }
 
+  clusterBinTime = 0.0f;
+
+  // The benchmarks and checks run once the first load is done, when asked for in the config
+  benchmarksPending = config.getBoolDef("RunBenchmarks", false);
+
   return true;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 //
 void App::exit(){
+  workerPool.stop();
+
   delete map;
-  delete sphereModel;
+  for(uint i=0; i<SPHERE_LOD_COUNT; i++){
+    delete sphereModels[i];
+  }
   delete horseModel;
 }
 
@@ -227,6 +280,7 @@ void App::onSize(const int w, const int h){
   if (renderer){
     // Make sure render targets are the size of the window
     renderer->resizeRenderTarget(lightIndexBuffer, w, h, 1, 1);
+    renderer->resizeRenderTarget(lightIndexBuffer16, w, h, 1, 1);
     renderer->resizeRenderTarget(depthRT, w, h, 1, 1);
   }
 }
@@ -286,6 +340,18 @@ bool App::onMouseWheel(const int x, const int y, const int scroll){
   return OpenGLApp::onMouseWheel(x, y, scroll);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+void App::onCheckBoxClicked(CheckBox *checkBox){
+
+  // Reload to rebuild the map buffers and shaders with or without compression
+  if(checkBox == compressMapVertices){
+    closeWindow(false, true);
+  }
+
+  OpenGLApp::onCheckBoxClicked(checkBox);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 bool App::load(){
@@ -300,8 +366,36 @@ bool App::load(){
     return false;
   }
 
+  // The map is drawn with compressed vertices if selected, which are all bound as generic attributes.
+  // Half float texcoords depend on the extensions, which are only known once the context exists.
+  // It is opt-in, and warns if validation puts any error above its bound, including how far the tangent
+  // frames turn to be made orthonormal for the quaternions.
+  bool packedMap = compressMapVertices->isChecked();
+  map->setCompression(packedMap? COMPRESS_POSITION | COMPRESS_TANGENT_FRAME | (GL_ARB_half_float_vertex_supported? COMPRESS_TEXCOORD : 0) : 0);
+  if(packedMap){
+    CompressionError error, bound;
+    if (!map->validateCompression(error, bound)){
+      char str[256];
+      sprintf(str, "Map vertex compression is above its error bounds:\nPosition %g (%g)\nTexcoord %g (%g)\nTangent frame %g (%g) rad, made orthonormal %g (%g) rad",
+        error.position, bound.position, error.texCoord, bound.texCoord, error.normal, bound.normal, error.frame, bound.frame);
+      WarningMsg(str);
+    }
+  }
+
+  // The map is seen from the inside, so its overdraw order is for a view from the middle of it
+  float mapMin[3], mapMax[3];
+  map->getBoundingBox(map->findStream(TYPE_VERTEX), mapMin, mapMax);
+  float mapCenter[3] = { 0.5f * (mapMin[0] + mapMax[0]), 0.5f * (mapMin[1] + mapMax[1]), 0.5f * (mapMin[2] + mapMax[2]) };
+  map->setOptimizeOrder(true, mapCenter);
+
+  // The depth passes draw the map and the horse from position only buffers
+  map->setPositionOnly(true);
   if (!map->makeDrawable(renderer)) return false;
-  if (!sphereModel->makeDrawable(renderer)) return false;
+
+  for(uint i=0; i<SPHERE_LOD_COUNT; i++){
+    if (!sphereModels[i]->makeDrawable(renderer)) return false;
+  }
+  horseModel->setPositionOnly(true);
   if (!horseModel->makeDrawable(renderer)) return false;
 
   // Samplerstates
@@ -315,6 +409,7 @@ bool App::load(){
 
   // Create the light direction buffers
   if ((lightIndexBuffer = renderer->addRenderTarget(width, height, FORMAT_RGBA8, pointClamp)) == TEXTURE_NONE) return false;
+  if ((lightIndexBuffer16 = renderer->addRenderTarget(width, height, FORMAT_RGBA16, pointClamp)) == TEXTURE_NONE) return false;
   if ((depthRT = renderer->addRenderDepth(width, height, fboDepthBits)) == TEXTURE_NONE) return false;
 
   // Shaders
@@ -323,8 +418,15 @@ bool App::load(){
   if ((plainColor = renderer->addShader("plainColor.shd")) == SHADER_NONE) return false;
   if ((depthOnly = renderer->addShader("depthOnly.shd")) == SHADER_NONE) return false;
 
-  if ((lightingMP = renderer->addShader("lightingMP.shd", attribs, elementsOf(attribs))) == SHADER_NONE) return false;
-  if ((lightingMP_ambient = renderer->addShader("lightingMP_ambient.shd", attribs, elementsOf(attribs))) == SHADER_NONE) return false;
+  // The map shaders decode the compressed vertices if the map is compressed
+  const char *packedAttribs[] = { NULL, "textureCoord", "tangentFrame" };
+  const char **mapAttribs = packedMap? packedAttribs : attribs;
+  int nMapAttribs = packedMap? elementsOf(packedAttribs) : elementsOf(attribs);
+  char mapDefines[320];
+  if ((depthOnly_packed = renderer->addShader("depthOnly.shd", getMapDefines(mapDefines, packedMap, ""))) == SHADER_NONE) return false;
+
+  if ((lightingMP = renderer->addShader("lightingMP.shd", mapAttribs, nMapAttribs, getMapDefines(mapDefines, packedMap, ""))) == SHADER_NONE) return false;
+  if ((lightingMP_ambient = renderer->addShader("lightingMP_ambient.shd", mapAttribs, nMapAttribs, getMapDefines(mapDefines, packedMap, ""))) == SHADER_NONE) return false;
 
   if ((lightingMP_stone = renderer->addShader("lightingMP_stone.shd")) == SHADER_NONE) return false;
   if ((lightingMP_stone_ambient = renderer->addShader("lightingMP_stone_ambient.shd")) == SHADER_NONE) return false;
@@ -332,13 +434,21 @@ bool App::load(){
   // Depth only pass for main view
   if ((lightingColorOnly = renderer->addShader("lightingColorOnly.shd")) == SHADER_NONE) return false;
   if ((lightingColorOnly_depthClamp = renderer->addShader("lightingColorOnly.shd", "#define CLAMP_DEPTH 1\n")) == SHADER_NONE) return false;
+
+  // Draw all the light volumes in one call if instancing and vertex texture fetch is supported
+  lightingColorOnly_instanced = SHADER_NONE;
+  if(renderer->supportsInstancing()){
+    char defines[128];
+    sprintf(defines, "#define INSTANCED\n#define LIGHT_INSTANCE_WIDTH %d.0\n#define LIGHT_INSTANCE_HEIGHT %d.0\n", LIGHT_INSTANCE_WIDTH, LIGHT_INSTANCE_HEIGHT);
+    lightingColorOnly_instanced = renderer->addShader("lightingColorOnly.shd", defines, ALLOW_FAILURE);
+  }
   
-  if ((lightingLIDefer[LCPF_One] = renderer->addShader("lightingLIDefer.shd", attribs, elementsOf(attribs), "#define OVERLAP_LIGHTS 1\n")) == SHADER_NONE) return false;
-  if ((lightingLIDefer[LCPF_Two] = renderer->addShader("lightingLIDefer.shd", attribs, elementsOf(attribs), "#define OVERLAP_LIGHTS 2\n")) == SHADER_NONE) return false;
-  if ((lightingLIDefer[LCPF_Three] = renderer->addShader("lightingLIDefer.shd", attribs, elementsOf(attribs), "#define OVERLAP_LIGHTS 3\n")) == SHADER_NONE) return false;
+  if ((lightingLIDefer[LCPF_One] = renderer->addShader("lightingLIDefer.shd", mapAttribs, nMapAttribs, getMapDefines(mapDefines, packedMap, "#define OVERLAP_LIGHTS 1\n"))) == SHADER_NONE) return false;
+  if ((lightingLIDefer[LCPF_Two] = renderer->addShader("lightingLIDefer.shd", mapAttribs, nMapAttribs, getMapDefines(mapDefines, packedMap, "#define OVERLAP_LIGHTS 2\n"))) == SHADER_NONE) return false;
+  if ((lightingLIDefer[LCPF_Three] = renderer->addShader("lightingLIDefer.shd", mapAttribs, nMapAttribs, getMapDefines(mapDefines, packedMap, "#define OVERLAP_LIGHTS 3\n"))) == SHADER_NONE) return false;
 
   // Some shader limited cards cannot compile 4 lights per fragment
-  if ((lightingLIDefer[LCPF_Four] = renderer->addShader("lightingLIDefer.shd", attribs, elementsOf(attribs), "#define OVERLAP_LIGHTS 4\n", ALLOW_FAILURE)) == SHADER_NONE)
+  if ((lightingLIDefer[LCPF_Four] = renderer->addShader("lightingLIDefer.shd", mapAttribs, nMapAttribs, getMapDefines(mapDefines, packedMap, "#define OVERLAP_LIGHTS 4\n"), ALLOW_FAILURE)) == SHADER_NONE)
   {
     lightingLIDefer[LCPF_Four] = lightingLIDefer[LCPF_Three];
   }
@@ -353,6 +463,36 @@ bool App::load(){
     lightingLIDefer_stone[LCPF_Four] = lightingLIDefer_stone[LCPF_Three];
   }
 
+  // 16-bit light index versions, the light tables get more rows past 255 lights
+  for(uint i=0; i<4; i++){
+    char defines[128];
+    sprintf(defines, "#define OVERLAP_LIGHTS %d\n#define LIGHT_INDEX_BITS 16\n#define LIGHT_TABLE_HEIGHT %d\n", i + 1, LIGHT_TABLE_HEIGHT);
+
+    // Some shader limited cards cannot compile 4 lights per fragment
+    uint flags = (i == LCPF_Four) ? ALLOW_FAILURE : 0;
+    if ((lightingLIDefer16[i] = renderer->addShader("lightingLIDefer.shd", mapAttribs, nMapAttribs, getMapDefines(mapDefines, packedMap, defines), flags)) == SHADER_NONE)
+    {
+      if(i != LCPF_Four) return false;
+      lightingLIDefer16[i] = lightingLIDefer16[LCPF_Three];
+    }
+    if ((lightingLIDefer16_stone[i] = renderer->addShader("lightingLIDefer_stone.shd", defines, flags)) == SHADER_NONE)
+    {
+      if(i != LCPF_Four) return false;
+      lightingLIDefer16_stone[i] = lightingLIDefer16_stone[LCPF_Three];
+    }
+  }
+
+  // Clustered versions, the light lists come from the CPU binned cluster textures
+  {
+    char defines[256];
+    sprintf(defines, "#define CLUSTERED\n#define CLUSTER_COUNT_X %d.0\n#define CLUSTER_COUNT_Y %d.0\n#define CLUSTER_COUNT_Z %d.0\n"
+                     "#define CLUSTER_INDEX_WIDTH %d.0\n#define CLUSTER_INDEX_HEIGHT %d.0\n#define LIGHT_TABLE_HEIGHT %d\n",
+                     CLUSTER_COUNT_X, CLUSTER_COUNT_Y, CLUSTER_COUNT_Z, CLUSTER_INDEX_WIDTH, CLUSTER_INDEX_HEIGHT, LIGHT_TABLE_HEIGHT);
+
+    if ((lightingLIDeferCluster = renderer->addShader("lightingLIDefer.shd", mapAttribs, nMapAttribs, getMapDefines(mapDefines, packedMap, defines))) == SHADER_NONE) return false;
+    if ((lightingLIDeferCluster_stone = renderer->addShader("lightingLIDefer_stone.shd", defines)) == SHADER_NONE) return false;
+  }
+
   if ((cmpTex = renderer->addShader("compareTex.shd")) == SHADER_NONE) return false;
 
   // Textures
@@ -376,9 +516,14 @@ bool App::load(){
 
   if ((noise3D = renderer->addTexture("../Textures/NoiseVolume.dds", true, linearWrap)) == SHADER_NONE) return false;
   
-  // Reset the bitmask texture lookups
-  bitMaskLightColors = TEXTURE_NONE;
-  bitMaskLightPos    = TEXTURE_NONE;
+  // Create the bitmask texture lookups
+  if (!bitMaskLightColors.create(renderer, FORMAT_RGBA8, LIGHT_TABLE_WIDTH, LIGHT_TABLE_HEIGHT, 1, pointClamp)) return false;
+  if (!bitMaskLightPos.create(renderer, FORMAT_RGBA32F, LIGHT_TABLE_WIDTH, LIGHT_TABLE_HEIGHT, 3, pointClamp)) return false;
+  if (!lightInstances.create(renderer, FORMAT_RGBA32F, LIGHT_INSTANCE_WIDTH, LIGHT_INSTANCE_HEIGHT, 3, pointClamp)) return false;
+
+  // Create the cluster lookups
+  if (!clusterGrid.create(renderer, FORMAT_RG32F, CLUSTER_COUNT_X, CLUSTER_COUNT_Y * CLUSTER_COUNT_Z, 3, pointClamp)) return false;
+  if (!clusterLightLists.create(renderer, FORMAT_R32F, CLUSTER_INDEX_WIDTH, CLUSTER_INDEX_HEIGHT, 3, pointClamp)) return false;
 
   // Blendstates
   if ((blendAdd = renderer->addBlendState(ONE, ONE)) == BS_NONE) return false;
@@ -405,6 +550,17 @@ bool App::load(){
     useDepthBoundsTest->setEnabled(true);
   }
 
+  if(lightingColorOnly_instanced == SHADER_NONE){
+    useInstancedVolumes->setChecked(false);
+    useInstancedVolumes->setEnabled(false);
+  }
+
+  // The 8-bit light index buffer cannot address more than 255 lights
+#if MAX_LIGHT_TOTAL > MAX_LIGHT_INDEX_8BIT
+  use16BitIndices->setChecked(true);
+  use16BitIndices->setEnabled(false);
+#endif
+
   // Set the values for lights per fragment
   lightCountPerFragment->clear();
   lightCountPerFragment->addItemUnique("1 Light per fragment");
@@ -423,13 +579,23 @@ bool App::load(){
   // Huh? This is not already all 1's? (according to the spec? - Nvidia bug if main surface does not have stencil?)
   glStencilMask(0xFFFFFFFF); 
 
+  if(benchmarksPending)
+  {
+    runBenchmarks();
+    benchmarksPending = false;
+  }
+
   return true;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 //
 void App::unload(){
-  
+  bitMaskLightColors.destroy();
+  bitMaskLightPos.destroy();
+  lightInstances.destroy();
+  clusterGrid.destroy();
+  clusterLightLists.destroy();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -444,27 +610,25 @@ void App::drawLightParticles(const vec3 &dx, const vec3 &dy){
   renderer->apply();
 
   glBegin(GL_QUADS);
-  for (uint i = 0; i < MAX_LIGHT_TOTAL; i++){
-
-   if(lightDataArray[i].isEnabled){
+  for (uint k = 0; k < lightStore.getVisibleCount(); k++){
+    uint i = lightStore.getVisible(k);
 
-    glColor3fv(lightDataArray[i].color);
+    glColor3fv(lightStore.getColor(i));
 
-    float renderSize = lightDataArray[i].size / 10.0f;
+    vec3 position = lightStore.getPosition(i);
+    float renderSize = lightStore.getSize(i) / 10.0f;
 
     glTexCoord2f(0, 0);
-    glVertex3fv(lightDataArray[i].position - renderSize * dx + renderSize * dy);
+    glVertex3fv(position - renderSize * dx + renderSize * dy);
 
     glTexCoord2f(1, 0);
-    glVertex3fv(lightDataArray[i].position + renderSize * dx + renderSize * dy);
+    glVertex3fv(position + renderSize * dx + renderSize * dy);
 
     glTexCoord2f(1, 1);
-    glVertex3fv(lightDataArray[i].position + renderSize * dx - renderSize * dy);
+    glVertex3fv(position + renderSize * dx - renderSize * dy);
 
     glTexCoord2f(0, 1);
-    glVertex3fv(lightDataArray[i].position - renderSize * dx - renderSize * dy);
-
-   }
+    glVertex3fv(position - renderSize * dx - renderSize * dy);
   }
   glEnd();
 }
@@ -473,12 +637,9 @@ void App::drawLightParticles(const vec3 &dx, const vec3 &dy){
 //
 void App::updateBitMaskedLightTextures()
 {
-  // If the color texture does not exist, create it now
-  if(bitMaskLightColors == TEXTURE_NONE) {
-    Image loadData;
-    loadData.create(FORMAT_RGBA8, MAX_LIGHT_TOTAL + 1, 1, 1, 1);
-
-    unsigned char *dstData = loadData.getPixels();
+  // Write the light colors, only the changed lights are uploaded
+  {
+    unsigned char *dstData = bitMaskLightColors.getData();
 
     // Set the zero entry to black (no light)
     dstData[0] = 0;
@@ -487,32 +648,24 @@ void App::updateBitMaskedLightTextures()
     dstData[3] = 0;
     dstData += 4;
 
-    for (int i =0; i<MAX_LIGHT_TOTAL; i++){
-      dstData[0] = (unsigned char)min((lightDataArray[i].color.x * 256.0f), 255.0f);
-      dstData[1] = (unsigned char)min((lightDataArray[i].color.y * 256.0f), 255.0f);
-      dstData[2] = (unsigned char)min((lightDataArray[i].color.z * 256.0f), 255.0f);
-      dstData[3] = 0;
+    // Only visible lights can be referenced by the light indices, the rest keep their old values
+    for (uint k = 0; k < lightStore.getVisibleCount(); k++){
+      uint i = lightStore.getVisible(k);
+      const vec3 &color = lightStore.getColor(i);
 
-      dstData += 4;
+      unsigned char *dstLight = dstData + i * 4;
+      dstLight[0] = (unsigned char)min((color.x * 256.0f), 255.0f);
+      dstLight[1] = (unsigned char)min((color.y * 256.0f), 255.0f);
+      dstLight[2] = (unsigned char)min((color.z * 256.0f), 255.0f);
+      dstLight[3] = 0;
     }
 
-    // Load in the new texture
-    bitMaskLightColors = renderer->addTexture(loadData, pointClamp);
+    bitMaskLightColors.upload();
   }
 
-  // TODO: Test if doing a image-sub is faster - Use PBO's?
-  // Delete the old lightPos texture
-  if(bitMaskLightPos != TEXTURE_NONE){
-    renderer->removeTexture(bitMaskLightPos);
-    bitMaskLightPos = TEXTURE_NONE;
-  }
-
-  // Upload a new texture
+  // Write the light positions
   {
-    Image loadPosData;
-    loadPosData.create(FORMAT_RGBA32F, MAX_LIGHT_TOTAL + 1, 1, 1, 1);
-
-    float *dstData = (float*)loadPosData.getPixels();
+    float *dstData = (float*)bitMaskLightPos.getData();
 
     // Set the zero entry to black (no light)
     dstData[0] = 0.0f;
@@ -521,20 +674,20 @@ void App::updateBitMaskedLightTextures()
     dstData[3] = 0.0f;
     dstData += 4;
 
-    for (int i =0; i<MAX_LIGHT_TOTAL; i++){
-      // Move position into view space
-      vec4 viewSpace = modelviewMatrix * vec4(lightDataArray[i].position, 1.0);
+    for (uint k = 0; k < lightStore.getVisibleCount(); k++){
+      uint i = lightStore.getVisible(k);
 
-      dstData[0] = viewSpace.x;
-      dstData[1] = viewSpace.y;
-      dstData[2] = viewSpace.z;
-      dstData[3] = 1.0f / lightDataArray[i].size;
+      // Move position into view space
+      vec4 viewSpace = modelviewMatrix * vec4(lightStore.getPosition(i), 1.0);
 
-      dstData += 4;
+      float *dstLight = dstData + i * 4;
+      dstLight[0] = viewSpace.x;
+      dstLight[1] = viewSpace.y;
+      dstLight[2] = viewSpace.z;
+      dstLight[3] = 1.0f / lightStore.getSize(i);
     }
 
-    // Load in the new texture
-    bitMaskLightPos = renderer->addTexture(loadPosData, pointClamp);
+    bitMaskLightPos.upload();
   }
 }
 
@@ -543,7 +696,7 @@ void App::updateBitMaskedLightTextures()
 void App::drawDepthOnly()
 {
   renderer->reset();
-  renderer->setShader(depthOnly);
+  renderer->setShader(depthOnly_packed);
   renderer->setBlendState(noColorWrite);
   renderer->setRasterizerState(cullBack);
   renderer->apply();
@@ -551,59 +704,69 @@ void App::drawDepthOnly()
   glClearStencil(0);
   glClear(GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
 
-  map->draw(renderer);
-  horseModel->draw(renderer);
+  map->drawDepth(renderer);
+
+  renderer->reset();
+  renderer->setShader(depthOnly);
+  renderer->setBlendState(noColorWrite);
+  renderer->setRasterizerState(cullBack);
+  renderer->apply();
+
+  horseModel->drawDepth(renderer);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-void App::drawLIDeferLight(GLubyte lightIndex, const vec3 &lightPosition, float lightSize){
+void App::getLightDepthBounds(const vec3 &lightPosition, float lightSize, float &nearVal, float &farVal){
 
-  if(useDepthBoundsTest->isChecked()){
+  vec4 diffVector = vec4(0.0f, 0.0f, lightSize, 0.0f);
+
+  vec4 viewSpaceLightPos = modelviewMatrix * vec4(lightPosition, 1.0f);
+  vec4 nearVec = projectionMatrix * (viewSpaceLightPos - diffVector);
+  vec4 farVec  = projectionMatrix * (viewSpaceLightPos + diffVector);
+
+  nearVal = clamp(nearVec.z / nearVec.w, -1.0f, 1.0f) * 0.5f + 0.5f;
+  if(nearVec.w <= 0.0f){
+    nearVal = 0.0f; 
+  }
+  farVal = clamp(farVec.z / farVec.w, -1.0f, 1.0f) * 0.5f + 0.5f;
+  if(farVec.w <= 0.0f){
+    farVal = 0.0f; 
+  }
 
-    vec4 diffVector = vec4(0.0f, 0.0f, lightSize, 0.0f);
+  // Sanity check
+  if(nearVal > farVal)
+  {
+    nearVal = farVal;
+  }
+}
 
-    vec4 viewSpaceLightPos = modelviewMatrix * vec4(lightPosition, 1.0f);
-    vec4 nearVec = projectionMatrix * (viewSpaceLightPos - diffVector);
-    vec4 farVec  = projectionMatrix * (viewSpaceLightPos + diffVector);
+///////////////////////////////////////////////////////////////////////////////
+//
+BlendStateID App::getLightIndexBlendState(){
 
-    float nearVal = clamp(nearVec.z / nearVec.w, -1.0f, 1.0f) * 0.5f + 0.5f;
-    if(nearVec.w <= 0.0f){
-      nearVal = 0.0f; 
-    }
-    float farVal = clamp(farVec.z / farVec.w, -1.0f, 1.0f) * 0.5f + 0.5f;
-    if(farVec.w <= 0.0f){
-      farVal = 0.0f; 
-    }
+  // Get the blend state for the light index packing
+  if(lightCountPerFragment->getSelectedItem() == LCPF_One){
+    return blendCopy;
+  }
+  else if(lightCountPerFragment->getSelectedItem() == LCPF_Two){
+    return blendMax;
+  }
+  return blendBitShift;
+}
 
-    // Sanity check
-    if(nearVal > farVal)
-    {
-      nearVal = farVal;
-    }
+///////////////////////////////////////////////////////////////////////////////
+//
+void App::drawLIDeferLight(uint lightIndex, uint stencilRef, const vec3 &lightPosition, float lightSize, uint sphereLOD){
 
+  if(useDepthBoundsTest->isChecked()){
+    float nearVal, farVal;
+    getLightDepthBounds(lightPosition, lightSize, nearVal, farVal);
     glDepthBoundsEXT(nearVal, farVal);
   }
 
-  // Convert the light count into 4 2bit values
-  GLubyte convertColor = lightIndex;
-  GLubyte redBit   = (convertColor & (0x3 << 0)) << 6; 
-  GLubyte greenBit = (convertColor & (0x3 << 2)) << 4;
-  GLubyte blueBit  = (convertColor & (0x3 << 4)) << 2;
-  GLubyte alphaBit = (convertColor & (0x3 << 6)) << 0;
-
   //Set the light index color 
-  // Convert the light values to floats and set as a constant?
-  //glColor4ub(redBit, greenBit, blueBit, alphaBit);
-  vec4 outColor( (float)redBit, (float)greenBit, (float)blueBit, (float)alphaBit);
-  static float divisor = 255.0f;
-  outColor = outColor / divisor;
-
-  // Setup lightIndex, 1-lightIndex when not using bit packing
-  if(lightCountPerFragment->getSelectedItem() < LCPF_Three){
-    outColor =  vec4((float)lightIndex, (float)(255 - lightIndex), (float)lightIndex, (float)lightIndex);  
-    outColor = outColor / divisor;
-  }
+  vec4 outColor = packLightIndex(lightIndex, use16BitIndices->isChecked(), lightCountPerFragment->getSelectedItem() >= LCPF_Three);
 
   // Note: Should use a infinite view projection matrix and cull front faces
   renderer->setShaderConstant3f("lightPos", lightPosition);
@@ -616,7 +779,7 @@ void App::drawLIDeferLight(GLubyte lightIndex, const vec3 &lightPosition, float
   if(useStencilMasking->isChecked()){
 
     // Set the stencil state to set the value on fail
-    glStencilFunc(GL_ALWAYS, lightIndex, 0xFFFFFFFF);
+    glStencilFunc(GL_ALWAYS, stencilRef, 0xFFFFFFFF);
     glStencilOp(GL_KEEP, GL_REPLACE, GL_KEEP); 
 
     // Disable color writes
@@ -624,29 +787,112 @@ void App::drawLIDeferLight(GLubyte lightIndex, const vec3 &lightPosition, float
     renderer->changeDepthState(noDepthWrite);
 
     // Draw a sphere the radius of the light
-    sphereModel->draw(renderer);
+    sphereModels[sphereLOD]->draw(renderer);
 
     // Set the stencil to only pass on equal value
-    glStencilFunc(GL_EQUAL, lightIndex, 0xFFFFFFFF);
+    glStencilFunc(GL_EQUAL, stencilRef, 0xFFFFFFFF);
     glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP); 
     renderer->changeRasterizerState(cullBack);
   }
 
   // Set the bitshift blend state
-  if(lightCountPerFragment->getSelectedItem() == LCPF_One){
-    renderer->changeBlendState(blendCopy);
+  renderer->changeBlendState(getLightIndexBlendState());
+
+  // Draw a sphere the radius of the light
+  sphereModels[sphereLOD]->draw(renderer);
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void App::drawLIDeferLightsInstanced(){
+
+  // Gather the lights by sphere LOD, keeping the order of the per light loop within each group.
+  // The primary lights have to be drawn last like in the per light loop, so they get a last group of their own
+  // drawn with the finest sphere any of them needs.
+  static vec3 positions[MAX_LIGHT_TOTAL];
+  static float radii[MAX_LIGHT_TOTAL];
+  static uint lightIndices[MAX_LIGHT_TOTAL];
+  static uint lightGroups[MAX_LIGHT_TOTAL];
+
+  const uint primaryGroup = SPHERE_LOD_COUNT;
+  uint groupLODs[SPHERE_LOD_COUNT + 1];
+  for(uint level=0; level<SPHERE_LOD_COUNT; level++){
+    groupLODs[level] = level;
   }
-  else if(lightCountPerFragment->getSelectedItem() == LCPF_Two){
-    renderer->changeBlendState(blendMax);
+  groupLODs[primaryGroup] = 0;
+
+  uint groupStart[SPHERE_LOD_COUNT + 2];
+  memset(groupStart, 0, sizeof(groupStart));
+
+  float nearBound = 1.0f;
+  float farBound = 0.0f;
+  for (uint k = 0; k < lightStore.getVisibleCount(); k++){
+    uint i = lightStore.getVisible(k);
+    uint lod = getSphereLOD(i);
+    if(i < PRIMARY_LIGHT_COUNT){
+      lightGroups[i] = primaryGroup;
+      groupLODs[primaryGroup] = max(groupLODs[primaryGroup], lod);
+    }
+    else{
+      lightGroups[i] = lod;
+    }
+    groupStart[lightGroups[i] + 1]++;
+
+    // Only one depth range can be set for the draw, so use the range of all the lights
+    if(useDepthBoundsTest->isChecked()){
+      float nearVal, farVal;
+      getLightDepthBounds(lightStore.getPosition(i), lightStore.getSize(i), nearVal, farVal);
+      nearBound = min(nearBound, nearVal);
+      farBound = max(farBound, farVal);
+    }
   }
-  else{
-    renderer->changeBlendState(blendBitShift);
+  for(uint group=0; group<=primaryGroup; group++){
+    groupStart[group + 1] += groupStart[group];
   }
 
-  //TODO: Render lowers detail spheres when light is far away?
-  // Draw a sphere the radius of the light
-  sphereModel->draw(renderer);
+  uint groupCount[SPHERE_LOD_COUNT + 1];
+  memset(groupCount, 0, sizeof(groupCount));
+  for (int k = lightStore.getVisibleCount() - 1; k >= 0; k--){
+    uint i = lightStore.getVisible(k);
+    uint dest = groupStart[lightGroups[i]] + groupCount[lightGroups[i]]++;
+    positions[dest] = lightStore.getPosition(i);
+    radii[dest] = lightStore.getSize(i);
+    lightIndices[dest] = i + 1;
+  }
+
+  // Write the instances of each group after each other
+  LightInstance *instances = (LightInstance *) lightInstances.getData();
+  uint nInstances = 0;
+  for(uint group=0; group<=primaryGroup; group++){
+    uint first = groupStart[group];
+    groupStart[group] = nInstances;
+    groupCount[group] = buildLightInstances(instances + nInstances, positions + first, radii + first, lightIndices + first, groupCount[group],
+                                            use16BitIndices->isChecked(), lightCountPerFragment->getSelectedItem() >= LCPF_Three);
+    nInstances += groupCount[group];
+  }
+  if(nInstances == 0){
+    return;
+  }
+  lightInstances.upload();
+
+  if(useDepthBoundsTest->isChecked()){
+    glDepthBoundsEXT(nearBound, farBound);
+  }
+
+  renderer->setTexture("InstanceTex", lightInstances.getTexture());
+  renderer->applyTextures();
+  renderer->changeBlendState(getLightIndexBlendState());
+
+  // Draw a sphere the radius of each light, with one draw per group
+  for(uint group=0; group<=primaryGroup; group++){
+    if(groupCount[group] > 0){
+      renderer->setShaderConstant1f("instanceOffset", (float) groupStart[group]);
+      renderer->applyConstants();
 
+      sphereModels[groupLODs[group]]->drawInstanced(renderer, groupCount[group]);
+    }
+  }
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -655,7 +901,7 @@ void App::drawLIDeferLights(){
 
   // Set target to render depth only 
   // (ATI does not sopport only rendering to a depth buffer? Depth buffer seems inverted when bound to another FBO)
-  renderer->changeRenderTarget(lightIndexBuffer, depthRT);
+  renderer->changeRenderTarget(use16BitIndices->isChecked() ? lightIndexBuffer16 : lightIndexBuffer, depthRT);
   drawDepthOnly();
 
   //Clear the output color
@@ -664,8 +910,19 @@ void App::drawLIDeferLights(){
 
   ShaderID colorShaderID = lightingColorOnly;
 
-  // Set the constant blend color to bit shift 2 bits down on each call
-  glBlendColor(0.251f, 0.251f, 0.251f, 0.251f); 
+  // Stencil masking needs a stencil reference per light, so cannot be batched
+  bool instanced = useInstancedVolumes->isChecked() && !useStencilMasking->isChecked();
+  if(instanced){
+    colorShaderID = lightingColorOnly_instanced;
+  }
+
+  // Set the constant blend color to bit shift 2 bits (4 bits for 16-bit indices) down on each call
+  if(use16BitIndices->isChecked()){
+    glBlendColor(BIT_SHIFT_CONSTANT_16BIT, BIT_SHIFT_CONSTANT_16BIT, BIT_SHIFT_CONSTANT_16BIT, BIT_SHIFT_CONSTANT_16BIT);
+  }
+  else{
+    glBlendColor(BIT_SHIFT_CONSTANT_8BIT, BIT_SHIFT_CONSTANT_8BIT, BIT_SHIFT_CONSTANT_8BIT, BIT_SHIFT_CONSTANT_8BIT); 
+  }
 
   if(useStencilMasking->isChecked()){
     glEnable(GL_STENCIL_TEST);
@@ -684,11 +941,25 @@ void App::drawLIDeferLights(){
   renderer->setDepthState(depthNoWritePassGreater);
   renderer->apply();
   
-  // Loop for each light color to give each color an even chance of been visible
-  //  Draw the primary lights last by iterating through the loop backwards
-  for (int i = MAX_LIGHT_TOTAL - 1; i >= 0; i--){
-    if(lightDataArray[i].isEnabled){
-      drawLIDeferLight(i + 1, lightDataArray[i].position, lightDataArray[i].size);
+  if(instanced){
+    drawLIDeferLightsInstanced();
+  }
+  else{
+    // Loop for each light color to give each color an even chance of been visible
+    //  Draw the primary lights last by iterating through the loop backwards
+    uint stencilRef = 0;
+    for (int k = lightStore.getVisibleCount() - 1; k >= 0; k--){
+      uint i = lightStore.getVisible(k);
+
+      // Only 8 bits fit in the stencil, so the stencil is cleared before a reference value is reused.
+      // A stale one would pass pixels outside this light's volume and shift a real light out of their indices.
+      if(useStencilMasking->isChecked() && stencilRef == 255){
+        glClear(GL_STENCIL_BUFFER_BIT);
+        stencilRef = 0;
+      }
+      stencilRef++;
+
+      drawLIDeferLight(i + 1, stencilRef, lightStore.getPosition(i), lightStore.getSize(i), getSphereLOD(i));
     }
   }
 
@@ -706,6 +977,17 @@ void App::drawLIDeferLights(){
 //
 void App::drawLIDeferLitObjects()
 {
+  // Select the light index buffer and matching shaders
+  TextureID indexBuffer = lightIndexBuffer;
+  ShaderID *shaders = lightingLIDefer;
+  ShaderID *stoneShaders = lightingLIDefer_stone;
+  if(use16BitIndices->isChecked()){
+    indexBuffer = lightIndexBuffer16;
+    shaders = lightingLIDefer16;
+    stoneShaders = lightingLIDefer16_stone;
+  }
+  bool clustered = useLightClusters->isChecked();
+
   // Do a z-pre pass (this is wasteful as we already have a render target with the depth)
   renderer->changeDepthState(DS_NONE);
   drawDepthOnly();
@@ -714,16 +996,23 @@ void App::drawLIDeferLitObjects()
 
   // Setup render states
   renderer->reset();
-  renderer->setShader(lightingLIDefer[lightCountPerFragment->getSelectedItem()]);
+  renderer->setShader(clustered ? lightingLIDeferCluster : shaders[lightCountPerFragment->getSelectedItem()]);
   renderer->setRasterizerState(cullBack);
   renderer->setBlendState(blendCopy);
   renderer->setDepthState(noDepthWrite);
   renderer->setShaderConstant3f("camPos", camPos);
   renderer->apply();
 
-  renderer->setTexture("BitPlane", lightIndexBuffer);
-  renderer->setTexture("LightColorTex", bitMaskLightColors);
-  renderer->setTexture("LightPosTex", bitMaskLightPos);
+  if(clustered){
+    renderer->setTexture("ClusterGrid", clusterGrid.getTexture());
+    renderer->setTexture("ClusterLights", clusterLightLists.getTexture());
+    renderer->setShaderConstant4f("clusterScale", lightClusters.getShaderScale());
+  }
+  else{
+    renderer->setTexture("BitPlane", indexBuffer);
+  }
+  renderer->setTexture("LightColorTex", bitMaskLightColors.getTexture());
+  renderer->setTexture("LightPosTex", bitMaskLightPos.getTexture());
 
   //Loop for all pieces of geometry
   for (uint k = 0; k < 4; k++){
@@ -739,21 +1028,52 @@ void App::drawLIDeferLitObjects()
   }
 
   renderer->reset();
-  renderer->setShader(lightingLIDefer_stone[lightCountPerFragment->getSelectedItem()]);
+  renderer->setShader(clustered ? lightingLIDeferCluster_stone : stoneShaders[lightCountPerFragment->getSelectedItem()]);
   renderer->setRasterizerState(cullBack);
   renderer->setBlendState(blendCopy);
   renderer->setDepthState(noDepthWrite);
 
   renderer->setTexture("Noise", noise3D);
-  renderer->setTexture("BitPlane", lightIndexBuffer);
-  renderer->setTexture("LightColorTex", bitMaskLightColors);
-  renderer->setTexture("LightPosTex", bitMaskLightPos);
+  if(clustered){
+    renderer->setTexture("ClusterGrid", clusterGrid.getTexture());
+    renderer->setTexture("ClusterLights", clusterLightLists.getTexture());
+    renderer->setShaderConstant4f("clusterScale", lightClusters.getShaderScale());
+  }
+  else{
+    renderer->setTexture("BitPlane", indexBuffer);
+  }
+  renderer->setTexture("LightColorTex", bitMaskLightColors.getTexture());
+  renderer->setTexture("LightPosTex", bitMaskLightPos.getTexture());
   renderer->apply();
 
   horseModel->draw(renderer);
 
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+void App::updateLightClusters()
+{
+  lightClusters.setView(VIEW_FOV, width, height, VIEW_NEAR, VIEW_FAR);
+  lightClusters.clearLights();
+
+  for (uint k = 0; k < lightStore.getVisibleCount(); k++){
+    uint i = lightStore.getVisible(k);
+    vec4 viewSpace = modelviewMatrix * vec4(lightStore.getPosition(i), 1.0);
+    lightClusters.addLight(i + 1, viewSpace.xyz(), lightStore.getSize(i),
+                           lightStore.getScreenX(i), lightStore.getScreenY(i), lightStore.getScreenWidth(i), lightStore.getScreenHeight(i));
+  }
+
+  // Time the binning on its own, without the texture uploads
+  uint64 startCycle = getCycleNumber();
+  lightClusters.build(workerPool);
+  clusterBinTime = float(getCycleNumber() - startCycle) * 1000.0f / float(cpuHz);
+
+  lightClusters.writeTextureData((float *) clusterGrid.getData(), (float *) clusterLightLists.getData());
+  clusterGrid.upload();
+  clusterLightLists.upload();
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 void App::drawLightingMPAmbient(){
@@ -811,18 +1131,17 @@ void App::drawLightingMP(){
 
     glEnable(GL_SCISSOR_TEST);
 
-    for(uint i=0; i<MAX_LIGHT_TOTAL; i++){
+    for(uint v=0; v<lightStore.getVisibleCount(); v++){
+      uint i = lightStore.getVisible(v);
 
-      if(lightDataArray[i].isEnabled){
-        glScissor(lightDataArray[i].screenX, lightDataArray[i].screenY, lightDataArray[i].screenWidth, lightDataArray[i].screenHeight);
+      glScissor(lightStore.getScreenX(i), lightStore.getScreenY(i), lightStore.getScreenWidth(i), lightStore.getScreenHeight(i));
 
-        renderer->setShaderConstant3f("lightColor", lightDataArray[i].color);
-        renderer->setShaderConstant3f("lightPos", lightDataArray[i].position);
-        renderer->setShaderConstant1f("invRadius", 1.0f / lightDataArray[i].size);
-        renderer->applyConstants();
+      renderer->setShaderConstant3f("lightColor", lightStore.getColor(i));
+      renderer->setShaderConstant3f("lightPos", lightStore.getPosition(i));
+      renderer->setShaderConstant1f("invRadius", 1.0f / lightStore.getSize(i));
+      renderer->applyConstants();
     
-        map->drawBatch(renderer, k);
-      }
+      map->drawBatch(renderer, k);
     }
     glDisable(GL_SCISSOR_TEST);
   }
@@ -837,19 +1156,18 @@ void App::drawLightingMP(){
   renderer->apply();
 
   glEnable(GL_SCISSOR_TEST);
-  for(uint i=0; i<MAX_LIGHT_TOTAL; i++)
+  for(uint v=0; v<lightStore.getVisibleCount(); v++)
   {
-    if(lightDataArray[i].isEnabled)
-    {
-      glScissor(lightDataArray[i].screenX, lightDataArray[i].screenY, lightDataArray[i].screenWidth, lightDataArray[i].screenHeight);
+    uint i = lightStore.getVisible(v);
+
+    glScissor(lightStore.getScreenX(i), lightStore.getScreenY(i), lightStore.getScreenWidth(i), lightStore.getScreenHeight(i));
     
-      renderer->setShaderConstant3f("lightColor", lightDataArray[i].color);
-      renderer->setShaderConstant3f("lightPos", lightDataArray[i].position);
-      renderer->setShaderConstant1f("invRadius", 1.0f/lightDataArray[i].size);
-      renderer->applyConstants();
+    renderer->setShaderConstant3f("lightColor", lightStore.getColor(i));
+    renderer->setShaderConstant3f("lightPos", lightStore.getPosition(i));
+    renderer->setShaderConstant1f("invRadius", 1.0f/lightStore.getSize(i));
+    renderer->applyConstants();
 
-      horseModel->draw(renderer);
-    }
+    horseModel->draw(renderer);
   }
   glDisable(GL_SCISSOR_TEST);
 
@@ -859,23 +1177,8 @@ void App::drawLightingMP(){
 //
 void App::updateLightCull()
 {
-  // Update the PFX light culling
-  for(uint i=0; i<MAX_LIGHT_TOTAL; i++)
-  {
-    if(lightDataArray[i].size > 0.0f){
-
-      // Get if the light is visible on screen
-      lightDataArray[i].isEnabled = getScissorRectangle(modelviewMatrix, lightDataArray[i].position, lightDataArray[i].size,
-        1.5f, width, height, 
-        &lightDataArray[i].screenX, 
-        &lightDataArray[i].screenY, 
-        &lightDataArray[i].screenWidth, 
-        &lightDataArray[i].screenHeight);
-    }
-    else{
-      lightDataArray[i].isEnabled = false;
-    }
-  }
+  // Rebuild the visible light list and the light screen rectangles
+  lightStore.cull(modelviewMatrix, VIEW_FOV, width, height);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -883,7 +1186,7 @@ void App::updateLightCull()
 void App::drawFrame(){
   
   // Update and load the modelview and projection matrices
-  projectionMatrix = perspectiveMatrixX(1.5f, width, height, 5, 4000);
+  projectionMatrix = perspectiveMatrixX(VIEW_FOV, width, height, VIEW_NEAR, VIEW_FAR);
   modelviewMatrix = rotateXY(-wx, -wy);
   modelviewMatrix.translate(-camPos);
 
@@ -923,8 +1226,14 @@ void App::drawFrame(){
     // (possibly use world space lights instead of camera space if lights do not move?)
     updateBitMaskedLightTextures();
 
-    // Add light volumes
-    drawLIDeferLights();
+    if(useLightClusters->isChecked()){
+      // Bin the lights into the cluster lists instead of drawing light volumes
+      updateLightClusters();
+    }
+    else{
+      // Add light volumes
+      drawLIDeferLights();
+    }
 
     // TODO: Find out why looking at the back wall 
     // is faster than looking across whole scene - even with no light - should be same fragment work...Fast depth Z not working?
@@ -933,6 +1242,14 @@ void App::drawFrame(){
     drawLIDeferLitObjects();
 
     drawLightParticles(modelviewMatrix.rows[0].xyz(), modelviewMatrix.rows[1].xyz());
+
+    if(useLightClusters->isChecked()){
+      renderer->setup2DMode(0, (float) width, 0, (float) height);
+
+      char str[64];
+      sprintf(str, "Binning %.3fms", clusterBinTime);
+      renderer->drawText(str, 8, 8 + 38, 30, 38, defaultFont, linearClamp, blendSrcAlpha, noDepthTest);
+    }
   }
   else
   {
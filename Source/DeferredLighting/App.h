@@ -23,25 +23,37 @@
 #include "../Framework3/OpenGL/OpenGLApp.h"
 #include "../Framework3/Util/Model.h"
 #include "../Framework3/Util/BSP.h"
+#include "../Framework3/Util/BVH.h"
+#include "../Framework3/Util/DynamicTexture.h"
 #include "../Framework3/Math/Scissor.h"
+#include "../Framework3/CPU.h"
+#include "LightIndexPacking.h"
+#include "LightClusters.h"
+#include "LightInstances.h"
+#include "LightParticles.h"
+#include "LightStore.h"
 
-#define MAX_LIGHT_TOTAL             255  // Must be a dimension supported by textures, then -1
+// The light data textures are rows of 256 lights, with light zero as "no light"
+#define LIGHT_TABLE_WIDTH           256
+#define LIGHT_TABLE_HEIGHT          ((MAX_LIGHT_TOTAL + LIGHT_TABLE_WIDTH) / LIGHT_TABLE_WIDTH)
 
-// Helper structure to store light data
-struct LightData
-{
-  LightData(const vec3& setColor, const vec3& setPosition, float setSize);
+// The view projection, which the light culling and the light clusters are set up with too
+#define VIEW_FOV                    1.5f
+#define VIEW_NEAR                   5.0f
+#define VIEW_FAR                    4000.0f
 
-  bool isEnabled;     // If the particle is enabled
-  int screenX;        // The screen X position
-  int screenY;        // The screen Y position
-  int screenWidth;    // The width on the screen  
-  int screenHeight;   // The height on the screen
+// The first lights are the animated primary lights, which are drawn last so they win in the light index packings
+#define PRIMARY_LIGHT_COUNT         3
 
-  vec3 color;         // The light color
-  vec3 position;      // The light position
-  float size;         // The light size
-};
+// Number of light volume sphere detail levels, using subdivision levels 0 to SPHERE_LOD_COUNT - 1
+#define SPHERE_LOD_COUNT            4
+
+// Rows of the instance texture used to draw all light volumes in one call
+#define LIGHT_INSTANCE_HEIGHT       ((MAX_LIGHT_TOTAL * LIGHT_INSTANCE_TEXELS + LIGHT_INSTANCE_WIDTH - 1) / LIGHT_INSTANCE_WIDTH)
+
+#if MAX_LIGHT_TOTAL > MAX_LIGHT_INDEX_16BIT
+#error "Too many lights for the light index buffer"
+#endif
 
 class App : public OpenGLApp {
 public:
@@ -59,10 +71,12 @@ public:
 	bool onMouseMove(const int x, const int y, const int deltaX, const int deltaY);
 	bool onMouseButton(const int x, const int y, const MouseButton button, const bool pressed);
 	bool onMouseWheel(const int x, const int y, const int scroll);
+  void onCheckBoxClicked(CheckBox *checkBox);
 
   bool load();
   void unload();
   void createSphereModel();
+  uint getSphereLOD(const uint lightIndex);
 
   void updateLightCull();
   void updateBitMaskedLightTextures();
@@ -73,10 +87,15 @@ public:
   void drawLightingMP();
 
   void drawDepthOnly();
-  void drawLIDeferLight(GLubyte lightIndex, const vec3 &lightPosition, float lightSize);
+  void getLightDepthBounds(const vec3 &lightPosition, float lightSize, float &nearVal, float &farVal);
+  BlendStateID getLightIndexBlendState();
+  void drawLIDeferLight(uint lightIndex, uint stencilRef, const vec3 &lightPosition, float lightSize, uint sphereLOD);
+  void drawLIDeferLightsInstanced();
   void drawLIDeferLights();
   void drawLIDeferLitObjects();
 
+  void updateLightClusters();
+
   void drawFrame();
 
 protected:
@@ -84,13 +103,14 @@ protected:
   mat4 projectionMatrix;   // The current frame's projection matrix
   mat4 modelviewMatrix;    // The current frame's modelview matrix
 
-  static LightData lightDataArray[MAX_LIGHT_TOTAL]; 
+  LightStore lightStore;
   bool staticLightSceneSet; // Flag indicating to set the static light scene
+  bool benchmarksPending;   // Flag indicating to run the benchmarks after the next load
 
   Model *map;
   BSP bsp;
 
-  ShaderID depthOnly, plainTex, lightingMP, lightingMP_ambient, lightingMP_stone, lightingMP_stone_ambient;
+  ShaderID depthOnly, depthOnly_packed, plainTex, lightingMP, lightingMP_ambient, lightingMP_stone, lightingMP_stone_ambient;
   TextureID base[4], bump[4], gloss[4], light, noise3D;
   SamplerStateID trilinearAniso, linearWrap, pointClamp;
   BlendStateID blendCopy, blendAdd, noColorWrite;
@@ -98,21 +118,37 @@ protected:
 
   float parallax[4];
 
-  Model *sphereModel;
+  Model *sphereModels[SPHERE_LOD_COUNT];  // Light volume spheres, lowest detail first
+  float sphereLODError[SPHERE_LOD_COUNT]; // How far each sphere can extend past the radius, relative to the radius
   Model *horseModel;
 
   ShaderID cmpTex;
   ShaderID plainColor;
   ShaderID lightingColorOnly;
   ShaderID lightingColorOnly_depthClamp;
+  ShaderID lightingColorOnly_instanced;
   ShaderID lightingLIDefer[4];
   ShaderID lightingLIDefer_stone[4];
+  ShaderID lightingLIDefer16[4];
+  ShaderID lightingLIDefer16_stone[4];
 
   TextureID lightIndexBuffer;
+  TextureID lightIndexBuffer16;
   TextureID depthRT;
 
-  TextureID bitMaskLightColors;
-  TextureID bitMaskLightPos;
+  DynamicTexture bitMaskLightColors; // Light colors, only re-uploaded when edited
+  DynamicTexture bitMaskLightPos;    // View space light positions, cycled over three textures
+  DynamicTexture lightInstances;     // Per light volume instance data
+
+  LightClusters lightClusters;       // CPU binned light lists, used instead of the light index buffer
+  WorkerPool workerPool;
+  DynamicTexture clusterGrid;        // (offset, count) of each cluster's light list
+  DynamicTexture clusterLightLists;  // The light indices of all cluster lists
+  ShaderID lightingLIDeferCluster;
+  ShaderID lightingLIDeferCluster_stone;
+
+  float clusterBinTime;              // Time taken to bin the lights last frame (ms)
+  uint64 cpuHz;
 
   BlendStateID blendTwoLightRender;
   BlendStateID blendBitShift;
@@ -125,6 +161,10 @@ protected:
   CheckBox *useDepthBoundsTest;
   DropDownList *lightCountPerFragment;
   CheckBox *useDeferedLighting;
+  CheckBox *use16BitIndices;
+  CheckBox *useLightClusters;
+  CheckBox *useInstancedVolumes;
+  CheckBox *compressMapVertices;
 
   CheckBox *doPrecisionTest;
 
@@ -140,6 +180,44 @@ protected:
   void updateLights(float updateTime);
   void updatePrimaryLights(float t);
   void SetStaticLightScene();
+  void seedLightParticles();
+
+  // Run the benchmarks and checks in App_Bench.cpp once, printing the results to the console
+  void runBenchmarks();
+
+  // Time the PFX light update over 1..N cores
+  void benchmarkLightParticles();
+
+  // Time the flattened BSP queries against the pointer tree
+  void benchmarkCollision();
+
+  // Compare the BSP and BVH on the map and on larger grids of map copies
+  void benchmarkAccelerators();
+
+  // Time the assemble() vertex hashes on the index tuples of growing numbers of map copies
+  void benchmarkVertexHash();
+
+  // Time the batched light scissor rectangles against one call per light, at up to 64k lights
+  void benchmarkScissor();
+
+  // Time the cluster binning of a fixed light set over 1..N cores, and check the lists match
+  void benchmarkClusterBinning();
+
+  // Check the pooled SSE tangent space against the serial scalar code
+  void checkTangentSpace();
+
+  // Check the light index packings against the shader unpacking, in 8 and 16 bits
+  void checkLightIndexPacking();
+
+  // Run all BSP queries on the worker pool at once and check them against the serial results.
+  // Build with make tsan and run with RunBenchmarks set to have the thread sanitizer watch the shared tree.
+  void checkBSPThreads();
+
+  // Check the exact vertex welding, serial and pooled, against a brute force weld
+  void checkVertexWelding();
+
+  // Print how the draw order optimization changed the map's vertex cache use and the depth pass position count
+  void printMapStats();
 
   // Precision of the graphics card methods
   void drawPrecisionTest1();
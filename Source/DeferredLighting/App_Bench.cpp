@@ -0,0 +1,1054 @@
+/* ============================================================================
+  Light Indexed Deferred Rendering Demo
+  By Damian Trebilco
+ 
+  Origional base lighting demo by "Humus"  
+============================================================================ */
+
+/***********      .---.         .-"-.      *******************\
+* -------- *     /   ._.       /  ` \     * ---------------- *
+* Author's *     \_  (__\      \_v_/     * humus@rogers.com *
+*   note   *     //   \\       //   \\     * ICQ #47010716    *
+* -------- *    ((     ))     ((     ))    * ---------------- *
+*          ****--""---""-------""---""--****                  ********\
+* This file is a part of the work done by Humus. You are free to use  *
+* the code in any way you like, modified, unmodified or copy'n'pasted *
+* into your own work. However, I expect you to respect these points:  *
+*  @ If you use this file and its contents unmodified, or use a major *
+*    part of this file, please credit the author and leave this note. *
+*  @ For use in anything commercial, please request my approval.      *
+*  @ Share your work and ideas too as much as you can.                *
+\*********************************************************************/
+
+#include "App.h"
+#include "../Framework3/Util/Hash.h"
+#include "../Framework3/Util/TupleHash.h"
+
+#define SCISSOR_BENCHMARK_SIZES     3      // 255, 4096 and 65536 lights
+#define SCISSOR_BENCHMARK_RUNS      16     // Culling passes timed per light count
+#define BINNING_BENCHMARK_LIGHTS    1024   // Lights binned into the clusters, four times the demo's
+#define BINNING_BENCHMARK_RUNS      64     // Builds timed per thread count
+#define BINNING_BENCHMARK_WIDTH     1024   // Fixed screen size, so the results don't depend on the window
+#define BINNING_BENCHMARK_HEIGHT    768
+
+#define PFX_BENCHMARK_COUNT         16384  // Particles simulated by the particle benchmark
+#define PFX_BENCHMARK_STEPS         60
+
+#define COLLISION_BENCHMARK_COUNT   65536  // Queries per collision benchmark test
+#define ACCEL_BENCHMARK_SIZES       3      // Grids of 1, 10 and 100 map copies
+#define HASH_BENCHMARK_SIZES        4      // Index tuples of 1 to 1000 map copies
+
+#define PACKING_CHECK_COUNT         65536  // Random light sets per light index packing
+
+#define BSP_CHECK_COUNT             4096   // Queries per BSP thread check item
+#define BSP_CHECK_ITEMS             64     // Worker pool items querying the BSP at once
+#define BSP_CHECK_BATCH             64     // Segments per intersectsBatch() call
+
+#define WELD_CHECK_COPIES           64     // Copies of the map positions welded together, enough to be sharded
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void App::runBenchmarks()
+{
+  benchmarkScissor();
+  checkLightIndexPacking();
+  benchmarkClusterBinning();
+  benchmarkLightParticles();
+  benchmarkCollision();
+  checkBSPThreads();
+  benchmarkAccelerators();
+  printMapStats();
+  checkTangentSpace();
+  checkVertexWelding();
+  benchmarkVertexHash();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void App::benchmarkScissor(){
+
+  static const uint lightCounts[SCISSOR_BENCHMARK_SIZES] = { 255, 4096, 65536 };
+
+  printf("Scissor benchmark, %d passes from the current view\n", SCISSOR_BENCHMARK_RUNS);
+
+  for(uint size=0; size<SCISSOR_BENCHMARK_SIZES; size++)
+  {
+    uint count = lightCounts[size];
+
+    // Lights spread around the current ones, every eighth one unspawned like the PFX lights
+    float *posX = new float[count];
+    float *posY = new float[count];
+    float *posZ = new float[count];
+    float *radius = new float[count];
+    for(uint i=0; i<count; i++)
+    {
+      vec3 offset(float(rand()) / RAND_MAX - 0.5f, float(rand()) / RAND_MAX - 0.5f, float(rand()) / RAND_MAX - 0.5f);
+      vec3 pos = lightStore.getPosition(i % MAX_LIGHT_TOTAL) + offset * 800.0f;
+
+      posX[i] = pos.x;
+      posY[i] = pos.y;
+      posZ[i] = pos.z;
+      radius[i] = (i % 8 == 0)? 0.0f : 30.0f + 120.0f * float(rand()) / RAND_MAX;
+    }
+
+    int *x = new int[count];
+    int *y = new int[count];
+    int *w = new int[count];
+    int *h = new int[count];
+    int *batchX = new int[count];
+    int *batchY = new int[count];
+    int *batchW = new int[count];
+    int *batchH = new int[count];
+    uint *visible = new uint[count];
+    uint *batchVisible = new uint[count];
+
+    // One call per light, as updateLightCull() did before
+    uint nVisible = 0;
+    uint64 startCycle = getCycleNumber();
+    for(uint run=0; run<SCISSOR_BENCHMARK_RUNS; run++)
+    {
+      nVisible = 0;
+      for(uint i=0; i<count; i++)
+      {
+        if(radius[i] > 0 && getScissorRectangle(modelviewMatrix, vec3(posX[i], posY[i], posZ[i]), radius[i], VIEW_FOV, width, height, x + i, y + i, w + i, h + i)){
+          visible[nVisible++] = i;
+        }
+      }
+    }
+    float scalarTime = float(getCycleNumber() - startCycle) * 1000.0f / float(cpuHz * SCISSOR_BENCHMARK_RUNS);
+
+    uint nBatchVisible = 0;
+    startCycle = getCycleNumber();
+    for(uint run=0; run<SCISSOR_BENCHMARK_RUNS; run++)
+    {
+      nBatchVisible = getScissorRectangles(modelviewMatrix, posX, posY, posZ, radius, count, VIEW_FOV, width, height, batchX, batchY, batchW, batchH, batchVisible);
+    }
+    float batchTime = float(getCycleNumber() - startCycle) * 1000.0f / float(cpuHz * SCISSOR_BENCHMARK_RUNS);
+
+    // Only the rectangles of visible lights are written. The scalar path is built with -ffast-math and the
+    // batch path is not, so an edge may land a pixel off, and further for a light whose sphere nearly
+    // touches the eye plane, where the tangent math is ill-conditioned.
+    uint nOffByOne = 0;
+    uint nDiffer = 0;
+    uint i = 0, j = 0;
+    while(i < nVisible || j < nBatchVisible)
+    {
+      if(j == nBatchVisible || (i < nVisible && visible[i] < batchVisible[j]))
+      {
+        uint l = visible[i++];
+        if(w[l] <= 1 || h[l] <= 1) nOffByOne++; else nDiffer++;
+      }
+      else if(i == nVisible || batchVisible[j] < visible[i])
+      {
+        uint l = batchVisible[j++];
+        if(batchW[l] <= 1 || batchH[l] <= 1) nOffByOne++; else nDiffer++;
+      }
+      else
+      {
+        uint l = visible[i++];
+        j++;
+
+        int dx = abs(x[l] - batchX[l]);
+        int dy = abs(y[l] - batchY[l]);
+        int dw = abs(x[l] + w[l] - batchX[l] - batchW[l]);
+        int dh = abs(y[l] + h[l] - batchY[l] - batchH[l]);
+        int d = max(max(dx, dy), max(dw, dh));
+        if(d == 1) nOffByOne++;
+        if(d > 1) nDiffer++;
+      }
+    }
+
+    printf("  %5d lights, %5d visible: scalar %.3f ms, batch %.3f ms, %.2fx, %d a pixel off, %d further off\n", count, nVisible, scalarTime, batchTime, scalarTime / batchTime, nOffByOne, nDiffer);
+
+    delete [] posX;
+    delete [] posY;
+    delete [] posZ;
+    delete [] radius;
+    delete [] x;
+    delete [] y;
+    delete [] w;
+    delete [] h;
+    delete [] batchX;
+    delete [] batchY;
+    delete [] batchW;
+    delete [] batchH;
+    delete [] visible;
+    delete [] batchVisible;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void App::checkLightIndexPacking(){
+
+  printf("Light index packing check, %d light sets each\n", PACKING_CHECK_COUNT);
+
+  for(uint bits=0; bits<2; bits++)
+  {
+    for(uint overlapLights=1; overlapLights<=4; overlapLights++)
+    {
+      uint failures = ::checkLightIndexPacking(bits != 0, overlapLights, PACKING_CHECK_COUNT);
+      printf("  %d-bit, %d lights per fragment: %s (%d failures)\n", bits? 16 : 8, overlapLights, failures? "results differ!" : "ok", failures);
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void App::benchmarkClusterBinning(){
+
+  const int w = BINNING_BENCHMARK_WIDTH;
+  const int h = BINNING_BENCHMARK_HEIGHT;
+  float ex = tanf(0.5f * VIEW_FOV);
+  float ey = (ex * h) / w;
+
+  // Seeded so every run bins the same lights, spread through the frustum
+  srand(1);
+  vec3 *viewPos = new vec3[BINNING_BENCHMARK_LIGHTS];
+  float *radius = new float[BINNING_BENCHMARK_LIGHTS];
+  int *rect = new int[BINNING_BENCHMARK_LIGHTS * 4];
+  for(uint i=0; i<BINNING_BENCHMARK_LIGHTS; i++)
+  {
+    float z = VIEW_NEAR + 3000.0f * float(rand()) / RAND_MAX;
+    float sx = 2.0f * float(rand()) / RAND_MAX - 1.0f;
+    float sy = 2.0f * float(rand()) / RAND_MAX - 1.0f;
+    viewPos[i] = vec3(sx * z * ex, sy * z * ey, z);
+    radius[i] = 30.0f + 120.0f * float(rand()) / RAND_MAX;
+
+    // A screen rectangle holding the sphere, all of the screen if it reaches the near plane
+    int *r = rect + 4 * i;
+    if(z - radius[i] <= VIEW_NEAR)
+    {
+      r[0] = 0;
+      r[1] = 0;
+      r[2] = w;
+      r[3] = h;
+    }
+    else
+    {
+      float d = z - radius[i];
+      int x0 = clamp(int((0.5f * (viewPos[i].x - radius[i]) / (d * ex) + 0.5f) * w), 0, w);
+      int x1 = clamp(int((0.5f * (viewPos[i].x + radius[i]) / (d * ex) + 0.5f) * w) + 1, 0, w);
+      int y0 = clamp(int((0.5f * (viewPos[i].y - radius[i]) / (d * ey) + 0.5f) * h), 0, h);
+      int y1 = clamp(int((0.5f * (viewPos[i].y + radius[i]) / (d * ey) + 0.5f) * h) + 1, 0, h);
+      r[0] = x0;
+      r[1] = y0;
+      r[2] = x1 - x0;
+      r[3] = y1 - y0;
+    }
+  }
+
+  // The clusters are too big for the stack
+  LightClusters *clusters = new LightClusters();
+  clusters->setView(VIEW_FOV, w, h, VIEW_NEAR, VIEW_FAR);
+  clusters->clearLights();
+  for(uint i=0; i<BINNING_BENCHMARK_LIGHTS; i++)
+  {
+    int *r = rect + 4 * i;
+    clusters->addLight(i + 1, viewPos[i], radius[i], r[0], r[1], r[2], r[3]);
+  }
+
+  const uint gridSize = 2 * CLUSTER_COUNT;
+  const uint indexSize = CLUSTER_INDEX_WIDTH * CLUSTER_INDEX_HEIGHT;
+  float *grid = new float[gridSize];
+  float *indices = new float[indexSize];
+  float *firstGrid = new float[gridSize];
+  float *firstIndices = new float[indexSize];
+  uint firstCount = 0;
+
+  printf("Cluster binning benchmark, %d lights at %dx%d, %d builds\n", BINNING_BENCHMARK_LIGHTS, w, h, BINNING_BENCHMARK_RUNS);
+
+  float singleTime = 0.0f;
+  for(int threads=1; threads<=max(cpuCount, 1); threads++)
+  {
+    WorkerPool pool;
+    pool.start(threads - 1);
+
+    uint64 startCycle = getCycleNumber();
+    for(uint run=0; run<BINNING_BENCHMARK_RUNS; run++)
+    {
+      clusters->build(pool);
+    }
+    float buildTime = float(getCycleNumber() - startCycle) * 1000.0f / (float(cpuHz) * BINNING_BENCHMARK_RUNS);
+
+    pool.stop();
+
+    // The lists must be the same for any thread count
+    bool matches = true;
+    uint count = clusters->writeTextureData(grid, indices);
+    if(threads == 1)
+    {
+      singleTime = buildTime;
+      firstCount = count;
+      memcpy(firstGrid, grid, gridSize * sizeof(float));
+      memcpy(firstIndices, indices, count * sizeof(float));
+    }
+    else
+    {
+      matches = (count == firstCount &&
+                 memcmp(firstGrid, grid, gridSize * sizeof(float)) == 0 &&
+                 memcmp(firstIndices, indices, count * sizeof(float)) == 0);
+    }
+
+    printf("  %d thread(s): %.3f ms/build, %.2fx, %d references, %d dropped%s\n", threads, buildTime, singleTime / buildTime, count, clusters->getDroppedCount(), matches? "" : " (results differ!)");
+  }
+
+  delete clusters;
+  delete [] viewPos;
+  delete [] radius;
+  delete [] rect;
+  delete [] grid;
+  delete [] indices;
+  delete [] firstGrid;
+  delete [] firstIndices;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void App::benchmarkLightParticles(){
+
+  PPFXLightData *particles = new PPFXLightData[PFX_BENCHMARK_COUNT];
+  vec3 *startPositions = new vec3[PFX_BENCHMARK_COUNT];
+  vec3 *positions = new vec3[PFX_BENCHMARK_COUNT];
+  vec3 *firstPositions = new vec3[PFX_BENCHMARK_COUNT];
+
+  // Spawn the particles from the primary lights at spread out ages
+  for(uint i=0; i<PFX_BENCHMARK_COUNT; i++)
+  {
+    particles[i].Seed(i);
+    startPositions[i] = particles[i].Spawn(lightStore.getPosition(i % PRIMARY_LIGHT_COUNT), SECONDARY_LIGHT_LIFETIME * float(i) / PFX_BENCHMARK_COUNT);
+  }
+  PPFXLightData *startParticles = new PPFXLightData[PFX_BENCHMARK_COUNT];
+  memcpy(startParticles, particles, PFX_BENCHMARK_COUNT * sizeof(PPFXLightData));
+
+  printf("Light particle benchmark, %d particles, %d steps\n", PFX_BENCHMARK_COUNT, PFX_BENCHMARK_STEPS);
+
+  float singleTime = 0.0f;
+  for(int threads=1; threads<=max(cpuCount, 1); threads++)
+  {
+    memcpy(particles, startParticles, PFX_BENCHMARK_COUNT * sizeof(PPFXLightData));
+    memcpy(positions, startPositions, PFX_BENCHMARK_COUNT * sizeof(vec3));
+
+    WorkerPool pool;
+    pool.start(threads - 1);
+
+    uint64 startCycle = getCycleNumber();
+    for(uint step=0; step<PFX_BENCHMARK_STEPS; step++)
+    {
+      updatePFX(pool, particles, positions, PFX_BENCHMARK_COUNT, 1.0f / 60.0f, bsp);
+    }
+    float stepTime = float(getCycleNumber() - startCycle) * 1000.0f / (float(cpuHz) * PFX_BENCHMARK_STEPS);
+
+    pool.stop();
+
+    // The results must be the same for any thread count
+    bool matches = true;
+    if(threads == 1)
+    {
+      singleTime = stepTime;
+      memcpy(firstPositions, positions, PFX_BENCHMARK_COUNT * sizeof(vec3));
+    }
+    else
+    {
+      matches = (memcmp(firstPositions, positions, PFX_BENCHMARK_COUNT * sizeof(vec3)) == 0);
+    }
+
+    printf("  %d thread(s): %.3f ms/step, %.2fx%s\n", threads, stepTime, singleTime / stepTime, matches? "" : " (results differ!)");
+  }
+
+  delete [] particles;
+  delete [] startParticles;
+  delete [] startPositions;
+  delete [] positions;
+  delete [] firstPositions;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void App::benchmarkCollision(){
+
+  BNode *tree = bsp.createTree();
+  if(tree == NULL){
+    return;
+  }
+
+  // Random segments the length of a particle step, starting around the lights
+  vec3 *starts = new vec3[COLLISION_BENCHMARK_COUNT];
+  vec3 *ends = new vec3[COLLISION_BENCHMARK_COUNT];
+  for(uint i=0; i<COLLISION_BENCHMARK_COUNT; i++)
+  {
+    vec3 offset(float(rand()) / RAND_MAX - 0.5f, float(rand()) / RAND_MAX - 0.5f, float(rand()) / RAND_MAX - 0.5f);
+    vec3 dir(float(rand()) / RAND_MAX - 0.5f, float(rand()) / RAND_MAX - 0.5f, float(rand()) / RAND_MAX - 0.5f);
+
+    starts[i] = lightStore.getPosition(i % MAX_LIGHT_TOTAL) + offset * 400.0f;
+    ends[i] = starts[i] + dir * 100.0f;
+  }
+
+  printf("Collision benchmark, %d nodes, %d queries\n", bsp.getNodeCount(), COLLISION_BENCHMARK_COUNT);
+
+  // Segment queries
+  uint treeHits = 0, flatHits = 0;
+  uint64 startCycle = getCycleNumber();
+  for(uint i=0; i<COLLISION_BENCHMARK_COUNT; i++)
+  {
+    vec3 point;
+    const BTri *tri;
+    if(tree->intersects(starts[i], ends[i], ends[i] - starts[i], &point, &tri)){
+      treeHits++;
+    }
+  }
+  float treeTime = float(getCycleNumber() - startCycle) * 1000.0f / float(cpuHz);
+
+  startCycle = getCycleNumber();
+  for(uint i=0; i<COLLISION_BENCHMARK_COUNT; i++)
+  {
+    vec3 point;
+    const BTri *tri;
+    if(bsp.intersects(starts[i], ends[i], &point, &tri)){
+      flatHits++;
+    }
+  }
+  float flatTime = float(getCycleNumber() - startCycle) * 1000.0f / float(cpuHz);
+
+  printf("  intersects:    tree %.3f ms, flat %.3f ms, %.2fx%s\n", treeTime, flatTime, treeTime / flatTime, (treeHits == flatHits)? "" : " (results differ!)");
+
+  // Sphere queries
+  uint mismatches = 0;
+  startCycle = getCycleNumber();
+  for(uint i=0; i<COLLISION_BENCHMARK_COUNT; i++)
+  {
+    vec3 pos = starts[i];
+    tree->pushSphere(pos, 30);
+    ends[i] = pos;
+  }
+  treeTime = float(getCycleNumber() - startCycle) * 1000.0f / float(cpuHz);
+
+  startCycle = getCycleNumber();
+  for(uint i=0; i<COLLISION_BENCHMARK_COUNT; i++)
+  {
+    vec3 pos = starts[i];
+    bsp.pushSphere(pos, 30);
+    if(!(pos == ends[i])){
+      mismatches++;
+    }
+  }
+  flatTime = float(getCycleNumber() - startCycle) * 1000.0f / float(cpuHz);
+
+  printf("  pushSphere:    tree %.3f ms, flat %.3f ms, %.2fx%s\n", treeTime, flatTime, treeTime / flatTime, (mismatches == 0)? "" : " (results differ!)");
+
+  // Batched sphere queries, compared against the single flat queries
+  vec3 *positions = new vec3[COLLISION_BENCHMARK_COUNT];
+  float *radii = new float[COLLISION_BENCHMARK_COUNT];
+  for(uint i=0; i<COLLISION_BENCHMARK_COUNT; i++)
+  {
+    positions[i] = starts[i];
+    radii[i] = 30;
+  }
+
+  mismatches = 0;
+  startCycle = getCycleNumber();
+  bsp.pushSpheres(positions, radii, COLLISION_BENCHMARK_COUNT);
+  float batchTime = float(getCycleNumber() - startCycle) * 1000.0f / float(cpuHz);
+  for(uint i=0; i<COLLISION_BENCHMARK_COUNT; i++)
+  {
+    if(!(positions[i] == ends[i])){
+      mismatches++;
+    }
+  }
+
+  printf("  pushSpheres:   flat %.3f ms, batch %.3f ms, %.2fx%s\n", flatTime, batchTime, flatTime / batchTime, (mismatches == 0)? "" : " (results differ!)");
+
+  mismatches = 0;
+  startCycle = getCycleNumber();
+  for(uint i=0; i<COLLISION_BENCHMARK_COUNT; i++)
+  {
+    radii[i] = bsp.getDistance(starts[i]);
+  }
+  flatTime = float(getCycleNumber() - startCycle) * 1000.0f / float(cpuHz);
+
+  float *distances = new float[COLLISION_BENCHMARK_COUNT];
+  startCycle = getCycleNumber();
+  bsp.getDistances(starts, COLLISION_BENCHMARK_COUNT, distances);
+  batchTime = float(getCycleNumber() - startCycle) * 1000.0f / float(cpuHz);
+  for(uint i=0; i<COLLISION_BENCHMARK_COUNT; i++)
+  {
+    if(distances[i] != radii[i]){
+      mismatches++;
+    }
+  }
+
+  printf("  getDistances:  flat %.3f ms, batch %.3f ms, %.2fx%s\n", flatTime, batchTime, flatTime / batchTime, (mismatches == 0)? "" : " (results differ!)");
+
+  delete [] positions;
+  delete [] radii;
+  delete [] distances;
+
+  // Point queries
+  uint openCount = 0;
+  startCycle = getCycleNumber();
+  for(uint i=0; i<COLLISION_BENCHMARK_COUNT; i++)
+  {
+    if(bsp.isInOpenSpace(starts[i])){
+      openCount++;
+    }
+  }
+  flatTime = float(getCycleNumber() - startCycle) * 1000.0f / float(cpuHz);
+
+  printf("  isInOpenSpace: flat %.3f ms, %d in open space\n", flatTime, openCount);
+
+  delete [] starts;
+  delete [] ends;
+  delete tree;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+struct BSPCheckJob {
+  const BSP *bsp;
+  const vec3 *starts, *ends;
+
+  // Single-threaded reference results
+  const bool *hits;
+  const vec3 *points;
+  const vec3 *pushed;
+  const float *distances;
+  const bool *open;
+
+  uint *mismatches;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static void checkBSPItem(void *data, const uint item){
+
+  BSPCheckJob *job = (BSPCheckJob *) data;
+
+  // Every item runs all query types on the shared tree with its own context,
+  // starting at a different query so the items don't run in lockstep
+  BSPQueryContext context;
+  uint offset = (item * 1031) % BSP_CHECK_COUNT;
+  uint mismatches = 0;
+
+  for(uint j=0; j<BSP_CHECK_COUNT; j += BSP_CHECK_BATCH)
+  {
+    uint start = (offset + j) % BSP_CHECK_COUNT;
+    uint count = min(BSP_CHECK_COUNT - start, BSP_CHECK_BATCH);
+
+    bool hits[BSP_CHECK_BATCH];
+    vec3 points[BSP_CHECK_BATCH];
+    job->bsp->intersectsBatch(job->starts + start, job->ends + start, count, hits, points);
+
+    for(uint k=0; k<count; k++)
+    {
+      uint i = start + k;
+
+      vec3 point;
+      bool hit = job->bsp->intersects(job->starts[i], job->ends[i], &point);
+      if(hit != job->hits[i] || (hit && !(point == job->points[i]))){
+        mismatches++;
+      }
+      if(hits[k] != job->hits[i] || (hits[k] && !(points[k] == job->points[i]))){
+        mismatches++;
+      }
+      if(job->bsp->intersectsCached(context, job->starts[i], job->ends[i]) != job->hits[i]){
+        mismatches++;
+      }
+
+      vec3 pos = job->starts[i];
+      job->bsp->pushSphere(pos, 30);
+      if(!(pos == job->pushed[i])){
+        mismatches++;
+      }
+      if(job->bsp->getDistance(job->starts[i]) != job->distances[i]){
+        mismatches++;
+      }
+      if(job->bsp->isInOpenSpace(job->starts[i]) != job->open[i]){
+        mismatches++;
+      }
+    }
+  }
+
+  job->mismatches[item] = mismatches;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void App::checkBSPThreads(){
+
+  printf("BSP thread check, %d items of %d queries on %d threads\n", BSP_CHECK_ITEMS, BSP_CHECK_COUNT, workerPool.getThreadCount() + 1);
+
+  // Random segments around the lights, as in the collision benchmark
+  vec3 *starts = new vec3[BSP_CHECK_COUNT];
+  vec3 *ends = new vec3[BSP_CHECK_COUNT];
+  for(uint i=0; i<BSP_CHECK_COUNT; i++)
+  {
+    vec3 offset(float(rand()) / RAND_MAX - 0.5f, float(rand()) / RAND_MAX - 0.5f, float(rand()) / RAND_MAX - 0.5f);
+    vec3 dir(float(rand()) / RAND_MAX - 0.5f, float(rand()) / RAND_MAX - 0.5f, float(rand()) / RAND_MAX - 0.5f);
+
+    starts[i] = lightStore.getPosition(i % MAX_LIGHT_TOTAL) + offset * 400.0f;
+    ends[i] = starts[i] + dir * 100.0f;
+  }
+
+  bool *hits = new bool[BSP_CHECK_COUNT];
+  vec3 *points = new vec3[BSP_CHECK_COUNT];
+  vec3 *pushed = new vec3[BSP_CHECK_COUNT];
+  float *distances = new float[BSP_CHECK_COUNT];
+  bool *open = new bool[BSP_CHECK_COUNT];
+  for(uint i=0; i<BSP_CHECK_COUNT; i++)
+  {
+    hits[i] = bsp.intersects(starts[i], ends[i], &points[i]);
+    pushed[i] = starts[i];
+    bsp.pushSphere(pushed[i], 30);
+    distances[i] = bsp.getDistance(starts[i]);
+    open[i] = bsp.isInOpenSpace(starts[i]);
+  }
+
+  uint mismatches[BSP_CHECK_ITEMS];
+
+  BSPCheckJob job;
+  job.bsp = &bsp;
+  job.starts = starts;
+  job.ends = ends;
+  job.hits = hits;
+  job.points = points;
+  job.pushed = pushed;
+  job.distances = distances;
+  job.open = open;
+  job.mismatches = mismatches;
+
+  uint64 startCycle = getCycleNumber();
+  workerPool.run(checkBSPItem, &job, BSP_CHECK_ITEMS);
+  float time = float(getCycleNumber() - startCycle) * 1000.0f / float(cpuHz);
+
+  uint total = 0;
+  for(uint i=0; i<BSP_CHECK_ITEMS; i++)
+  {
+    total += mismatches[i];
+  }
+  printf("  %.2f ms, %s (%d mismatches)\n", time, total? "results differ!" : "identical", total);
+
+  delete [] starts;
+  delete [] ends;
+  delete [] hits;
+  delete [] points;
+  delete [] pushed;
+  delete [] distances;
+  delete [] open;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+template <class ACCEL>
+static void benchmarkAcceleratorQueries(const char *name, const ACCEL &accel, const vec3 *starts, const vec3 *ends, const uint count, const uint64 hz){
+
+  uint hits = 0;
+  uint64 startCycle = getCycleNumber();
+  for(uint i=0; i<count; i++)
+  {
+    if(accel.intersects(starts[i], ends[i])){
+      hits++;
+    }
+  }
+  float intersectsTime = float(getCycleNumber() - startCycle) * 1000.0f / float(hz);
+
+  startCycle = getCycleNumber();
+  for(uint i=0; i<count; i++)
+  {
+    vec3 pos = starts[i];
+    accel.pushSphere(pos, 30);
+  }
+  float pushTime = float(getCycleNumber() - startCycle) * 1000.0f / float(hz);
+
+  float distSum = 0.0f;
+  startCycle = getCycleNumber();
+  for(uint i=0; i<count; i++)
+  {
+    distSum += accel.getDistance(starts[i]);
+  }
+  float distTime = float(getCycleNumber() - startCycle) * 1000.0f / float(hz);
+
+  uint openCount = 0;
+  startCycle = getCycleNumber();
+  for(uint i=0; i<count; i++)
+  {
+    if(accel.isInOpenSpace(starts[i])){
+      openCount++;
+    }
+  }
+  float openTime = float(getCycleNumber() - startCycle) * 1000.0f / float(hz);
+
+  printf("    %s queries: intersects %.2f ms, pushSphere %.2f ms, getDistance %.2f ms, isInOpenSpace %.2f ms\n", name, intersectsTime, pushTime, distTime, openTime);
+  printf("    %s results: %d hits, %d in open space, average distance %.2f\n", name, hits, openCount, distSum / count);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void App::benchmarkAccelerators(){
+
+  Stream stream = map->getStream(map->findStream(TYPE_VERTEX));
+  vec3 *vertices = (vec3 *) stream.vertices;
+  uint *indices = stream.indices;
+  uint nIndices = map->getIndexCount();
+
+  // Get the map bounds to place the copies side by side
+  vec3 minBound = vertices[indices[0]];
+  vec3 maxBound = minBound;
+  for(uint i=0; i<nIndices; i++)
+  {
+    const vec3 &v = vertices[indices[i]];
+    minBound = vec3(min(minBound.x, v.x), min(minBound.y, v.y), min(minBound.z, v.z));
+    maxBound = vec3(max(maxBound.x, v.x), max(maxBound.y, v.y), max(maxBound.z, v.z));
+  }
+  vec3 mapSize = maxBound - minBound;
+
+  vec3 *starts = new vec3[COLLISION_BENCHMARK_COUNT];
+  vec3 *ends = new vec3[COLLISION_BENCHMARK_COUNT];
+
+  printf("BSP against BVH benchmark, %d queries\n", COLLISION_BENCHMARK_COUNT);
+
+  uint copies = 1;
+  for(uint size=0; size<ACCEL_BENCHMARK_SIZES; size++, copies *= 10)
+  {
+    uint side = (uint) ceilf(sqrtf(float(copies)));
+
+    BSP testBSP;
+    BVH testBVH;
+    for(uint c=0; c<copies; c++)
+    {
+      vec3 offset((c % side) * mapSize.x, 0, (c / side) * mapSize.z);
+      for(uint i=0; i<nIndices; i += 3)
+      {
+        vec3 v0 = vertices[indices[i]] + offset;
+        vec3 v1 = vertices[indices[i + 1]] + offset;
+        vec3 v2 = vertices[indices[i + 2]] + offset;
+        testBSP.addTriangle(v0, v1, v2);
+        testBVH.addTriangle(v0, v1, v2);
+      }
+    }
+
+    uint64 startCycle = getCycleNumber();
+    testBSP.build(3, 1, 0.001f, BSP_DEFAULT_SAMPLES, &workerPool);
+    float bspBuildTime = float(getCycleNumber() - startCycle) * 1000.0f / float(cpuHz);
+
+    startCycle = getCycleNumber();
+    testBVH.build();
+    float bvhBuildTime = float(getCycleNumber() - startCycle) * 1000.0f / float(cpuHz);
+
+    printf("  %d map copies, %d triangles\n", copies, testBVH.getTriangleCount());
+    printf("    BSP build: %.2f ms, %d nodes, %d KB\n", bspBuildTime, testBSP.getNodeCount(), testBSP.getMemoryUsage() / 1024);
+    printf("    BVH build: %.2f ms, %d nodes, %d KB\n", bvhBuildTime, testBVH.getNodeCount(), testBVH.getMemoryUsage() / 1024);
+
+    // Random particle step sized segments over the whole grid
+    vec3 gridSize(side * mapSize.x, mapSize.y, side * mapSize.z);
+    for(uint i=0; i<COLLISION_BENCHMARK_COUNT; i++)
+    {
+      vec3 t(float(rand()) / RAND_MAX, float(rand()) / RAND_MAX, float(rand()) / RAND_MAX);
+      vec3 dir(float(rand()) / RAND_MAX - 0.5f, float(rand()) / RAND_MAX - 0.5f, float(rand()) / RAND_MAX - 0.5f);
+
+      starts[i] = minBound + t * gridSize;
+      ends[i] = starts[i] + dir * 100.0f;
+    }
+
+    benchmarkAcceleratorQueries("BSP", testBSP, starts, ends, COLLISION_BENCHMARK_COUNT, cpuHz);
+    benchmarkAcceleratorQueries("BVH", testBVH, starts, ends, COLLISION_BENCHMARK_COUNT, cpuHz);
+  }
+
+  delete [] starts;
+  delete [] ends;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void App::printMapStats(){
+
+  const VertexCacheStats &before = map->getOrderStats(false);
+  const VertexCacheStats &after = map->getOrderStats(true);
+
+  printf("Map stats\n");
+  printf("  Vertex cache ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n", before.acmr, after.acmr, before.atvr, after.atvr);
+  printf("  Depth pass positions %d\n", map->getPositionCount());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static bool sameStreams(const Model &a, const Model &b){
+
+  if(a.getStreamCount() != b.getStreamCount() || a.getIndexCount() != b.getIndexCount())
+  {
+    return false;
+  }
+
+  for(uint s=0; s<a.getStreamCount(); s++)
+  {
+    const Stream &sa = a.getStream(s);
+    const Stream &sb = b.getStream(s);
+    if(sa.nVertices != sb.nVertices || sa.nComponents != sb.nComponents ||
+       memcmp(sa.vertices, sb.vertices, sa.nVertices * sa.nComponents * sizeof(float)) != 0 ||
+       memcmp(sa.indices, sb.indices, a.getIndexCount() * sizeof(uint)) != 0)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void App::checkTangentSpace(){
+
+  printf("Tangent space check, pooled SSE against serial scalar\n");
+
+  // Both tangent space modes have to come out bit identical, whatever the compiler flags
+  for(uint flat=0; flat<2; flat++)
+  {
+    Model pooled, scalar;
+    if(!pooled.loadObj("../Models/Room6/Map.obj", &workerPool) || !scalar.loadObj("../Models/Room6/Map.obj", &workerPool))
+    {
+      return;
+    }
+
+    uint64 startCycle = getCycleNumber();
+    pooled.computeTangentSpace(flat != 0, &workerPool);
+    float pooledTime = float(getCycleNumber() - startCycle) * 1000.0f / float(cpuHz);
+
+    startCycle = getCycleNumber();
+    scalar.computeTangentSpace(flat != 0, NULL, false);
+    float scalarTime = float(getCycleNumber() - startCycle) * 1000.0f / float(cpuHz);
+
+    printf("  %s: pooled %.2f ms, scalar %.2f ms, %s\n", flat? "Flat" : "Smooth", pooledTime, scalarTime, sameStreams(pooled, scalar)? "identical" : "results differ!");
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static bool sameComponent(const float a, const float b){
+
+  // Float equality, 0 equals -0 and NaN equals nothing. Spelled out on the bits since -ffast-math assumes there are no NaNs.
+  union { float f; uint u; } bitsA, bitsB;
+  bitsA.f = a;
+  bitsB.f = b;
+
+  if((bitsA.u & 0x7FFFFFFF) > 0x7F800000 || (bitsB.u & 0x7FFFFFFF) > 0x7F800000){
+    return false;
+  }
+  return (bitsA.u == bitsB.u || ((bitsA.u | bitsB.u) & 0x7FFFFFFF) == 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static uint referenceWeld(float *vertices, const uint nVertices, const uint nComponents, uint *remap){
+
+  // Every vertex is compared against all kept ones, later duplicates overwrite the kept vertex
+  float *original = new float[nVertices * nComponents];
+  memcpy(original, vertices, nVertices * nComponents * sizeof(float));
+
+  uint *kept = new uint[nVertices];
+  uint nKept = 0;
+  for(uint i=0; i<nVertices; i++)
+  {
+    const float *vertex = original + i * nComponents;
+
+    uint k;
+    for(k=0; k<nKept; k++)
+    {
+      const float *other = original + kept[k] * nComponents;
+      uint c = 0;
+      while(c < nComponents && sameComponent(other[c], vertex[c])){
+        c++;
+      }
+      if(c == nComponents){
+        break;
+      }
+    }
+    if(k == nKept){
+      kept[nKept++] = i;
+    }
+
+    remap[i] = k;
+    memcpy(vertices + k * nComponents, vertex, nComponents * sizeof(float));
+  }
+
+  delete [] original;
+  delete [] kept;
+
+  return nKept;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static void checkWeld(const char *name, const float *vertices, const uint nVertices, const uint nComponents, WorkerPool &pool){
+
+  uint size = nVertices * nComponents;
+  float *refVertices = new float[size];
+  float *weldedVertices = new float[size];
+  uint *refRemap = new uint[nVertices];
+  uint *remap = new uint[nVertices];
+
+  memcpy(refVertices, vertices, size * sizeof(float));
+  uint refKept = referenceWeld(refVertices, nVertices, nComponents, refRemap);
+
+  // Serial, then sharded on the worker pool
+  const char *results[2];
+  for(uint pooled=0; pooled<2; pooled++)
+  {
+    memcpy(weldedVertices, vertices, size * sizeof(float));
+    uint nKept = weldVertices(weldedVertices, nVertices, nComponents, remap, 0, pooled? &pool : NULL);
+
+    bool matches = (nKept == refKept &&
+                    memcmp(remap, refRemap, nVertices * sizeof(uint)) == 0 &&
+                    memcmp(weldedVertices, refVertices, nKept * nComponents * sizeof(float)) == 0);
+    results[pooled] = matches? "identical" : "results differ!";
+  }
+
+  printf("  %s: %d vertices, %d kept, serial %s, pooled %s\n", name, nVertices, refKept, results[0], results[1]);
+
+  delete [] refVertices;
+  delete [] weldedVertices;
+  delete [] refRemap;
+  delete [] remap;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void App::checkVertexWelding(){
+
+  printf("Vertex welding check, exact mode against a brute force weld\n");
+
+  // The map as loaded, before the welding in load()
+  Model model;
+  if(!model.loadObj("../Models/Room6/Map.obj", &workerPool))
+  {
+    return;
+  }
+
+  char name[32];
+  for(uint s=0; s<model.getStreamCount(); s++)
+  {
+    const Stream &stream = model.getStream(s);
+    sprintf(name, "Stream %d", s);
+    checkWeld(name, stream.vertices, stream.nVertices, stream.nComponents, workerPool);
+  }
+
+  // The map streams are too small to be sharded, so also weld copies of the positions. Some components are
+  // zeroed, with the sign flipped in every other copy, which still welds. A few random NaNs never weld.
+  const Stream &positions = model.getStream(0);
+  uint nComponents = positions.nComponents;
+  uint copySize = positions.nVertices * nComponents;
+  // Written as bits, -ffast-math is free to turn a -0 into a 0
+  uint nan = 0x7FC00000;
+
+  float *vertices = new float[WELD_CHECK_COPIES * copySize];
+  for(uint c=0; c<WELD_CHECK_COPIES; c++)
+  {
+    float *copy = vertices + c * copySize;
+    memcpy(copy, positions.vertices, copySize * sizeof(float));
+    for(uint i=0; i<copySize; i++)
+    {
+      if(i % 5 == 0){
+        uint zero = (c & 1) << 31;
+        memcpy(copy + i, &zero, sizeof(float));
+      }
+      if(rand() % 256 == 0){
+        memcpy(copy + i, &nan, sizeof(float));
+      }
+    }
+  }
+
+  sprintf(name, "%d copies", WELD_CHECK_COPIES);
+  checkWeld(name, vertices, WELD_CHECK_COPIES * positions.nVertices, nComponents, workerPool);
+
+  delete [] vertices;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static void benchmarkVertexHashes(const char *name, const uint *tuples, const uint nTuples, const uint nStreams, const uint64 hz){
+
+  uint *hashIndices = new uint[nTuples];
+  uint *tupleIndices = new uint[nTuples];
+  uint *growIndices = new uint[nTuples];
+
+  // The Hash arena can't grow, so it is sized for every tuple being unique. The TupleHash gets the same room.
+  uint64 startCycle = getCycleNumber();
+  Hash hash(nStreams, nTuples >> 3, nTuples);
+  for(uint i=0; i<nTuples; i++)
+  {
+    hash.insert(tuples + i * nStreams, hashIndices + i);
+  }
+  float hashTime = float(getCycleNumber() - startCycle) * 1000.0f / float(hz);
+
+  startCycle = getCycleNumber();
+  TupleHash <uint> tupleHash(nStreams, nTuples);
+  for(uint i=0; i<nTuples; i++)
+  {
+    tupleHash.insert(tuples + i * nStreams, tupleIndices + i);
+  }
+  float tupleHashTime = float(getCycleNumber() - startCycle) * 1000.0f / float(hz);
+
+  // Timed separately, the TupleHash as assemble() sizes it, growing from a quarter of the tuples
+  startCycle = getCycleNumber();
+  TupleHash <uint> growHash(nStreams, nTuples >> 2);
+  for(uint i=0; i<nTuples; i++)
+  {
+    growHash.insert(tuples + i * nStreams, growIndices + i);
+  }
+  float growTime = float(getCycleNumber() - startCycle) * 1000.0f / float(hz);
+
+  // All have to give the same indices for assemble() to be unchanged
+  bool matches = (hash.getCount() == tupleHash.getCount() && memcmp(hashIndices, tupleIndices, nTuples * sizeof(uint)) == 0 &&
+                  hash.getCount() == growHash.getCount() && memcmp(hashIndices, growIndices, nTuples * sizeof(uint)) == 0);
+
+  printf("    %s: Hash %.2f ms, TupleHash %.2f ms, %.2fx, growing TupleHash %.2f ms%s\n", name, hashTime, tupleHashTime, hashTime / tupleHashTime, growTime, matches? "" : " (results differ!)");
+
+  delete [] hashIndices;
+  delete [] tupleIndices;
+  delete [] growIndices;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void App::benchmarkVertexHash(){
+
+  // The index tuples Model::assemble() dedups, from every stream of the map
+  uint nStreams = map->getStreamCount();
+  uint nIndices = map->getIndexCount();
+
+  printf("Vertex hash benchmark, %d streams\n", nStreams);
+
+  uint copies = 1;
+  for(uint size=0; size<HASH_BENCHMARK_SIZES; size++, copies *= 10)
+  {
+    // Each copy of the map uses its own range of every stream
+    uint nTuples = copies * nIndices;
+    uint *tuples = new uint[nTuples * nStreams];
+    for(uint s=0; s<nStreams; s++)
+    {
+      Stream stream = map->getStream(s);
+      for(uint c=0; c<copies; c++)
+      {
+        for(uint i=0; i<nIndices; i++)
+        {
+          tuples[(c * nIndices + i) * nStreams + s] = stream.indices[i] + c * stream.nVertices;
+        }
+      }
+    }
+
+    printf("  %d map copies, %d tuples\n", copies, nTuples);
+    benchmarkVertexHashes("Mesh order", tuples, nTuples, nStreams, cpuHz);
+
+    // The copies come in increasing index order, which favors the additive hash, so also time the triangles shuffled
+    uint triangleSize = 3 * nStreams;
+    uint *triangle = new uint[triangleSize];
+    for(uint t=nTuples / 3 - 1; t>0; t--)
+    {
+      uint r = ((uint(rand()) << 15) ^ uint(rand())) % (t + 1);
+      memcpy(triangle, tuples + t * triangleSize, triangleSize * sizeof(uint));
+      memcpy(tuples + t * triangleSize, tuples + r * triangleSize, triangleSize * sizeof(uint));
+      memcpy(tuples + r * triangleSize, triangle, triangleSize * sizeof(uint));
+    }
+    benchmarkVertexHashes("Shuffled", tuples, nTuples, nStreams, cpuHz);
+
+    delete [] triangle;
+    delete [] tuples;
+  }
+}
@@ -22,9 +22,7 @@
 
 #include "App.h"
 
-#define PRIMARY_LIGHT_COUNT         3
 #define SECONDARY_LIGHT_COUNT       (MAX_LIGHT_TOTAL - PRIMARY_LIGHT_COUNT)
-#define SECONDARY_LIGHT_LIFETIME    8.0f
 #define SECONDARY_LIGHT_SPAWNRATE   (SECONDARY_LIGHT_LIFETIME / (float)SECONDARY_LIGHT_COUNT)
 
 
@@ -49,25 +47,12 @@ struct EditorData
 };
 EditorData editorData;
 
-
-//Structure to hold PFX light data
-struct PPFXLightData
-{
-  PPFXLightData();
-  void Spawn(const vec3 &spawnPos, float intialAge, LightData &setLight);
-  void Update(float updateTime, const BSP &collideBSP, LightData &setLight);
-
-  vec3 spawnPosition; // The spawn/intersection position
-  vec3 direction;     // The current direction
-
-  float lifeTime;     // The lifetime of the particle
-  float dirLifeTime;  // The life of the particle in the current direction
-};
+// The secondary lights, spawned from the primary lights in turn
 uint nextPFXLightEnable = 0;
 PPFXLightData pfxLights[SECONDARY_LIGHT_COUNT];
 
 // Define the arry of static light data positions
-LightData staticLightDataArray[MAX_LIGHT_TOTAL] = { 
+LightData staticLightDataArray[] = { 
 #include "LightPositions.h"
 };
 
@@ -100,10 +85,16 @@ void ConvertMatrix(const mat4 &srcMat, GLdouble outMat[16])
 //
 void App::SetStaticLightScene()
 {
-  // Copy over the fixed light positions
+  // Copy over the fixed light positions, any lights past the recorded ones only get a color until the PFX lights spawn them
   for(uint i =0; i<MAX_LIGHT_TOTAL; i++)
   {
-    lightDataArray[i] = staticLightDataArray[i];
+    const LightData &light = staticLightDataArray[i % elementsOf(staticLightDataArray)];
+    if(i < elementsOf(staticLightDataArray)){
+      lightStore.setLight(i, light);
+    }
+    else{
+      lightStore.setLight(i, LightData(light.color, light.position, 0.0f));
+    }
   }
 }
 
@@ -165,10 +156,11 @@ bool App::GetSpherePosition(const int x, const int y){
       if(i != editorData.lightIndex){
 
         // This is a lazy approximation of sphere line intersection
-        float projDist = dot(lightDataArray[i].position - camPos, dirVector);
-        if(length((dirVector * projDist) - (lightDataArray[i].position - camPos)) < lightDataArray[i].size){
+        vec3 lightPos = lightStore.getPosition(i);
+        float projDist = dot(lightPos - camPos, dirVector);
+        if(length((dirVector * projDist) - (lightPos - camPos)) < lightStore.getSize(i)){
 
-          newPosDist = min(projDist - lightDataArray[i].size - editorData.lightSize, newPosDist);
+          newPosDist = min(projDist - lightStore.getSize(i) - editorData.lightSize, newPosDist);
         }
       }
     }
@@ -216,10 +208,11 @@ bool App::onKeyEditor(const uint key, const bool pressed) {
   // Dump out all the current light data
   if(key == KEY_D && pressed){
     for(uint i=0; i<MAX_LIGHT_TOTAL; i++){
+      LightData light = lightStore.getLight(i);
       printf("  LightData(vec3(%ff,%ff,%ff), vec3(%ff,%ff,%ff), %ff), \n", 
-            lightDataArray[i].color.x, lightDataArray[i].color.y, lightDataArray[i].color.z,
-            lightDataArray[i].position.x, lightDataArray[i].position.y, lightDataArray[i].position.z,
-            lightDataArray[i].size);
+            light.color.x, light.color.y, light.color.z,
+            light.position.x, light.position.y, light.position.z,
+            light.size);
     }
   }
 
@@ -286,15 +279,7 @@ bool App::onMouseButtonEditor(const int x, const int y, const MouseButton button
 
   // Place the light sphere
   if(GetSpherePosition(x,y)){
-    lightDataArray[editorData.lightIndex].position = editorData.lightPosition;
-    lightDataArray[editorData.lightIndex].color = editorData.lightColor;
-    lightDataArray[editorData.lightIndex].size = editorData.lightSize;
-  }
-
-  // Reset the deferred rendering light color texture to force a re-generation
-  if(bitMaskLightColors != TEXTURE_NONE){
-    renderer->removeTexture(bitMaskLightColors);
-    bitMaskLightColors = TEXTURE_NONE;
+    lightStore.setLight(editorData.lightIndex, LightData(editorData.lightColor, editorData.lightPosition, editorData.lightSize));
   }
 
   return true;
@@ -338,7 +323,7 @@ void App::drawFrameEditor(){
   renderer->applyConstants();
 
   // Draw a sphere the radius of the light
-  sphereModel->draw(renderer);
+  sphereModels[SPHERE_LOD_COUNT - 1]->draw(renderer);
 
   // Draw text data to the screen 
 	renderer->setup2DMode(0, (float) width, 0, (float) height);
@@ -363,104 +348,33 @@ void App::drawFrameEditor(){
 	renderer->drawText(str, (float)width - (14 * 30) - 8, 8.0f + offset, 30, 38, defaultFont, linearClamp, blendSrcAlpha, noDepthTest);
 }
 
-///////////////////////////////////////////////////////////////////////////////
-//
-PPFXLightData::PPFXLightData():
-  lifeTime(0.0f),
-  dirLifeTime(0.0f)
-{
-  spawnPosition = vec3(0.0f);
-  direction = vec3(0.0f);
-}
-
-///////////////////////////////////////////////////////////////////////////////
-//
-void PPFXLightData::Spawn(const vec3 &spawnPos, float intialAge, LightData &setLight){
-
-  spawnPosition = spawnPos;
-  setLight.position = spawnPosition;
-
-  // Spawn in a random directoin
-  direction = vec3(2.0f * float(rand()) / RAND_MAX - 1.0f,
-                   2.0f * float(rand()) / RAND_MAX - 1.0f,
-                   2.0f * float(rand()) / RAND_MAX - 1.0f);
- 
-  direction = normalize(direction) *  500.0f;
-  
-  setLight.size = 75.0f;
-  lifeTime    = intialAge;
-  dirLifeTime = intialAge;
-}
-
-///////////////////////////////////////////////////////////////////////////////
-//
-void PPFXLightData::Update(float updateTime, const BSP &collideBSP, LightData &setLight){
-
-  // Update particle lifetimes
-  lifeTime    += updateTime;
-  dirLifeTime += updateTime;
-
-/*
-  // Attenuate size over time
-  if(lifeTime > (SECONDARY_LIGHT_LIFETIME*0.75f)){
-    setLight.size = 75.0f * (1.0f - (lifeTime - (SECONDARY_LIGHT_LIFETIME*0.75f)) / (SECONDARY_LIGHT_LIFETIME*0.25f));
-  }
-  else{
-    setLight.size = 75.0f; 
-  }
-*/
-
-  // Calculate the new position using s = ut + 0.5at^2
-  vec3 newPosition = spawnPosition + (direction * dirLifeTime) + (vec3(0.0f, -100.0f, 0.0f) * dirLifeTime * dirLifeTime * 0.5f);
-
-  // Check for a collision between the last and new position
-  vec3 colPoint;
-  const BTri *colTriangle;
-  if(collideBSP.intersects(setLight.position, newPosition, &colPoint, &colTriangle))
-  {
-    // Don't land exactly on the plane, 
-    spawnPosition = colPoint + 10.0f * colTriangle->plane.xyz();
-
-    // Calculate the new direction, with 95% of the origional velocity
-    direction = reflect(direction, colTriangle->plane.xyz()); 
-    direction *= 0.95f;
-    dirLifeTime = 0.0f;
-
-    // Don't worry about calculating the directional 
-    newPosition = spawnPosition;
-  }
-
-  // Assign the new position
-  setLight.position = newPosition;
-}
-
 ///////////////////////////////////////////////////////////////////////////////
 //
 void App::updatePrimaryLights(float t){
 
   float c = 0.5f + 0.5f * sinf(t * 0.723f);
 
-  lightDataArray[0].size = 600.0f;
-  lightDataArray[1].size = 600.0f;
-  lightDataArray[2].size = 600.0f;
+  lightStore.setSize(0, 600.0f);
+  lightStore.setSize(1, 600.0f);
+  lightStore.setSize(2, 600.0f);
 
   // Set primary light positions along a pre-programmed track
-  lightDataArray[1].position = vec3(350 * cosf(1.82345f * t), 300 * cosf(1.252f * t), 180 * sinf(2.451f * t) - 1300);
-  lightDataArray[2].position = vec3(85 - 250 * c * sinf(t * 2 * 0.723f), 400 * sinf(t * 0.723f) - 320, 150 * c * sinf(t * 3 * 0.723f) - 115);
+  lightStore.setPosition(1, vec3(350 * cosf(1.82345f * t), 300 * cosf(1.252f * t), 180 * sinf(2.451f * t) - 1300));
+  lightStore.setPosition(2, vec3(85 - 250 * c * sinf(t * 2 * 0.723f), 400 * sinf(t * 0.723f) - 320, 150 * c * sinf(t * 3 * 0.723f) - 115));
 
   float f = fmodf(0.7f * t, 4.0f);
   float cf = cosf(PI * f);
   if (f < 2){
     if (f < 1){
-      lightDataArray[0].position = float3(720 * cf, 0, 720);
+      lightStore.setPosition(0, float3(720 * cf, 0, 720));
     } else {
-      lightDataArray[0].position = float3(-720, 0, -720 * cf);
+      lightStore.setPosition(0, float3(-720, 0, -720 * cf));
     }
   } else {
     if (f < 3){
-      lightDataArray[0].position = float3(-720 * cf, 0, -720);
+      lightStore.setPosition(0, float3(-720 * cf, 0, -720));
     } else {
-      lightDataArray[0].position = float3(720, 0, 720 * cf);
+      lightStore.setPosition(0, float3(720, 0, 720 * cf));
     }
   }
 
@@ -487,10 +401,11 @@ void App::updateLights(float updateTime){
     updatePrimaryLights(spawnTime);
 
     // Spawn a particle at the new position of the specified age
-    pfxLights[nextPFXLightEnable].Spawn(
-        lightDataArray[nextPFXLightEnable%3].position,
-         animateTime - spawnTime, 
-         lightDataArray[nextPFXLightEnable + PRIMARY_LIGHT_COUNT]);
+    uint lightIndex = nextPFXLightEnable + PRIMARY_LIGHT_COUNT;
+    lightStore.setPosition(lightIndex, pfxLights[nextPFXLightEnable].Spawn(
+                                       lightStore.getPosition(nextPFXLightEnable%3),
+                                       animateTime - spawnTime));
+    lightStore.setSize(lightIndex, 75.0f);
 
     // Get the next available PFX spawn light position
     nextPFXLightEnable = (nextPFXLightEnable + 1) % SECONDARY_LIGHT_COUNT;
@@ -501,9 +416,17 @@ void App::updateLights(float updateTime){
   updatePrimaryLights(animateTime);
 
   // Update the PFX light positions for each tick
+  static vec3 positions[SECONDARY_LIGHT_COUNT];
   for(uint i=0; i<SECONDARY_LIGHT_COUNT; i++)
   {
-    pfxLights[i].Update(updateTime, bsp, lightDataArray[i + PRIMARY_LIGHT_COUNT]);
+    positions[i] = lightStore.getPosition(i + PRIMARY_LIGHT_COUNT);
+  }
+
+  updatePFX(workerPool, pfxLights, positions, SECONDARY_LIGHT_COUNT, updateTime, bsp);
+
+  for(uint i=0; i<SECONDARY_LIGHT_COUNT; i++)
+  {
+    lightStore.setPosition(i + PRIMARY_LIGHT_COUNT, positions[i]);
   }
 
 }
@@ -594,3 +517,13 @@ void App::drawPrecisionTest1(){
   }
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+void App::seedLightParticles(){
+
+  // Give each particle its own random sequence
+  for(uint i=0; i<SECONDARY_LIGHT_COUNT; i++)
+  {
+    pfxLights[i].Seed(i);
+  }
+}
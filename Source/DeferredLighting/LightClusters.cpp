@@ -0,0 +1,251 @@
+/* ============================================================================
+  Light Indexed Deferred Rendering Demo
+  By Damian Trebilco
+ 
+  Origional base lighting demo by "Humus"  
+============================================================================ */
+
+/***********      .---.         .-"-.      *******************\
+* -------- *     /   ._.       /  ` \     * ---------------- *
+* Author's *     \_  (__\      \_v_/     * humus@rogers.com *
+*   note   *     //   \\       //   \\     * ICQ #47010716    *
+* -------- *    ((     ))     ((     ))    * ---------------- *
+*          ****--""---""-------""---""--****                  ********\
+* This file is a part of the work done by Humus. You are free to use  *
+* the code in any way you like, modified, unmodified or copy'n'pasted *
+* into your own work. However, I expect you to respect these points:  *
+*  @ If you use this file and its contents unmodified, or use a major *
+*    part of this file, please credit the author and leave this note. *
+*  @ For use in anything commercial, please request my approval.      *
+*  @ Share your work and ideas too as much as you can.                *
+\*********************************************************************/
+
+#include "LightClusters.h"
+
+#ifdef USE_SSE
+#include <emmintrin.h>
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+//
+LightClusters::LightClusters():
+  fov(0.0f),
+  width(0),
+  height(0),
+  zNear(0.0f),
+  zFar(0.0f),
+  sliceScale(0.0f)
+{
+  memset(clusterCounts, 0, sizeof(clusterCounts));
+  memset(droppedCounts, 0, sizeof(droppedCounts));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void LightClusters::setView(const float setFov, const int setWidth, const int setHeight, const float setNear, const float setFar){
+
+  if(setFov == fov && setWidth == width && setHeight == height && setNear == zNear && setFar == zFar){
+    return;
+  }
+  fov = setFov;
+  width = setWidth;
+  height = setHeight;
+  zNear = setNear;
+  zFar = setFar;
+
+  // Same frustum extents as perspectiveMatrixX
+  float ex = tanf(0.5f * fov);
+  float ey = (ex * height) / width;
+
+  sliceScale = CLUSTER_COUNT_Z / logf(zFar / zNear);
+  for(uint z=0; z<=CLUSTER_COUNT_Z; z++){
+    sliceDepth[z] = zNear * expf(z / sliceScale);
+  }
+
+  // A tile covers the same range of the screen at any depth, so its bounds grow linearly over the slice
+  for(uint z=0; z<CLUSTER_COUNT_Z; z++){
+    float d0 = sliceDepth[z];
+    float d1 = sliceDepth[z + 1];
+
+    for(uint x=0; x<CLUSTER_COUNT_X; x++){
+      float a = (2.0f * x) / CLUSTER_COUNT_X - 1.0f;
+      float b = (2.0f * (x + 1)) / CLUSTER_COUNT_X - 1.0f;
+      tileMinX[z][x] = min(a * d0, a * d1) * ex;
+      tileMaxX[z][x] = max(b * d0, b * d1) * ex;
+    }
+    for(uint y=0; y<CLUSTER_COUNT_Y; y++){
+      float a = (2.0f * y) / CLUSTER_COUNT_Y - 1.0f;
+      float b = (2.0f * (y + 1)) / CLUSTER_COUNT_Y - 1.0f;
+      tileMinY[z][y] = min(a * d0, a * d1) * ey;
+      tileMaxY[z][y] = max(b * d0, b * d1) * ey;
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void LightClusters::clearLights(){
+  lights.clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void LightClusters::addLight(const uint lightIndex, const vec3 &viewPos, const float radius, const int x, const int y, const int w, const int h){
+
+  float nearZ = viewPos.z - radius;
+  float farZ  = viewPos.z + radius;
+  if(w <= 0 || h <= 0 || farZ < zNear || nearZ > zFar){
+    return;
+  }
+
+  ClusterLight light;
+  light.viewPos = viewPos;
+  light.radius = radius;
+  light.lightIndex = lightIndex;
+
+  // Find the tiles of the first and last pixel centers, the same way the shader does
+  light.tileX0 = (int)((x + 0.5f) * CLUSTER_COUNT_X / width);
+  light.tileX1 = (int)((x + w - 0.5f) * CLUSTER_COUNT_X / width);
+  light.tileY0 = (int)((y + 0.5f) * CLUSTER_COUNT_Y / height);
+  light.tileY1 = (int)((y + h - 0.5f) * CLUSTER_COUNT_Y / height);
+
+  light.tileX1 = min(light.tileX1, CLUSTER_COUNT_X - 1);
+  light.tileY1 = min(light.tileY1, CLUSTER_COUNT_Y - 1);
+
+  light.slice0 = (int)(logf(max(nearZ, zNear) / zNear) * sliceScale);
+  light.slice1 = (int)(logf(min(farZ,  zFar)  / zNear) * sliceScale);
+
+  light.slice0 = clamp(light.slice0, 0, CLUSTER_COUNT_Z - 1);
+  light.slice1 = clamp(light.slice1, 0, CLUSTER_COUNT_Z - 1);
+
+  lights.add(light);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static forceinline uint addToCluster(ushort (*lists)[CLUSTER_MAX_LIGHTS], ushort *counts, const uint cluster, const uint lightIndex){
+
+  // Returns one if the light had to be dropped
+  if(counts[cluster] < CLUSTER_MAX_LIGHTS){
+    lists[cluster][counts[cluster]++] = (ushort) lightIndex;
+    return 0;
+  }
+  return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void LightClusters::binSlice(void *data, const uint z){
+
+  LightClusters *clusters = (LightClusters *) data;
+
+  ushort *counts = clusters->clusterCounts + z * CLUSTER_COUNT_X * CLUSTER_COUNT_Y;
+  ushort (*lists)[CLUSTER_MAX_LIGHTS] = clusters->clusterLights + z * CLUSTER_COUNT_X * CLUSTER_COUNT_Y;
+  memset(counts, 0, CLUSTER_COUNT_X * CLUSTER_COUNT_Y * sizeof(ushort));
+  uint dropped = 0;
+
+  const float *minX = clusters->tileMinX[z];
+  const float *maxX = clusters->tileMaxX[z];
+
+  for(uint i=0; i<clusters->lights.getCount(); i++){
+    const ClusterLight &light = clusters->lights[i];
+    if((int)z < light.slice0 || (int)z > light.slice1){
+      continue;
+    }
+
+    // Squared distance from the light center to each cluster box, summed one axis at a time
+    const vec3 &c = light.viewPos;
+    float r2 = light.radius * light.radius;
+
+    float dz = max(max(clusters->sliceDepth[z] - c.z, c.z - clusters->sliceDepth[z + 1]), 0.0f);
+    float dz2 = dz * dz;
+
+    for(int y=light.tileY0; y<=light.tileY1; y++){
+
+      float dy = max(max(clusters->tileMinY[z][y] - c.y, c.y - clusters->tileMaxY[z][y]), 0.0f);
+      float dyz2 = dy * dy + dz2;
+      if(dyz2 > r2){
+        continue;
+      }
+
+      uint rowStart = y * CLUSTER_COUNT_X;
+
+#ifdef USE_SSE
+      // Test four tiles along the row at a time
+      __m128 cx = _mm_set1_ps(c.x);
+      __m128 zero = _mm_setzero_ps();
+      __m128 sdyz2 = _mm_set1_ps(dyz2);
+      __m128 sr2 = _mm_set1_ps(r2);
+
+      for(int x=light.tileX0 & ~3; x<=light.tileX1; x+=4){
+        __m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(minX + x), cx), _mm_sub_ps(cx, _mm_loadu_ps(maxX + x))), zero);
+        __m128 d2 = _mm_add_ps(_mm_mul_ps(dx, dx), sdyz2);
+        int mask = _mm_movemask_ps(_mm_cmple_ps(d2, sr2));
+
+        for(int k=max(light.tileX0 - x, 0); mask != 0 && k<4 && x + k<=light.tileX1; k++){
+          if(mask & (1 << k)){
+            dropped += addToCluster(lists, counts, rowStart + x + k, light.lightIndex);
+          }
+        }
+      }
+#else
+      for(int x=light.tileX0; x<=light.tileX1; x++){
+        float dx = max(max(minX[x] - c.x, c.x - maxX[x]), 0.0f);
+        if(dx * dx + dyz2 <= r2){
+          dropped += addToCluster(lists, counts, rowStart + x, light.lightIndex);
+        }
+      }
+#endif
+    }
+  }
+
+  clusters->droppedCounts[z] = dropped;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void LightClusters::build(WorkerPool &pool){
+
+  // Each slice only writes its own clusters, so the slices can be binned in parallel
+  pool.run(binSlice, this, CLUSTER_COUNT_Z);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+uint LightClusters::writeTextureData(float *gridData, float *indexData) const{
+
+  uint offset = 0;
+  for(uint i=0; i<CLUSTER_COUNT; i++){
+
+    // Clip the list if the index texture is full
+    uint count = min((uint)clusterCounts[i], CLUSTER_INDEX_WIDTH * CLUSTER_INDEX_HEIGHT - offset);
+
+    gridData[0] = (float)offset;
+    gridData[1] = (float)count;
+    gridData += 2;
+
+    for(uint k=0; k<count; k++){
+      indexData[offset + k] = (float)clusterLights[i][k];
+    }
+    offset += count;
+  }
+
+  return offset;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+vec4 LightClusters::getShaderScale() const{
+  return vec4((float)CLUSTER_COUNT_X / width, (float)CLUSTER_COUNT_Y / height, 1.0f / zNear, sliceScale);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+uint LightClusters::getDroppedCount() const{
+
+  uint dropped = 0;
+  for(uint z=0; z<CLUSTER_COUNT_Z; z++){
+    dropped += droppedCounts[z];
+  }
+  return dropped;
+}
@@ -0,0 +1,105 @@
+/* ============================================================================
+  Light Indexed Deferred Rendering Demo
+  By Damian Trebilco
+ 
+  Origional base lighting demo by "Humus"  
+============================================================================ */
+
+/***********      .---.         .-"-.      *******************\
+* -------- *     /   ._.       /  ` \     * ---------------- *
+* Author's *     \_  (__\      \_v_/     * humus@rogers.com *
+*   note   *     //   \\       //   \\     * ICQ #47010716    *
+* -------- *    ((     ))     ((     ))    * ---------------- *
+*          ****--""---""-------""---""--****                  ********\
+* This file is a part of the work done by Humus. You are free to use  *
+* the code in any way you like, modified, unmodified or copy'n'pasted *
+* into your own work. However, I expect you to respect these points:  *
+*  @ If you use this file and its contents unmodified, or use a major *
+*    part of this file, please credit the author and leave this note. *
+*  @ For use in anything commercial, please request my approval.      *
+*  @ Share your work and ideas too as much as you can.                *
+\*********************************************************************/
+
+#ifndef _LIGHTCLUSTERS_H_
+#define _LIGHTCLUSTERS_H_
+
+#include "../Framework3/Math/Vector.h"
+#include "../Framework3/Util/Array.h"
+#include "../Framework3/Util/WorkerPool.h"
+
+// The view frustum is split into screen tiles and exponential depth slices
+#define CLUSTER_COUNT_X       16   // Must be a multiple of 4
+#define CLUSTER_COUNT_Y       8
+#define CLUSTER_COUNT_Z       16
+#define CLUSTER_COUNT         (CLUSTER_COUNT_X * CLUSTER_COUNT_Y * CLUSTER_COUNT_Z)
+
+#define CLUSTER_MAX_LIGHTS    64   // Lights kept per cluster, any more are dropped
+
+// Size of the texture holding all the cluster light lists
+#define CLUSTER_INDEX_WIDTH   256
+#define CLUSTER_INDEX_HEIGHT  256
+
+// Helper structure to store a light to bin
+struct ClusterLight
+{
+  vec3 viewPos;       // The view space position
+  float radius;       // The light radius
+  uint lightIndex;    // The index written to the cluster lists
+
+  int tileX0, tileX1; // The tile range the light's screen rectangle covers
+  int tileY0, tileY1;
+  int slice0, slice1; // The depth slice range the light covers
+};
+
+/*
+  Bins lights into view space clusters on the CPU. Each cluster gets a list of
+  the lights touching it, which the lighting shader walks instead of reading
+  a light index buffer, so no light volumes need to be drawn.
+*/
+class LightClusters {
+public:
+  LightClusters();
+
+  // Set the view frustum to split up, the cluster bounds are only rebuilt when it changes
+  void setView(const float fov, const int width, const int height, const float zNear, const float zFar);
+
+  // Add a light to bin. The screen rectangle is the one returned by getScissorRectangles
+  void clearLights();
+  void addLight(const uint lightIndex, const vec3 &viewPos, const float radius, const int x, const int y, const int w, const int h);
+
+  // Bin the added lights, with one depth slice per worker item
+  void build(WorkerPool &pool);
+
+  // Writes an (offset, count) pair per cluster and the light lists, in the layout the shader reads.
+  // Returns the number of light indices written.
+  uint writeTextureData(float *gridData, float *indexData) const;
+
+  // Get the scale values the shader needs to find the cluster of a fragment
+  vec4 getShaderScale() const;
+
+  // Get how many light references were dropped from full clusters in the last build
+  uint getDroppedCount() const;
+
+protected:
+
+  static void binSlice(void *data, const uint slice);
+
+  float fov;
+  int width, height;
+  float zNear, zFar;
+  float sliceScale;                         // Slices per unit of log depth
+
+  float tileMinX[CLUSTER_COUNT_Z][CLUSTER_COUNT_X]; // View space x bounds of the tiles in each slice
+  float tileMaxX[CLUSTER_COUNT_Z][CLUSTER_COUNT_X];
+  float tileMinY[CLUSTER_COUNT_Z][CLUSTER_COUNT_Y]; // View space y bounds of the tiles in each slice
+  float tileMaxY[CLUSTER_COUNT_Z][CLUSTER_COUNT_Y];
+  float sliceDepth[CLUSTER_COUNT_Z + 1];            // Depth of the slice boundaries
+
+  Array <ClusterLight> lights;
+
+  ushort clusterCounts[CLUSTER_COUNT];
+  ushort clusterLights[CLUSTER_COUNT][CLUSTER_MAX_LIGHTS];
+  uint droppedCounts[CLUSTER_COUNT_Z];
+};
+
+#endif // _LIGHTCLUSTERS_H_
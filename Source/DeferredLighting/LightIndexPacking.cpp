@@ -0,0 +1,234 @@
+/* ============================================================================
+  Light Indexed Deferred Rendering Demo
+  By Damian Trebilco
+ 
+  Origional base lighting demo by "Humus"  
+============================================================================ */
+
+/***********      .---.         .-"-.      *******************\
+* -------- *     /   ._.       /  ` \     * ---------------- *
+* Author's *     \_  (__\      \_v_/     * humus@rogers.com *
+*   note   *     //   \\       //   \\     * ICQ #47010716    *
+* -------- *    ((     ))     ((     ))    * ---------------- *
+*          ****--""---""-------""---""--****                  ********\
+* This file is a part of the work done by Humus. You are free to use  *
+* the code in any way you like, modified, unmodified or copy'n'pasted *
+* into your own work. However, I expect you to respect these points:  *
+*  @ If you use this file and its contents unmodified, or use a major *
+*    part of this file, please credit the author and leave this note. *
+*  @ For use in anything commercial, please request my approval.      *
+*  @ Share your work and ideas too as much as you can.                *
+\*********************************************************************/
+
+#include "LightIndexPacking.h"
+#include <stdlib.h>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+vec4 packLightIndex(const uint lightIndex, const bool use16Bit, const bool bitShiftPacking){
+
+  float maxValue = use16Bit ? (float)MAX_LIGHT_INDEX_16BIT : (float)MAX_LIGHT_INDEX_8BIT;
+
+  // Setup lightIndex, 1-lightIndex when not using bit packing
+  if(!bitShiftPacking){
+    return vec4((float)lightIndex, maxValue - (float)lightIndex, (float)lightIndex, (float)lightIndex) / maxValue;
+  }
+
+  // Convert the light index into 4 2bit values (4 4bit values for 16 bit), 
+  // each in the top bits of a channel with the lowest bits in red
+  uint fieldBits = use16Bit ? 4 : 2;
+  uint fieldMask = (1 << fieldBits) - 1;
+  uint topShift  = (use16Bit ? 16 : 8) - fieldBits;
+
+  vec4 outColor;
+  for(uint i=0; i<4; i++){
+    outColor[i] = (float)(((lightIndex >> (i * fieldBits)) & fieldMask) << topShift);
+  }
+
+  return outColor / maxValue;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void unpackLightIndices(const vec4 &texel, const bool use16Bit, const uint overlapLights, uint *lightIndices){
+
+  vec4 packedLight = texel;
+
+  if(use16Bit){
+
+    // Expand out to the 0..65535 range
+    vec4 indexValues;
+    for(uint c=0; c<4; c++){
+      indexValues[c] = floorf(packedLight[c] * 65535.0f + 0.5f);
+    }
+
+    if(overlapLights >= 3){
+
+      // Ignore the first value when using 3 lights
+      if(overlapLights == 3){
+        for(uint c=0; c<4; c++){
+          indexValues[c] = floorf(indexValues[c] * (1.0f / 16.0f));
+        }
+      }
+
+      for(uint i=0; i<overlapLights; i++){
+        vec4 packedNibbles = indexValues * (1.0f / 16.0f);
+        for(uint c=0; c<4; c++){
+          indexValues[c] = floorf(packedNibbles[c]);
+        }
+        lightIndices[i] = (uint)dot(packedNibbles - indexValues, vec4(16.0f, 256.0f, 4096.0f, 65536.0f));
+      }
+    }
+    else if(overlapLights == 2){
+
+      indexValues.y = 65535.0f - indexValues.y;
+      if(indexValues.y == indexValues.x){
+        indexValues.y = 0.0f;
+      }
+      lightIndices[0] = (uint)indexValues.x;
+      lightIndices[1] = (uint)indexValues.y;
+    }
+    else{
+      lightIndices[0] = (uint)indexValues.x;
+    }
+    return;
+  }
+
+  // The 8 bit shaders produce a 0..1 texture coordinate (index / 256), this returns it scaled back up
+  if(overlapLights >= 3){
+
+    // Expand out to the 0..255 range (ceil to avoid precision errors)
+    vec4 floorValues;
+    for(uint c=0; c<4; c++){
+      floorValues[c] = ceilf(packedLight[c] * 254.5f);
+    }
+
+    // Ignore the first value when using 3 lights
+    if(overlapLights == 3){
+      for(uint c=0; c<4; c++){
+        floorValues[c] = floorf(floorValues[c] * 0.25f);
+      }
+    }
+
+    for(uint i=0; i<overlapLights; i++){
+      packedLight = floorValues * 0.25f;
+      for(uint c=0; c<4; c++){
+        floorValues[c] = floorf(packedLight[c]);
+      }
+      lightIndices[i] = (uint)dot(packedLight - floorValues, vec4(4.0f, 16.0f, 64.0f, 256.0f));
+    }
+  }
+  else if(overlapLights == 2){
+
+    packedLight.y = 1.0f - packedLight.y;
+    if(fabsf(packedLight.y - packedLight.x) < 0.001f){
+      packedLight.y = 0.0f;
+    }
+    lightIndices[0] = (uint)ceilf(packedLight.x * 254.5f);
+    lightIndices[1] = (uint)ceilf(packedLight.y * 254.5f);
+  }
+  else{
+    lightIndices[0] = (uint)ceilf(packedLight.x * 254.5f);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static vec4 quantizeColor(const vec4 &color, const float maxValue){
+
+  // The render target stores each channel as a clamped normalized integer
+  vec4 result;
+  for(uint c=0; c<4; c++){
+    result[c] = floorf(clamp(color[c], 0.0f, 1.0f) * maxValue + 0.5f) / maxValue;
+  }
+  return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static void sortIndices(uint *indices, const uint count){
+
+  for(uint i=1; i<count; i++){
+    for(uint j=i; j>0 && indices[j - 1] > indices[j]; j--){
+      uint tmp = indices[j];
+      indices[j] = indices[j - 1];
+      indices[j - 1] = tmp;
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+uint checkLightIndexPacking(const bool use16Bit, const uint overlapLights, const uint nTests){
+
+  uint maxIndex = use16Bit ? MAX_LIGHT_INDEX_16BIT : MAX_LIGHT_INDEX_8BIT;
+  float maxValue = (float)maxIndex;
+
+  // The blend constant is also stored at the target precision
+  float bitShift = floorf((use16Bit ? BIT_SHIFT_CONSTANT_16BIT : BIT_SHIFT_CONSTANT_8BIT) * maxValue + 0.5f) / maxValue;
+
+  uint failures = 0;
+  for(uint t=0; t<nTests; t++){
+
+    // The bit shift packing holds 4 lights, any more get shifted out with rounding errors that can carry into the
+    // kept lights. The copy and max blends take any number of lights. Every third set starts with the largest index.
+    uint drawIndices[6];
+    uint nDraws = 1 + t % ((overlapLights >= 3) ? 4 : 6);
+    for(uint i=0; i<nDraws; i++){
+      uint r = (uint(rand()) << 15) ^ uint(rand());
+      drawIndices[i] = (t % 3 == 0 && i == 0) ? maxIndex : 1 + r % maxIndex;
+    }
+
+    vec4 texel(0.0f, 0.0f, 0.0f, 0.0f);
+    for(uint i=0; i<nDraws; i++){
+      vec4 color = quantizeColor(packLightIndex(drawIndices[i], use16Bit, overlapLights >= 3), maxValue);
+      if(overlapLights == 1){
+        texel = color;
+      }
+      else if(overlapLights == 2){
+        for(uint c=0; c<4; c++){
+          texel[c] = max(texel[c], color[c]);
+        }
+      }
+      else{
+        texel = quantizeColor(color + texel * bitShift, maxValue);
+      }
+    }
+
+    // The copy keeps the last light, the max blend the highest and lowest and the bit shift the last ones drawn
+    uint expected[4] = { 0, 0, 0, 0 };
+    if(overlapLights == 1){
+      expected[0] = drawIndices[nDraws - 1];
+    }
+    else if(overlapLights == 2){
+      uint lowest = drawIndices[0];
+      uint highest = drawIndices[0];
+      for(uint i=1; i<nDraws; i++){
+        lowest = min(lowest, drawIndices[i]);
+        highest = max(highest, drawIndices[i]);
+      }
+      expected[0] = highest;
+      expected[1] = (lowest != highest) ? lowest : 0;
+    }
+    else{
+      uint nKept = min(nDraws, overlapLights);
+      for(uint i=0; i<nKept; i++){
+        expected[i] = drawIndices[nDraws - nKept + i];
+      }
+    }
+
+    uint unpacked[4] = { 0, 0, 0, 0 };
+    unpackLightIndices(texel, use16Bit, overlapLights, unpacked);
+
+    sortIndices(expected, overlapLights);
+    sortIndices(unpacked, overlapLights);
+    for(uint i=0; i<overlapLights; i++){
+      if(unpacked[i] != expected[i]){
+        failures++;
+        break;
+      }
+    }
+  }
+
+  return failures;
+}
@@ -0,0 +1,53 @@
+/* ============================================================================
+  Light Indexed Deferred Rendering Demo
+  By Damian Trebilco
+ 
+  Origional base lighting demo by "Humus"  
+============================================================================ */
+
+/***********      .---.         .-"-.      *******************\
+* -------- *     /   ._.       /  ` \     * ---------------- *
+* Author's *     \_  (__\      \_v_/     * humus@rogers.com *
+*   note   *     //   \\       //   \\     * ICQ #47010716    *
+* -------- *    ((     ))     ((     ))    * ---------------- *
+*          ****--""---""-------""---""--****                  ********\
+* This file is a part of the work done by Humus. You are free to use  *
+* the code in any way you like, modified, unmodified or copy'n'pasted *
+* into your own work. However, I expect you to respect these points:  *
+*  @ If you use this file and its contents unmodified, or use a major *
+*    part of this file, please credit the author and leave this note. *
+*  @ For use in anything commercial, please request my approval.      *
+*  @ Share your work and ideas too as much as you can.                *
+\*********************************************************************/
+
+#ifndef _LIGHTINDEXPACKING_H_
+#define _LIGHTINDEXPACKING_H_
+
+#include "../Framework3/Math/Vector.h"
+
+// Largest light index each light index buffer format can hold (index 0 is no light)
+#define MAX_LIGHT_INDEX_8BIT   255
+#define MAX_LIGHT_INDEX_16BIT  65535
+
+// Blend constants that shift the bit-packed fields down by one light on each draw.
+// The constant gets stored at the precision of the target, so it is set to 64/255 and 4096/65535.
+#define BIT_SHIFT_CONSTANT_8BIT   0.251f
+#define BIT_SHIFT_CONSTANT_16BIT  (4096.0f / 65535.0f)
+
+// Get the color a light volume outputs to the light index buffer.
+//  use16Bit        - The light index buffer is RGBA16 instead of RGBA8
+//  bitShiftPacking - Split the index over the channels for the bit shift blend (3-4 lights),
+//                    otherwise output (index, max - index) for the copy and max blends (1-2 lights)
+vec4 packLightIndex(const uint lightIndex, const bool use16Bit, const bool bitShiftPacking);
+
+// CPU reference of the unpacking in lightingLIDefer.shd. It follows the shader math
+// step by step, so it can be used to check what the GPU reads back from a light index buffer.
+// Writes overlapLights indices, where 0 is no light.
+void unpackLightIndices(const vec4 &texel, const bool use16Bit, const uint overlapLights, uint *lightIndices);
+
+// Draws nTests random sets of light indices into a simulated light index buffer, with the blend and
+// the precision of the real one, and checks that unpackLightIndices() gets back the lights that should win.
+// Returns the number of sets that did not unpack correctly.
+uint checkLightIndexPacking(const bool use16Bit, const uint overlapLights, const uint nTests);
+
+#endif // _LIGHTINDEXPACKING_H_
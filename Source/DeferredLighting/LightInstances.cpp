@@ -0,0 +1,42 @@
+/* ============================================================================
+  Light Indexed Deferred Rendering Demo
+  By Damian Trebilco
+ 
+  Origional base lighting demo by "Humus"  
+============================================================================ */
+
+/***********      .---.         .-"-.      *******************\
+* -------- *     /   ._.       /  ` \     * ---------------- *
+* Author's *     \_  (__\      \_v_/     * humus@rogers.com *
+*   note   *     //   \\       //   \\     * ICQ #47010716    *
+* -------- *    ((     ))     ((     ))    * ---------------- *
+*          ****--""---""-------""---""--****                  ********\
+* This file is a part of the work done by Humus. You are free to use  *
+* the code in any way you like, modified, unmodified or copy'n'pasted *
+* into your own work. However, I expect you to respect these points:  *
+*  @ If you use this file and its contents unmodified, or use a major *
+*    part of this file, please credit the author and leave this note. *
+*  @ For use in anything commercial, please request my approval.      *
+*  @ Share your work and ideas too as much as you can.                *
+\*********************************************************************/
+
+#include "LightInstances.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+uint buildLightInstances(LightInstance *dest, const vec3 *positions, const float *radii, const uint *lightIndices, const uint count,
+                         const bool use16Bit, const bool bitShiftPacking){
+
+  uint nInstances = 0;
+  for(uint i=0; i<count; i++){
+    if(radii[i] <= 0.0f){
+      continue;
+    }
+
+    LightInstance &instance = dest[nInstances++];
+    instance.posRadius = vec4(positions[i], radii[i]);
+    instance.indexColor = packLightIndex(lightIndices[i], use16Bit, bitShiftPacking);
+  }
+
+  return nInstances;
+}
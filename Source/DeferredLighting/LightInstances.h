@@ -0,0 +1,45 @@
+/* ============================================================================
+  Light Indexed Deferred Rendering Demo
+  By Damian Trebilco
+ 
+  Origional base lighting demo by "Humus"  
+============================================================================ */
+
+/***********      .---.         .-"-.      *******************\
+* -------- *     /   ._.       /  ` \     * ---------------- *
+* Author's *     \_  (__\      \_v_/     * humus@rogers.com *
+*   note   *     //   \\       //   \\     * ICQ #47010716    *
+* -------- *    ((     ))     ((     ))    * ---------------- *
+*          ****--""---""-------""---""--****                  ********\
+* This file is a part of the work done by Humus. You are free to use  *
+* the code in any way you like, modified, unmodified or copy'n'pasted *
+* into your own work. However, I expect you to respect these points:  *
+*  @ If you use this file and its contents unmodified, or use a major *
+*    part of this file, please credit the author and leave this note. *
+*  @ For use in anything commercial, please request my approval.      *
+*  @ Share your work and ideas too as much as you can.                *
+\*********************************************************************/
+
+#ifndef _LIGHTINSTANCES_H_
+#define _LIGHTINSTANCES_H_
+
+#include "LightIndexPacking.h"
+
+// The instance texture is RGBA32F, with each instance taking two texels
+#define LIGHT_INSTANCE_WIDTH  256
+#define LIGHT_INSTANCE_TEXELS 2
+
+// Helper structure laid out as the instance texture data
+struct LightInstance
+{
+  vec4 posRadius;   // The light position with the radius in w
+  vec4 indexColor;  // The packed light index color to output
+};
+
+// Writes the instance data of the lights to draw, in the order they are to be drawn.
+//  use16Bit, bitShiftPacking - The light index packing, as for packLightIndex
+// Lights with no radius are skipped. Returns the number of instances written.
+uint buildLightInstances(LightInstance *dest, const vec3 *positions, const float *radii, const uint *lightIndices, const uint count,
+                         const bool use16Bit, const bool bitShiftPacking);
+
+#endif // _LIGHTINSTANCES_H_
@@ -0,0 +1,168 @@
+/* ============================================================================
+  Light Indexed Deferred Rendering Demo
+  By Damian Trebilco
+ 
+  Origional base lighting demo by "Humus"  
+============================================================================ */
+
+/***********      .---.         .-"-.      *******************\
+* -------- *     /   ._.       /  ` \     * ---------------- *
+* Author's *     \_  (__\      \_v_/     * humus@rogers.com *
+*   note   *     //   \\       //   \\     * ICQ #47010716    *
+* -------- *    ((     ))     ((     ))    * ---------------- *
+*          ****--""---""-------""---""--****                  ********\
+* This file is a part of the work done by Humus. You are free to use  *
+* the code in any way you like, modified, unmodified or copy'n'pasted *
+* into your own work. However, I expect you to respect these points:  *
+*  @ If you use this file and its contents unmodified, or use a major *
+*    part of this file, please credit the author and leave this note. *
+*  @ For use in anything commercial, please request my approval.      *
+*  @ Share your work and ideas too as much as you can.                *
+\*********************************************************************/
+
+#include "LightParticles.h"
+
+#define PFX_UPDATE_CHUNK            64     // Particles per worker pool item
+
+// Data for updating a set of particles on the worker pool
+struct PFXUpdateJob
+{
+  PPFXLightData *particles;
+  vec3 *positions;
+  uint count;
+
+  float updateTime;
+  const BSP *collideBSP;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+PPFXLightData::PPFXLightData():
+  lifeTime(0.0f),
+  dirLifeTime(0.0f),
+  randomState(1)
+{
+  spawnPosition = vec3(0.0f);
+  direction = vec3(0.0f);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void PPFXLightData::Seed(uint seed){
+
+  // Scramble the seed so neighbouring particles do not get correlated sequences
+  randomState = (seed * 2654435761U) ^ 0x9E3779B9;
+  if(randomState == 0){
+    randomState = 1;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+float PPFXLightData::Random(){
+
+  // Xorshift generator
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+
+  return 2.0f * float(randomState >> 8) / float(0xFFFFFF) - 1.0f;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+vec3 PPFXLightData::Spawn(const vec3 &spawnPos, float intialAge){
+
+  spawnPosition = spawnPos;
+
+  // Spawn in a random directoin
+  direction = vec3(Random(), Random(), Random());
+ 
+  direction = normalize(direction) *  500.0f;
+  
+  lifeTime    = intialAge;
+  dirLifeTime = intialAge;
+
+  return spawnPosition;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+vec3 PPFXLightData::Update(float updateTime){
+
+  // Update particle lifetimes
+  lifeTime    += updateTime;
+  dirLifeTime += updateTime;
+
+/*
+  // Attenuate size over time
+  if(lifeTime > (SECONDARY_LIGHT_LIFETIME*0.75f)){
+    size = 75.0f * (1.0f - (lifeTime - (SECONDARY_LIGHT_LIFETIME*0.75f)) / (SECONDARY_LIGHT_LIFETIME*0.25f));
+  }
+  else{
+    size = 75.0f; 
+  }
+*/
+
+  // Calculate the new position using s = ut + 0.5at^2
+  return spawnPosition + (direction * dirLifeTime) + (vec3(0.0f, -100.0f, 0.0f) * dirLifeTime * dirLifeTime * 0.5f);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+vec3 PPFXLightData::Bounce(const vec3 &colPoint, const BTri *colTriangle){
+
+  // Don't land exactly on the plane, 
+  spawnPosition = colPoint + 10.0f * colTriangle->plane.xyz();
+
+  // Calculate the new direction, with 95% of the origional velocity
+  direction = reflect(direction, colTriangle->plane.xyz()); 
+  direction *= 0.95f;
+  dirLifeTime = 0.0f;
+
+  // Don't worry about calculating the directional 
+  return spawnPosition;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static void updatePFXChunk(void *data, const uint chunk){
+
+  PFXUpdateJob *job = (PFXUpdateJob *) data;
+
+  // Each particle only touches its own data, so chunks can run in any order
+  uint start = chunk * PFX_UPDATE_CHUNK;
+  uint count = min(job->count - start, PFX_UPDATE_CHUNK);
+
+  vec3 newPositions[PFX_UPDATE_CHUNK];
+  for(uint i=0; i<count; i++){
+    newPositions[i] = job->particles[start + i].Update(job->updateTime);
+  }
+
+  // Check for collisions between the last and new positions for the whole chunk at once
+  bool hits[PFX_UPDATE_CHUNK];
+  vec3 colPoints[PFX_UPDATE_CHUNK];
+  const BTri *colTriangles[PFX_UPDATE_CHUNK];
+  job->collideBSP->intersectsBatch(job->positions + start, newPositions, count, hits, colPoints, colTriangles);
+
+  for(uint i=0; i<count; i++){
+    if(hits[i]){
+      newPositions[i] = job->particles[start + i].Bounce(colPoints[i], colTriangles[i]);
+    }
+    job->positions[start + i] = newPositions[i];
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void updatePFX(WorkerPool &pool, PPFXLightData *particles, vec3 *positions, const uint count, float updateTime, const BSP &collideBSP){
+
+  PFXUpdateJob job;
+  job.particles = particles;
+  job.positions = positions;
+  job.count = count;
+  job.updateTime = updateTime;
+  job.collideBSP = &collideBSP;
+
+  pool.run(updatePFXChunk, &job, (count + PFX_UPDATE_CHUNK - 1) / PFX_UPDATE_CHUNK);
+}
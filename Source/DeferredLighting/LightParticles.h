@@ -0,0 +1,57 @@
+/* ============================================================================
+  Light Indexed Deferred Rendering Demo
+  By Damian Trebilco
+ 
+  Origional base lighting demo by "Humus"  
+============================================================================ */
+
+/***********      .---.         .-"-.      *******************\
+* -------- *     /   ._.       /  ` \     * ---------------- *
+* Author's *     \_  (__\      \_v_/     * humus@rogers.com *
+*   note   *     //   \\       //   \\     * ICQ #47010716    *
+* -------- *    ((     ))     ((     ))    * ---------------- *
+*          ****--""---""-------""---""--****                  ********\
+* This file is a part of the work done by Humus. You are free to use  *
+* the code in any way you like, modified, unmodified or copy'n'pasted *
+* into your own work. However, I expect you to respect these points:  *
+*  @ If you use this file and its contents unmodified, or use a major *
+*    part of this file, please credit the author and leave this note. *
+*  @ For use in anything commercial, please request my approval.      *
+*  @ Share your work and ideas too as much as you can.                *
+\*********************************************************************/
+
+#ifndef _LIGHTPARTICLES_H_
+#define _LIGHTPARTICLES_H_
+
+#include "../Framework3/Math/Vector.h"
+#include "../Framework3/Util/BSP.h"
+#include "../Framework3/Util/WorkerPool.h"
+
+#define SECONDARY_LIGHT_LIFETIME    8.0f
+
+// Structure to hold PFX light data
+struct PPFXLightData
+{
+  PPFXLightData();
+  void Seed(uint seed);
+  vec3 Spawn(const vec3 &spawnPos, float intialAge);
+  vec3 Update(float updateTime);
+  vec3 Bounce(const vec3 &colPoint, const BTri *colTriangle);
+
+  // Get a random value in the -1..1 range from the particle's own generator
+  float Random();
+
+  vec3 spawnPosition; // The spawn/intersection position
+  vec3 direction;     // The current direction
+
+  float lifeTime;     // The lifetime of the particle
+  float dirLifeTime;  // The life of the particle in the current direction
+
+  uint randomState;   // The random generator state, so results do not depend on update order
+};
+
+// Move the particles on by updateTime, bouncing them off the BSP. The positions are the
+// particles' current ones and get updated in place. The results don't depend on the thread count.
+void updatePFX(WorkerPool &pool, PPFXLightData *particles, vec3 *positions, const uint count, float updateTime, const BSP &collideBSP);
+
+#endif // _LIGHTPARTICLES_H_
@@ -0,0 +1,74 @@
+/* ============================================================================
+  Light Indexed Deferred Rendering Demo
+  By Damian Trebilco
+ 
+  Origional base lighting demo by "Humus"  
+============================================================================ */
+
+/***********      .---.         .-"-.      *******************\
+* -------- *     /   ._.       /  ` \     * ---------------- *
+* Author's *     \_  (__\      \_v_/     * humus@rogers.com *
+*   note   *     //   \\       //   \\     * ICQ #47010716    *
+* -------- *    ((     ))     ((     ))    * ---------------- *
+*          ****--""---""-------""---""--****                  ********\
+* This file is a part of the work done by Humus. You are free to use  *
+* the code in any way you like, modified, unmodified or copy'n'pasted *
+* into your own work. However, I expect you to respect these points:  *
+*  @ If you use this file and its contents unmodified, or use a major *
+*    part of this file, please credit the author and leave this note. *
+*  @ For use in anything commercial, please request my approval.      *
+*  @ Share your work and ideas too as much as you can.                *
+\*********************************************************************/
+
+#include "LightStore.h"
+#include "../Framework3/Math/Scissor.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+LightData::LightData(const vec3& setColor, const vec3& setPosition, float setSize):
+  color(setColor),
+  position(setPosition),
+  size(setSize)
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+LightStore::LightStore():
+  visibleCount(0)
+{
+  for(uint i=0; i<MAX_LIGHT_TOTAL; i++){
+    setLight(i, LightData(vec3(0.0f), vec3(0.0f), 0.0f));
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void LightStore::setLight(const uint index, const LightData &light){
+  setPosition(index, light.position);
+  colors[index] = light.color;
+  sizes[index] = light.size;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+LightData LightStore::getLight(const uint index) const{
+  return LightData(colors[index], getPosition(index), sizes[index]);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void LightStore::setPosition(const uint index, const vec3 &position){
+  posX[index] = position.x;
+  posY[index] = position.y;
+  posZ[index] = position.z;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+void LightStore::cull(const mat4 &modelview, const float fov, const int width, const int height){
+
+  // Get which lights are visible on screen
+  visibleCount = getScissorRectangles(modelview, posX, posY, posZ, sizes, MAX_LIGHT_TOTAL,
+                                      fov, width, height, screenX, screenY, screenWidth, screenHeight, visible);
+}
@@ -0,0 +1,93 @@
+/* ============================================================================
+  Light Indexed Deferred Rendering Demo
+  By Damian Trebilco
+ 
+  Origional base lighting demo by "Humus"  
+============================================================================ */
+
+/***********      .---.         .-"-.      *******************\
+* -------- *     /   ._.       /  ` \     * ---------------- *
+* Author's *     \_  (__\      \_v_/     * humus@rogers.com *
+*   note   *     //   \\       //   \\     * ICQ #47010716    *
+* -------- *    ((     ))     ((     ))    * ---------------- *
+*          ****--""---""-------""---""--****                  ********\
+* This file is a part of the work done by Humus. You are free to use  *
+* the code in any way you like, modified, unmodified or copy'n'pasted *
+* into your own work. However, I expect you to respect these points:  *
+*  @ If you use this file and its contents unmodified, or use a major *
+*    part of this file, please credit the author and leave this note. *
+*  @ For use in anything commercial, please request my approval.      *
+*  @ Share your work and ideas too as much as you can.                *
+\*********************************************************************/
+
+#ifndef _LIGHTSTORE_H_
+#define _LIGHTSTORE_H_
+
+#include "../Framework3/Math/Vector.h"
+
+// More than 255 lights needs the 16-bit light index buffer, build with MAX_LIGHT_TOTAL defined (make LIGHTS=4096) to run with more
+#ifndef MAX_LIGHT_TOTAL
+#define MAX_LIGHT_TOTAL             255
+#endif
+
+// Helper structure to describe a light
+struct LightData
+{
+  LightData(const vec3& setColor, const vec3& setPosition, float setSize);
+
+  vec3 color;         // The light color
+  vec3 position;      // The light position
+  float size;         // The light size
+};
+
+/*
+  Holds all the lights in structure-of-arrays form. Culling writes the screen
+  rectangles and a compact list of the visible light indices, so the render
+  passes only need to walk that list.
+*/
+class LightStore {
+public:
+  LightStore();
+
+  void setLight(const uint index, const LightData &light);
+  LightData getLight(const uint index) const;
+
+  vec3 getPosition(const uint index) const { return vec3(posX[index], posY[index], posZ[index]); }
+  void setPosition(const uint index, const vec3 &position);
+
+  const vec3 &getColor(const uint index) const { return colors[index]; }
+  void setColor(const uint index, const vec3 &color){ colors[index] = color; }
+
+  float getSize(const uint index) const { return sizes[index]; }
+  void setSize(const uint index, const float size){ sizes[index] = size; }
+
+  // Rebuild the visible list and screen rectangles for the view
+  void cull(const mat4 &modelview, const float fov, const int width, const int height);
+
+  // The visible light indices, in ascending order
+  uint getVisibleCount() const { return visibleCount; }
+  uint getVisible(const uint i) const { return visible[i]; }
+
+  // Screen rectangle of a visible light
+  int getScreenX(const uint index) const { return screenX[index]; }
+  int getScreenY(const uint index) const { return screenY[index]; }
+  int getScreenWidth(const uint index) const { return screenWidth[index]; }
+  int getScreenHeight(const uint index) const { return screenHeight[index]; }
+
+protected:
+  float posX[MAX_LIGHT_TOTAL];   // The light positions
+  float posY[MAX_LIGHT_TOTAL];
+  float posZ[MAX_LIGHT_TOTAL];
+  float sizes[MAX_LIGHT_TOTAL];  // The light sizes
+  vec3 colors[MAX_LIGHT_TOTAL];  // The light colors
+
+  int screenX[MAX_LIGHT_TOTAL];  // The screen rectangle of each light, only valid when visible
+  int screenY[MAX_LIGHT_TOTAL];
+  int screenWidth[MAX_LIGHT_TOTAL];
+  int screenHeight[MAX_LIGHT_TOTAL];
+
+  uint visible[MAX_LIGHT_TOTAL];
+  uint visibleCount;
+};
+
+#endif // _LIGHTSTORE_H_
@@ -221,39 +221,27 @@ Direct3DRenderer::~Direct3DRenderer(){
 
 	// Delete shaders
 	for (uint i = 0; i < shaders.getCount(); i++){
-		if (shaders[i].vertexShader) shaders[i].vertexShader->Release();
-		if (shaders[i].pixelShader) shaders[i].pixelShader->Release();
-		if (shaders[i].vsConstants) shaders[i].vsConstants->Release();
-		if (shaders[i].psConstants) shaders[i].psConstants->Release();
-
-		for (uint j = 0; j < shaders[i].nSamplers; j++){
-			delete shaders[i].samplers[j].name;
-		}
-		for (uint j = 0; j < shaders[i].nConstants; j++){
-			delete shaders[i].constants[j].name;
-		}
-		delete shaders[i].samplers;
-		delete shaders[i].constants;
+		if (shaders.isUsed(i)) removeShader(shaders.getHandle(i));
 	}
 
     // Delete vertex formats
 	for (uint i = 0; i < vertexFormats.getCount(); i++){
-		if (vertexFormats[i].vertexDecl) vertexFormats[i].vertexDecl->Release();
+		if (vertexFormats.isUsed(i)) removeVertexFormat(vertexFormats.getHandle(i));
 	}
 
     // Delete vertex buffers
 	for (uint i = 0; i < vertexBuffers.getCount(); i++){
-		if (vertexBuffers[i].vertexBuffer) vertexBuffers[i].vertexBuffer->Release();
+		if (vertexBuffers.isUsed(i)) removeVertexBuffer(vertexBuffers.getHandle(i));
 	}
 
 	// Delete index buffers
 	for (uint i = 0; i < indexBuffers.getCount(); i++){
-		if (indexBuffers[i].indexBuffer) indexBuffers[i].indexBuffer->Release();
+		if (indexBuffers.isUsed(i)) removeIndexBuffer(indexBuffers.getHandle(i));
 	}
 
 	// Delete textures
 	for (uint i = 0; i < textures.getCount(); i++){
-		removeTexture(i);
+		if (textures.isUsed(i)) removeTexture(textures.getHandle(i));
 	}
 }
 
@@ -370,12 +358,15 @@ bool createRenderTarget(LPDIRECT3DDEVICE9 dev, Texture &tex){
 
 bool Direct3DRenderer::resetDevice(D3DPRESENT_PARAMETERS &d3dpp){
 	for (uint i = 0; i < textures.getCount(); i++){
-		if (textures[i].surfaces){
-			int n = (textures[i].flags & CUBEMAP)? 6 : 1;
+		if (!textures.isUsed(i)) continue;
+
+		Texture &tex = textures.getSlot(i);
+		if (tex.surfaces){
+			int n = (tex.flags & CUBEMAP)? 6 : 1;
 
-			if (textures[i].texture) textures[i].texture->Release();
+			if (tex.texture) tex.texture->Release();
 			for (int k = 0; k < n; k++){
-				textures[i].surfaces[k]->Release();
+				tex.surfaces[k]->Release();
 			}
 		}
 	}
@@ -393,8 +384,8 @@ bool Direct3DRenderer::resetDevice(D3DPRESENT_PARAMETERS &d3dpp){
 	setD3Ddefaults();
 
 	for (uint i = 0; i < textures.getCount(); i++){
-		if (textures[i].surfaces){
-			createRenderTarget(dev, textures[i]);
+		if (textures.isUsed(i) && textures.getSlot(i).surfaces){
+			createRenderTarget(dev, textures.getSlot(i));
 		}
 	}
 
@@ -425,6 +416,10 @@ TextureID Direct3DRenderer::addTexture(Image &img, const SamplerStateID samplerS
 	tex.mipMapped = (img.getMipMapCount() > 1);
 
 	FORMAT format = img.getFormat();
+	tex.format = format;
+	tex.flags  = flags;
+	tex.width  = img.getWidth();
+	tex.height = img.getHeight();
 	if (img.isCube()){
 		if (dev->CreateCubeTexture(img.getWidth(), img.getMipMapCount(), 0, formats[format], D3DPOOL_MANAGED, (LPDIRECT3DCUBETEXTURE9 *) &tex.texture, NULL) != D3D_OK){
 			ErrorMsg("Couldn't create cubemap");
@@ -546,7 +541,55 @@ bool Direct3DRenderer::resizeRenderTarget(const TextureID renderTarget, const in
 	return createRenderTarget(dev, textures[renderTarget]);
 }
 
+bool Direct3DRenderer::updateTexture(const TextureID texture, const int x, const int y, const int width, const int height, const void *pixels){
+	Texture &tex = textures[texture];
+	// RGB8 textures are stored expanded to RGBA8, so they can't be updated directly
+	if (tex.texture == NULL || tex.texture->GetType() != D3DRTYPE_TEXTURE || isCompressedFormat(tex.format) || tex.format == FORMAT_RGB8) return false;
+	ASSERT(x >= 0 && y >= 0 && x + width <= tex.width && y + height <= tex.height);
+
+	LPDIRECT3DTEXTURE9 d3dTex = (LPDIRECT3DTEXTURE9) tex.texture;
+
+	RECT rect = { x, y, x + width, y + height };
+	D3DLOCKED_RECT lockedRect;
+	if (d3dTex->LockRect(0, &lockedRect, &rect, 0) != D3D_OK) return false;
+
+	int bpp = getBytesPerPixel(tex.format);
+	const ubyte *src = (const ubyte *) pixels;
+	ubyte *dest = (ubyte *) lockedRect.pBits;
+	for (int j = 0; j < height; j++){
+		if (tex.format == FORMAT_RGBA8){
+			// Match the channel swap done in addTexture()
+			for (int i = 0; i < width; i++){
+				dest[4 * i    ] = src[4 * i + 2];
+				dest[4 * i + 1] = src[4 * i + 1];
+				dest[4 * i + 2] = src[4 * i    ];
+				dest[4 * i + 3] = src[4 * i + 3];
+			}
+		} else {
+			memcpy(dest, src, width * bpp);
+		}
+		src  += width * bpp;
+		dest += lockedRect.Pitch;
+	}
+
+	d3dTex->UnlockRect(0);
+
+	return true;
+}
+
 void Direct3DRenderer::removeTexture(const TextureID texture){
+	// Make sure nothing is left bound to it
+	for (uint i = 0; i < MAX_TEXTUREUNIT; i++){
+		if (currentTextures[i] == texture){
+			dev->SetTexture(i, NULL);
+			currentTextures[i] = TEXTURE_NONE;
+		}
+	}
+	for (uint i = 0; i < nMRTs; i++){
+		if (currentColorRT[i] == texture) changeToMainFramebuffer();
+	}
+	if (currentDepthRT == texture) changeToMainFramebuffer();
+
 	if (textures[texture].surfaces){
 		int n = (textures[texture].flags & CUBEMAP)? 6 : 1;
 		for (int k = 0; k < n; k++){
@@ -559,6 +602,7 @@ void Direct3DRenderer::removeTexture(const TextureID texture){
 		textures[texture].texture->Release();
 		textures[texture].texture = NULL;
 	}
+	textures.remove(texture);
 }
 
 ShaderID Direct3DRenderer::addShader(const char *vsText, const char *gsText, const char *fsText, const int vsLine, const int gsLine, const int fsLine,
@@ -738,6 +782,7 @@ VertexFormatID Direct3DRenderer::addVertexFormat(const FormatDesc *formatDesc, c
 		D3DDECLTYPE_FLOAT1, D3DDECLTYPE_FLOAT2,    D3DDECLTYPE_FLOAT3, D3DDECLTYPE_FLOAT4,
 		D3DDECLTYPE_UNUSED, D3DDECLTYPE_FLOAT16_2, D3DDECLTYPE_UNUSED, D3DDECLTYPE_FLOAT16_4,
 		D3DDECLTYPE_UNUSED, D3DDECLTYPE_UNUSED,    D3DDECLTYPE_UNUSED, D3DDECLTYPE_UBYTE4N,
+		D3DDECLTYPE_UNUSED, D3DDECLTYPE_SHORT2N,   D3DDECLTYPE_UNUSED, D3DDECLTYPE_SHORT4N,
 	};
 
 	static const D3DDECLUSAGE usages[] = {
@@ -891,6 +936,85 @@ RasterizerStateID Direct3DRenderer::addRasterizerState(const int cullMode, const
 	return rasterizerStates.add(rasterizerState);
 }
 
+void Direct3DRenderer::removeShader(const ShaderID shader){
+	if (currentShader == shader) changeShader(SHADER_NONE);
+
+	Shader &sh = shaders[shader];
+	if (sh.vertexShader) sh.vertexShader->Release();
+	if (sh.pixelShader) sh.pixelShader->Release();
+	if (sh.vsConstants) sh.vsConstants->Release();
+	if (sh.psConstants) sh.psConstants->Release();
+
+	for (uint j = 0; j < sh.nSamplers; j++){
+		delete sh.samplers[j].name;
+	}
+	for (uint j = 0; j < sh.nConstants; j++){
+		delete sh.constants[j].name;
+	}
+	delete sh.samplers;
+	delete sh.constants;
+
+	shaders.remove(shader);
+}
+
+void Direct3DRenderer::removeVertexFormat(const VertexFormatID vertexFormat){
+	if (currentVertexFormat == vertexFormat){
+		dev->SetVertexDeclaration(NULL);
+		currentVertexFormat = VF_NONE;
+	}
+
+	if (vertexFormats[vertexFormat].vertexDecl) vertexFormats[vertexFormat].vertexDecl->Release();
+	vertexFormats.remove(vertexFormat);
+}
+
+void Direct3DRenderer::removeVertexBuffer(const VertexBufferID vertexBuffer){
+	for (uint i = 0; i < MAX_VERTEXSTREAM; i++){
+		if (currentVertexBuffers[i] == vertexBuffer) changeVertexBuffer(i, VB_NONE, 0);
+	}
+
+	if (vertexBuffers[vertexBuffer].vertexBuffer) vertexBuffers[vertexBuffer].vertexBuffer->Release();
+	vertexBuffers.remove(vertexBuffer);
+}
+
+void Direct3DRenderer::removeIndexBuffer(const IndexBufferID indexBuffer){
+	if (currentIndexBuffer == indexBuffer) changeIndexBuffer(IB_NONE);
+
+	if (indexBuffers[indexBuffer].indexBuffer) indexBuffers[indexBuffer].indexBuffer->Release();
+	indexBuffers.remove(indexBuffer);
+}
+
+void Direct3DRenderer::removeSamplerState(const SamplerStateID samplerState){
+	// The next applySamplerStates() compares against the current state, so it must not point to a removed slot
+	for (uint i = 0; i < MAX_SAMPLERSTATE; i++){
+		if (currentSamplerStates[i] == samplerState){
+			dev->SetSamplerState(i, D3DSAMP_MINFILTER, D3DTEXF_POINT);
+			dev->SetSamplerState(i, D3DSAMP_MAGFILTER, D3DTEXF_POINT);
+			dev->SetSamplerState(i, D3DSAMP_MIPFILTER, D3DTEXF_NONE);
+			dev->SetSamplerState(i, D3DSAMP_ADDRESSU, D3DTADDRESS_WRAP);
+			dev->SetSamplerState(i, D3DSAMP_ADDRESSV, D3DTADDRESS_WRAP);
+			dev->SetSamplerState(i, D3DSAMP_ADDRESSW, D3DTADDRESS_WRAP);
+			currentSamplerStates[i] = SS_NONE;
+		}
+	}
+
+	samplerStates.remove(samplerState);
+}
+
+void Direct3DRenderer::removeBlendState(const BlendStateID blendState){
+	if (currentBlendState == blendState) changeBlendState(BS_NONE);
+	blendStates.remove(blendState);
+}
+
+void Direct3DRenderer::removeDepthState(const DepthStateID depthState){
+	if (currentDepthState == depthState) changeDepthState(DS_NONE);
+	depthStates.remove(depthState);
+}
+
+void Direct3DRenderer::removeRasterizerState(const RasterizerStateID rasterizerState){
+	if (currentRasterizerState == rasterizerState) changeRasterizerState(RS_NONE);
+	rasterizerStates.remove(rasterizerState);
+}
+
 int Direct3DRenderer::getSamplerUnit(const ShaderID shader, const char *samplerName) const {
 	Sampler *samplers = shaders[shader].samplers;
 	int minSampler = 0;
@@ -1453,6 +1577,16 @@ void Direct3DRenderer::drawElements(const Primitives primitives, const int first
 	dev->DrawIndexedPrimitive(d3dPrim[primitives], 0, firstVertex, nVertices, firstIndex, getPrimitiveCount(primitives, nIndices));
 }
 
+void Direct3DRenderer::drawElementsInstanced(const Primitives primitives, const int firstIndex, const int nIndices, const int firstVertex, const int nVertices, const int nInstances){
+	// Not supported, see supportsInstancing()
+	ASSERT(0);
+}
+
+bool Direct3DRenderer::supportsInstancing() const {
+	// D3D9 only instances through a per-instance vertex stream, there is no instance ID to fetch the instance data with
+	return false;
+}
+
 void Direct3DRenderer::setup2DMode(const float left, const float right, const float top, const float bottom){
 	scaleBias2D.x = 2.0f / (right - left);
 	scaleBias2D.y = 2.0f / (top - bottom);
@@ -25,6 +25,7 @@ struct Texture {
 	DXGI_FORMAT srvFormat;
 	DXGI_FORMAT rtvFormat;
 	DXGI_FORMAT dsvFormat;
+	FORMAT format;
 	int width, height;
 	uint flags;
 };
@@ -232,88 +233,47 @@ Direct3D10Renderer::~Direct3D10Renderer(){
 
 	// Delete shaders
 	for (uint i = 0; i < shaders.getCount(); i++){
-		if (shaders[i].vertexShader  ) shaders[i].vertexShader->Release();
-		if (shaders[i].geometryShader) shaders[i].geometryShader->Release();
-		if (shaders[i].pixelShader   ) shaders[i].pixelShader->Release();
-		if (shaders[i].inputSignature) shaders[i].inputSignature->Release();
-
-		for (uint k = 0; k < shaders[i].nVSCBuffers; k++){
-			shaders[i].vsConstants[k]->Release();
-			delete shaders[i].vsConstMem[k];
-		}
-		for (uint k = 0; k < shaders[i].nGSCBuffers; k++){
-			shaders[i].gsConstants[k]->Release();
-			delete shaders[i].gsConstMem[k];
-		}
-		for (uint k = 0; k < shaders[i].nPSCBuffers; k++){
-			shaders[i].psConstants[k]->Release();
-			delete shaders[i].psConstMem[k];
-		}
-		delete shaders[i].vsConstants;
-		delete shaders[i].gsConstants;
-		delete shaders[i].psConstants;
-		delete shaders[i].vsConstMem;
-		delete shaders[i].gsConstMem;
-		delete shaders[i].psConstMem;
-
-		for (uint k = 0; k < shaders[i].nConstants; k++){
-			delete shaders[i].constants[k].name;
-		}
-		delete shaders[i].constants;
-
-		for (uint k = 0; k < shaders[i].nTextures; k++){
-			delete shaders[i].textures[k].name;
-		}
-		delete shaders[i].textures;
-
-		for (uint k = 0; k < shaders[i].nSamplers; k++){
-			delete shaders[i].samplers[k].name;
-		}
-		delete shaders[i].samplers;
-
-		delete shaders[i].vsDirty;
-		delete shaders[i].gsDirty;
-		delete shaders[i].psDirty;
+		if (shaders.isUsed(i)) removeShader(shaders.getHandle(i));
 	}
 
     // Delete vertex formats
 	for (uint i = 0; i < vertexFormats.getCount(); i++){
-		if (vertexFormats[i].inputLayout) vertexFormats[i].inputLayout->Release();
+		if (vertexFormats.isUsed(i)) removeVertexFormat(vertexFormats.getHandle(i));
 	}
 
     // Delete vertex buffers
 	for (uint i = 0; i < vertexBuffers.getCount(); i++){
-		if (vertexBuffers[i].vertexBuffer) vertexBuffers[i].vertexBuffer->Release();
+		if (vertexBuffers.isUsed(i)) removeVertexBuffer(vertexBuffers.getHandle(i));
 	}
 
 	// Delete index buffers
 	for (uint i = 0; i < indexBuffers.getCount(); i++){
-		if (indexBuffers[i].indexBuffer) indexBuffers[i].indexBuffer->Release();
+		if (indexBuffers.isUsed(i)) removeIndexBuffer(indexBuffers.getHandle(i));
 	}
 
 	// Delete samplerstates
 	for (uint i = 0; i < samplerStates.getCount(); i++){
-		if (samplerStates[i].samplerState) samplerStates[i].samplerState->Release();
+		if (samplerStates.isUsed(i)) removeSamplerState(samplerStates.getHandle(i));
 	}
 
 	// Delete blendstates
 	for (uint i = 0; i < blendStates.getCount(); i++){
-		if (blendStates[i].blendState) blendStates[i].blendState->Release();
+		if (blendStates.isUsed(i)) removeBlendState(blendStates.getHandle(i));
 	}
 
 	// Delete depthstates
 	for (uint i = 0; i < depthStates.getCount(); i++){
-		if (depthStates[i].dsState) depthStates[i].dsState->Release();
+		if (depthStates.isUsed(i)) removeDepthState(depthStates.getHandle(i));
 	}
 
 	// Delete rasterizerstates
 	for (uint i = 0; i < rasterizerStates.getCount(); i++){
-		if (rasterizerStates[i].rsState) rasterizerStates[i].rsState->Release();
+		if (rasterizerStates.isUsed(i)) removeRasterizerState(rasterizerStates.getHandle(i));
 	}
 
 	// Delete textures
 	for (uint i = 0; i < textures.getCount(); i++){
-		removeTexture(i);
+		if (textures.isUsed(i)) removeTexture(textures.getHandle(i));
 	}
 
 //	if (rollingVB) rollingVB->Release();
@@ -491,6 +451,10 @@ TextureID Direct3D10Renderer::addTexture(Image &img, const SamplerStateID sample
 		}
 	}
 
+	tex.format = format;
+	tex.flags  = flags;
+	tex.width  = img.getWidth();
+	tex.height = img.getHeight();
 	tex.texFormat = formats[format];
 	if (flags & SRGB){
 		// Change to the matching sRGB format
@@ -508,7 +472,7 @@ TextureID Direct3D10Renderer::addTexture(Image &img, const SamplerStateID sample
 		desc.Width  = img.getWidth();
 		desc.Format = tex.texFormat;
 		desc.MipLevels = nMipMaps;
-		desc.Usage = D3D10_USAGE_IMMUTABLE;
+		desc.Usage = (flags & UPDATABLE)? D3D10_USAGE_DEFAULT : D3D10_USAGE_IMMUTABLE;
 		desc.BindFlags = D3D10_BIND_SHADER_RESOURCE;
 		desc.CPUAccessFlags = 0;
 		desc.ArraySize = 1;
@@ -523,7 +487,7 @@ TextureID Direct3D10Renderer::addTexture(Image &img, const SamplerStateID sample
 		desc.MipLevels = nMipMaps;
 		desc.SampleDesc.Count = 1;
 		desc.SampleDesc.Quality = 0;
-		desc.Usage = D3D10_USAGE_IMMUTABLE;
+		desc.Usage = (flags & UPDATABLE)? D3D10_USAGE_DEFAULT : D3D10_USAGE_IMMUTABLE;
 		desc.BindFlags = D3D10_BIND_SHADER_RESOURCE;
 		desc.CPUAccessFlags = 0;
 		if (img.isCube()){
@@ -707,11 +671,51 @@ bool Direct3D10Renderer::resizeRenderTarget(const TextureID renderTarget, const
 	return true;
 }
 
+bool Direct3D10Renderer::updateTexture(const TextureID texture, const int x, const int y, const int width, const int height, const void *pixels){
+	Texture &tex = textures[texture];
+	if (!(tex.flags & UPDATABLE) || isCompressedFormat(tex.format)) return false;
+	ASSERT(x >= 0 && y >= 0 && x + width <= tex.width && y + height <= tex.height);
+
+	D3D10_BOX box;
+	box.left   = x;
+	box.right  = x + width;
+	box.top    = y;
+	box.bottom = y + height;
+	box.front  = 0;
+	box.back   = 1;
+
+	device->UpdateSubresource(tex.texture, 0, &box, pixels, width * getBytesPerPixel(tex.format), 0);
+
+	return true;
+}
+
 void Direct3D10Renderer::removeTexture(const TextureID texture){
+	// Make sure nothing is left bound to it
+	ID3D10ShaderResourceView *null[] = { NULL };
+	for (uint i = 0; i < MAX_TEXTUREUNIT; i++){
+		if (currentTexturesVS[i] == texture){
+			device->VSSetShaderResources(i, 1, null);
+			currentTexturesVS[i] = TEXTURE_NONE;
+		}
+		if (currentTexturesGS[i] == texture){
+			device->GSSetShaderResources(i, 1, null);
+			currentTexturesGS[i] = TEXTURE_NONE;
+		}
+		if (currentTexturesPS[i] == texture){
+			device->PSSetShaderResources(i, 1, null);
+			currentTexturesPS[i] = TEXTURE_NONE;
+		}
+	}
+	for (uint i = 0; i < MAX_MRTS; i++){
+		if (currentColorRT[i] == texture) changeToMainFramebuffer();
+	}
+	if (currentDepthRT == texture) changeToMainFramebuffer();
+
 	SAFE_RELEASE(textures[texture].texture);
 	SAFE_RELEASE(textures[texture].srv);
 	SAFE_RELEASE(textures[texture].rtv);
 	SAFE_RELEASE(textures[texture].dsv);
+	textures.remove(texture);
 }
 
 ShaderID Direct3D10Renderer::addShader(const char *vsText, const char *gsText, const char *fsText, const int vsLine, const int gsLine, const int fsLine,
@@ -1118,6 +1122,7 @@ VertexFormatID Direct3D10Renderer::addVertexFormat(const FormatDesc *formatDesc,
 		DXGI_FORMAT_R32_FLOAT, DXGI_FORMAT_R32G32_FLOAT, DXGI_FORMAT_R32G32B32_FLOAT, DXGI_FORMAT_R32G32B32A32_FLOAT,
 		DXGI_FORMAT_R16_FLOAT, DXGI_FORMAT_R16G16_FLOAT, DXGI_FORMAT_UNKNOWN,         DXGI_FORMAT_R16G16B16A16_FLOAT,
 		DXGI_FORMAT_R8_UNORM,  DXGI_FORMAT_R8G8_UNORM,   DXGI_FORMAT_UNKNOWN,         DXGI_FORMAT_R8G8B8A8_UNORM,
+		DXGI_FORMAT_R16_SNORM, DXGI_FORMAT_R16G16_SNORM, DXGI_FORMAT_UNKNOWN,         DXGI_FORMAT_R16G16B16A16_SNORM,
 	};
 
 	static const char *semantics[] = {
@@ -1331,6 +1336,122 @@ RasterizerStateID Direct3D10Renderer::addRasterizerState(const int cullMode, con
 	return rasterizerStates.add(rasterizerState);
 }
 
+void Direct3D10Renderer::removeShader(const ShaderID shader){
+	if (currentShader == shader) changeShader(SHADER_NONE);
+
+	Shader &sh = shaders[shader];
+	if (sh.vertexShader  ) sh.vertexShader->Release();
+	if (sh.geometryShader) sh.geometryShader->Release();
+	if (sh.pixelShader   ) sh.pixelShader->Release();
+	if (sh.inputSignature) sh.inputSignature->Release();
+
+	for (uint k = 0; k < sh.nVSCBuffers; k++){
+		sh.vsConstants[k]->Release();
+		delete sh.vsConstMem[k];
+	}
+	for (uint k = 0; k < sh.nGSCBuffers; k++){
+		sh.gsConstants[k]->Release();
+		delete sh.gsConstMem[k];
+	}
+	for (uint k = 0; k < sh.nPSCBuffers; k++){
+		sh.psConstants[k]->Release();
+		delete sh.psConstMem[k];
+	}
+	delete sh.vsConstants;
+	delete sh.gsConstants;
+	delete sh.psConstants;
+	delete sh.vsConstMem;
+	delete sh.gsConstMem;
+	delete sh.psConstMem;
+
+	for (uint k = 0; k < sh.nConstants; k++){
+		delete sh.constants[k].name;
+	}
+	delete sh.constants;
+
+	for (uint k = 0; k < sh.nTextures; k++){
+		delete sh.textures[k].name;
+	}
+	delete sh.textures;
+
+	for (uint k = 0; k < sh.nSamplers; k++){
+		delete sh.samplers[k].name;
+	}
+	delete sh.samplers;
+
+	delete sh.vsDirty;
+	delete sh.gsDirty;
+	delete sh.psDirty;
+
+	shaders.remove(shader);
+}
+
+void Direct3D10Renderer::removeVertexFormat(const VertexFormatID vertexFormat){
+	if (currentVertexFormat == vertexFormat) changeVertexFormat(VF_NONE);
+
+	SAFE_RELEASE(vertexFormats[vertexFormat].inputLayout);
+	vertexFormats.remove(vertexFormat);
+}
+
+void Direct3D10Renderer::removeVertexBuffer(const VertexBufferID vertexBuffer){
+	for (uint i = 0; i < MAX_VERTEXSTREAM; i++){
+		if (currentVertexBuffers[i] == vertexBuffer) changeVertexBuffer(i, VB_NONE, 0);
+	}
+
+	SAFE_RELEASE(vertexBuffers[vertexBuffer].vertexBuffer);
+	vertexBuffers.remove(vertexBuffer);
+}
+
+void Direct3D10Renderer::removeIndexBuffer(const IndexBufferID indexBuffer){
+	if (currentIndexBuffer == indexBuffer) changeIndexBuffer(IB_NONE);
+
+	SAFE_RELEASE(indexBuffers[indexBuffer].indexBuffer);
+	indexBuffers.remove(indexBuffer);
+}
+
+void Direct3D10Renderer::removeSamplerState(const SamplerStateID samplerState){
+	ID3D10SamplerState *null[] = { NULL };
+	for (uint i = 0; i < MAX_SAMPLERSTATE; i++){
+		if (currentSamplerStatesVS[i] == samplerState){
+			device->VSSetSamplers(i, 1, null);
+			currentSamplerStatesVS[i] = SS_NONE;
+		}
+		if (currentSamplerStatesGS[i] == samplerState){
+			device->GSSetSamplers(i, 1, null);
+			currentSamplerStatesGS[i] = SS_NONE;
+		}
+		if (currentSamplerStatesPS[i] == samplerState){
+			device->PSSetSamplers(i, 1, null);
+			currentSamplerStatesPS[i] = SS_NONE;
+		}
+	}
+
+	SAFE_RELEASE(samplerStates[samplerState].samplerState);
+	samplerStates.remove(samplerState);
+}
+
+void Direct3D10Renderer::removeBlendState(const BlendStateID blendState){
+	if (currentBlendState == blendState) changeBlendState(BS_NONE);
+
+	SAFE_RELEASE(blendStates[blendState].blendState);
+	blendStates.remove(blendState);
+}
+
+void Direct3D10Renderer::removeDepthState(const DepthStateID depthState){
+	if (currentDepthState == depthState) changeDepthState(DS_NONE);
+
+	SAFE_RELEASE(depthStates[depthState].dsState);
+	depthStates.remove(depthState);
+}
+
+void Direct3D10Renderer::removeRasterizerState(const RasterizerStateID rasterizerState){
+	// Release first, RS_NONE falls back on the state in the first slot, which may be this one
+	SAFE_RELEASE(rasterizerStates[rasterizerState].rsState);
+	if (currentRasterizerState == rasterizerState) changeRasterizerState(RS_NONE);
+
+	rasterizerStates.remove(rasterizerState);
+}
+
 const Sampler *getSampler(const Sampler *samplers, const int count, const char *name){
 	int minSampler = 0;
 	int maxSampler = count - 1;
@@ -1382,7 +1503,7 @@ void Direct3D10Renderer::setTexture(const char *textureName, const TextureID tex
 	}
 }
 
-bool fillSRV(ID3D10ShaderResourceView **dest, int &min, int &max, const TextureID selectedTextures[], TextureID currentTextures[], const Texture *textures){
+bool fillSRV(ID3D10ShaderResourceView **dest, int &min, int &max, const TextureID selectedTextures[], TextureID currentTextures[], const HandlePool <Texture> &textures){
 	min = 0;
 	do {
 		if (selectedTextures[min] != currentTextures[min]){
@@ -1411,13 +1532,13 @@ void Direct3D10Renderer::applyTextures(){
 	ID3D10ShaderResourceView *srViews[MAX_TEXTUREUNIT];
 
 	int min, max;
-	if (fillSRV(srViews, min, max, selectedTexturesVS, currentTexturesVS, textures.getArray())){
+	if (fillSRV(srViews, min, max, selectedTexturesVS, currentTexturesVS, textures)){
 		device->VSSetShaderResources(min, max - min + 1, srViews);
 	}
-	if (fillSRV(srViews, min, max, selectedTexturesGS, currentTexturesGS, textures.getArray())){
+	if (fillSRV(srViews, min, max, selectedTexturesGS, currentTexturesGS, textures)){
 		device->GSSetShaderResources(min, max - min + 1, srViews);
 	}
-	if (fillSRV(srViews, min, max, selectedTexturesPS, currentTexturesPS, textures.getArray())){
+	if (fillSRV(srViews, min, max, selectedTexturesPS, currentTexturesPS, textures)){
 		device->PSSetShaderResources(min, max - min + 1, srViews);
 	}
 }
@@ -1433,7 +1554,7 @@ void Direct3D10Renderer::setSamplerState(const char *samplerName, const SamplerS
 	}
 }
 
-bool fillSS(ID3D10SamplerState **dest, int &min, int &max, const SamplerStateID selectedSamplerStates[], SamplerStateID currentSamplerStates[], const SamplerState *samplerStates){
+bool fillSS(ID3D10SamplerState **dest, int &min, int &max, const SamplerStateID selectedSamplerStates[], SamplerStateID currentSamplerStates[], const HandlePool <SamplerState> &samplerStates){
 	min = 0;
 	do {
 		if (selectedSamplerStates[min] != currentSamplerStates[min]){
@@ -1462,13 +1583,13 @@ void Direct3D10Renderer::applySamplerStates(){
 	ID3D10SamplerState *samplers[MAX_SAMPLERSTATE];
 
 	int min, max;
-	if (fillSS(samplers, min, max, selectedSamplerStatesVS, currentSamplerStatesVS, samplerStates.getArray())){
+	if (fillSS(samplers, min, max, selectedSamplerStatesVS, currentSamplerStatesVS, samplerStates)){
 		device->VSSetSamplers(min, max - min + 1, samplers);
 	}
-	if (fillSS(samplers, min, max, selectedSamplerStatesGS, currentSamplerStatesGS, samplerStates.getArray())){
+	if (fillSS(samplers, min, max, selectedSamplerStatesGS, currentSamplerStatesGS, samplerStates)){
 		device->GSSetSamplers(min, max - min + 1, samplers);
 	}
-	if (fillSS(samplers, min, max, selectedSamplerStatesPS, currentSamplerStatesPS, samplerStates.getArray())){
+	if (fillSS(samplers, min, max, selectedSamplerStatesPS, currentSamplerStatesPS, samplerStates)){
 		device->PSSetSamplers(min, max - min + 1, samplers);
 	}
 }
@@ -1738,7 +1859,7 @@ void Direct3D10Renderer::changeRasterizerState(const RasterizerStateID rasterize
 	if (rasterizerState != currentRasterizerState){
 		if (rasterizerState == RS_NONE){
 			//device->RSSetState(NULL);
-			device->RSSetState(rasterizerStates[0].rsState);
+			device->RSSetState(rasterizerStates.getSlot(0).rsState);
 		} else {
 			device->RSSetState(rasterizerStates[rasterizerState].rsState);
 		}
@@ -1790,6 +1911,15 @@ void Direct3D10Renderer::drawElements(const Primitives primitives, const int fir
 	device->DrawIndexed(nIndices, firstIndex, 0);
 }
 
+void Direct3D10Renderer::drawElementsInstanced(const Primitives primitives, const int firstIndex, const int nIndices, const int firstVertex, const int nVertices, const int nInstances){
+	device->IASetPrimitiveTopology(d3dPrim[primitives]);
+	device->DrawIndexedInstanced(nIndices, nInstances, firstIndex, 0, 0);
+}
+
+bool Direct3D10Renderer::supportsInstancing() const {
+	return true;
+}
+
 void Direct3D10Renderer::setup2DMode(const float left, const float right, const float top, const float bottom){
 	scaleBias2D.x = 2.0f / (right - left);
 	scaleBias2D.y = 2.0f / (top - bottom);
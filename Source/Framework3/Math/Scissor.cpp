@@ -14,6 +14,11 @@
 \*********************************************************************/
 
 #include "Scissor.h"
+#include "../Platform.h"
+
+#ifdef USE_SSE
+#include <emmintrin.h>
+#endif
 /*
 bool getScissorRectangle(const mat4 &projection, const mat4 &modelview, const vec3 &camPos, const vec3 &lightPos, const float radius, const int width, const int height, int *x, int *y, int *w, int *h){
 
@@ -55,6 +60,28 @@ bool getScissorRectangle(const mat4 &projection, const mat4 &modelview, const ve
 
 #define EPSILON 0.0005f
 
+// Converts the normalized screen extents into a clamped pixel rectangle
+static inline bool clampRectangle(float lp, float rp, float bp, float tp, const int width, const int height, int *x, int *y, int *w, int *h){
+	lp *= width;
+	rp *= width;
+	tp *= height;
+	bp *= height;
+
+	int left   = int(lp);
+	int right  = int(rp);
+	int top    = int(tp);
+	int bottom = int(bp);
+
+	if (right <= left || top <= bottom) return false;
+
+	*x = min(max(int(left),   0), width  - 1);
+	*y = min(max(int(bottom), 0), height - 1);
+	*w = min(int(right) - *x, width  - *x);
+	*h = min(int(top)   - *y, height - *y);
+
+	return (*w > 0 && *h > 0);
+}
+
 bool getScissorRectangle(const mat4 &modelview, const vec3 &pos, const float radius, const float fov, const int width, const int height, int *x, int *y, int *w, int *h){
 	vec4 lightPos = modelview * vec4(pos, 1.0f);
 
@@ -120,22 +147,113 @@ bool getScissorRectangle(const mat4 &modelview, const vec3 &pos, const float rad
 		if (Py1 < lightPos.y && y1 > bp) bp = y1;
 	}
 
-	lp *= width;
-	rp *= width;
-	tp *= height;
-	bp *= height;
+	return clampRectangle(lp, rp, bp, tp, width, height, x, y, w, h);
+}
 
-	int left   = int(lp);
-	int right  = int(rp);
-	int top    = int(tp);
-	int bottom = int(bp);
+#ifdef USE_SSE
+
+#define sseNeg(a) _mm_xor_ps(a, _mm_set1_ps(-0.0f))
+#define sseSelect(mask, a, b) _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b))
+
+// Computes the [lo, hi] extent along one screen axis for four lights at once.
+// This is a direct translation of the scalar code above, keeping the same
+// order of operations. With -ffast-math the scalar code is free to reorder its
+// math, so the edges can then be a pixel apart.
+static forceinline SIMD_EXACT void getAxisRange(const __m128 lc, const __m128 lz, const __m128 radius, const __m128 e, __m128 &lo, __m128 &hi){
+	__m128 zero = _mm_setzero_ps();
+	__m128 one  = _mm_set1_ps(1.0f);
+	__m128 half = _mm_set1_ps(0.5f);
+
+	__m128 rr = _mm_mul_ps(radius, radius);
+	__m128 L = _mm_add_ps(_mm_mul_ps(lc, lc), _mm_mul_ps(lz, lz));
+	__m128 a = _mm_div_ps(_mm_mul_ps(sseNeg(radius), lc), L);
+	__m128 b = _mm_div_ps(_mm_sub_ps(rr, _mm_mul_ps(lz, lz)), L);
+	__m128 f = _mm_add_ps(sseNeg(b), _mm_mul_ps(a, a));
+
+	__m128 valid = _mm_cmpgt_ps(f, zero);
+
+	__m128 s = _mm_sqrt_ps(f);
+	__m128 N0 = _mm_add_ps(sseNeg(a), s);
+	__m128 N1 = _mm_sub_ps(sseNeg(a), s);
+	__m128 Nz0 = _mm_div_ps(_mm_sub_ps(radius, _mm_mul_ps(N0, lc)), lz);
+	__m128 Nz1 = _mm_div_ps(_mm_sub_ps(radius, _mm_mul_ps(N1, lc)), lz);
+
+	__m128 c0 = _mm_mul_ps(half, _mm_sub_ps(one, _mm_div_ps(Nz0, _mm_mul_ps(N0, e))));
+	__m128 c1 = _mm_mul_ps(half, _mm_sub_ps(one, _mm_div_ps(Nz1, _mm_mul_ps(N1, e))));
+
+	__m128 Lr = _mm_sub_ps(L, rr);
+	__m128 Pz0 = _mm_div_ps(Lr, _mm_sub_ps(lz, _mm_div_ps(_mm_mul_ps(lc, Nz0), N0)));
+	__m128 Pz1 = _mm_div_ps(Lr, _mm_sub_ps(lz, _mm_div_ps(_mm_mul_ps(lc, Nz1), N1)));
+
+	__m128 P0 = _mm_div_ps(sseNeg(_mm_mul_ps(Pz0, Nz0)), N0);
+	__m128 P1 = _mm_div_ps(sseNeg(_mm_mul_ps(Pz1, Nz1)), N1);
+
+	__m128 h = one;
+	__m128 l = zero;
+	h = sseSelect(_mm_cmpgt_ps(P0, lc), c0, h);
+	l = sseSelect(_mm_cmplt_ps(P0, lc), c0, l);
+	h = sseSelect(_mm_and_ps(_mm_cmpgt_ps(P1, lc), _mm_cmplt_ps(c1, h)), c1, h);
+	l = sseSelect(_mm_and_ps(_mm_cmplt_ps(P1, lc), _mm_cmpgt_ps(c1, l)), c1, l);
+
+	hi = sseSelect(valid, h, one);
+	lo = sseSelect(valid, l, zero);
+}
 
-	if (right <= left || top <= bottom) return false;
+#endif // USE_SSE
 
-	*x = min(max(int(left),   0), width  - 1);
-	*y = min(max(int(bottom), 0), height - 1);
-	*w = min(int(right) - *x, width  - *x);
-	*h = min(int(top)   - *y, height - *y);
+SIMD_EXACT uint getScissorRectangles(const mat4 &modelview, const float *posX, const float *posY, const float *posZ, const float *radius, const uint count,
+						  const float fov, const int width, const int height, int *x, int *y, int *w, int *h, uint *visible){
+	uint nVisible = 0;
+	uint i = 0;
 
-	return (*w > 0 && *h > 0);
+#ifdef USE_SSE
+	float ex = tanf(fov / 2);
+	float ey = ex * height / width;
+
+	__m128 sex = _mm_set1_ps(ex);
+	__m128 sey = _mm_set1_ps(ey);
+
+	const vec4 *rows = modelview.rows;
+
+	alignment(16) float lp[4], rp[4], bp[4], tp[4];
+	for (; i + 4 <= count; i += 4){
+		__m128 px = _mm_loadu_ps(posX + i);
+		__m128 py = _mm_loadu_ps(posY + i);
+		__m128 pz = _mm_loadu_ps(posZ + i);
+		__m128 r  = _mm_loadu_ps(radius + i);
+
+		// Skip the whole group if no light in it has a size
+		int active = _mm_movemask_ps(_mm_cmpgt_ps(r, _mm_setzero_ps()));
+		if (active == 0) continue;
+
+		// Transform the light positions to view space
+		__m128 lx = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(rows[0].x), px), _mm_mul_ps(_mm_set1_ps(rows[0].y), py)), _mm_mul_ps(_mm_set1_ps(rows[0].z), pz)), _mm_set1_ps(rows[0].w));
+		__m128 ly = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(rows[1].x), px), _mm_mul_ps(_mm_set1_ps(rows[1].y), py)), _mm_mul_ps(_mm_set1_ps(rows[1].z), pz)), _mm_set1_ps(rows[1].w));
+		__m128 lz = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(rows[2].x), px), _mm_mul_ps(_mm_set1_ps(rows[2].y), py)), _mm_mul_ps(_mm_set1_ps(rows[2].z), pz)), _mm_set1_ps(rows[2].w));
+
+		__m128 lo, hi;
+		getAxisRange(lx, lz, r, sex, lo, hi);
+		_mm_store_ps(lp, lo);
+		_mm_store_ps(rp, hi);
+
+		getAxisRange(ly, lz, r, sey, lo, hi);
+		_mm_store_ps(bp, lo);
+		_mm_store_ps(tp, hi);
+
+		for (uint k = 0; k < 4; k++){
+			if ((active & (1 << k)) && clampRectangle(lp[k], rp[k], bp[k], tp[k], width, height, x + i + k, y + i + k, w + i + k, h + i + k)){
+				visible[nVisible++] = i + k;
+			}
+		}
+	}
+#endif
+
+	// Remaining lights
+	for (; i < count; i++){
+		if (radius[i] > 0 && getScissorRectangle(modelview, vec3(posX[i], posY[i], posZ[i]), radius[i], fov, width, height, x + i, y + i, w + i, h + i)){
+			visible[nVisible++] = i;
+		}
+	}
+
+	return nVisible;
 }
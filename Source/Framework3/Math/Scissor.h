@@ -21,4 +21,11 @@
 //bool getScissorRectangle(const mat4 &projection, const mat4 &modelview, const vec3 &camPos, const vec3 &lightPos, const float radius, const int width, const int height, int *x, int *y, int *w, int *h);
 bool getScissorRectangle(const mat4 &modelview, const vec3 &pos, const float radius, const float fov, const int width, const int height, int *x, int *y, int *w, int *h);
 
+// Batched version of getScissorRectangle() for lights stored in structure-of-arrays form.
+// Rectangles are written at each light's index and match the scalar results exactly.
+// Lights with a radius of zero or less are skipped. The indices of the visible lights
+// are written in ascending order to visible, and the number of them is returned.
+unsigned int getScissorRectangles(const mat4 &modelview, const float *posX, const float *posY, const float *posZ, const float *radius, const unsigned int count,
+	const float fov, const int width, const int height, int *x, int *y, int *w, int *h, unsigned int *visible);
+
 #endif // _SCISSOR_H_
@@ -70,6 +70,8 @@ bool GL_HP_occlusion_test_supported    = false;
 bool GL_NV_blend_square_supported      = false;
 
 bool GL_EXT_depth_bounds_test_supported = false;
+bool GL_ARB_draw_instanced_supported = false;
+bool GL_ARB_half_float_vertex_supported = false;
 
 bool GL_SGIS_generate_mipmap_supported = false;
 
@@ -486,6 +488,11 @@ PFNGLTEXIMAGE3DEXTPROC glTexImage3DEXT = NULL;
 PFNGLDEPTHBOUNDSEXTPROC glDepthBoundsEXT = NULL;
 #endif
 
+#ifdef GL_ARB_draw_instanced_PROTOTYPES
+PFNGLDRAWARRAYSINSTANCEDARBPROC glDrawArraysInstancedARB = NULL;
+PFNGLDRAWELEMENTSINSTANCEDARBPROC glDrawElementsInstancedARB = NULL;
+#endif
+
 #if defined(_WIN32)
 
 // WGL_ARB_extensions_string
@@ -1251,6 +1258,17 @@ void initExtensions(){
   }
 #endif
 
+  GL_ARB_draw_instanced_supported = isExtensionSupported("GL_ARB_draw_instanced");
+
+#ifdef GL_ARB_draw_instanced_PROTOTYPES
+  if(GL_ARB_draw_instanced_supported) {
+    glDrawArraysInstancedARB = (PFNGLDRAWARRAYSINSTANCEDARBPROC) wglxGetProcAddress("glDrawArraysInstancedARB");
+    glDrawElementsInstancedARB = (PFNGLDRAWELEMENTSINSTANCEDARBPROC) wglxGetProcAddress("glDrawElementsInstancedARB");
+  }
+#endif
+
+  GL_ARB_half_float_vertex_supported = isExtensionSupported("GL_ARB_half_float_vertex");
+
 	GL_SGIS_generate_mipmap_supported = isExtensionSupported("GL_SGIS_generate_mipmap");
 
 #if defined(_WIN32)
@@ -122,6 +122,8 @@ extern bool GL_HP_occlusion_test_supported;
 extern bool GL_NV_blend_square_supported;
 
 extern bool GL_EXT_depth_bounds_test_supported;
+extern bool GL_ARB_draw_instanced_supported;
+extern bool GL_ARB_half_float_vertex_supported;
 
 extern bool GL_SGIS_generate_mipmap_supported;
 
@@ -269,6 +271,10 @@ extern int GLReleaseVersion;
 #define GL_EXT_depth_bounds_test_PROTOTYPES
 #endif
 
+#if !defined(GL_ARB_draw_instanced) || defined(PROTOTYPES)
+#define GL_ARB_draw_instanced_PROTOTYPES
+#endif
+
 
 
 
@@ -1736,6 +1742,19 @@ typedef void (APIENTRY * PFNGLDEPTHBOUNDSEXTPROC)(GLclampd zmin, GLclampd zmax);
 extern PFNGLDEPTHBOUNDSEXTPROC glDepthBoundsEXT;
 #endif
 
+#ifndef GL_ARB_draw_instanced
+#define GL_ARB_draw_instanced
+
+typedef void (APIENTRY * PFNGLDRAWARRAYSINSTANCEDARBPROC)(GLenum mode, GLint first, GLsizei count, GLsizei primcount);
+typedef void (APIENTRY * PFNGLDRAWELEMENTSINSTANCEDARBPROC)(GLenum mode, GLsizei count, GLenum type, const GLvoid *indices, GLsizei primcount);
+
+#endif
+
+#ifdef GL_ARB_draw_instanced_PROTOTYPES
+extern PFNGLDRAWARRAYSINSTANCEDARBPROC glDrawArraysInstancedARB;
+extern PFNGLDRAWELEMENTSINSTANCEDARBPROC glDrawElementsInstancedARB;
+#endif
+
 #ifndef GL_HP_occlusion_test
 #define GL_HP_occlusion_test
 
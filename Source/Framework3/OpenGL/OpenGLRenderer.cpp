@@ -288,33 +288,22 @@ OpenGLRenderer::~OpenGLRenderer(){
 
 	// Delete shaders
 	for (uint i = 0; i < shaders.getCount(); i++){
-		for (uint j = 0; j < shaders[i].nSamplers; j++){
-			delete shaders[i].samplers[j].name;
-		}
-		for (uint j = 0; j < shaders[i].nUniforms; j++){
-			delete shaders[i].uniforms[j].name;
-			delete shaders[i].uniforms[j].data;
-		}
-		delete shaders[i].samplers;
-		delete shaders[i].uniforms;
-		glDeleteObjectARB(shaders[i].vertexShader);
-		glDeleteObjectARB(shaders[i].fragmentShader);
-		glDeleteObjectARB(shaders[i].program);
+		if (shaders.isUsed(i)) removeShader(shaders.getHandle(i));
 	}
 
     // Delete vertex buffers
 	for (uint i = 0; i < vertexBuffers.getCount(); i++){
-		glDeleteBuffersARB(1, &vertexBuffers[i].vboVB);
+		if (vertexBuffers.isUsed(i)) removeVertexBuffer(vertexBuffers.getHandle(i));
 	}
 
 	// Delete index buffers
 	for (uint i = 0; i < indexBuffers.getCount(); i++){
-		glDeleteBuffersARB(1, &indexBuffers[i].vboIB);
+		if (indexBuffers.isUsed(i)) removeIndexBuffer(indexBuffers.getHandle(i));
 	}
 
 	// Delete textures
 	for (uint i = 0; i < textures.getCount(); i++){
-		removeTexture(i);
+		if (textures.isUsed(i)) removeTexture(textures.getHandle(i));
 	}
 
 	if (fbo) glDeleteFramebuffersEXT(1, &fbo);
@@ -466,6 +455,9 @@ TextureID OpenGLRenderer::addTexture(Image &img, const SamplerStateID samplerSta
 
 //	tex.lod = lod;
 	tex.format = format;
+	tex.flags  = flags;
+	tex.width  = img.getWidth();
+	tex.height = img.getHeight();
 	tex.glTarget = img.isCube()? GL_TEXTURE_CUBE_MAP : img.is3D()? GL_TEXTURE_3D : img.is2D()? GL_TEXTURE_2D : GL_TEXTURE_1D;
 	// Generate a texture
 	glGenTextures(1, &tex.glTexID);
@@ -606,6 +598,20 @@ bool OpenGLRenderer::resizeRenderTarget(const TextureID renderTarget, const int
 
 
 void OpenGLRenderer::removeTexture(const TextureID texture){
+	// Make sure nothing is left bound to it
+	for (uint i = 0; i < MAX_TEXTUREUNIT; i++){
+		if (currentTextures[i] == texture){
+			glActiveTextureARB(GL_TEXTURE0 + i);
+			glDisable(textures[texture].glTarget);
+			glBindTexture(textures[texture].glTarget, 0);
+			currentTextures[i] = TEXTURE_NONE;
+		}
+	}
+	for (uint i = 0; i < nCurrentRenderTargets; i++){
+		if (currentColorRT[i] == texture) changeToMainFramebuffer();
+	}
+	if (currentDepthRT == texture) changeToMainFramebuffer();
+
 	if (textures[texture].glTarget){
 		if (textures[texture].glTarget == GL_RENDERBUFFER_EXT){
 			glDeleteRenderbuffersEXT(1, &textures[texture].glDepthID);
@@ -614,6 +620,26 @@ void OpenGLRenderer::removeTexture(const TextureID texture){
 		}
 		textures[texture].glTarget = 0;
 	}
+	textures.remove(texture);
+}
+
+bool OpenGLRenderer::updateTexture(const TextureID texture, const int x, const int y, const int width, const int height, const void *pixels){
+	Texture &tex = textures[texture];
+	if ((tex.glTarget != GL_TEXTURE_1D && tex.glTarget != GL_TEXTURE_2D) || isCompressedFormat(tex.format)) return false;
+	ASSERT(x >= 0 && y >= 0 && x + width <= tex.width && y + height <= tex.height);
+
+	GLenum srcFormat = srcFormats[getChannelCount(tex.format)];
+	GLenum srcType = srcTypes[tex.format];
+
+	glBindTexture(tex.glTarget, tex.glTexID);
+	if (tex.glTarget == GL_TEXTURE_1D){
+		glTexSubImage1D(GL_TEXTURE_1D, 0, x, width, srcFormat, srcType, pixels);
+	} else {
+		glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, srcFormat, srcType, pixels);
+	}
+	glBindTexture(tex.glTarget, 0);
+
+	return true;
 }
 
 int samplerCompare(const void *sampler0, const void *sampler1){
@@ -942,6 +968,81 @@ RasterizerStateID OpenGLRenderer::addRasterizerState(const int cullMode, const i
 	return rasterizerStates.add(rasterizerState);
 }
 
+void OpenGLRenderer::removeShader(const ShaderID shader){
+	if (currentShader == shader) changeShader(SHADER_NONE);
+
+	Shader &sh = shaders[shader];
+	for (uint j = 0; j < sh.nSamplers; j++){
+		delete sh.samplers[j].name;
+	}
+	for (uint j = 0; j < sh.nUniforms; j++){
+		delete sh.uniforms[j].name;
+		delete sh.uniforms[j].data;
+	}
+	delete sh.samplers;
+	delete sh.uniforms;
+	glDeleteObjectARB(sh.vertexShader);
+	glDeleteObjectARB(sh.fragmentShader);
+	glDeleteObjectARB(sh.program);
+
+	shaders.remove(shader);
+}
+
+void OpenGLRenderer::removeVertexFormat(const VertexFormatID vertexFormat){
+	// Disable its arrays and make sure the attribute pointers are set up again for a reused ID
+	if (currentVertexFormat == vertexFormat) changeVertexFormat(VF_NONE);
+	for (uint i = 0; i < MAX_VERTEXSTREAM; i++){
+		if (activeVertexFormat[i] == vertexFormat) activeVertexFormat[i] = VF_NONE;
+	}
+
+	vertexFormats.remove(vertexFormat);
+}
+
+void OpenGLRenderer::removeVertexBuffer(const VertexBufferID vertexBuffer){
+	for (uint i = 0; i < MAX_VERTEXSTREAM; i++){
+		if (currentVertexBuffers[i] == vertexBuffer) currentVertexBuffers[i] = VB_NONE;
+	}
+	// Deleting a bound buffer unbinds it
+	if (currentVBO == vertexBuffers[vertexBuffer].vboVB) currentVBO = 0;
+
+	glDeleteBuffersARB(1, &vertexBuffers[vertexBuffer].vboVB);
+	vertexBuffers.remove(vertexBuffer);
+}
+
+void OpenGLRenderer::removeIndexBuffer(const IndexBufferID indexBuffer){
+	if (currentIndexBuffer == indexBuffer) changeIndexBuffer(IB_NONE);
+
+	glDeleteBuffersARB(1, &indexBuffers[indexBuffer].vboIB);
+	indexBuffers.remove(indexBuffer);
+}
+
+void OpenGLRenderer::removeSamplerState(const SamplerStateID samplerState){
+	// Textures remember the last sampler state applied to them, so force it to be set up again
+	for (uint i = 0; i < textures.getCount(); i++){
+		if (textures.isUsed(i) && textures.getSlot(i).samplerState == samplerState) textures.getSlot(i).samplerState = SS_NONE;
+	}
+	for (uint i = 0; i < MAX_SAMPLERSTATE; i++){
+		if (currentSamplerStates[i] == samplerState) currentSamplerStates[i] = SS_NONE;
+	}
+
+	samplerStates.remove(samplerState);
+}
+
+void OpenGLRenderer::removeBlendState(const BlendStateID blendState){
+	if (currentBlendState == blendState) changeBlendState(BS_NONE);
+	blendStates.remove(blendState);
+}
+
+void OpenGLRenderer::removeDepthState(const DepthStateID depthState){
+	if (currentDepthState == depthState) changeDepthState(DS_NONE);
+	depthStates.remove(depthState);
+}
+
+void OpenGLRenderer::removeRasterizerState(const RasterizerStateID rasterizerState){
+	if (currentRasterizerState == rasterizerState) changeRasterizerState(RS_NONE);
+	rasterizerStates.remove(rasterizerState);
+}
+
 int OpenGLRenderer::getSamplerUnit(const ShaderID shader, const char *samplerName) const {
 	ASSERT(shader != SHADER_NONE);
 
@@ -1228,8 +1329,9 @@ void OpenGLRenderer::changeVertexFormat(const VertexFormatID vertexFormat){
 void OpenGLRenderer::changeVertexBuffer(const int stream, const VertexBufferID vertexBuffer, const intptr offset){
 	const GLsizei glTypes[] = {
 		GL_FLOAT,
-		0, // No half float support
+		GL_HALF_FLOAT_ARB, // Needs GL_ARB_half_float_vertex
 		GL_UNSIGNED_BYTE,
+		GL_SHORT,
 	};
 
 	GLuint vbo = 0;
@@ -1558,6 +1660,20 @@ void OpenGLRenderer::drawElements(const Primitives primitives, const int firstIn
 	nDrawCalls++;
 }
 
+void OpenGLRenderer::drawElementsInstanced(const Primitives primitives, const int firstIndex, const int nIndices, const int firstVertex, const int nVertices, const int nInstances){
+	ASSERT(GL_ARB_draw_instanced_supported);
+
+	uint indexSize = indexBuffers[currentIndexBuffer].indexSize;
+
+	glDrawElementsInstancedARB(glPrim[primitives], nIndices, indexSize == 2? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT, BUFFER_OFFSET(indexSize * firstIndex), nInstances);
+
+	nDrawCalls++;
+}
+
+bool OpenGLRenderer::supportsInstancing() const {
+	return GL_ARB_draw_instanced_supported;
+}
+
 void OpenGLRenderer::setup2DMode(const float left, const float right, const float top, const float bottom){
 	glMatrixMode(GL_PROJECTION);
 	glLoadIdentity();
@@ -41,6 +41,7 @@ public:
 	bool resizeRenderTarget(const TextureID renderTarget, const int width, const int height, const int depth, const int arraySize);
 
 	void removeTexture(const TextureID texture);
+	bool updateTexture(const TextureID texture, const int x, const int y, const int width, const int height, const void *pixels);
 
 	ShaderID addShader(const char *vsText, const char *gsText, const char *fsText, const int vsLine, const int gsLine, const int fsLine,
 		const char *header = NULL, const char *extra = NULL, const char *fileName = NULL, const char **attributeNames = NULL, const int nAttributes = 0, const uint flags = 0);
@@ -56,6 +57,15 @@ public:
   DepthStateID addDepthState(const bool depthTest, const bool depthWrite, const int depthFunc = LEQUAL);
 	RasterizerStateID addRasterizerState(const int cullMode, const int fillMode = SOLID, const bool multiSample = true, const bool scissor = false);
 
+	void removeShader(const ShaderID shader);
+	void removeVertexFormat(const VertexFormatID vertexFormat);
+	void removeVertexBuffer(const VertexBufferID vertexBuffer);
+	void removeIndexBuffer(const IndexBufferID indexBuffer);
+	void removeSamplerState(const SamplerStateID samplerState);
+	void removeBlendState(const BlendStateID blendState);
+	void removeDepthState(const DepthStateID depthState);
+	void removeRasterizerState(const RasterizerStateID rasterizerState);
+
 	int getSamplerUnit(const ShaderID shader, const char *samplerName) const;
 
 	void setTexture(const TextureID texture){ selectedTextures[0] = texture; }
@@ -100,6 +110,8 @@ public:
 
 	void drawArrays(const Primitives primitives, const int firstVertex, const int nVertices);
 	void drawElements(const Primitives primitives, const int firstIndex, const int nIndices, const int firstVertex, const int nVertices);
+	void drawElementsInstanced(const Primitives primitives, const int firstIndex, const int nIndices, const int firstVertex, const int nVertices, const int nInstances);
+	bool supportsInstancing() const;
 
 	void setup2DMode(const float left, const float right, const float top, const float bottom);
 	void drawPlain(const Primitives primitives, vec2 *vertices, const uint nVertices, const BlendStateID blendState, const DepthStateID depthState, const vec4 *color = NULL);
@@ -88,6 +88,54 @@ void InfoMsg(const char *string){
 
 #endif
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+void *mapFile(const char *fileName, size_t &size){
+#ifdef _WIN32
+	HANDLE file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return NULL;
+
+	size = GetFileSize(file, NULL);
+	HANDLE mapping = (size > 0)? CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+	CloseHandle(file);
+	if (mapping == NULL) return NULL;
+
+	// The view keeps the mapping alive
+	void *mem = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+
+	return mem;
+#else
+	int file = open(fileName, O_RDONLY);
+	if (file < 0) return NULL;
+
+	struct stat st;
+	if (fstat(file, &st) != 0 || st.st_size == 0){
+		close(file);
+		return NULL;
+	}
+	size = st.st_size;
+
+	void *mem = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);
+
+	return (mem == MAP_FAILED)? NULL : mem;
+#endif
+}
+
+void unmapFile(void *mem, const size_t size){
+#ifdef _WIN32
+	UnmapViewOfFile(mem);
+#else
+	munmap(mem, size);
+#endif
+}
+
 
 
 #ifdef DEBUG
@@ -132,6 +180,11 @@ void outputDebugString(const char *str){
 
 #else
 
+void failedAssert(char *file, int line, char *statement){
+	// No dialog to offer a break, so just report it and carry on
+	fprintf(stderr, "Assert failed: (%s)\nFile: %s\nLine: %d\n", statement, file, line);
+}
+
 void outputDebugString(const char *str){
 	printf("%s\n", str);
 }
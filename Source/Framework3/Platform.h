@@ -86,6 +86,19 @@ typedef unsigned int uint;
 #define elementsOf(x) (sizeof(x) / sizeof(x[0]))
 #define offsetOf(strct, member) uint(((strct *) NULL)->member)
 
+// SSE2 intrinsics are used for batched math where the target supports them
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define USE_SSE
+#endif
+
+// For SIMD code that has to match its scalar version bit for bit, and for that scalar version. gcc implements
+// the SSE intrinsics with its generic vector operators, which -ffast-math is free to reorder.
+#if defined(__GNUC__) && !defined(__clang__)
+#  define SIMD_EXACT __attribute__ ((optimize("no-unsafe-math-optimizations")))
+#else
+#  define SIMD_EXACT
+#endif
+
 #ifdef _WIN32
 #define forceinline __forceinline
 #define alignment(x) __declspec(align(x))
@@ -99,6 +112,10 @@ void ErrorMsg(const char *string);
 void WarningMsg(const char *string);
 void InfoMsg(const char *string);
 
+// Read-only memory mapping of a whole file, returns NULL if the file couldn't be mapped
+void *mapFile(const char *fileName, size_t &size);
+void unmapFile(void *mem, const size_t size);
+
 
 
 #ifdef _WIN32
@@ -116,6 +133,7 @@ void InfoMsg(const char *string);
 #else
 
 #define stricmp(a, b) strcasecmp(a, b)
+#define strnicmp(a, b, n) strncasecmp(a, b, n)
 
 #endif // LINUX
 
@@ -18,6 +18,7 @@
 
 #include "Platform.h"
 #include "Util/Array.h"
+#include "Util/HandlePool.h"
 #include "Math/Vector.h"
 #include "Imaging/Image.h"
 
@@ -149,6 +150,7 @@ struct TexVertex {
 #define HALF_FLOAT   0x2
 #define SRGB         0x4
 #define SAMPLE_DEPTH 0x8
+#define UPDATABLE    0x10
 
 // Shader flags
 #define ASSEMBLY 0x1
@@ -206,6 +208,7 @@ enum AttributeFormat {
 	FORMAT_FLOAT = 0,
 	FORMAT_HALF  = 1,
 	FORMAT_UBYTE = 2,
+	FORMAT_SHORT = 3, // Signed normalized
 };
 
 struct FormatDesc {
@@ -286,6 +289,9 @@ public:
 
 	virtual void removeTexture(const TextureID texture) = 0;
 
+	// Replaces a region of the top mip level. Textures to be updated should be created with the UPDATABLE flag.
+	virtual bool updateTexture(const TextureID texture, const int x, const int y, const int width, const int height, const void *pixels) = 0;
+
 
 	ShaderID addShader(const char *fileName, const uint flags = 0);
 	ShaderID addShader(const char *fileName, const char *extra, const uint flags = 0);
@@ -306,6 +312,16 @@ public:
   virtual DepthStateID addDepthState(const bool depthTest, const bool depthWrite, const int depthFunc = LEQUAL) = 0;
 	virtual RasterizerStateID addRasterizerState(const int cullMode, const int fillMode = SOLID, const bool multiSample = true, const bool scissor = false) = 0;
 
+	// Removed resources free their slot for reuse. Using a removed ID is caught in debug builds.
+	virtual void removeShader(const ShaderID shader) = 0;
+	virtual void removeVertexFormat(const VertexFormatID vertexFormat) = 0;
+	virtual void removeVertexBuffer(const VertexBufferID vertexBuffer) = 0;
+	virtual void removeIndexBuffer(const IndexBufferID indexBuffer) = 0;
+	virtual void removeSamplerState(const SamplerStateID samplerState) = 0;
+	virtual void removeBlendState(const BlendStateID blendState) = 0;
+	virtual void removeDepthState(const DepthStateID depthState) = 0;
+	virtual void removeRasterizerState(const RasterizerStateID rasterizerState) = 0;
+
 	FontID addFont(const char *textureFile, const char *fontFile, const SamplerStateID samplerState);
 
 
@@ -429,6 +445,9 @@ public:
 
 	virtual void drawArrays(const Primitives primitives, const int firstVertex, const int nVertices) = 0;
 	virtual void drawElements(const Primitives primitives, const int firstIndex, const int nIndices, const int firstVertex, const int nVertices) = 0;
+	virtual void drawElementsInstanced(const Primitives primitives, const int firstIndex, const int nIndices, const int firstVertex, const int nVertices, const int nInstances) = 0;
+	// Instanced draws are only valid if this returns true, callers should fall back on separate draws otherwise
+	virtual bool supportsInstancing() const = 0;
 
 	virtual void setup2DMode(const float left, const float right, const float top, const float bottom) = 0;
 	virtual void drawPlain(const Primitives primitives, vec2 *vertices, const uint nVertices, const BlendStateID blendState, const DepthStateID depthState, const vec4 *color = NULL) = 0;
@@ -447,16 +466,16 @@ public:
 	uint getDrawCallCount(){ return nDrawCalls; }
 
 protected:
-	Array <Texture> textures;
-	Array <Shader> shaders;
-	Array <VertexBuffer> vertexBuffers;
-	Array <IndexBuffer> indexBuffers;
+	HandlePool <Texture> textures;
+	HandlePool <Shader> shaders;
+	HandlePool <VertexBuffer> vertexBuffers;
+	HandlePool <IndexBuffer> indexBuffers;
 	Array <TexFont> fonts;
-	Array <VertexFormat> vertexFormats;
-	Array <SamplerState> samplerStates;
-	Array <BlendState> blendStates;
-	Array <DepthState> depthStates;
-	Array <RasterizerState> rasterizerStates;
+	HandlePool <VertexFormat> vertexFormats;
+	HandlePool <SamplerState> samplerStates;
+	HandlePool <BlendState> blendStates;
+	HandlePool <DepthState> depthStates;
+	HandlePool <RasterizerState> rasterizerStates;
 
 	uint nImageUnits, nMRTs;
 	int maxAnisotropic;
@@ -14,6 +14,11 @@
 \*********************************************************************/
 
 #include "BSP.h"
+#include "String.h"
+
+#ifdef USE_SSE
+#include <emmintrin.h>
+#endif
 
 #ifdef _WIN32
 #pragma warning(push, 1)
@@ -144,14 +149,23 @@ no_alias bool BTri::isAbove(const vec3 &pos) const {
 	return (planeDistance(edgePlanes[0], pos) >= 0 && planeDistance(edgePlanes[1], pos) >= 0 && planeDistance(edgePlanes[2], pos) >= 0);
 }
 
-no_alias float BTri::getDistance(const vec3 &pos) const {
+// The dot() and planeDistance() math, kept in this file so getDistances() can match getDistance() bit for bit
+static forceinline SIMD_EXACT float exactDot(const vec3 &u, const vec3 &v){
+	return u.x * v.x + u.y * v.y + u.z * v.z;
+}
+
+static forceinline SIMD_EXACT float exactPlaneDistance(const vec4 &plane, const vec3 &point){
+	return point.x * plane.x + point.y * plane.y + point.z * plane.z + plane.w;
+}
+
+no_alias SIMD_EXACT float BTri::getDistance(const vec3 &pos) const {
 	int k = 2;
 	for (int i = 0; i < 3; i++){
-		float d = planeDistance(edgePlanes[i], pos);
+		float d = exactPlaneDistance(edgePlanes[i], pos);
 		if (d < 0){
 			// Project onto the line between the points
 			vec3 dir = v[i] - v[k];
-			float c = dot(dir, pos - v[k]) / dot(dir, dir);
+			float c = exactDot(dir, pos - v[k]) / exactDot(dir, dir);
 
 			vec3 d;
 			if (c >= 1){
@@ -161,35 +175,17 @@ no_alias float BTri::getDistance(const vec3 &pos) const {
 				if (c > 0) d += c * dir;
 			}
 
-			return length(pos - d);
+			d = pos - d;
+			return sqrtf(exactDot(d, d));
 		}
 
 		k = i;
 	}
 
-	return fabsf(planeDistance(plane, pos));
+	return fabsf(exactPlaneDistance(plane, pos));
 }
 
 
-#ifdef USE_SIMD
-bool BTri::isAbove3DNow(v2sf v0XY, v2sf v0Z1) const {
-	for (int i = 0; i < 3; i++){
-		v2sf planeXY = ((v2sf *) &edgePlanes[i])[0];
-		v2sf planeZD = ((v2sf *) &edgePlanes[i])[1];
-
-		v2sf dotXY = pfmul(planeXY, v0XY);
-		v2sf dotZD = pfmul(planeZD, v0Z1);
-		v2sf dot = pfacc(dotXY, dotZD);
-		dot = pfacc(dot, dot);
-
-		int d = _m_to_int(dot);
-		if (d < 0) return false;
-	}
-
-	return true;
-}
-#endif
-
 BNode::~BNode(){
     delete back;
 	delete front;
@@ -322,124 +318,6 @@ BTri *BNode::intersectsCached(const vec3 &v0, const vec3 &v1, const vec3 &dir) c
 }
 */
 
-no_alias BTri *BNode::intersectsCached(const vec3 &v0, const vec3 &v1, const vec3 &dir) const {
-	float d = planeDistance(tri.plane, v0);
-
-	if (d > 0){
-		if (front != NULL){
-			BTri *tri = front->intersectsCached(v0, v1, dir);
-			if (tri) return tri;
-		}
-		if (planeDistance(tri.plane, v1) < 0){
-			vec3 pos = v0 - (d / dot(tri.plane.xyz(), dir)) * dir;
-			if (tri.isAbove(pos)) return (BTri *) &tri;
-			if (back != NULL){
-				BTri *tri = back->intersectsCached(v0, v1, dir);
-				if (tri) return tri;
-			}
-		}
-	} else {
-		if (back != NULL){
-			BTri *tri = back->intersectsCached(v0, v1, dir);
-			if (tri) return tri;
-		}
-		if (planeDistance(tri.plane, v1) > 0){
-			vec3 pos = v0 - (d / dot(tri.plane.xyz(), dir)) * dir;
-			if (tri.isAbove(pos)) return (BTri *) &tri;
-			if (front != NULL){
-				BTri *tri = front->intersectsCached(v0, v1, dir);
-				if (tri) return tri;
-			}
-		}
-	}
-
-	return NULL;
-}
-
-#ifdef USE_SIMD
-bool BNode::intersects3DNow(const vec4 &v0, const vec4 &v1, const vec4 &dir) const {
-	v2sf planeXY = ((v2sf *) &tri.plane)[0];
-	v2sf planeZD = ((v2sf *) &tri.plane)[1];
-
-	v2sf v0XY = ((v2sf *) &v0)[0];
-	v2sf v0Z1 = ((v2sf *) &v0)[1];
-
-	v2sf dotXY = pfmul(planeXY, v0XY);
-	v2sf dotZD = pfmul(planeZD, v0Z1);
-	v2sf dotD = pfacc(dotXY, dotZD);
-	dotD = pfacc(dotD, dotD);
-
-	int d = _m_to_int(dotD);
-
-	if (d > 0){
-		if (front != NULL && front->intersects3DNow(v0, v1, dir)) return true;
-
-		v2sf dotXY = pfmul(planeXY, ((v2sf *) &v1)[0]);
-		v2sf dotZD = pfmul(planeZD, ((v2sf *) &v1)[1]);
-		v2sf dot = pfacc(dotXY, dotZD);
-		dot = pfacc(dot, dot);
-
-		int d = _m_to_int(dot);
-		if (d < 0){
-			v2sf dirXY = ((v2sf *) &dir)[0];
-			v2sf dirZ0 = ((v2sf *) &dir)[1];
-
-			v2sf dotXY = pfmul(planeXY, dirXY);
-			v2sf dotZ0 = pfmul(planeZD, dirZ0);
-			v2sf dot = pfacc(dotXY, dotZ0);
-			dot = pfacc(dot, dot);
-			dot = pfrcp(dot);
-			dot = pfmul(dot, dotD);
-
-			dirXY = pfmul(dirXY, dot);
-			dirZ0 = pfmul(dirZ0, dot);
-
-			v0XY = pfsub(v0XY, dirXY);
-			v0Z1 = pfsub(v0Z1, dirZ0);
-
-			if (tri.isAbove3DNow(v0XY, v0Z1)){
-				return true;
-			}
-
-			if (back != NULL && back->intersects3DNow(v0, v1, dir)) return true;
-		}
-
-	} else {
-		if (back != NULL && back->intersects3DNow(v0, v1, dir)) return true;
-
-		v2sf dotXY = pfmul(planeXY, ((v2sf *) &v1)[0]);
-		v2sf dotZD = pfmul(planeZD, ((v2sf *) &v1)[1]);
-		v2sf dot = pfacc(dotXY, dotZD);
-		dot = pfacc(dot, dot);
-		
-		int d = _m_to_int(dot);
-		if (d > 0){
-			v2sf dirXY = ((v2sf *) &dir)[0];
-			v2sf dirZ0 = ((v2sf *) &dir)[1];
-
-			v2sf dotXY = pfmul(planeXY, dirXY);
-			v2sf dotZ0 = pfmul(planeZD, dirZ0);
-			v2sf dot = pfacc(dotXY, dotZ0);
-			dot = pfacc(dot, dot);
-			dot = pfrcp(dot);
-			dot = pfmul(dot, dotD);
-
-			dirXY = pfmul(dirXY, dot);
-			dirZ0 = pfmul(dirZ0, dot);
-
-			v0XY = pfsub(v0XY, dirXY);
-			v0Z1 = pfsub(v0Z1, dirZ0);
-
-			if (tri.isAbove3DNow(v0XY, v0Z1)){
-				return true;
-			}
-			if (front != NULL && front->intersects3DNow(v0, v1, dir)) return true;
-		}
-	}
-	return false;
-}
-#endif
-
 no_alias bool BNode::pushSphere(vec3 &pos, const float radius) const {
 	float d = planeDistance(tri.plane, pos);
 
@@ -491,14 +369,12 @@ void BNode::read(FILE *file){
 	} else front = NULL;
 }
 
-void BNode::write(FILE *file) const {
-	fwrite(&tri.v, sizeof(tri.v), 1, file);
-	int flags = 0;
-	if (back) flags |= 1;
-	if (front) flags |= 2;
-	fwrite(&flags, sizeof(int), 1, file);
-	if (back) back->write(file);
-	if (front) front->write(file);
+uint BNode::getNodeCount() const {
+	uint count = 1;
+	if (back) count += back->getNodeCount();
+	if (front) count += front->getNodeCount();
+
+	return count;
 }
 /*
 void BNode::build(Array <BTri> &tris){
@@ -553,14 +429,30 @@ void BNode::build(Array <BTri> &tris){
 }
 */
 
-void BNode::build(Array <BTri> &tris, const int splitCost, const int balCost, const float epsilon){
+void BNode::split(Array <BTri> &tris, Array <BTri> &backTris, Array <BTri> &frontTris, const int splitCost, const int balCost, const float epsilon, const uint sampleCount){
+	uint count = tris.getCount();
+
+	// Score every triangle for small nodes, otherwise a fixed number of candidates.
+	// The candidates only depend on the triangles, so the tree is the same on any thread.
+	uint nCandidates = count;
+	uint random = count * 2654435761U + 1;
+	if (sampleCount > 0 && sampleCount < count) nCandidates = sampleCount;
+
 	uint index = 0;
 	int minScore = 0x7FFFFFFF;
 
-	for (uint i = 0; i < tris.getCount(); i++){
+	for (uint c = 0; c < nCandidates; c++){
+		uint i = c;
+		if (nCandidates < count){
+			random ^= random << 13;
+			random ^= random >> 17;
+			random ^= random << 5;
+			i = random % count;
+		}
+
 		int score = 0;
 		int diff = 0;
-		for (uint k = 0; k < tris.getCount(); k++){
+		for (uint k = 0; k < count; k++){
 			uint neg = 0, pos = 0;
 			for (uint j = 0; j < 3; j++){
 				float dist = planeDistance(tris[i].plane, tris[k].v[j]);
@@ -572,6 +464,9 @@ void BNode::build(Array <BTri> &tris, const int splitCost, const int balCost, co
 			} else {
 				if (neg) diff--; else diff++;
 			}
+
+			// No need to finish scoring a candidate that already lost
+			if (score >= minScore) break;
 		}
 		score += balCost * abs(diff);
 		if (score < minScore){
@@ -583,8 +478,6 @@ void BNode::build(Array <BTri> &tris, const int splitCost, const int balCost, co
 	tri = tris[index];
 	tris.fastRemove(index);
 
-	Array <BTri> backTris;
-	Array <BTri> frontTris;
 	for (uint i = 0; i < tris.getCount(); i++){
 
 		uint neg = 0, pos = 0;
@@ -613,35 +506,24 @@ void BNode::build(Array <BTri> &tris, const int splitCost, const int balCost, co
 		}
 	}
 	tris.reset();
+}
+
+void BNode::build(Array <BTri> &tris, const int splitCost, const int balCost, const float epsilon, const uint sampleCount, BNodeArena &arena){
+	Array <BTri> backTris;
+	Array <BTri> frontTris;
+	split(tris, backTris, frontTris, splitCost, balCost, epsilon, sampleCount);
 
 	if (backTris.getCount() > 0){
-		back = new BNode;
-		back->build(backTris, splitCost, balCost, epsilon);
+		back = arena.newNode();
+		back->build(backTris, splitCost, balCost, epsilon, sampleCount, arena);
 	} else back = NULL;
 
 	if (frontTris.getCount() > 0){
-		front = new BNode;
-		front->build(frontTris, splitCost, balCost, epsilon);
+		front = arena.newNode();
+		front->build(frontTris, splitCost, balCost, epsilon, sampleCount, arena);
 	} else front = NULL;
 }
 
-#ifdef USE_SIMD
-void SSENode::build(const BNode *node, SSENode *&sseDest){
-	tri.plane = loadups((const float *) &node->tri.plane);
-	for (int i = 0; i < 3; i++){
-		tri.edgePlanes[i] = loadups((const float *) &node->tri.edgePlanes[i]);
-	}
-	if (node->front){
-        front = sseDest++;
-		front->build(node->front, sseDest);
-	} else front = NULL;
-	if (node->back){
-        back = sseDest++;
-		back->build(node->back, sseDest);
-	} else back = NULL;
-}
-#endif
-
 void BSP::addTriangle(const vec3 &v0, const vec3 &v1, const vec3 &v2, void *data){
 	BTri tri;
 
@@ -655,155 +537,716 @@ void BSP::addTriangle(const vec3 &v0, const vec3 &v1, const vec3 &v2, void *data
 	tris.add(tri);
 }
 
-void BSP::build(const int splitCost, const int balCost, const float epsilon){
-//	int nTris = tris.getCount();
+#define BSP_PARALLEL_TRIS    256 // Smaller nodes are not worth a task of their own
+#define BSP_TASKS_PER_THREAD 4
 
-	top = new BNode;
-//	top->build(tris);
-	top->build(tris, splitCost, balCost, epsilon);
-/*
-	SSENode *mem = new SSENode[nTris * 4];
+// A subtree that is built as one worker pool item
+struct BSPBuildTask {
+	BNode *node;
+	Array <BTri> *tris;
+	BNodeArena *arena;
+};
 
-	sseTop = (SSENode *) ((intptr(mem) + 15) & ~intptr(0xF));
-	sseDest = sseTop + 1;
-	sseTop->build(top, sseDest);
+struct BSPBuildJob {
+	BSPBuildTask *tasks;
 
-	sseDest = mem;
-*/
+	int splitCost;
+	int balCost;
+	float epsilon;
+	uint sampleCount;
+};
+
+static void buildSubtree(void *data, const uint index){
+	BSPBuildJob *job = (BSPBuildJob *) data;
+	BSPBuildTask &task = job->tasks[index];
+
+	task.node->build(*task.tris, job->splitCost, job->balCost, job->epsilon, job->sampleCount, *task.arena);
+}
+
+void BSP::build(const int splitCost, const int balCost, const float epsilon, const uint sampleCount, WorkerPool *pool){
+	BNodeArena arena;
+	BNode *top = arena.newNode();
+
+	if (pool == NULL || pool->getThreadCount() == 0 || tris.getCount() < BSP_PARALLEL_TRIS){
+		top->build(tris, splitCost, balCost, epsilon, sampleCount, arena);
+		flatten(top);
+		return;
+	}
+
+	// Split the largest node serially until there are enough subtrees to keep all threads busy
+	Array <BSPBuildTask> tasks;
+	BSPBuildTask first = { top, &tris, NULL };
+	tasks.add(first);
+
+	uint nTasks = BSP_TASKS_PER_THREAD * (pool->getThreadCount() + 1);
+	while (tasks.getCount() < nTasks){
+		uint largest = 0;
+		for (uint i = 1; i < tasks.getCount(); i++){
+			if (tasks[i].tris->getCount() > tasks[largest].tris->getCount()) largest = i;
+		}
+		if (tasks[largest].tris->getCount() < BSP_PARALLEL_TRIS) break;
+
+		BSPBuildTask task = tasks[largest];
+		tasks.fastRemove(largest);
+
+		Array <BTri> *backTris  = new Array <BTri>;
+		Array <BTri> *frontTris = new Array <BTri>;
+		task.node->split(*task.tris, *backTris, *frontTris, splitCost, balCost, epsilon, sampleCount);
+		if (task.tris != &tris) delete task.tris;
+
+		task.node->back = NULL;
+		if (backTris->getCount() > 0){
+			BSPBuildTask back = { task.node->back = arena.newNode(), backTris, NULL };
+			tasks.add(back);
+		} else delete backTris;
+
+		task.node->front = NULL;
+		if (frontTris->getCount() > 0){
+			BSPBuildTask front = { task.node->front = arena.newNode(), frontTris, NULL };
+			tasks.add(front);
+		} else delete frontTris;
+	}
+
+	// Each subtree allocates from its own arena
+	BNodeArena *arenas = new BNodeArena[tasks.getCount()];
+	for (uint i = 0; i < tasks.getCount(); i++){
+		tasks[i].arena = &arenas[i];
+	}
+
+	BSPBuildJob job;
+	job.tasks = tasks.getArray();
+	job.splitCost = splitCost;
+	job.balCost = balCost;
+	job.epsilon = epsilon;
+	job.sampleCount = sampleCount;
+	pool->run(buildSubtree, &job, tasks.getCount());
+
+	flatten(top);
+
+	for (uint i = 0; i < tasks.getCount(); i++){
+		if (tasks[i].tris != &tris) delete tasks[i].tris;
+	}
+	delete [] arenas;
+}
+
+void BSP::flatten(const BNode *top){
+	release();
+
+	nodeCount = top->getNodeCount();
+
+	// One allocation for both arrays, with the traversal nodes aligned for SSE
+	nodeMem = new ubyte[nodeCount * (sizeof(BFlatNode) + sizeof(BTri)) + 15];
+	nodes = (BFlatNode *) ((intptr(nodeMem) + 15) & ~intptr(0xF));
+	nodeTris = (BTri *) (nodes + nodeCount);
+
+	uint dest = 0;
+	flattenNode(top, dest);
+}
+
+uint BSP::flattenNode(const BNode *node, uint &dest){
+	uint index = dest++;
+
+	const BTri &tri = node->tri;
+	BFlatNode &flat = nodes[index];
+
+	flat.plane = tri.plane;
+	for (int i = 0; i < 3; i++){
+		flat.edgeX[i] = tri.edgePlanes[i].x;
+		flat.edgeY[i] = tri.edgePlanes[i].y;
+		flat.edgeZ[i] = tri.edgePlanes[i].z;
+		flat.edgeW[i] = tri.edgePlanes[i].w;
+	}
+	flat.edgeX[3] = 0;
+	flat.edgeY[3] = 0;
+	flat.edgeZ[3] = 0;
+	flat.edgeW[3] = 1;
+	flat.pad[0] = flat.pad[1] = 0;
+
+	nodeTris[index] = tri;
+
+	flat.back  = (node->back  != NULL)? flattenNode(node->back,  dest) : BSP_NO_CHILD;
+	flat.front = (node->front != NULL)? flattenNode(node->front, dest) : BSP_NO_CHILD;
+
+	return index;
+}
+
+BNode *BSP::createTree() const {
+	if (nodes == NULL) return NULL;
+
+	return createNode(0);
+}
+
+BNode *BSP::createNode(const uint index) const {
+	BNode *node = new BNode;
+
+	node->tri = nodeTris[index];
+	node->back  = (nodes[index].back  != BSP_NO_CHILD)? createNode(nodes[index].back)  : NULL;
+	node->front = (nodes[index].front != BSP_NO_CHILD)? createNode(nodes[index].front) : NULL;
+
+	return node;
+}
+
+// The node math below uses the same operation order as planeDistance() and the BNode queries, so the results are bit exact
+#ifdef USE_SSE
+typedef __m128 BPos;
+
+static forceinline SIMD_EXACT BPos loadPos(const vec3 &v){
+	return _mm_setr_ps(v.x, v.y, v.z, 1.0f);
+}
+
+static forceinline SIMD_EXACT vec3 storePos(const BPos &pos){
+	alignment(16) float p[4];
+	_mm_store_ps(p, pos);
+	return vec3(p[0], p[1], p[2]);
+}
+
+static forceinline SIMD_EXACT float nodeDistance(const BFlatNode &node, const BPos &pos){
+	__m128 m = _mm_mul_ps(pos, _mm_load_ps(&node.plane.x));
+	__m128 d = _mm_add_ss(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1)));
+	d = _mm_add_ss(d, _mm_movehl_ps(m, m));
+	d = _mm_add_ss(d, _mm_shuffle_ps(m, m, _MM_SHUFFLE(3, 3, 3, 3)));
+	return _mm_cvtss_f32(d);
+}
+
+static forceinline SIMD_EXACT float nodeDot(const BFlatNode &node, const BPos &dir){
+	__m128 m = _mm_mul_ps(_mm_load_ps(&node.plane.x), dir);
+	__m128 d = _mm_add_ss(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1)));
+	d = _mm_add_ss(d, _mm_movehl_ps(m, m));
+	return _mm_cvtss_f32(d);
+}
+
+// All three edge planes at once, the 4th lane is a dummy plane that always passes
+static forceinline SIMD_EXACT bool nodeIsAbove(const BFlatNode &node, const BPos &pos){
+	__m128 d = _mm_add_ps(_mm_mul_ps(_mm_shuffle_ps(pos, pos, _MM_SHUFFLE(0, 0, 0, 0)), _mm_load_ps(node.edgeX)),
+	                      _mm_mul_ps(_mm_shuffle_ps(pos, pos, _MM_SHUFFLE(1, 1, 1, 1)), _mm_load_ps(node.edgeY)));
+	d = _mm_add_ps(d, _mm_mul_ps(_mm_shuffle_ps(pos, pos, _MM_SHUFFLE(2, 2, 2, 2)), _mm_load_ps(node.edgeZ)));
+	d = _mm_add_ps(d, _mm_load_ps(node.edgeW));
+
+	return (_mm_movemask_ps(_mm_cmpge_ps(d, _mm_setzero_ps())) == 0xF);
+}
+
+static forceinline SIMD_EXACT BPos hitPos(const BPos &v0, const BPos &dir, const float k){
+	return _mm_sub_ps(v0, _mm_mul_ps(dir, _mm_set1_ps(k)));
+}
+
+static forceinline SIMD_EXACT BPos pushPos(const BPos &pos, const BFlatNode &node, const float s){
+	return _mm_add_ps(pos, _mm_mul_ps(_mm_load_ps(&node.plane.x), _mm_setr_ps(s, s, s, 0.0f)));
+}
+
+#else
+typedef vec3 BPos;
+
+static forceinline BPos loadPos(const vec3 &v){ return v; }
+static forceinline vec3 storePos(const BPos &pos){ return pos; }
+
+static forceinline float nodeDistance(const BFlatNode &node, const BPos &pos){
+	return planeDistance(node.plane, pos);
+}
+
+static forceinline float nodeDot(const BFlatNode &node, const BPos &dir){
+	return dot(node.plane.xyz(), dir);
+}
+
+static forceinline bool nodeIsAbove(const BFlatNode &node, const BPos &pos){
+	for (int i = 0; i < 3; i++){
+		if (pos.x * node.edgeX[i] + pos.y * node.edgeY[i] + pos.z * node.edgeZ[i] + node.edgeW[i] < 0) return false;
+	}
+	return true;
+}
+
+static forceinline BPos hitPos(const BPos &v0, const BPos &dir, const float k){
+	return v0 - k * dir;
+}
+
+static forceinline BPos pushPos(const BPos &pos, const BFlatNode &node, const float s){
+	return pos + s * node.plane.xyz();
+}
+#endif
+
+struct SegmentQuery {
+	const BFlatNode *nodes;
+	const BTri *tris;
+
+	BPos v0, v1, dir;
+
+	vec3 *point;
+	const BTri **triangle;
+};
+
+static SIMD_EXACT bool intersectsNode(const SegmentQuery &query, const uint index){
+	const BFlatNode &node = query.nodes[index];
+	float d = nodeDistance(node, query.v0);
+
+	if (d > 0){
+		if (node.front != BSP_NO_CHILD && intersectsNode(query, node.front)) return true;
+		if (nodeDistance(node, query.v1) < 0){
+			BPos pos = hitPos(query.v0, query.dir, d / nodeDot(node, query.dir));
+			if (nodeIsAbove(node, pos)){
+				if (query.point) *query.point = storePos(pos);
+				if (query.triangle) *query.triangle = query.tris + index;
+				return true;
+			}
+			if (node.back != BSP_NO_CHILD && intersectsNode(query, node.back)) return true;
+		}
+	} else {
+		if (node.back != BSP_NO_CHILD && intersectsNode(query, node.back)) return true;
+		if (nodeDistance(node, query.v1) > 0){
+			BPos pos = hitPos(query.v0, query.dir, d / nodeDot(node, query.dir));
+			if (nodeIsAbove(node, pos)){
+				if (query.point) *query.point = storePos(pos);
+				if (query.triangle) *query.triangle = query.tris + index;
+				return true;
+			}
+			if (node.front != BSP_NO_CHILD && intersectsNode(query, node.front)) return true;
+		}
+	}
+
+	return false;
 }
 
 no_alias bool BSP::intersects(const vec3 &v0, const vec3 &v1, vec3 *point, const BTri **triangle) const {
-	if (top != NULL) return top->intersects(v0, v1, v1 - v0, point, triangle);
+	if (nodes != NULL){
+		SegmentQuery query;
+		query.nodes = nodes;
+		query.tris = nodeTris;
+		query.v0 = loadPos(v0);
+		query.v1 = loadPos(v1);
+		query.dir = loadPos(v1 - v0);
+		query.point = point;
+		query.triangle = triangle;
+
+		return intersectsNode(query, 0);
+	}
 
 	return false;
 }
 
-bool BSP::intersectsCached(const vec3 &v0, const vec3 &v1){
-	if (top != NULL){
-		if (cache){
-			if (cache->intersects(v0, v1)) return true;
+#ifdef USE_SSE
+// Four segments in SoA form, traced through the tree together
+struct SegmentPacket {
+	const BFlatNode *nodes;
+	const BTri *tris;
+
+	__m128 x0, y0, z0;
+	__m128 x1, y1, z1;
+	__m128 dx, dy, dz;
+
+	vec3 points[4];
+	const BTri *triangles[4];
+};
+
+static forceinline SIMD_EXACT __m128 planeDistance4(const vec4 &plane, const __m128 x, const __m128 y, const __m128 z){
+	// Same operation order as planeDistance() so the results are bit exact
+	__m128 d = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(plane.x)), _mm_mul_ps(y, _mm_set1_ps(plane.y)));
+	d = _mm_add_ps(d, _mm_mul_ps(z, _mm_set1_ps(plane.z)));
+	return _mm_add_ps(d, _mm_set1_ps(plane.w));
+}
+
+static forceinline SIMD_EXACT __m128 edgeDistance4(const BFlatNode &node, const int i, const __m128 x, const __m128 y, const __m128 z){
+	__m128 d = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(node.edgeX[i])), _mm_mul_ps(y, _mm_set1_ps(node.edgeY[i])));
+	d = _mm_add_ps(d, _mm_mul_ps(z, _mm_set1_ps(node.edgeZ[i])));
+	return _mm_add_ps(d, _mm_set1_ps(node.edgeW[i]));
+}
+
+// Returns the mask of active lanes that hit. Each lane visits the nodes in the same order as BNode::intersects().
+static SIMD_EXACT int intersectsPacket(SegmentPacket &packet, const uint index, const int active){
+	const BFlatNode &node = packet.nodes[index];
+	__m128 zero = _mm_setzero_ps();
+
+	__m128 d = planeDistance4(node.plane, packet.x0, packet.y0, packet.z0);
+	int frontFirst = _mm_movemask_ps(_mm_cmpgt_ps(d, zero)) & active;
+	int backFirst  = active & ~frontFirst;
+
+	int hits = 0;
+	if (frontFirst && node.front != BSP_NO_CHILD) hits |= intersectsPacket(packet, node.front, frontFirst);
+	if (backFirst  && node.back  != BSP_NO_CHILD) hits |= intersectsPacket(packet, node.back,  backFirst);
+
+	// Segments that cross the plane and missed on the near side
+	__m128 d1 = planeDistance4(node.plane, packet.x1, packet.y1, packet.z1);
+	int crossing = (_mm_movemask_ps(_mm_cmplt_ps(d1, zero)) & frontFirst) | (_mm_movemask_ps(_mm_cmpgt_ps(d1, zero)) & backFirst);
+	crossing &= ~hits;
+	if (crossing == 0) return hits;
+
+	__m128 nd = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(node.plane.x), packet.dx), _mm_mul_ps(_mm_set1_ps(node.plane.y), packet.dy));
+	nd = _mm_add_ps(nd, _mm_mul_ps(_mm_set1_ps(node.plane.z), packet.dz));
+	__m128 k = _mm_div_ps(d, nd);
+
+	__m128 x = _mm_sub_ps(packet.x0, _mm_mul_ps(packet.dx, k));
+	__m128 y = _mm_sub_ps(packet.y0, _mm_mul_ps(packet.dy, k));
+	__m128 z = _mm_sub_ps(packet.z0, _mm_mul_ps(packet.dz, k));
+
+	__m128 above = _mm_cmpge_ps(edgeDistance4(node, 0, x, y, z), zero);
+	above = _mm_and_ps(above, _mm_cmpge_ps(edgeDistance4(node, 1, x, y, z), zero));
+	above = _mm_and_ps(above, _mm_cmpge_ps(edgeDistance4(node, 2, x, y, z), zero));
+
+	int hitHere = _mm_movemask_ps(above) & crossing;
+	if (hitHere){
+		alignment(16) float px[4], py[4], pz[4];
+		_mm_store_ps(px, x);
+		_mm_store_ps(py, y);
+		_mm_store_ps(pz, z);
+		for (int i = 0; i < 4; i++){
+			if (hitHere & (1 << i)){
+				packet.points[i] = vec3(px[i], py[i], pz[i]);
+				packet.triangles[i] = packet.tris + index;
+			}
 		}
-		cache = top->intersectsCached(v0, v1, v1 - v0);
-		return (cache != NULL);
+		hits |= hitHere;
+		crossing &= ~hitHere;
 	}
 
-	return false;
+	// Continue on the far side
+	int backAfter  = crossing & frontFirst;
+	int frontAfter = crossing & backFirst;
+	if (backAfter  && node.back  != BSP_NO_CHILD) hits |= intersectsPacket(packet, node.back,  backAfter);
+	if (frontAfter && node.front != BSP_NO_CHILD) hits |= intersectsPacket(packet, node.front, frontAfter);
+
+	return hits;
 }
+#endif
 
-#ifdef USE_SIMD
-bool BSP::intersects3DNow(const vec3 &v0, const vec3 &v1) const {
-	if (top != NULL){
-		femms();
+uint BSP::intersectsBatch(const vec3 *v0, const vec3 *v1, const uint count, bool *hits, vec3 *points, const BTri **triangles) const {
+	uint nHits = 0;
 
-		vec4 v04 = vec4(v0, 1);
-		vec4 v14 = vec4(v1, 1);
+#ifdef USE_SSE
+	for (uint i = 0; i < count; i += 4){
+		uint n = min(count - i, 4U);
 
-		bool result = top->intersects3DNow(v04, v14, v14 - v04);
+		if (nodes == NULL){
+			for (uint j = 0; j < n; j++) hits[i + j] = false;
+			continue;
+		}
 
-		femms();
-		return result;
+		// Transpose into SoA, unused lanes are left inactive
+		alignment(16) float x0[4] = {}, y0[4] = {}, z0[4] = {};
+		alignment(16) float x1[4] = {}, y1[4] = {}, z1[4] = {};
+		for (uint j = 0; j < n; j++){
+			x0[j] = v0[i + j].x;
+			y0[j] = v0[i + j].y;
+			z0[j] = v0[i + j].z;
+			x1[j] = v1[i + j].x;
+			y1[j] = v1[i + j].y;
+			z1[j] = v1[i + j].z;
+		}
+
+		SegmentPacket packet;
+		packet.nodes = nodes;
+		packet.tris = nodeTris;
+		packet.x0 = _mm_load_ps(x0);
+		packet.y0 = _mm_load_ps(y0);
+		packet.z0 = _mm_load_ps(z0);
+		packet.x1 = _mm_load_ps(x1);
+		packet.y1 = _mm_load_ps(y1);
+		packet.z1 = _mm_load_ps(z1);
+		packet.dx = _mm_sub_ps(packet.x1, packet.x0);
+		packet.dy = _mm_sub_ps(packet.y1, packet.y0);
+		packet.dz = _mm_sub_ps(packet.z1, packet.z0);
+
+		int mask = intersectsPacket(packet, 0, (1 << n) - 1);
+
+		for (uint j = 0; j < n; j++){
+			hits[i + j] = (mask & (1 << j)) != 0;
+			if (hits[i + j]){
+				if (points) points[i + j] = packet.points[j];
+				if (triangles) triangles[i + j] = packet.triangles[j];
+				nHits++;
+			}
+		}
+	}
+#else
+	for (uint i = 0; i < count; i++){
+		hits[i] = intersects(v0[i], v1[i], points? &points[i] : NULL, triangles? &triangles[i] : NULL);
+		if (hits[i]) nHits++;
+	}
+#endif
+
+	return nHits;
+}
+
+bool BSP::intersectsCached(BSPQueryContext &context, const vec3 &v0, const vec3 &v1) const {
+	if (nodes != NULL){
+		if (context.cache){
+			if (context.cache->intersects(v0, v1)) return true;
+		}
+		if (!intersects(v0, v1, NULL, &context.cache)) context.cache = NULL;
+		return (context.cache != NULL);
 	}
 
 	return false;
 }
-#endif
+
+static SIMD_EXACT bool pushSphereNode(const BFlatNode *nodes, const uint index, BPos &pos, const float radius){
+	const BFlatNode &node = nodes[index];
+	float d = nodeDistance(node, pos);
+
+	bool pushed = false;
+	if (fabsf(d) < radius){
+		if (nodeIsAbove(node, pos)){
+			pos = pushPos(pos, node, radius - d);
+			pushed = true;
+		}
+	}
+
+	if (node.front != BSP_NO_CHILD && d > -radius) pushed |= pushSphereNode(nodes, node.front, pos, radius);
+	if (node.back  != BSP_NO_CHILD && d <  radius) pushed |= pushSphereNode(nodes, node.back,  pos, radius);
+
+	return pushed;
+}
 
 bool BSP::pushSphere(vec3 &pos, const float radius) const {
-	if (top != NULL) return top->pushSphere(pos, radius);
+	if (nodes != NULL){
+		BPos p = loadPos(pos);
+		bool pushed = pushSphereNode(nodes, 0, p, radius);
+		pos = storePos(p);
+
+		return pushed;
+	}
 
 	return false;
 }
 
+static SIMD_EXACT void getDistanceNode(const BFlatNode *nodes, const BTri *tris, const uint index, const vec3 &pos, float &minDist){
+	const BFlatNode &node = nodes[index];
+	float d = exactPlaneDistance(node.plane, pos);
+
+	float dist = tris[index].getDistance(pos);
+	if (dist < minDist){
+		minDist = dist;
+	}
+	
+	if (node.back != BSP_NO_CHILD && d < minDist){
+		getDistanceNode(nodes, tris, node.back, pos, minDist);
+	}
+
+	if (node.front != BSP_NO_CHILD && -d < minDist){
+		getDistanceNode(nodes, tris, node.front, pos, minDist);
+	}
+}
+
 no_alias float BSP::getDistance(const vec3 &pos) const {
 	float dist = FLT_MAX;
 
-	if (top != NULL) top->getDistance(pos, dist);
+	if (nodes != NULL) getDistanceNode(nodes, nodeTris, 0, pos, dist);
 
 	return dist;
 }
 
 
-no_alias bool BSP::isInOpenSpace(const vec3 &pos) const {
-	if (top != NULL){
+#ifdef USE_SSE
+// Four spheres in SoA form, traced through the tree together
+struct SpherePacket {
+	const BFlatNode *nodes;
+	const BTri *tris;
 
-		BNode *node = top;
-		while (true){
-			float d = planeDistance(node->tri.plane, pos);
+	__m128 x, y, z;
+	__m128 radius;
+	__m128 minDist;
+};
 
-			if (d > 0){
-				if (node->front){
-					node = node->front;
-				} else return true;
-			} else {
-				if (node->back){
-					node = node->back;
-				} else return false;
-			}
+static forceinline SIMD_EXACT __m128 select4(const __m128 mask, const __m128 a, const __m128 b){
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static forceinline SIMD_EXACT __m128 laneMask(const int mask){
+	return _mm_castsi128_ps(_mm_setr_epi32(-(mask & 1), -((mask >> 1) & 1), -((mask >> 2) & 1), -((mask >> 3) & 1)));
+}
+
+// Each lane visits the nodes in the same order as pushSphereNode() and moves the same way
+static SIMD_EXACT int pushSpherePacket(SpherePacket &packet, const uint index, const int active){
+	const BFlatNode &node = packet.nodes[index];
+	__m128 zero = _mm_setzero_ps();
+	__m128 signBit = _mm_set1_ps(-0.0f);
+
+	__m128 d = planeDistance4(node.plane, packet.x, packet.y, packet.z);
+
+	int pushed = 0;
+	int close = _mm_movemask_ps(_mm_cmplt_ps(_mm_andnot_ps(signBit, d), packet.radius)) & active;
+	if (close){
+		__m128 above = _mm_cmpge_ps(edgeDistance4(node, 0, packet.x, packet.y, packet.z), zero);
+		above = _mm_and_ps(above, _mm_cmpge_ps(edgeDistance4(node, 1, packet.x, packet.y, packet.z), zero));
+		above = _mm_and_ps(above, _mm_cmpge_ps(edgeDistance4(node, 2, packet.x, packet.y, packet.z), zero));
+
+		pushed = _mm_movemask_ps(above) & close;
+		if (pushed){
+			__m128 mask = laneMask(pushed);
+			__m128 s = _mm_sub_ps(packet.radius, d);
+			packet.x = select4(mask, _mm_add_ps(packet.x, _mm_mul_ps(_mm_set1_ps(node.plane.x), s)), packet.x);
+			packet.y = select4(mask, _mm_add_ps(packet.y, _mm_mul_ps(_mm_set1_ps(node.plane.y), s)), packet.y);
+			packet.z = select4(mask, _mm_add_ps(packet.z, _mm_mul_ps(_mm_set1_ps(node.plane.z), s)), packet.z);
 		}
 	}
 
-	return false;
+	int front = _mm_movemask_ps(_mm_cmpgt_ps(d, _mm_xor_ps(packet.radius, signBit))) & active;
+	int back  = _mm_movemask_ps(_mm_cmplt_ps(d, packet.radius)) & active;
+	if (front && node.front != BSP_NO_CHILD) pushed |= pushSpherePacket(packet, node.front, front);
+	if (back  && node.back  != BSP_NO_CHILD) pushed |= pushSpherePacket(packet, node.back,  back);
+
+	return pushed;
 }
 
-#ifdef USE_SIMD
-bool BSP::isInOpenSpace3DNow(const vec3 &pos) const {
-	if (top != NULL){
-		SSENode *node = sseTop;
-		femms();
+// BTri::getDistance() for four points, with the same operation order
+static SIMD_EXACT __m128 triDistance4(const BTri &tri, const __m128 x, const __m128 y, const __m128 z){
+	__m128 zero = _mm_setzero_ps();
+	__m128 one = _mm_set1_ps(1.0f);
 
-		v2sf posXY, posZ1;
-		posXY = *(v2sf *) &pos.x;
-		posZ1.m64_f32[0] = pos.z;
-		posZ1.m64_f32[1] = 1.0f;
+	__m128 dist = _mm_andnot_ps(_mm_set1_ps(-0.0f), planeDistance4(tri.plane, x, y, z));
 
-		while (true){
-			v2sf planeXY = ((v2sf *) &node->tri.plane)[0];
-			v2sf planeZD = ((v2sf *) &node->tri.plane)[1];
+	// The first edge a point is outside of decides which edge it is projected on
+	int done = 0;
+	int k = 2;
+	for (int i = 0; i < 3; i++){
+		int outside = _mm_movemask_ps(_mm_cmplt_ps(planeDistance4(tri.edgePlanes[i], x, y, z), zero)) & ~done;
+		if (outside){
+			vec3 dir = tri.v[i] - tri.v[k];
+			__m128 dirX = _mm_set1_ps(dir.x);
+			__m128 dirY = _mm_set1_ps(dir.y);
+			__m128 dirZ = _mm_set1_ps(dir.z);
+
+			__m128 px = _mm_sub_ps(x, _mm_set1_ps(tri.v[k].x));
+			__m128 py = _mm_sub_ps(y, _mm_set1_ps(tri.v[k].y));
+			__m128 pz = _mm_sub_ps(z, _mm_set1_ps(tri.v[k].z));
+			__m128 c = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dirX, px), _mm_mul_ps(dirY, py)), _mm_mul_ps(dirZ, pz));
+			c = _mm_div_ps(c, _mm_set1_ps(exactDot(dir, dir)));
+
+			// Clamp to the end points
+			__m128 atEnd = _mm_cmpge_ps(c, one);
+			__m128 inside = _mm_cmpgt_ps(c, zero);
+			__m128 qx = select4(atEnd, _mm_set1_ps(tri.v[i].x), select4(inside, _mm_add_ps(_mm_set1_ps(tri.v[k].x), _mm_mul_ps(dirX, c)), _mm_set1_ps(tri.v[k].x)));
+			__m128 qy = select4(atEnd, _mm_set1_ps(tri.v[i].y), select4(inside, _mm_add_ps(_mm_set1_ps(tri.v[k].y), _mm_mul_ps(dirY, c)), _mm_set1_ps(tri.v[k].y)));
+			__m128 qz = select4(atEnd, _mm_set1_ps(tri.v[i].z), select4(inside, _mm_add_ps(_mm_set1_ps(tri.v[k].z), _mm_mul_ps(dirZ, c)), _mm_set1_ps(tri.v[k].z)));
+
+			__m128 dx = _mm_sub_ps(x, qx);
+			__m128 dy = _mm_sub_ps(y, qy);
+			__m128 dz = _mm_sub_ps(z, qz);
+			__m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+
+			dist = select4(laneMask(outside), len, dist);
+			done |= outside;
+		}
 
-			v2sf dotXY = pfmul(planeXY, posXY);
-			v2sf dotZD = pfmul(planeZD, posZ1);
-			v2sf dot = pfacc(dotXY, dotZD);
-			dot = pfacc(dot, dot);
+		k = i;
+	}
 
-			int d = _m_to_int(dot);
+	return dist;
+}
 
-			if (d > 0){
-				if (node->front){
-					node = node->front;
-				} else {
-					femms();
-					return true;
-				}
-			} else {
-				if (node->back){
-					node = node->back;
-				} else {
-					femms();
-					return false;
-				}
+// Each lane visits the nodes in the same order as getDistanceNode()
+static SIMD_EXACT void getDistancePacket(SpherePacket &packet, const uint index, const int active){
+	const BFlatNode &node = packet.nodes[index];
+
+	__m128 d = planeDistance4(node.plane, packet.x, packet.y, packet.z);
+
+	__m128 dist = triDistance4(packet.tris[index], packet.x, packet.y, packet.z);
+	packet.minDist = select4(_mm_and_ps(laneMask(active), _mm_cmplt_ps(dist, packet.minDist)), dist, packet.minDist);
+
+	int back = _mm_movemask_ps(_mm_cmplt_ps(d, packet.minDist)) & active;
+	if (back && node.back != BSP_NO_CHILD) getDistancePacket(packet, node.back, back);
+
+	int front = _mm_movemask_ps(_mm_cmplt_ps(_mm_xor_ps(d, _mm_set1_ps(-0.0f)), packet.minDist)) & active;
+	if (front && node.front != BSP_NO_CHILD) getDistancePacket(packet, node.front, front);
+}
+
+static void loadSpherePacket(SpherePacket &packet, const vec3 *positions, const float *radii, const uint n){
+	alignment(16) float x[4] = {}, y[4] = {}, z[4] = {}, r[4] = {};
+	for (uint j = 0; j < n; j++){
+		x[j] = positions[j].x;
+		y[j] = positions[j].y;
+		z[j] = positions[j].z;
+		if (radii) r[j] = radii[j];
+	}
+
+	packet.x = _mm_load_ps(x);
+	packet.y = _mm_load_ps(y);
+	packet.z = _mm_load_ps(z);
+	packet.radius = _mm_load_ps(r);
+	packet.minDist = _mm_set1_ps(FLT_MAX);
+}
+#endif
+
+uint BSP::pushSpheres(vec3 *positions, const float *radii, const uint count, bool *pushed) const {
+	uint nPushed = 0;
+
+#ifdef USE_SSE
+	for (uint i = 0; i < count; i += 4){
+		uint n = min(count - i, 4U);
+
+		int mask = 0;
+		if (nodes != NULL){
+			SpherePacket packet;
+			packet.nodes = nodes;
+			packet.tris = nodeTris;
+			loadSpherePacket(packet, positions + i, radii + i, n);
+
+			mask = pushSpherePacket(packet, 0, (1 << n) - 1);
+
+			alignment(16) float x[4], y[4], z[4];
+			_mm_store_ps(x, packet.x);
+			_mm_store_ps(y, packet.y);
+			_mm_store_ps(z, packet.z);
+			for (uint j = 0; j < n; j++){
+				positions[i + j] = vec3(x[j], y[j], z[j]);
 			}
 		}
+
+		for (uint j = 0; j < n; j++){
+			bool p = (mask & (1 << j)) != 0;
+			if (pushed) pushed[i + j] = p;
+			if (p) nPushed++;
+		}
+	}
+#else
+	for (uint i = 0; i < count; i++){
+		bool p = pushSphere(positions[i], radii[i]);
+		if (pushed) pushed[i] = p;
+		if (p) nPushed++;
 	}
+#endif
 
-	return false;
+	return nPushed;
 }
 
-bool BSP::isInOpenSpaceSSE(const vec3 &pos) const {
-	if (top != NULL){
-		v4sf zero = setzerops();
-		v4sf pos4 = loadups((const float *) &vec4(pos, 1));
+void BSP::getDistances(const vec3 *positions, const uint count, float *distances) const {
+#ifdef USE_SSE
+	for (uint i = 0; i < count; i += 4){
+		uint n = min(count - i, 4U);
+
+		alignment(16) float dist[4] = { FLT_MAX, FLT_MAX, FLT_MAX, FLT_MAX };
+		if (nodes != NULL){
+			SpherePacket packet;
+			packet.nodes = nodes;
+			packet.tris = nodeTris;
+			loadSpherePacket(packet, positions + i, NULL, n);
 
-		SSENode *node = sseTop;
+			getDistancePacket(packet, 0, (1 << n) - 1);
+			_mm_store_ps(dist, packet.minDist);
+		}
+
+		for (uint j = 0; j < n; j++){
+			distances[i + j] = dist[j];
+		}
+	}
+#else
+	for (uint i = 0; i < count; i++){
+		distances[i] = getDistance(positions[i]);
+	}
+#endif
+}
+
+no_alias bool BSP::isInOpenSpace(const vec3 &pos) const {
+	if (nodes != NULL){
+		BPos p = loadPos(pos);
+
+		const BFlatNode *node = nodes;
 		while (true){
-			v4sf d = dot4(node->tri.plane, pos4);
+			float d = nodeDistance(*node, p);
 
-			if (comigt(d, zero)){
-				if (node->front){
-					node = node->front;
+			if (d > 0){
+				if (node->front != BSP_NO_CHILD){
+					node = nodes + node->front;
 				} else return true;
 			} else {
-				if (node->back){
-					node = node->back;
+				if (node->back != BSP_NO_CHILD){
+					node = nodes + node->back;
 				} else return false;
 			}
 		}
@@ -811,33 +1254,198 @@ bool BSP::isInOpenSpaceSSE(const vec3 &pos) const {
 
 	return false;
 }
-#endif
 
 bool BSP::loadFile(const char *fileName){
 	FILE *file = fopen(fileName, "rb");
 	if (file == NULL) return false;
 
-	delete top;
-
-	top = new BNode;
+	BNode *top = new BNode;
 	top->read(file);
 	fclose(file);
 
+	flatten(top);
+	delete top;
+
 	return true;
 }
 
+void BSP::writeNode(FILE *file, const uint index) const {
+	fwrite(&nodeTris[index].v, sizeof(nodeTris[index].v), 1, file);
+	int flags = 0;
+	if (nodes[index].back  != BSP_NO_CHILD) flags |= 1;
+	if (nodes[index].front != BSP_NO_CHILD) flags |= 2;
+	fwrite(&flags, sizeof(int), 1, file);
+	if (flags & 1) writeNode(file, nodes[index].back);
+	if (flags & 2) writeNode(file, nodes[index].front);
+}
+
 bool BSP::saveFile(const char *fileName) const {
-	if (top == NULL) return false;
+	if (nodes == NULL) return false;
 
 	FILE *file = fopen(fileName, "wb");
 	if (file == NULL) return false;
 
-	top->write(file);
+	writeNode(file, 0);
 	fclose(file);
 
 	return true;
 }
 
+#define BSP_CACHE_VERSION 1
+
+// The nodes and triangles follow the header, the nodes at a 16 byte aligned offset
+struct BSPCacheHeader {
+	uint id;
+	uint version;
+	uint nodeSize;
+	uint triSize;
+	uint64 key;
+	uint nodeCount;
+	uint nodeOffset;
+	uint triOffset;
+	uint pad[7];
+};
+
+void BSP::release(){
+	delete [] nodeMem;
+	nodeMem = NULL;
+
+	if (mapMem){
+		unmapFile(mapMem, mapSize);
+		mapMem = NULL;
+		mapSize = 0;
+	}
+
+	nodes = NULL;
+	nodeTris = NULL;
+	nodeCount = 0;
+}
+
+uint64 BSP::getBuildKey(const int splitCost, const int balCost, const float epsilon, const uint sampleCount) const {
+	// 64 bit FNV-1a of the triangle vertices and the build parameters
+	uint64 key = 14695981039346656037ULL;
+
+	for (uint i = 0; i < tris.getCount(); i++){
+		const ubyte *data = (const ubyte *) tris[i].v;
+		for (uint j = 0; j < sizeof(tris[i].v); j++){
+			key = (key ^ data[j]) * 1099511628211ULL;
+		}
+	}
+
+	int params[4] = { splitCost, balCost, 0, int(sampleCount) };
+	memcpy(&params[2], &epsilon, sizeof(float));
+
+	const ubyte *data = (const ubyte *) params;
+	for (uint j = 0; j < sizeof(params); j++){
+		key = (key ^ data[j]) * 1099511628211ULL;
+	}
+
+	return key;
+}
+
+static bool validCacheNodes(const BFlatNode *nodes, const uint nodeCount){
+	// The nodes are stored in pre-order, so a child always comes after its parent. Checking that
+	// also rules out loops, which would otherwise send the queries round forever.
+	for (uint i = 0; i < nodeCount; i++){
+		if (nodes[i].back  != BSP_NO_CHILD && (nodes[i].back  <= i || nodes[i].back  >= nodeCount)) return false;
+		if (nodes[i].front != BSP_NO_CHILD && (nodes[i].front <= i || nodes[i].front >= nodeCount)) return false;
+	}
+	return true;
+}
+
+bool BSP::mapCache(const char *fileName, const uint64 key){
+	size_t size = 0;
+	void *mem = mapFile(fileName, size);
+	if (mem == NULL) return false;
+
+	// Anything that does not match exactly is a stale or foreign cache. The sizes are checked
+	// by dividing down the space left after each offset, so a large count cannot wrap around.
+	const BSPCacheHeader *header = (const BSPCacheHeader *) mem;
+	if (size < sizeof(BSPCacheHeader) ||
+		header->id != MCHAR4('B', 'S', 'P', 'C') || header->version != BSP_CACHE_VERSION ||
+		header->nodeSize != sizeof(BFlatNode) || header->triSize != sizeof(BTri) ||
+		header->key != key || header->nodeCount == 0 ||
+		(header->nodeOffset & 0xF) != 0 || (header->triOffset & 0xF) != 0 ||
+		header->nodeOffset < sizeof(BSPCacheHeader) || header->nodeOffset > size ||
+		header->triOffset < sizeof(BSPCacheHeader) || header->triOffset > size ||
+		header->nodeCount > (size - header->nodeOffset) / sizeof(BFlatNode) ||
+		header->nodeCount > (size - header->triOffset) / sizeof(BTri) ||
+		!validCacheNodes((const BFlatNode *) ((ubyte *) mem + header->nodeOffset), header->nodeCount)){
+
+		unmapFile(mem, size);
+		return false;
+	}
+
+	release();
+
+	mapMem = mem;
+	mapSize = size;
+	nodeCount = header->nodeCount;
+	nodes = (BFlatNode *) ((ubyte *) mem + header->nodeOffset);
+	nodeTris = (BTri *) ((ubyte *) mem + header->triOffset);
+
+	return true;
+}
+
+bool BSP::saveCache(const char *fileName, const uint64 key) const {
+	if (nodes == NULL) return false;
+
+	// Write to a temporary file and swap it in, so a mapping of the old file is never truncated
+	String tmpName(fileName);
+	tmpName += ".tmp";
+
+	FILE *file = fopen(tmpName, "wb");
+	if (file == NULL) return false;
+
+	BSPCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	header.id = MCHAR4('B', 'S', 'P', 'C');
+	header.version = BSP_CACHE_VERSION;
+	header.nodeSize = sizeof(BFlatNode);
+	header.triSize = sizeof(BTri);
+	header.key = key;
+	header.nodeCount = nodeCount;
+	header.nodeOffset = sizeof(BSPCacheHeader);
+	header.triOffset = header.nodeOffset + nodeCount * sizeof(BFlatNode);
+
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(nodes, sizeof(BFlatNode), nodeCount, file);
+
+	// The data pointers are meaningless in another process
+	for (uint i = 0; i < nodeCount; i++){
+		BTri tri = nodeTris[i];
+		tri.data = NULL;
+		fwrite(&tri, sizeof(BTri), 1, file);
+	}
+	bool written = (ferror(file) == 0);
+	fclose(file);
+
+#ifdef _WIN32
+	// Fails if the old file is still mapped, the cache is then just not updated
+	remove(fileName);
+#endif
+	if (!written || rename(tmpName, fileName) != 0){
+		remove(tmpName);
+		return false;
+	}
+
+	return true;
+}
+
+bool BSP::buildCached(const char *fileName, const int splitCost, const int balCost, const float epsilon, const uint sampleCount, WorkerPool *pool){
+	uint64 key = getBuildKey(splitCost, balCost, epsilon, sampleCount);
+
+	if (mapCache(fileName, key)){
+		tris.reset();
+		return true;
+	}
+
+	build(splitCost, balCost, epsilon, sampleCount, pool);
+	saveCache(fileName, key);
+
+	return false;
+}
+
 #ifdef _WIN32
 #pragma warning(pop)
 #endif
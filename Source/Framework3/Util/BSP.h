@@ -16,13 +16,10 @@
 #ifndef _BSP_H_
 #define _BSP_H_
 
-#ifdef USE_SIMD
-#include "../Math/SIMD.h"
-#endif
-
 #include "../Platform.h"
 #include "../Math/Vector.h"
 #include "Array.h"
+#include "WorkerPool.h"
 #include <stdio.h>
 
 
@@ -33,9 +30,6 @@ struct BTri {
 	bool intersects(const vec3 &v0, const vec3 &v1) const;
 
 	bool isAbove(const vec3 &pos) const;
-#ifdef USE_SIMD
-	bool isAbove3DNow(v2sf v0XY, v2sf v0Z1) const;
-#endif
 	float getDistance(const vec3 &pos) const;
 
 	vec4 plane;
@@ -51,23 +45,27 @@ struct BTri {
 	void *data;
 };
 
+// Pointer tree used while building, BSP queries run on the flattened nodes.
+// The queries are kept as a reference implementation.
+class BNodeArena;
+
 struct BNode {
 	~BNode();
 
 	bool intersects(const vec3 &v0, const vec3 &v1, const vec3 &dir, vec3 *point, const BTri **triangle) const;
-	BTri *intersectsCached(const vec3 &v0, const vec3 &v1, const vec3 &dir) const;
-#ifdef USE_SIMD
-	bool intersects3DNow(const vec4 &v0, const vec4 &v1, const vec4 &dir) const;
-#endif
 
 	bool pushSphere(vec3 &pos, const float radius) const;
 	void getDistance(const vec3 &pos, float &minDist) const;
 
-	void build(Array <BTri> &tris, const int splitCost, const int balCost, const float epsilon);
+	void build(Array <BTri> &tris, const int splitCost, const int balCost, const float epsilon, const uint sampleCount, BNodeArena &arena);
 	//void build(Array <BTri> &tris);
 
+	// Picks the splitting triangle and distributes the rest of the triangles on either side
+	void split(Array <BTri> &tris, Array <BTri> &backTris, Array <BTri> &frontTris, const int splitCost, const int balCost, const float epsilon, const uint sampleCount);
+
+	uint getNodeCount() const;
+
 	void read(FILE *file);
-	void write(FILE *file) const;
 
 	
 	BNode *back;
@@ -76,68 +74,130 @@ struct BNode {
 	BTri tri;
 };
 
-#ifdef USE_SIMD
-struct SSETri {
-    v4sf plane;
-	v4sf edgePlanes[3];
+#define BNODE_ARENA_BLOCK 1024
+
+// Allocates build nodes in blocks that are freed together. Nodes from an arena must never be deleted.
+class BNodeArena {
+public:
+	BNodeArena(){
+		used = BNODE_ARENA_BLOCK;
+	}
+	~BNodeArena(){
+		for (uint i = 0; i < blocks.getCount(); i++){
+			free(blocks[i]);
+		}
+	}
+
+	BNode *newNode(){
+		if (used == BNODE_ARENA_BLOCK){
+			blocks.add((BNode *) malloc(BNODE_ARENA_BLOCK * sizeof(BNode)));
+			used = 0;
+		}
+		return blocks[blocks.getCount() - 1] + used++;
+	}
+
+protected:
+	Array <BNode *> blocks;
+	uint used;
 };
 
-align(16) struct SSENode {
-	SSETri tri;
+#define BSP_NO_CHILD 0xFFFFFFFF
 
-	SSENode *back;
-	SSENode *front;
+// Number of candidate splitting planes scored at each node, zero scores every triangle
+#define BSP_DEFAULT_SAMPLES 32
 
-    void build(const BNode *node, SSENode *&sseDest);
+// Traversal data of a flattened node. Nodes are stored depth-first, the back subtree directly after its parent.
+// The triangle vertices and user data are kept in a separate array since they are rarely touched.
+struct BFlatNode {
+	vec4 plane;
+	float edgeX[4], edgeY[4], edgeZ[4], edgeW[4]; // The edge planes in SoA form, the 4th plane always passes
+
+	uint back, front;
+	uint pad[2];
+};
+
+// Per-thread query state. The BSP itself is not changed by queries, so any number of threads
+// can query it at once as long as each uses its own context. Reset the context if the BSP is rebuilt.
+struct BSPQueryContext {
+	BSPQueryContext(){
+		cache = NULL;
+	}
+	void reset(){
+		cache = NULL;
+	}
+
+	const BTri *cache; // The last triangle hit by intersectsCached()
 };
-#endif
 
 class BSP {
 public:
 	BSP(){
-		top = NULL;
-#ifdef USE_SIMD
-		sseTop = NULL;
-		sseDest = NULL;
-#endif
-		cache = NULL;
+		nodes = NULL;
+		nodeTris = NULL;
+		nodeMem = NULL;
+		nodeCount = 0;
+		mapMem = NULL;
+		mapSize = 0;
 	}
 	~BSP(){
-#ifdef USE_SIMD
-		delete sseDest;
-#endif
-		delete top;
+		release();
 	}
 
 	void addTriangle(const vec3 &v0, const vec3 &v1, const vec3 &v2, void *data = NULL);
-	void build(const int splitCost = 3, const int balCost = 1, const float epsilon = 0.001f);
+	// Subtrees are built in parallel if a worker pool is passed. The result does not depend on the thread count.
+	void build(const int splitCost = 3, const int balCost = 1, const float epsilon = 0.001f, const uint sampleCount = BSP_DEFAULT_SAMPLES, WorkerPool *pool = NULL);
+
+	// Maps the compiled tree from the cache file if it was built from the same triangles with the same parameters,
+	// otherwise builds it and writes a new cache file. Returns true if the cache was used.
+	// The triangle data pointers are not stored in the cache.
+	bool buildCached(const char *fileName, const int splitCost = 3, const int balCost = 1, const float epsilon = 0.001f, const uint sampleCount = BSP_DEFAULT_SAMPLES, WorkerPool *pool = NULL);
 
 	bool intersects(const vec3 &v0, const vec3 &v1, vec3 *point = NULL, const BTri **triangle = NULL) const;
-	bool intersectsCached(const vec3 &v0, const vec3 &v1);
-#ifdef USE_SIMD
-	bool intersects3DNow(const vec3 &v0, const vec3 &v1) const;
-#endif
+	bool intersectsCached(BSPQueryContext &context, const vec3 &v0, const vec3 &v1) const;
+	// Traces count segments together, returns the number of segments that hit. Results match intersects().
+	uint intersectsBatch(const vec3 *v0, const vec3 *v1, const uint count, bool *hits, vec3 *points = NULL, const BTri **triangles = NULL) const;
 
 	bool pushSphere(vec3 &pos, const float radius) const;
 	float getDistance(const vec3 &pos) const;
 
+	// Batched sphere queries, the results match pushSphere() and getDistance() for each sphere.
+	// Returns the number of spheres that were pushed.
+	uint pushSpheres(vec3 *positions, const float *radii, const uint count, bool *pushed = NULL) const;
+	void getDistances(const vec3 *positions, const uint count, float *distances) const;
+
 	bool isInOpenSpace(const vec3 &pos) const;
-#ifdef USE_SIMD
-	bool isInOpenSpace3DNow(const vec3 &pos) const;
-	bool isInOpenSpaceSSE(const vec3 &pos) const;
-#endif
 
 	bool loadFile(const char *fileName);
 	bool saveFile(const char *fileName) const;
 
+	uint getNodeCount() const { return nodeCount; }
+	uint getMemoryUsage() const { return nodeCount * (sizeof(BFlatNode) + sizeof(BTri)); }
+
+	// Creates a pointer tree of the flattened nodes for comparing against the BNode queries
+	BNode *createTree() const;
+
 protected:
+	BNode *createNode(const uint index) const;
+
+	uint64 getBuildKey(const int splitCost, const int balCost, const float epsilon, const uint sampleCount) const;
+	bool mapCache(const char *fileName, const uint64 key);
+	bool saveCache(const char *fileName, const uint64 key) const;
+	void release();
+	void flatten(const BNode *top);
+	uint flattenNode(const BNode *node, uint &dest);
+	void writeNode(FILE *file, const uint index) const;
+
 	Array <BTri> tris;
-	BNode *top;
-	BTri *cache;
-#ifdef USE_SIMD
-	SSENode *sseTop;
-	SSENode *sseDest;
-#endif
+
+	BFlatNode *nodes;
+	BTri *nodeTris;
+	uint nodeCount;
+	ubyte *nodeMem;
+
+	// The nodes point into this when mapped from a cache file
+	void *mapMem;
+	size_t mapSize;
+
 };
 
 #endif // _BSP_H_
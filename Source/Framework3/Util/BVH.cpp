@@ -0,0 +1,341 @@
+/***********      .---.         .-"-.      *******************\
+* -------- *     /   ._.       /  ` \     * ---------------- *
+* Author's *     \_  (__\      \_v_/     * humus@rogers.com *
+*   note   *     //   \\       //   \\     * ICQ #47010716    *
+* -------- *    ((     ))     ((     ))    * ---------------- *
+*          ****--""---""-------""---""--****                  ********\
+* This file is a part of the work done by Humus. You are free to use  *
+* the code in any way you like, modified, unmodified or copy'n'pasted *
+* into your own work. However, I expect you to respect these points:  *
+*  @ If you use this file and its contents unmodified, or use a major *
+*    part of this file, please credit the author and leave this note. *
+*  @ For use in anything commercial, please request my approval.      *
+*  @ Share your work and ideas too as much as you can.                *
+\*********************************************************************/
+
+#include "BVH.h"
+
+#define BVH_SAH_BINS 16
+
+void BVH::addTriangle(const vec3 &v0, const vec3 &v1, const vec3 &v2, void *data){
+	BTri tri;
+
+	tri.v[0] = v0;
+	tri.v[1] = v1;
+	tri.v[2] = v2;
+	tri.data = data;
+
+	tri.finalize();
+
+	tris.add(tri);
+}
+
+static float boxArea(const vec3 &minBound, const vec3 &maxBound){
+	vec3 d = maxBound - minBound;
+	return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+static void growBox(vec3 &minBound, vec3 &maxBound, const vec3 &v){
+	if (v.x < minBound.x) minBound.x = v.x;
+	if (v.y < minBound.y) minBound.y = v.y;
+	if (v.z < minBound.z) minBound.z = v.z;
+	if (v.x > maxBound.x) maxBound.x = v.x;
+	if (v.y > maxBound.y) maxBound.y = v.y;
+	if (v.z > maxBound.z) maxBound.z = v.z;
+}
+
+void BVH::build(const uint maxLeafTris){
+	uint nTris = tris.getCount();
+
+	uint *indices = new uint[nTris];
+	vec3 *centroids = new vec3[nTris];
+	for (uint i = 0; i < nTris; i++){
+		indices[i] = i;
+		centroids[i] = (tris[i].v[0] + tris[i].v[1] + tris[i].v[2]) * (1.0f / 3.0f);
+	}
+
+	Array <BVHNode> nodeList;
+	if (nTris > 0) buildNode(nodeList, indices, centroids, 0, nTris, maxLeafTris, 0);
+
+	// Store the triangles in leaf order
+	Array <BTri> sorted(nTris);
+	for (uint i = 0; i < nTris; i++){
+		sorted.add(tris[indices[i]]);
+	}
+	memcpy(tris.getArray(), sorted.getArray(), nTris * sizeof(BTri));
+
+	delete [] nodes;
+	nNodes = nodeList.getCount();
+	nodes = new BVHNode[nNodes];
+	memcpy(nodes, nodeList.getArray(), nNodes * sizeof(BVHNode));
+
+	delete [] indices;
+	delete [] centroids;
+}
+
+uint BVH::buildNode(Array <BVHNode> &nodeList, uint *indices, const vec3 *centroids, const uint first, const uint count, const uint maxLeafTris, const uint depth){
+	BVHNode node;
+	node.minBound = node.maxBound = tris[indices[first]].v[0];
+
+	vec3 cMin = centroids[indices[first]];
+	vec3 cMax = cMin;
+	for (uint i = first; i < first + count; i++){
+		for (uint j = 0; j < 3; j++){
+			growBox(node.minBound, node.maxBound, tris[indices[i]].v[j]);
+		}
+		growBox(cMin, cMax, centroids[indices[i]]);
+	}
+	node.first = first;
+	node.count = count;
+
+	uint index = nodeList.add(node);
+	if (count <= maxLeafTris || depth >= BVH_MAX_DEPTH - 1) return index;
+
+	// Split along the axis with the largest centroid extent
+	vec3 extent = cMax - cMin;
+	int axis = (extent.x > extent.y)? 0 : 1;
+	if (extent.z > ((const float *) &extent)[axis]) axis = 2;
+
+	float axisMin = ((const float *) &cMin)[axis];
+	float axisExtent = ((const float *) &extent)[axis];
+	if (axisExtent <= 0) return index;
+
+	float binScale = BVH_SAH_BINS / axisExtent;
+
+	// Bin the triangles by centroid
+	uint binCounts[BVH_SAH_BINS];
+	vec3 binMin[BVH_SAH_BINS], binMax[BVH_SAH_BINS];
+	for (uint b = 0; b < BVH_SAH_BINS; b++){
+		binCounts[b] = 0;
+		binMin[b] = vec3(FLT_MAX);
+		binMax[b] = vec3(-FLT_MAX);
+	}
+	for (uint i = first; i < first + count; i++){
+		int b = int((((const float *) &centroids[indices[i]])[axis] - axisMin) * binScale);
+		if (b > BVH_SAH_BINS - 1) b = BVH_SAH_BINS - 1;
+
+		binCounts[b]++;
+		for (uint j = 0; j < 3; j++){
+			growBox(binMin[b], binMax[b], tris[indices[i]].v[j]);
+		}
+	}
+
+	// Sweep from the right to get the right side costs, then from the left to find the cheapest split
+	float rightCost[BVH_SAH_BINS];
+	vec3 rMin = vec3(FLT_MAX), rMax = vec3(-FLT_MAX);
+	uint rCount = 0;
+	for (int b = BVH_SAH_BINS - 1; b > 0; b--){
+		rCount += binCounts[b];
+		if (binCounts[b]){
+			growBox(rMin, rMax, binMin[b]);
+			growBox(rMin, rMax, binMax[b]);
+		}
+		rightCost[b] = rCount? rCount * boxArea(rMin, rMax) : 0;
+	}
+
+	vec3 lMin = vec3(FLT_MAX), lMax = vec3(-FLT_MAX);
+	uint lCount = 0;
+	uint bestBin = 0;
+	float bestCost = FLT_MAX;
+	for (uint b = 0; b < BVH_SAH_BINS - 1; b++){
+		lCount += binCounts[b];
+		if (binCounts[b]){
+			growBox(lMin, lMax, binMin[b]);
+			growBox(lMin, lMax, binMax[b]);
+		}
+		float cost = (lCount? lCount * boxArea(lMin, lMax) : 0) + rightCost[b + 1];
+		if (lCount > 0 && lCount < count && cost < bestCost){
+			bestCost = cost;
+			bestBin = b;
+		}
+	}
+
+	// Partition the indices into the two halves
+	uint mid = first;
+	for (uint i = first; i < first + count; i++){
+		int b = int((((const float *) &centroids[indices[i]])[axis] - axisMin) * binScale);
+		if (b > BVH_SAH_BINS - 1) b = BVH_SAH_BINS - 1;
+
+		if (b <= int(bestBin)){
+			uint tmp = indices[i];
+			indices[i] = indices[mid];
+			indices[mid] = tmp;
+			mid++;
+		}
+	}
+
+	buildNode(nodeList, indices, centroids, first, mid - first, maxLeafTris, depth + 1);
+	uint right = buildNode(nodeList, indices, centroids, mid, first + count - mid, maxLeafTris, depth + 1);
+
+	nodeList[index].first = right;
+	nodeList[index].count = 0;
+
+	return index;
+}
+
+static bool segmentHitsBox(const BVHNode &node, const vec3 &v0, const vec3 &invDir, const float tMax){
+	float t0 = (node.minBound.x - v0.x) * invDir.x;
+	float t1 = (node.maxBound.x - v0.x) * invDir.x;
+	float tNear = min(t0, t1);
+	float tFar  = max(t0, t1);
+
+	t0 = (node.minBound.y - v0.y) * invDir.y;
+	t1 = (node.maxBound.y - v0.y) * invDir.y;
+	tNear = max(tNear, min(t0, t1));
+	tFar  = min(tFar,  max(t0, t1));
+
+	t0 = (node.minBound.z - v0.z) * invDir.z;
+	t1 = (node.maxBound.z - v0.z) * invDir.z;
+	tNear = max(tNear, min(t0, t1));
+	tFar  = min(tFar,  max(t0, t1));
+
+	return (tNear <= tFar && tFar >= 0 && tNear <= tMax);
+}
+
+static float boxDistanceSqr(const BVHNode &node, const vec3 &pos){
+	float dx = max(max(node.minBound.x - pos.x, pos.x - node.maxBound.x), 0.0f);
+	float dy = max(max(node.minBound.y - pos.y, pos.y - node.maxBound.y), 0.0f);
+	float dz = max(max(node.minBound.z - pos.z, pos.z - node.maxBound.z), 0.0f);
+
+	return dx * dx + dy * dy + dz * dz;
+}
+
+no_alias bool BVH::intersects(const vec3 &v0, const vec3 &v1, vec3 *point, const BTri **triangle) const {
+	if (nNodes == 0) return false;
+
+	vec3 dir = v1 - v0;
+	vec3 invDir(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+
+	// Closest hit so far as a fraction of the segment
+	float best = 1.0f;
+	const BTri *hit = NULL;
+	vec3 hitPos;
+
+	uint stack[BVH_MAX_DEPTH + 1];
+	uint sp = 0;
+	stack[sp++] = 0;
+	while (sp > 0){
+		uint index = stack[--sp];
+		const BVHNode &node = nodes[index];
+		if (!segmentHitsBox(node, v0, invDir, best)) continue;
+
+		if (node.count){
+			for (uint i = node.first; i < node.first + node.count; i++){
+				const BTri &tri = tris[i];
+
+				// Crossing the plane in either direction, like the BSP
+				float d0 = planeDistance(tri.plane, v0);
+				float d1 = planeDistance(tri.plane, v1);
+				if ((d0 > 0)? d1 < 0 : d1 > 0){
+					float t = d0 / (d0 - d1);
+					if (t < best){
+						vec3 pos = v0 + t * dir;
+						if (tri.isAbove(pos)){
+							best = t;
+							hit = &tri;
+							hitPos = pos;
+						}
+					}
+				}
+			}
+		} else {
+			stack[sp++] = node.first;
+			stack[sp++] = index + 1;
+		}
+	}
+
+	if (hit){
+		if (point) *point = hitPos;
+		if (triangle) *triangle = hit;
+		return true;
+	}
+
+	return false;
+}
+
+no_alias bool BVH::pushSphere(vec3 &pos, const float radius) const {
+	if (nNodes == 0) return false;
+
+	bool pushed = false;
+
+	uint stack[BVH_MAX_DEPTH + 1];
+	uint sp = 0;
+	stack[sp++] = 0;
+	while (sp > 0){
+		uint index = stack[--sp];
+		const BVHNode &node = nodes[index];
+		if (boxDistanceSqr(node, pos) >= radius * radius) continue;
+
+		if (node.count){
+			for (uint i = node.first; i < node.first + node.count; i++){
+				const BTri &tri = tris[i];
+
+				float d = planeDistance(tri.plane, pos);
+				if (fabsf(d) < radius && tri.isAbove(pos)){
+					pos += (radius - d) * tri.plane.xyz();
+					pushed = true;
+				}
+			}
+		} else {
+			stack[sp++] = node.first;
+			stack[sp++] = index + 1;
+		}
+	}
+
+	return pushed;
+}
+
+const BTri *BVH::findClosest(const vec3 &pos, float &minDist) const {
+	const BTri *closest = NULL;
+
+	uint stack[BVH_MAX_DEPTH + 1];
+	uint sp = 0;
+	stack[sp++] = 0;
+	while (sp > 0){
+		uint index = stack[--sp];
+		const BVHNode &node = nodes[index];
+		if (boxDistanceSqr(node, pos) >= minDist * minDist) continue;
+
+		if (node.count){
+			for (uint i = node.first; i < node.first + node.count; i++){
+				float dist = tris[i].getDistance(pos);
+				if (dist < minDist){
+					minDist = dist;
+					closest = &tris[i];
+				}
+			}
+		} else {
+			// Visit the closer child first for better pruning
+			uint left = index + 1;
+			uint right = node.first;
+			if (boxDistanceSqr(nodes[left], pos) < boxDistanceSqr(nodes[right], pos)){
+				stack[sp++] = right;
+				stack[sp++] = left;
+			} else {
+				stack[sp++] = left;
+				stack[sp++] = right;
+			}
+		}
+	}
+
+	return closest;
+}
+
+no_alias float BVH::getDistance(const vec3 &pos) const {
+	float dist = FLT_MAX;
+
+	if (nNodes > 0) findClosest(pos, dist);
+
+	return dist;
+}
+
+no_alias bool BVH::isInOpenSpace(const vec3 &pos) const {
+	if (nNodes > 0){
+		float dist = FLT_MAX;
+		const BTri *closest = findClosest(pos, dist);
+
+		return (closest != NULL && planeDistance(closest->plane, pos) > 0);
+	}
+
+	return false;
+}
@@ -0,0 +1,71 @@
+/***********      .---.         .-"-.      *******************\
+* -------- *     /   ._.       /  ` \     * ---------------- *
+* Author's *     \_  (__\      \_v_/     * humus@rogers.com *
+*   note   *     //   \\       //   \\     * ICQ #47010716    *
+* -------- *    ((     ))     ((     ))    * ---------------- *
+*          ****--""---""-------""---""--****                  ********\
+* This file is a part of the work done by Humus. You are free to use  *
+* the code in any way you like, modified, unmodified or copy'n'pasted *
+* into your own work. However, I expect you to respect these points:  *
+*  @ If you use this file and its contents unmodified, or use a major *
+*    part of this file, please credit the author and leave this note. *
+*  @ For use in anything commercial, please request my approval.      *
+*  @ Share your work and ideas too as much as you can.                *
+\*********************************************************************/
+
+#ifndef _BVH_H_
+#define _BVH_H_
+
+#include "BSP.h"
+
+// Depth-first node, the left child follows its parent directly
+struct BVHNode {
+	vec3 minBound;
+	uint first; // First triangle for leaves, right child index otherwise
+	vec3 maxBound;
+	uint count; // Number of triangles in a leaf, zero for inner nodes
+};
+
+#define BVH_MAX_DEPTH 64
+
+/*
+	Bounding volume hierarchy over the unsplit triangles, built with a binned SAH.
+	Offers the same queries as BSP. Segment queries return the closest hit, and
+	isInOpenSpace() uses the side of the closest triangle, so it assumes closed geometry.
+	All queries are const and can be run from any number of threads.
+*/
+class BVH {
+public:
+	BVH(){
+		nodes = NULL;
+		nNodes = 0;
+	}
+	~BVH(){
+		delete [] nodes;
+	}
+
+	void addTriangle(const vec3 &v0, const vec3 &v1, const vec3 &v2, void *data = NULL);
+	void build(const uint maxLeafTris = 4);
+
+	bool intersects(const vec3 &v0, const vec3 &v1, vec3 *point = NULL, const BTri **triangle = NULL) const;
+
+	bool pushSphere(vec3 &pos, const float radius) const;
+	float getDistance(const vec3 &pos) const;
+
+	bool isInOpenSpace(const vec3 &pos) const;
+
+	uint getNodeCount() const { return nNodes; }
+	uint getTriangleCount() const { return tris.getCount(); }
+	uint getMemoryUsage() const { return nNodes * sizeof(BVHNode) + tris.getCount() * sizeof(BTri); }
+
+protected:
+	uint buildNode(Array <BVHNode> &nodeList, uint *indices, const vec3 *centroids, const uint first, const uint count, const uint maxLeafTris, const uint depth);
+	const BTri *findClosest(const vec3 &pos, float &minDist) const;
+
+	Array <BTri> tris;
+
+	BVHNode *nodes;
+	uint nNodes;
+};
+
+#endif // _BVH_H_
@@ -0,0 +1,140 @@
+/***********      .---.         .-"-.      *******************\
+* -------- *     /   ._.       /  ` \     * ---------------- *
+* Author's *     \_  (__\      \_v_/     * humus@rogers.com *
+*   note   *     //   \\       //   \\     * ICQ #47010716    *
+* -------- *    ((     ))     ((     ))    * ---------------- *
+*          ****--""---""-------""---""--****                  ********\
+* This file is a part of the work done by Humus. You are free to use  *
+* the code in any way you like, modified, unmodified or copy'n'pasted *
+* into your own work. However, I expect you to respect these points:  *
+*  @ If you use this file and its contents unmodified, or use a major *
+*    part of this file, please credit the author and leave this note. *
+*  @ For use in anything commercial, please request my approval.      *
+*  @ Share your work and ideas too as much as you can.                *
+\*********************************************************************/
+
+#include "DynamicTexture.h"
+#include <string.h>
+
+DynamicTexture::DynamicTexture(){
+	renderer = NULL;
+	data = NULL;
+	nBuffers = 0;
+	clear();
+}
+
+DynamicTexture::~DynamicTexture(){
+	for (uint i = 0; i < nBuffers; i++){
+		delete shadows[i];
+	}
+	delete data;
+}
+
+void DynamicTexture::clear(){
+	for (uint i = 0; i < MAX_DYNAMIC_BUFFERS; i++){
+		textures[i] = TEXTURE_NONE;
+		shadows[i] = NULL;
+	}
+	width = 0;
+	height = 0;
+	current = 0;
+	uploadedCount = 0;
+}
+
+bool DynamicTexture::create(Renderer *renderer, const FORMAT format, const int width, const int height, const uint nBuffers, const SamplerStateID samplerState){
+	ASSERT(nBuffers > 0 && nBuffers <= MAX_DYNAMIC_BUFFERS);
+	ASSERT(!isCompressedFormat(format));
+
+	// Any previous textures belonged to a renderer that may no longer exist, so only free the memory
+	for (uint i = 0; i < this->nBuffers; i++){
+		delete shadows[i];
+	}
+	delete data;
+	data = NULL;
+	this->nBuffers = 0;
+	clear();
+
+	this->renderer = renderer;
+	this->format = format;
+	this->width  = width;
+	this->height = height;
+
+	Image img;
+	ubyte *pixels = img.create(format, width, height, 1, 1);
+	uint size = width * height * getBytesPerPixel(format);
+	memset(pixels, 0, size);
+
+	for (uint i = 0; i < nBuffers; i++){
+		shadows[i] = new ubyte[size];
+		memset(shadows[i], 0, size);
+		this->nBuffers++;
+
+		if ((textures[i] = renderer->addTexture(img, samplerState, UPDATABLE)) == TEXTURE_NONE) return false;
+	}
+	data = new ubyte[size];
+	memset(data, 0, size);
+
+	// Start so that the first upload goes to the first buffer
+	current = nBuffers - 1;
+
+	return true;
+}
+
+void DynamicTexture::destroy(){
+	for (uint i = 0; i < nBuffers; i++){
+		if (textures[i] != TEXTURE_NONE) renderer->removeTexture(textures[i]);
+		delete shadows[i];
+	}
+	delete data;
+	data = NULL;
+	nBuffers = 0;
+	clear();
+}
+
+TextureID DynamicTexture::upload(){
+	if (data == NULL) return TEXTURE_NONE;
+
+	current = (current + 1) % nBuffers;
+
+	// Find the first and last bytes that differ from what the texture holds
+	uint bpp = getBytesPerPixel(format);
+	uint size = width * height * bpp;
+	ubyte *shadow = shadows[current];
+
+	uint first = 0;
+	while (first < size && data[first] == shadow[first]) first++;
+
+	if (first == size){
+		uploadedCount = 0;
+		return textures[current];
+	}
+
+	uint last = size - 1;
+	while (data[last] == shadow[last]) last--;
+
+	first /= bpp;
+	last  /= bpp;
+
+	// Upload the changed span, as full rows if it crosses a row boundary
+	int y0 = first / width;
+	int y1 = last  / width;
+	int x0, x1;
+	if (y0 == y1){
+		x0 = first % width;
+		x1 = last  % width;
+	} else {
+		x0 = 0;
+		x1 = width - 1;
+	}
+
+	// Either span is contiguous in memory, so it can be sent straight from the data
+	uint offset = (y0 * width + x0) * bpp;
+	uint count = (x1 - x0 + 1) * (y1 - y0 + 1);
+	memcpy(shadow + offset, data + offset, count * bpp);
+
+	renderer->updateTexture(textures[current], x0, y0, x1 - x0 + 1, y1 - y0 + 1, data + offset);
+
+	uploadedCount = count;
+
+	return textures[current];
+}
@@ -0,0 +1,64 @@
+/***********      .---.         .-"-.      *******************\
+* -------- *     /   ._.       /  ` \     * ---------------- *
+* Author's *     \_  (__\      \_v_/     * humus@rogers.com *
+*   note   *     //   \\       //   \\     * ICQ #47010716    *
+* -------- *    ((     ))     ((     ))    * ---------------- *
+*          ****--""---""-------""---""--****                  ********\
+* This file is a part of the work done by Humus. You are free to use  *
+* the code in any way you like, modified, unmodified or copy'n'pasted *
+* into your own work. However, I expect you to respect these points:  *
+*  @ If you use this file and its contents unmodified, or use a major *
+*    part of this file, please credit the author and leave this note. *
+*  @ For use in anything commercial, please request my approval.      *
+*  @ Share your work and ideas too as much as you can.                *
+\*********************************************************************/
+
+#ifndef _DYNAMICTEXTURE_H_
+#define _DYNAMICTEXTURE_H_
+
+#include "../Renderer.h"
+
+#define MAX_DYNAMIC_BUFFERS 3
+
+/*
+	A persistent texture that is rewritten from the CPU every frame. The new
+	contents are written to getData() and upload() then only sends the span of
+	texels that changed since the texture was last written. With more than one
+	buffer, the textures are cycled so that an update doesn't have to wait on
+	the GPU still reading the texture used in the previous frame.
+*/
+class DynamicTexture {
+public:
+	DynamicTexture();
+	~DynamicTexture();
+
+	bool create(Renderer *renderer, const FORMAT format, const int width, const int height, const uint nBuffers, const SamplerStateID samplerState);
+	void destroy();
+
+	ubyte *getData() const { return data; }
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+
+	TextureID upload();
+	TextureID getTexture() const { return textures[current]; }
+
+	// Number of texels sent in the last upload
+	uint getUploadedCount() const { return uploadedCount; }
+
+protected:
+	void clear();
+
+	Renderer *renderer;
+
+	TextureID textures[MAX_DYNAMIC_BUFFERS];
+	ubyte *shadows[MAX_DYNAMIC_BUFFERS];
+	ubyte *data;
+
+	FORMAT format;
+	int width, height;
+	uint nBuffers;
+	uint current;
+	uint uploadedCount;
+};
+
+#endif // _DYNAMICTEXTURE_H_
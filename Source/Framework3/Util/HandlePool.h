@@ -0,0 +1,94 @@
+/***********      .---.         .-"-.      *******************\
+* -------- *     /   ._.       /  ` \     * ---------------- *
+* Author's *     \_  (__\      \_v_/     * humus@rogers.com *
+*   note   *     //   \\       //   \\     * ICQ #47010716    *
+* -------- *    ((     ))     ((     ))    * ---------------- *
+*          ****--""---""-------""---""--****                  ********\
+* This file is a part of the work done by Humus. You are free to use  *
+* the code in any way you like, modified, unmodified or copy'n'pasted *
+* into your own work. However, I expect you to respect these points:  *
+*  @ If you use this file and its contents unmodified, or use a major *
+*    part of this file, please credit the author and leave this note. *
+*  @ For use in anything commercial, please request my approval.      *
+*  @ Share your work and ideas too as much as you can.                *
+\*********************************************************************/
+
+#ifndef _HANDLEPOOL_H_
+#define _HANDLEPOOL_H_
+
+#include "../Platform.h"
+#include "Array.h"
+
+// A handle keeps the slot index in the low bits and the slot's generation above it.
+// The sign bit is never used so that handles can't collide with the -1 NONE values.
+#define HANDLE_INDEX_BITS 20
+#define HANDLE_INDEX_MASK ((1 << HANDLE_INDEX_BITS) - 1)
+#define HANDLE_GENERATION_MASK ((1 << (31 - HANDLE_INDEX_BITS)) - 1)
+#define HANDLE_SLOT_USED 0x80000000
+
+/*
+	Storage for objects referred to by integer handles. Removed slots are put on a
+	free list and reused by later adds, so memory stays flat when objects are
+	created and destroyed continuously. Each reuse bumps the slot's generation,
+	which makes old handles to the slot detectable as stale in debug builds.
+*/
+template <class TYPE>
+class HandlePool {
+public:
+	HandlePool(){
+	}
+
+	int add(const TYPE &object){
+		unsigned int index;
+		if (freeSlots.getCount()){
+			index = freeSlots[freeSlots.getCount() - 1];
+			freeSlots.fastRemove(freeSlots.getCount() - 1);
+			objects[index] = object;
+		} else {
+			ASSERT(objects.getCount() <= HANDLE_INDEX_MASK);
+			index = objects.add(object);
+			generations.add(0);
+		}
+		int handle = (int) (index | (generations[index] << HANDLE_INDEX_BITS));
+		generations[index] |= HANDLE_SLOT_USED;
+
+		return handle;
+	}
+
+	void remove(const int handle){
+		ASSERT(isValid(handle));
+
+		unsigned int index = handle & HANDLE_INDEX_MASK;
+		generations[index] = ((generations[index] & ~HANDLE_SLOT_USED) + 1) & HANDLE_GENERATION_MASK;
+		freeSlots.add(index);
+	}
+
+	bool isValid(const int handle) const {
+		if (handle < 0) return false;
+
+		unsigned int index = handle & HANDLE_INDEX_MASK;
+		if (index >= generations.getCount()) return false;
+
+		return (generations[index] == ((handle >> HANDLE_INDEX_BITS) | HANDLE_SLOT_USED));
+	}
+
+	TYPE &operator [] (const int handle) const {
+#ifdef DEBUG
+		ASSERT(isValid(handle));
+#endif
+		return objects[handle & HANDLE_INDEX_MASK];
+	}
+
+	// Slots are numbered from zero to getCount() - 1, including free ones
+	unsigned int getCount() const { return objects.getCount(); }
+	bool isUsed(const unsigned int index) const { return (generations[index] & HANDLE_SLOT_USED) != 0; }
+	int getHandle(const unsigned int index) const { return (int) (index | ((generations[index] & ~HANDLE_SLOT_USED) << HANDLE_INDEX_BITS)); }
+	TYPE &getSlot(const unsigned int index) const { return objects[index]; }
+
+protected:
+	Array <TYPE> objects;
+	Array <unsigned int> generations;
+	Array <unsigned int> freeSlots;
+};
+
+#endif // _HANDLEPOOL_H_
@@ -0,0 +1,607 @@
+/***********      .---.         .-"-.      *******************\
+* -------- *     /   ._.       /  ` \     * ---------------- *
+* Author's *     \_  (__\      \_v_/     * humus@rogers.com *
+*   note   *     //   \\       //   \\     * ICQ #47010716    *
+* -------- *    ((     ))     ((     ))    * ---------------- *
+*          ****--""---""-------""---""--****                  ********\
+* This file is a part of the work done by Humus. You are free to use  *
+* the code in any way you like, modified, unmodified or copy'n'pasted *
+* into your own work. However, I expect you to respect these points:  *
+*  @ If you use this file and its contents unmodified, or use a major *
+*    part of this file, please credit the author and leave this note. *
+*  @ For use in anything commercial, please request my approval.      *
+*  @ Share your work and ideas too as much as you can.                *
+\*********************************************************************/
+
+#include "MeshOptimizer.h"
+#include "Array.h"
+#include "WorkerPool.h"
+#include "../Math/Vector.h"
+
+#define NOT_CACHED 0xFFFFFFFF
+
+// FIFO cache simulation with timestamps, a vertex is in the cache if it was added within the last cacheSize misses
+struct CacheSimulator {
+	CacheSimulator(const uint nVertices, const uint size){
+		cacheTime = new uint[nVertices];
+		memset(cacheTime, 0xFF, nVertices * sizeof(uint));
+		cacheSize = size;
+		time = 0;
+	}
+	~CacheSimulator(){
+		delete [] cacheTime;
+	}
+
+	// Returns the number of misses
+	uint addTriangle(const uint *tri){
+		uint misses = 0;
+		for (uint k = 0; k < 3; k++){
+			uint v = tri[k];
+			if (cacheTime[v] == NOT_CACHED || time - cacheTime[v] >= cacheSize){
+				cacheTime[v] = time++;
+				misses++;
+			}
+		}
+		return misses;
+	}
+
+	void flush(){
+		time += cacheSize;
+	}
+
+	uint *cacheTime;
+	uint cacheSize;
+	uint time;
+};
+
+VertexCacheStats getVertexCacheStats(const uint *indices, const uint nIndices, const uint nVertices, const uint cacheSize){
+	VertexCacheStats stats;
+	stats.acmr = stats.atvr = 0;
+
+	uint nTriangles = nIndices / 3;
+	if (nTriangles == 0) return stats;
+
+	CacheSimulator cache(nVertices, cacheSize);
+
+	uint misses = 0;
+	for (uint i = 0; i < nTriangles; i++){
+		misses += cache.addTriangle(indices + 3 * i);
+	}
+
+	// Every referenced vertex has been in the cache once
+	uint nUsed = 0;
+	for (uint v = 0; v < nVertices; v++){
+		if (cache.cacheTime[v] != NOT_CACHED) nUsed++;
+	}
+
+	stats.acmr = float(misses) / nTriangles;
+	stats.atvr = float(misses) / nUsed;
+
+	return stats;
+}
+
+uint optimizeVertexCache(uint *indices, const uint nIndices, const uint nVertices, uint *clusters, const uint cacheSize){
+	uint nTriangles = nIndices / 3;
+	if (nTriangles == 0) return 0;
+
+	// Vertex to triangle adjacency
+	uint *offsets = new uint[nVertices + 1];
+	memset(offsets, 0, (nVertices + 1) * sizeof(uint));
+	for (uint i = 0; i < 3 * nTriangles; i++){
+		offsets[indices[i] + 1]++;
+	}
+	for (uint v = 0; v < nVertices; v++){
+		offsets[v + 1] += offsets[v];
+	}
+
+	uint *adjacency = new uint[3 * nTriangles];
+	uint *live = new uint[nVertices];
+	for (uint v = 0; v < nVertices; v++){
+		live[v] = 0;
+	}
+	for (uint i = 0; i < 3 * nTriangles; i++){
+		uint v = indices[i];
+		adjacency[offsets[v] + live[v]++] = i / 3;
+	}
+
+	uint *cacheTime = new uint[nVertices];
+	memset(cacheTime, 0, nVertices * sizeof(uint));
+
+	bool *emitted = new bool[nTriangles];
+	memset(emitted, 0, nTriangles * sizeof(bool));
+
+	uint *deadEnd = new uint[3 * nTriangles];
+	uint nDeadEnd = 0;
+
+	uint *output = new uint[3 * nTriangles];
+	uint nOutput = 0;
+
+	Array <uint> candidates;
+
+	uint time = cacheSize + 1;
+	uint cursor = 0;
+	uint nClusters = 0;
+	bool newCluster = true;
+
+	int fanning = indices[0];
+	while (fanning >= 0){
+		// Emit all remaining triangles around the fanning vertex
+		candidates.clear();
+		for (uint a = offsets[fanning]; a < offsets[fanning + 1]; a++){
+			uint t = adjacency[a];
+			if (emitted[t]) continue;
+
+			if (newCluster){
+				clusters[nClusters++] = nOutput / 3;
+				newCluster = false;
+			}
+
+			for (uint k = 0; k < 3; k++){
+				uint v = indices[3 * t + k];
+
+				output[nOutput++] = v;
+				deadEnd[nDeadEnd++] = v;
+				candidates.add(v);
+				live[v]--;
+
+				if (time - cacheTime[v] > cacheSize){
+					cacheTime[v] = time++;
+				}
+			}
+			emitted[t] = true;
+		}
+
+		// Pick the candidate that will still be in the cache once its triangles are emitted, the oldest one first
+		int best = -1;
+		int bestPriority = -1;
+		for (uint i = 0; i < candidates.getCount(); i++){
+			uint v = candidates[i];
+			if (live[v] > 0){
+				int priority = 0;
+				if (time - cacheTime[v] + 2 * live[v] <= cacheSize){
+					priority = time - cacheTime[v];
+				}
+				if (priority > bestPriority){
+					bestPriority = priority;
+					best = v;
+				}
+			}
+		}
+
+		if (best < 0){
+			// Dead end, continue from a recently used vertex or else the next unfinished one, this starts a new cluster
+			newCluster = true;
+			while (nDeadEnd > 0){
+				uint v = deadEnd[--nDeadEnd];
+				if (live[v] > 0){
+					best = v;
+					break;
+				}
+			}
+			while (best < 0 && cursor < nVertices){
+				if (live[cursor] > 0) best = cursor; else cursor++;
+			}
+		}
+
+		fanning = best;
+	}
+
+	memcpy(indices, output, 3 * nTriangles * sizeof(uint));
+
+	delete [] offsets;
+	delete [] adjacency;
+	delete [] live;
+	delete [] cacheTime;
+	delete [] emitted;
+	delete [] deadEnd;
+	delete [] output;
+
+	return nClusters;
+}
+
+struct OverdrawCluster {
+	float sortKey;
+	uint start;
+	uint count;
+};
+
+static int compareClusters(const OverdrawCluster &elem0, const OverdrawCluster &elem1){
+	if (elem0.sortKey != elem1.sortKey) return (elem0.sortKey > elem1.sortKey)? -1 : 1;
+	return int(elem0.start) - int(elem1.start);
+}
+
+void optimizeOverdraw(uint *indices, const uint nIndices, const uint nVertices, const float *positions, const uint stride, const uint *clusters, const uint nClusters, const float *viewPosition, const float threshold, const uint cacheSize){
+	uint nTriangles = nIndices / 3;
+	if (nTriangles == 0) return;
+
+	// Split the clusters where the ACMR so far is close enough to the whole cluster's, the cache restarts at each split
+	CacheSimulator cache(nVertices, cacheSize);
+	Array <OverdrawCluster> parts;
+	for (uint c = 0; c < nClusters; c++){
+		uint start = clusters[c];
+		uint end = (c + 1 < nClusters)? clusters[c + 1] : nTriangles;
+
+		uint misses = 0;
+		cache.flush();
+		for (uint t = start; t < end; t++){
+			misses += cache.addTriangle(indices + 3 * t);
+		}
+		float limit = threshold * float(misses) / (end - start);
+
+		OverdrawCluster part;
+		part.start = start;
+		misses = 0;
+		cache.flush();
+		for (uint t = start; t < end; t++){
+			misses += cache.addTriangle(indices + 3 * t);
+
+			if (float(misses) <= limit * (t + 1 - part.start)){
+				part.count = t + 1 - part.start;
+				parts.add(part);
+
+				part.start = t + 1;
+				misses = 0;
+				cache.flush();
+			}
+		}
+		if (part.start < end){
+			// The tail goes with the part before it, unless that belongs to another cluster
+			if (part.start > start){
+				parts[parts.getCount() - 1].count += end - part.start;
+			} else {
+				part.count = end - part.start;
+				parts.add(part);
+			}
+		}
+	}
+
+	// Area weighted centers and normals
+	vec3 *centers = new vec3[parts.getCount()];
+	vec3 *normals = new vec3[parts.getCount()];
+	vec3 meshCenter(0, 0, 0);
+	float meshArea = 0;
+	for (uint c = 0; c < parts.getCount(); c++){
+		vec3 center(0, 0, 0);
+		vec3 normal(0, 0, 0);
+		float area = 0;
+		for (uint t = parts[c].start; t < parts[c].start + parts[c].count; t++){
+			const uint *tri = indices + 3 * t;
+			vec3 v0 = *(const vec3 *) (positions + tri[0] * stride);
+			vec3 v1 = *(const vec3 *) (positions + tri[1] * stride);
+			vec3 v2 = *(const vec3 *) (positions + tri[2] * stride);
+
+			vec3 n = cross(v1 - v0, v2 - v0);
+			float a = length(n);
+
+			center += (v0 + v1 + v2) * (a / 3);
+			normal += n;
+			area += a;
+		}
+
+		meshCenter += center;
+		meshArea += area;
+
+		centers[c] = (area > 0)? center / area : center;
+		normals[c] = normal;
+	}
+	if (meshArea > 0) meshCenter /= meshArea;
+
+	// Clusters facing the viewer are the ones likely to occlude the others, so they go first. Without a view
+	// position the mesh is taken to be seen from all around the outside, where that means facing away from the center.
+	for (uint c = 0; c < parts.getCount(); c++){
+		float len = length(normals[c]);
+		if (viewPosition){
+			vec3 view(viewPosition[0], viewPosition[1], viewPosition[2]);
+			parts[c].sortKey = (len > 0)? dot(view - centers[c], normals[c]) / len : 0;
+		} else {
+			parts[c].sortKey = (len > 0)? dot(centers[c] - meshCenter, normals[c]) / len : 0;
+		}
+	}
+	parts.sort(compareClusters);
+
+	uint *output = new uint[3 * nTriangles];
+	uint *dest = output;
+	for (uint c = 0; c < parts.getCount(); c++){
+		memcpy(dest, indices + 3 * parts[c].start, 3 * parts[c].count * sizeof(uint));
+		dest += 3 * parts[c].count;
+	}
+	memcpy(indices, output, 3 * nTriangles * sizeof(uint));
+
+	delete [] output;
+	delete [] centers;
+	delete [] normals;
+}
+
+uint optimizeVertexFetch(float *vertices, uint *indices, const uint nIndices, const uint nVertices, const uint vertexSize){
+	uint *remap = new uint[nVertices];
+	memset(remap, 0xFF, nVertices * sizeof(uint));
+
+	uint nUsed = 0;
+	for (uint i = 0; i < nIndices; i++){
+		uint v = indices[i];
+		if (remap[v] == NOT_CACHED) remap[v] = nUsed++;
+		indices[i] = remap[v];
+	}
+
+	ubyte *src = (ubyte *) vertices;
+	ubyte *dest = new ubyte[nUsed * vertexSize];
+	for (uint v = 0; v < nVertices; v++){
+		if (remap[v] != NOT_CACHED){
+			memcpy(dest + remap[v] * vertexSize, src + v * vertexSize, vertexSize);
+		}
+	}
+	memcpy(vertices, dest, nUsed * vertexSize);
+
+	delete [] dest;
+	delete [] remap;
+
+	return nUsed;
+}
+
+#define WELD_CHUNK_SIZE 8192
+#define WELD_SHARDS_PER_THREAD 4
+#define WELD_NONE 0xFFFFFFFF
+
+// Components are compared as floats, so 0 and -0 have to hash the same
+static forceinline uint componentBits(const float f){
+	union { float f; uint u; } bits;
+	bits.f = f;
+	return ((bits.u & 0x7FFFFFFF) == 0)? 0 : bits.u;
+}
+
+static forceinline uint hashVertex(const float *vertex, const uint nComponents){
+	uint h = nComponents;
+	for (uint i = 0; i < nComponents; i++){
+		h ^= componentBits(vertex[i]) * 0xCC9E2D51;
+		h = ((h << 13) | (h >> 19)) * 5 + 0xE6546B64;
+	}
+
+	h ^= h >> 16;
+	h *= 0x85EBCA6B;
+	h ^= h >> 13;
+	h *= 0xC2B2AE35;
+	h ^= h >> 16;
+
+	return h;
+}
+
+// Compared on the bits, since -ffast-math lets the compiler assume a float compare never sees a NaN
+static forceinline bool equalVertices(const float *v0, const float *v1, const uint nComponents){
+	for (uint i = 0; i < nComponents; i++){
+		uint bits = componentBits(v0[i]);
+		if (bits != componentBits(v1[i]) || (bits & 0x7FFFFFFF) > 0x7F800000) return false;
+	}
+	return true;
+}
+
+static uint nextPowerOfTwo(const uint x){
+	uint n = 1;
+	while (n < x) n <<= 1;
+	return n;
+}
+
+struct WeldJob {
+	const float *vertices;
+	uint nVertices;
+	uint nComponents;
+
+	uint *hashes;
+	uint shardShift;
+
+	// Vertices of every shard in CSR form, in their original order
+	uint *shardStart;
+	uint *shardVertices;
+
+	// Index of the first equal vertex of every vertex
+	uint *first;
+};
+
+static void hashVerticesProc(void *data, const uint index){
+	WeldJob *job = (WeldJob *) data;
+
+	uint last = min((index + 1) * WELD_CHUNK_SIZE, job->nVertices);
+	for (uint i = index * WELD_CHUNK_SIZE; i < last; i++){
+		job->hashes[i] = hashVertex(job->vertices + i * job->nComponents, job->nComponents);
+	}
+}
+
+static void weldShardProc(void *data, const uint index){
+	WeldJob *job = (WeldJob *) data;
+
+	const uint *shard = job->shardVertices + job->shardStart[index];
+	uint count = job->shardStart[index + 1] - job->shardStart[index];
+	if (count == 0) return;
+
+	// Open addressing with linear probing, the table is at most half full
+	uint size = nextPowerOfTwo(2 * count);
+	uint *table = new uint[size];
+	memset(table, 0xFF, size * sizeof(uint));
+
+	uint nComp = job->nComponents;
+	for (uint i = 0; i < count; i++){
+		uint v = shard[i];
+		uint h = job->hashes[v];
+		const float *vertex = job->vertices + v * nComp;
+
+		uint slot = h & (size - 1);
+		while (table[slot] != WELD_NONE){
+			uint w = table[slot];
+			if (job->hashes[w] == h && equalVertices(job->vertices + w * nComp, vertex, nComp)) break;
+			slot = (slot + 1) & (size - 1);
+		}
+
+		if (table[slot] == WELD_NONE) table[slot] = v;
+		job->first[v] = table[slot];
+	}
+
+	delete [] table;
+}
+
+static void weldExact(const float *vertices, const uint nVertices, const uint nComponents, uint *first, WorkerPool *pool){
+	WeldJob job;
+	job.vertices = vertices;
+	job.nVertices = nVertices;
+	job.nComponents = nComponents;
+	job.first = first;
+	job.hashes = new uint[nVertices];
+
+	uint nChunks = (nVertices + WELD_CHUNK_SIZE - 1) / WELD_CHUNK_SIZE;
+	uint nShards = 1;
+	if (pool && nChunks > 1){
+		pool->run(hashVerticesProc, &job, nChunks);
+		nShards = nextPowerOfTwo(min((pool->getThreadCount() + 1) * WELD_SHARDS_PER_THREAD, nChunks));
+	} else {
+		for (uint i = 0; i < nChunks; i++){
+			hashVerticesProc(&job, i);
+		}
+	}
+
+	// The shards use the top bits of the hash and the tables the bottom ones
+	uint shardBits = 0;
+	while ((1U << shardBits) < nShards) shardBits++;
+	job.shardShift = 32 - shardBits;
+
+	job.shardStart = new uint[nShards + 1];
+	if (nShards > 1){
+		// Counting sort of the vertices by shard, after the fill pass each start has moved to the next shard's start
+		job.shardVertices = new uint[nVertices];
+		memset(job.shardStart, 0, (nShards + 1) * sizeof(uint));
+		for (uint i = 0; i < nVertices; i++){
+			job.shardStart[(job.hashes[i] >> job.shardShift) + 1]++;
+		}
+		for (uint s = 0; s < nShards; s++){
+			job.shardStart[s + 1] += job.shardStart[s];
+		}
+		for (uint i = 0; i < nVertices; i++){
+			job.shardVertices[job.shardStart[job.hashes[i] >> job.shardShift]++] = i;
+		}
+		memmove(job.shardStart + 1, job.shardStart, nShards * sizeof(uint));
+		job.shardStart[0] = 0;
+
+		pool->run(weldShardProc, &job, nShards);
+	} else {
+		job.shardVertices = new uint[nVertices];
+		for (uint i = 0; i < nVertices; i++){
+			job.shardVertices[i] = i;
+		}
+		job.shardStart[0] = 0;
+		job.shardStart[1] = nVertices;
+
+		weldShardProc(&job, 0);
+	}
+
+	delete [] job.shardVertices;
+	delete [] job.shardStart;
+	delete [] job.hashes;
+}
+
+#define WELD_MAX_CELL (1 << 30)
+
+static forceinline int weldCell(const float f, const float invCellSize){
+	float c = floorf(f * invCellSize);
+	if (c != c) return 0;
+	if (c < -WELD_MAX_CELL) return -WELD_MAX_CELL;
+	if (c >  WELD_MAX_CELL) return  WELD_MAX_CELL;
+	return (int) c;
+}
+
+static forceinline uint hashCell(const int *cell, const uint nGrid){
+	uint h = 0;
+	for (uint i = 0; i < nGrid; i++){
+		h = (h ^ uint(cell[i])) * 0x9E3779B1;
+	}
+	return h ^ (h >> 15);
+}
+
+static void weldEpsilon(const float *vertices, const uint nVertices, const uint nComponents, uint *first, const float epsilon){
+	// Vertices within epsilon of each other are in the same or neighboring cells of the first three components
+	uint nGrid = min(nComponents, 3);
+	float invCellSize = 1.0f / epsilon;
+
+	uint size = nextPowerOfTwo(2 * nVertices);
+	int *cellKeys = new int[size * 3];
+	uint *cellHeads = new uint[size];
+	uint *next = new uint[nVertices];
+	memset(cellHeads, 0xFF, size * sizeof(uint));
+
+	for (uint v = 0; v < nVertices; v++){
+		const float *vertex = vertices + v * nComponents;
+		first[v] = v;
+
+		bool valid = true;
+		for (uint k = 0; k < nComponents; k++){
+			if ((componentBits(vertex[k]) & 0x7FFFFFFF) > 0x7F800000) valid = false;
+		}
+		// NaN is never within epsilon of anything. Tested on the bits, as -ffast-math assumes there are none.
+		if (!valid) continue;
+
+		int cell[3];
+		for (uint k = 0; k < nGrid; k++){
+			cell[k] = weldCell(vertex[k], invCellSize);
+		}
+
+		// Merge into the lowest kept vertex in the 3^nGrid neighborhood that is within epsilon in every component
+		uint nNeighbors = 1;
+		for (uint k = 0; k < nGrid; k++) nNeighbors *= 3;
+		for (uint n = 0; n < nNeighbors; n++){
+			int neighbor[3];
+			uint d = n;
+			for (uint k = 0; k < nGrid; k++){
+				neighbor[k] = cell[k] + int(d % 3) - 1;
+				d /= 3;
+			}
+
+			uint slot = hashCell(neighbor, nGrid) & (size - 1);
+			while (cellHeads[slot] != WELD_NONE && memcmp(cellKeys + 3 * slot, neighbor, nGrid * sizeof(int))){
+				slot = (slot + 1) & (size - 1);
+			}
+
+			for (uint w = cellHeads[slot]; w != WELD_NONE; w = next[w]){
+				if (w > first[v]) continue;
+
+				const float *kept = vertices + w * nComponents;
+				uint k = 0;
+				while (k < nComponents && fabsf(kept[k] - vertex[k]) <= epsilon) k++;
+				if (k == nComponents) first[v] = w;
+			}
+		}
+
+		if (first[v] == v){
+			// Kept vertices go at the head of their cell's list
+			uint slot = hashCell(cell, nGrid) & (size - 1);
+			while (cellHeads[slot] != WELD_NONE && memcmp(cellKeys + 3 * slot, cell, nGrid * sizeof(int))){
+				slot = (slot + 1) & (size - 1);
+			}
+			memcpy(cellKeys + 3 * slot, cell, nGrid * sizeof(int));
+			next[v] = cellHeads[slot];
+			cellHeads[slot] = v;
+		}
+	}
+
+	delete [] next;
+	delete [] cellHeads;
+	delete [] cellKeys;
+}
+
+uint weldVertices(float *vertices, const uint nVertices, const uint nComponents, uint *remap, const float epsilon, WorkerPool *pool){
+	if (epsilon > 0){
+		weldEpsilon(vertices, nVertices, nComponents, remap, epsilon);
+	} else {
+		weldExact(vertices, nVertices, nComponents, remap, pool);
+	}
+
+	// The first equal vertex always comes earlier, so it has already been given its new index
+	uint nKept = 0;
+	for (uint i = 0; i < nVertices; i++){
+		bool kept = (remap[i] == i);
+		uint index = kept? nKept++ : remap[remap[i]];
+		remap[i] = index;
+
+		// Exact duplicates overwrite their kept vertex like the kd-tree did, which can only change the sign of a zero
+		if (kept || epsilon <= 0){
+			memcpy(vertices + index * nComponents, vertices + i * nComponents, nComponents * sizeof(float));
+		}
+	}
+
+	return nKept;
+}
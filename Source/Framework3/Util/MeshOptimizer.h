@@ -0,0 +1,64 @@
+/***********      .---.         .-"-.      *******************\
+* -------- *     /   ._.       /  ` \     * ---------------- *
+* Author's *     \_  (__\      \_v_/     * humus@rogers.com *
+*   note   *     //   \\       //   \\     * ICQ #47010716    *
+* -------- *    ((     ))     ((     ))    * ---------------- *
+*          ****--""---""-------""---""--****                  ********\
+* This file is a part of the work done by Humus. You are free to use  *
+* the code in any way you like, modified, unmodified or copy'n'pasted *
+* into your own work. However, I expect you to respect these points:  *
+*  @ If you use this file and its contents unmodified, or use a major *
+*    part of this file, please credit the author and leave this note. *
+*  @ For use in anything commercial, please request my approval.      *
+*  @ Share your work and ideas too as much as you can.                *
+\*********************************************************************/
+
+#ifndef _MESHOPTIMIZER_H_
+#define _MESHOPTIMIZER_H_
+
+#include "../Platform.h"
+
+class WorkerPool;
+
+// FIFO post-transform cache the orderings and statistics assume
+#define VERTEX_CACHE_SIZE 16
+
+// How much the overdraw clusters may raise the ACMR of the cache optimized order
+#define OVERDRAW_THRESHOLD 1.05f
+
+struct VertexCacheStats {
+	float acmr; // Transformed vertices per triangle
+	float atvr; // Transformed vertices per referenced vertex
+};
+
+VertexCacheStats getVertexCacheStats(const uint *indices, const uint nIndices, const uint nVertices, const uint cacheSize = VERTEX_CACHE_SIZE);
+
+/*
+	Triangle and vertex reordering for drawing. optimizeVertexCache() is Tipsify
+	(Sander et al. 2007) and returns the number of clusters it wrote to clusters,
+	which needs room for one entry per triangle. optimizeOverdraw() splits these
+	clusters where the cache allows it and sorts them using the positions, which are
+	read with a stride in floats. Clusters facing the view position go first, or
+	without one those facing out from the mesh center, which suits a mesh seen
+	from the outside. optimizeVertexFetch() puts the
+	vertices, vertexSize bytes each, in the order they are first used and returns
+	the number of used vertices.
+	All of them are deterministic.
+*/
+uint optimizeVertexCache(uint *indices, const uint nIndices, const uint nVertices, uint *clusters, const uint cacheSize = VERTEX_CACHE_SIZE);
+void optimizeOverdraw(uint *indices, const uint nIndices, const uint nVertices, const float *positions, const uint stride, const uint *clusters, const uint nClusters, const float *viewPosition = NULL, const float threshold = OVERDRAW_THRESHOLD, const uint cacheSize = VERTEX_CACHE_SIZE);
+uint optimizeVertexFetch(float *vertices, uint *indices, const uint nIndices, const uint nVertices, const uint vertexSize);
+
+/*
+	Welds the vertices, nComponents floats each, in place and writes the new index
+	of every vertex to remap. Vertices are kept in the order they first come in and
+	the number of kept vertices is returned. Without an epsilon only equal vertices
+	are merged, compared as floats so 0 and -0 are equal and NaN equals nothing.
+	These are hashed into shards that a worker pool welds in parallel. With an
+	epsilon a vertex merges into the first kept vertex that is within epsilon in
+	every component, found through a hash grid on the first three components.
+	This is order dependent and runs serially.
+*/
+uint weldVertices(float *vertices, const uint nVertices, const uint nComponents, uint *remap, const float epsilon = 0, WorkerPool *pool = NULL);
+
+#endif // _MESHOPTIMIZER_H_
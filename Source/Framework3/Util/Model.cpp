@@ -15,8 +15,16 @@
 
 #include "Model.h"
 #include "Tokenizer.h"
+#include "WorkerPool.h"
 
 #include "Hash.h"
+#include "TupleHash.h"
+#include "VertexCompression.h"
+#include <float.h>
+
+#ifdef USE_SSE
+#include <emmintrin.h>
+#endif
 
 Model::Model(){
 	vertexFormat = VF_NONE;
@@ -24,10 +32,27 @@ Model::Model(){
 	indexBuffer  = IB_NONE;
 	nIndices = 0;
 
+	positionFormat = VF_NONE;
+	positionBuffer = VB_NONE;
+	positionIndexBuffer = IB_NONE;
+	nPositions = 0;
+	positionOnly = false;
+
 	lastVertexCount = 0;
 	lastVertices = NULL;
 	lastIndices = NULL;
 	lastFormat = NULL;
+	lastFormatCount = 0;
+	lastVertexSize = 0;
+
+	compression = 0;
+
+	optimizeOrder = false;
+	orderViewSet = false;
+	memset(orderStats, 0, sizeof(orderStats));
+
+	compiled = NULL;
+	compiledSize = 0;
 }
 
 Model::~Model(){
@@ -53,6 +78,32 @@ void Model::changeAllGeneric(const bool excludeVertex){
 	}
 }
 
+#define COMPILED_MODEL_VERSION 4
+
+// Compiled file layout, all sections are 16 byte aligned
+struct CompiledModelHeader {
+	uint version;
+	uint nIndices;
+	uint nVertices;
+	uint indexSize;
+	uint nStreams;
+	uint nBatches;
+	uint streamOffset;
+	uint batchOffset;
+	uint vertexOffset;
+	uint indexOffset;
+	uint pad[2];
+	uint64 sourceKey;
+};
+
+struct CompiledStream {
+	AttributeType type;
+	uint nComponents;
+	float minBound[4];
+	float maxBound[4];
+	uint pad[2];
+};
+
 BatchID Model::addBatch(const uint startIndex, const uint nIndices){
 	Batch batch;
 
@@ -76,6 +127,15 @@ bool Model::mergeBatches(const BatchID batch, const BatchID toMerge){
 }
 
 void Model::getBoundingBox(const StreamID stream, float *minCoord, float *maxCoord) const {
+	if (compiled){
+		const CompiledStream *cStream = (const CompiledStream *) ((const ubyte *) compiled + compiled->streamOffset) + stream;
+		for (uint j = 0; j < cStream->nComponents; j++){
+			minCoord[j] = cStream->minBound[j];
+			maxCoord[j] = cStream->maxBound[j];
+		}
+		return;
+	}
+
 	float *src = streams[stream].vertices;
 	uint nVertices = streams[stream].nVertices;
 	uint nComp = streams[stream].nComponents;
@@ -149,6 +209,10 @@ bool Model::load(const char *fileName){
 
 	uint version = 0;
 	fread(&version, sizeof(uint), 1, file);
+	if (version == COMPILED_MODEL_VERSION){
+		fclose(file);
+		return loadCompiled(fileName);
+	}
 	if (version != 2){
 		fclose(file);
 		return false;
@@ -216,15 +280,484 @@ bool Model::save(const char *fileName){
 	return true;
 }
 
-bool Model::loadObj(const char *fileName){
-	Tokenizer tok, lineTok;
-	if (!tok.setFile(fileName)){
-		char str[256];
-		sprintf(str, "Couldn't open \"%s\"", fileName);
-		ErrorMsg(str);
+void convertToShorts(const uint *src, int nIndices, const uint nVertices);
+
+static uint alignOffset(const uint offset){
+	return (offset + 15) & ~15;
+}
+
+bool Model::saveCompiled(const char *fileName, const uint64 sourceKey){
+	if (compiled || streams.getCount() == 0) return false;
+	for (uint i = 0; i < streams.getCount(); i++){
+		if (streams[i].nComponents > 4) return false;
+	}
+
+	CompiledStream *cStreams = new CompiledStream[streams.getCount()];
+	StreamID *aStreams = new StreamID[streams.getCount()];
+	for (uint i = 0; i < streams.getCount(); i++){
+		aStreams[i] = i;
+
+		memset(&cStreams[i], 0, sizeof(CompiledStream));
+		cStreams[i].type = streams[i].type;
+		cStreams[i].nComponents = streams[i].nComponents;
+		getBoundingBox(i, cStreams[i].minBound, cStreams[i].maxBound);
+	}
+
+	float *vertices;
+	uint *indices;
+	uint nVertices = assemble(aStreams, streams.getCount(), &vertices, &indices, false);
+	if (optimizeOrder) nVertices = optimizeDrawOrder(vertices, indices, nVertices);
+	computeBatchRanges(indices);
+
+	CompiledModelHeader header;
+	memset(&header, 0, sizeof(header));
+	header.version = COMPILED_MODEL_VERSION;
+	header.sourceKey = sourceKey;
+	header.nIndices = nIndices;
+	header.nVertices = nVertices;
+	header.indexSize = (nVertices > 65535)? 4 : 2;
+	header.nStreams = streams.getCount();
+	header.nBatches = batches.getCount();
+	header.streamOffset = sizeof(header);
+	header.batchOffset  = alignOffset(header.streamOffset + header.nStreams * sizeof(CompiledStream));
+	header.vertexOffset = alignOffset(header.batchOffset  + header.nBatches * sizeof(Batch));
+	header.indexOffset  = alignOffset(header.vertexOffset + nVertices * getVertexSize());
+	uint fileSize = alignOffset(header.indexOffset + nIndices * header.indexSize);
+
+	if (header.indexSize == 2) convertToShorts(indices, nIndices, nVertices);
+
+	ubyte *data = new ubyte[fileSize];
+	memset(data, 0, fileSize);
+	memcpy(data, &header, sizeof(header));
+	memcpy(data + header.streamOffset, cStreams, header.nStreams * sizeof(CompiledStream));
+	memcpy(data + header.batchOffset, batches.getArray(), header.nBatches * sizeof(Batch));
+	memcpy(data + header.vertexOffset, vertices, nVertices * getVertexSize());
+	memcpy(data + header.indexOffset, indices, nIndices * header.indexSize);
+
+	delete [] aStreams;
+	delete [] cStreams;
+	delete [] vertices;
+	delete [] indices;
+
+	FILE *file = fopen(fileName, "wb");
+	bool result = (file != NULL && fwrite(data, fileSize, 1, file) == 1);
+	if (file) fclose(file);
+
+	delete [] data;
+
+	return result;
+}
+
+bool Model::loadCompiled(const char *fileName, const uint64 sourceKey){
+	clear();
+
+	size_t size;
+	void *mem = mapFile(fileName, size);
+	if (mem == NULL) return false;
+
+	const CompiledModelHeader *header = (const CompiledModelHeader *) mem;
+	if (size < sizeof(CompiledModelHeader) || header->version != COMPILED_MODEL_VERSION ||
+		(sourceKey != 0 && header->sourceKey != sourceKey) ||
+		size < header->streamOffset + header->nStreams * sizeof(CompiledStream) ||
+		size < header->batchOffset  + header->nBatches * sizeof(Batch) ||
+		size < header->indexOffset  + header->nIndices * header->indexSize){
+		unmapFile(mem, size);
+		return false;
+	}
+
+	compiled = header;
+	compiledSize = size;
+
+	// Only the vertex format is kept in the streams, the data stays in the mapping
+	const CompiledStream *cStreams = (const CompiledStream *) ((const ubyte *) mem + header->streamOffset);
+	for (uint i = 0; i < header->nStreams; i++){
+		Stream stream;
+		stream.nVertices = header->nVertices;
+		stream.vertices  = NULL;
+		stream.indices   = NULL;
+		stream.type      = cStreams[i].type;
+		stream.nComponents = cStreams[i].nComponents;
+		stream.optimized = true;
+
+		streams.add(stream);
+	}
+
+	const Batch *cBatches = (const Batch *) ((const ubyte *) mem + header->batchOffset);
+	for (uint i = 0; i < header->nBatches; i++){
+		batches.add(cBatches[i]);
+	}
+
+	nIndices = header->nIndices;
+	lastVertexCount = header->nVertices;
+
+	if (size < header->vertexOffset + header->nVertices * getVertexSize()){
+		clear();
+		return false;
+	}
+
+	return true;
+}
+
+// Compiled models are only drawn, so they always get the optimized order
+#define COMPILE_OPTIMIZE_ORDER true
+
+static uint64 getSourceKey(const char *srcFileName){
+	size_t size = 0;
+	void *mem = mapFile(srcFileName, size);
+	if (mem == NULL) return 0;
+
+	// 64 bit FNV-1a of the source file and the compile options
+	uint64 key = 14695981039346656037ULL;
+
+	const ubyte *data = (const ubyte *) mem;
+	for (size_t i = 0; i < size; i++){
+		key = (key ^ data[i]) * 1099511628211ULL;
+	}
+	unmapFile(mem, size);
+
+	uint options[1] = { COMPILE_OPTIMIZE_ORDER };
+
+	data = (const ubyte *) options;
+	for (uint j = 0; j < sizeof(options); j++){
+		key = (key ^ data[j]) * 1099511628211ULL;
+	}
+
+	return key;
+}
+
+bool Model::compileFile(const char *srcFileName, const char *destFileName){
+	Model model;
+
+	const char *ext = strrchr(srcFileName, '.');
+	bool loaded = (ext != NULL && stricmp(ext, ".obj") == 0)? model.loadObj(srcFileName) : model.load(srcFileName);
+
+	model.setOptimizeOrder(COMPILE_OPTIMIZE_ORDER);
+
+	return loaded && model.saveCompiled(destFileName, getSourceKey(srcFileName));
+}
+
+bool Model::loadCached(const char *srcFileName, const char *compiledFileName){
+	uint64 key = getSourceKey(srcFileName);
+
+	// Without the source there is nothing to check against or compile from, so take the compiled file as is
+	if (key == 0) return loadCompiled(compiledFileName);
+
+	if (loadCompiled(compiledFileName, key)) return true;
+
+	return compileFile(srcFileName, compiledFileName) && loadCompiled(compiledFileName, key);
+}
+
+// Zero-copy tokenizer over the file contents, splits tokens the same way as Tokenizer does
+struct ObjTokenizer {
+	ObjTokenizer(const char *string, const uint len, const uint pos){
+		str = string;
+		length = len;
+		start = end = pos;
+	}
+
+	// Position of the next token, or the length if there is none
+	uint peek() const {
+		uint pos = end;
+		while (pos < length && isWhiteSpace(str[pos])) pos++;
+		return pos;
+	}
+
+	bool next(){
+		start = peek();
+		end = start + 1;
+
+		if (start < length){
+			if (isNumeric(str[start])){
+				while (end < length && (isNumeric(str[end]) || str[end] == '.')) end++;
+			} else if (isAlphabetical(str[start])){
+				while (end < length && (isAlphabetical(str[end]) || isNumeric(str[end]))) end++;
+			}
+			return true;
+		}
+		start = end = length;
 		return false;
 	}
 
+	bool goToNextLine(){
+		if (end < length){
+			start = end;
+
+			while (end < length && !isNewLine(str[end])) end++;
+
+			if (end + 1 < length && isNewLine(str[end + 1]) && str[end] != str[end + 1]) end += 2; else end++;
+			if (end > length) end = length;
+			return true;
+		}
+		return false;
+	}
+
+	char first() const { return (start < end)? str[start] : '\0'; }
+	char second() const { return (start + 1 < end)? str[start + 1] : '\0'; }
+
+	bool equals(const char *string) const {
+		uint len = (uint) strlen(string);
+		return (end - start == len && strnicmp(str + start, string, len) == 0);
+	}
+
+	// Same result as atoi() on the token
+	int toInt() const {
+		uint value = 0;
+		for (uint i = start; i < end && isNumeric(str[i]); i++){
+			value = value * 10 + (str[i] - '0');
+		}
+		return (int) value;
+	}
+
+	// Same result as (float) atof() on the token
+	float toFloat() const {
+		if (start < end && isNumeric(str[start])){
+			uint64 mantissa = 0;
+			uint nDigits = 0;
+			uint nDecimals = 0;
+			bool point = false;
+			for (uint i = start; i < end; i++){
+				if (str[i] == '.'){
+					if (point) break;
+					point = true;
+				} else {
+					mantissa = mantissa * 10 + (str[i] - '0');
+					if (mantissa) nDigits++;
+					if (point) nDecimals++;
+				}
+			}
+
+			// The mantissa and power of ten are exact doubles, so the division is correctly rounded like atof()
+			static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+			if (nDigits <= 15 && nDecimals <= 22){
+				return (float) (double(int64(mantissa)) / powers[nDecimals]);
+			}
+		}
+
+		char buffer[256];
+		uint len = min(end - start, (uint) sizeof(buffer) - 1);
+		memcpy(buffer, str + start, len);
+		buffer[len] = '\0';
+
+		return (float) atof(buffer);
+	}
+
+	float readFloat(){
+		if (!next()) return 0;
+
+		if (first() == '-'){
+			next();
+			return -toFloat();
+		} else {
+			if (first() == '+'){
+				next();
+			}
+			return toFloat();
+		}
+	}
+
+	const char *str;
+	uint length;
+	uint start, end;
+};
+
+#define OBJ_FACE     0
+#define OBJ_MATERIAL 1
+
+// Faces and material changes depend on what came before them in the file, so they are replayed in order after parsing
+struct ObjStatement {
+	uint type;
+
+	// The token values of a face, or the material name in the file
+	uint first;
+	uint count;
+
+	// Texture coordinates and normals earlier in the chunk
+	uint nTexCoords;
+	uint nNormals;
+};
+
+struct ObjChunk {
+	void reset(){
+		vertices.reset();
+		normals.reset();
+		texCoords.reset();
+		tangents.reset();
+		binormals.reset();
+		tokens.reset();
+		statements.reset();
+	}
+
+	uint start, end;
+	uint parsedEnd;
+
+	Array <vec3> vertices;
+	Array <vec3> normals;
+	Array <vec2> texCoords;
+	Array <vec3> tangents;
+	Array <vec3> binormals;
+
+	Array <int> tokens;
+	Array <ObjStatement> statements;
+};
+
+// Parses the statements that begin in [from, chunk.end). Vertex data is stored directly, faces and material changes are recorded.
+static void parseObjChunk(const char *str, const uint length, ObjChunk &chunk, const uint from){
+	ObjTokenizer tok(str, length, from);
+
+	ObjStatement statement;
+	float x, y, z;
+
+	while (tok.peek() < chunk.end){
+		tok.next();
+
+		switch (tok.first()){
+			case 'f':
+				statement.type = OBJ_FACE;
+				statement.first = chunk.tokens.getCount();
+				statement.nTexCoords = chunk.texCoords.getCount();
+				statement.nNormals = chunk.normals.getCount();
+
+				if (tok.goToNextLine()){
+					ObjTokenizer lineTok(str, tok.end, tok.start);
+					while (lineTok.next()){
+						chunk.tokens.add(lineTok.toInt());
+					}
+				}
+
+				statement.count = chunk.tokens.getCount() - statement.first;
+				chunk.statements.add(statement);
+				break;
+			case 'v':
+				switch (tok.second()){
+					case '\0':
+						x = tok.readFloat();
+						y = tok.readFloat();
+						z = tok.readFloat();
+						chunk.vertices.add(vec3(x, y, z));
+						break;
+					case 'n':
+						x = tok.readFloat();
+						y = tok.readFloat();
+						z = tok.readFloat();
+						chunk.normals.add(vec3(x, y, z));
+						break;
+					case 't':
+						x = tok.readFloat();
+						y = tok.readFloat();
+						chunk.texCoords.add(vec2(x, y));
+						break;
+				}
+				break;
+			case '#':
+				if (tok.next() && tok.first() == '_'){
+					tok.next();
+					tok.next();
+					if (tok.equals("tangent")){
+						x = tok.readFloat();
+						y = tok.readFloat();
+						z = tok.readFloat();
+						chunk.tangents.add(vec3(x, y, z));
+					} else if (tok.equals("binormal")){
+						x = tok.readFloat();
+						y = tok.readFloat();
+						z = tok.readFloat();
+						chunk.binormals.add(vec3(x, y, z));
+					}
+				} else {
+					tok.goToNextLine();
+				}
+				break;
+			case 'u':
+				tok.next();
+
+				statement.type = OBJ_MATERIAL;
+				statement.first = tok.start;
+				statement.count = tok.end - tok.start;
+				chunk.statements.add(statement);
+				break;
+			default:
+				tok.goToNextLine();
+				break;
+		}
+	}
+
+	chunk.parsedEnd = tok.end;
+}
+
+struct ObjParseJob {
+	const char *str;
+	uint length;
+	ObjChunk *chunks;
+};
+
+static void parseObjChunkProc(void *data, const uint index){
+	ObjParseJob *job = (ObjParseJob *) data;
+	ObjChunk &chunk = job->chunks[index];
+
+	parseObjChunk(job->str, job->length, chunk, chunk.start);
+}
+
+template <class TYPE>
+static void appendArray(Array <TYPE> &dest, const Array <TYPE> &src){
+	uint count = dest.getCount();
+	if (src.getCount()){
+		dest.setCount(count + src.getCount());
+		memcpy(dest.getArray() + count, src.getArray(), src.getCount() * sizeof(TYPE));
+	}
+}
+
+#define OBJ_CHUNK_SIZE (256 * 1024)
+#define OBJ_CHUNKS_PER_THREAD 4
+
+bool Model::loadObj(const char *fileName, WorkerPool *pool){
+	size_t size = 0;
+	const char *str = (const char *) mapFile(fileName, size);
+	if (str == NULL){
+		// Empty files can't be mapped
+		FILE *file = fopen(fileName, "rb");
+		if (file == NULL){
+			char error[256];
+			sprintf(error, "Couldn't open \"%s\"", fileName);
+			ErrorMsg(error);
+			return false;
+		}
+		fclose(file);
+		size = 0;
+	}
+	uint length = (uint) size;
+
+	// Split the file into chunks at line starts
+	uint nChunks = 1;
+	if (pool){
+		nChunks = min((pool->getThreadCount() + 1) * OBJ_CHUNKS_PER_THREAD, length / OBJ_CHUNK_SIZE + 1);
+	}
+
+	ObjChunk *chunks = new ObjChunk[nChunks];
+	uint start = 0;
+	for (uint i = 0; i < nChunks; i++){
+		uint end = length;
+		if (i + 1 < nChunks){
+			end = max(uint(uint64(length) * (i + 1) / nChunks), start);
+			while (end < length && str[end] != '\n') end++;
+			if (end < length) end++;
+		}
+
+		chunks[i].start = start;
+		chunks[i].end = end;
+		start = end;
+	}
+
+	ObjParseJob job;
+	job.str = str;
+	job.length = length;
+	job.chunks = chunks;
+
+	if (pool){
+		pool->run(parseObjChunkProc, &job, nChunks);
+	} else {
+		parseObjChunkProc(&job, 0);
+	}
+
 	Array <vec3> vertices;
 	Array <vec3> normals;
 	Array <vec2> texCoords;
@@ -245,89 +778,61 @@ bool Model::loadObj(const char *fileName){
 	uint currIndex = 0;
 	uint currMaterial = 0;
 
+	Array <char> name;
 
-	uint n, vStart, nStart, tStart;
-	char *str;
+	for (uint c = 0; c < nChunks; c++){
+		ObjChunk &chunk = chunks[c];
 
-	while ((str = tok.next()) != NULL){
-		switch (str[0]){
-			case 'f':
-				lineTok.setString(tok.nextLine());
+		// A statement ran past the end of the previous chunk, so this one has to be parsed again from where it ended
+		if (c > 0 && chunks[c - 1].parsedEnd > chunk.start){
+			chunk.reset();
+			parseObjChunk(str, length, chunk, chunks[c - 1].parsedEnd);
+		}
 
-				vStart = vtxIndices.getCount();
-				nStart = nrmIndices.getCount();
-				tStart = txcIndices.getCount();
-				n = 0;
-				while ((str = lineTok.next()) != NULL){
+		for (uint s = 0; s < chunk.statements.getCount(); s++){
+			const ObjStatement &statement = chunk.statements[s];
+
+			if (statement.type == OBJ_FACE){
+				bool hasTexCoords = (texCoords.getCount() + statement.nTexCoords > 0);
+				bool hasNormals   = (normals.getCount()   + statement.nNormals   > 0);
+
+				const int *tokens = chunk.tokens.getArray() + statement.first;
+				uint nTokens = statement.count;
+
+				uint vStart = vtxIndices.getCount();
+				uint nStart = nrmIndices.getCount();
+				uint tStart = txcIndices.getCount();
+				uint n = 0;
+				uint t = 0;
+				while (t < nTokens){
 					if (n > 2){
 						vtxIndices.add(vtxIndices[vStart]);
 						vtxIndices.add(vtxIndices[vtxIndices.getCount() - 2]);
-						if (texCoords.getCount()){
+						if (hasTexCoords){
 							txcIndices.add(txcIndices[tStart]);
 							txcIndices.add(txcIndices[txcIndices.getCount() - 2]);
 						}
-						if (normals.getCount()){
+						if (hasNormals){
 							nrmIndices.add(nrmIndices[nStart]);
 							nrmIndices.add(nrmIndices[nrmIndices.getCount() - 2]);
 						}
 					}
 
-					vtxIndices.add(atoi(str) - 1);
+					vtxIndices.add(tokens[t++] - 1);
 
-					if (texCoords.getCount() || normals.getCount()) lineTok.goToNext();
-					if (texCoords.getCount()){
-						txcIndices.add(atoi(lineTok.next()) - 1);
+					// Skip the separators
+					if ((hasTexCoords || hasNormals) && t < nTokens) t++;
+					if (hasTexCoords){
+						txcIndices.add(((t < nTokens)? tokens[t++] : 0) - 1);
 					}
-					if (normals.getCount()){
-						lineTok.goToNext();
-						nrmIndices.add(atoi(lineTok.next()) - 1);
+					if (hasNormals){
+						if (t < nTokens) t++;
+						nrmIndices.add(((t < nTokens)? tokens[t++] : 0) - 1);
 					}
 
 					n++;
 				}
-				break;
-			case 'v':
-				float x, y, z;
-				switch (str[1]){
-					case '\0':
-						x = readFloat(tok);
-						y = readFloat(tok);
-						z = readFloat(tok);
-						vertices.add(vec3(x, y, z));
-						break;
-					case 'n':
-						x = readFloat(tok);
-						y = readFloat(tok);
-						z = readFloat(tok);
-						normals.add(vec3(x, y, z));
-						break;
-					case 't':
-						x = readFloat(tok);
-						y = readFloat(tok);
-						texCoords.add(vec2(x, y));
-						break;
-				}
-				break;
-			case '#':
-				if (*tok.next() == '_'){
-					tok.goToNext();
-					str = tok.next();
-					if (stricmp(str, "tangent") == 0){
-						x = readFloat(tok);
-						y = readFloat(tok);
-						z = readFloat(tok);
-						tangents.add(vec3(x, y, z));
-					} else if (stricmp(str, "binormal") == 0){
-						x = readFloat(tok);
-						y = readFloat(tok);
-						z = readFloat(tok);
-						binormals.add(vec3(x, y, z));
-					}
-				} else {
-					tok.goToNextLine();
-				}
-				break;
-			case 'u':
+			} else {
 				if (vtxIndices.getCount()){
 					materials[currMaterial].indices->add(currIndex);
 					materials[currMaterial].indices->add(vtxIndices.getCount() - currIndex);
@@ -339,14 +844,26 @@ bool Model::loadObj(const char *fileName){
 					materials.clear();
 				}
 
-				currMaterial = getObjMaterial(materials, tok.next());
-				break;
-			default:
-				tok.goToNextLine();
-				break;
+				name.setCount(statement.count + 1);
+				memcpy(name.getArray(), str + statement.first, statement.count);
+				name[statement.count] = '\0';
+
+				currMaterial = getObjMaterial(materials, name.getArray());
+			}
 		}
+
+		appendArray(vertices,  chunk.vertices);
+		appendArray(normals,   chunk.normals);
+		appendArray(texCoords, chunk.texCoords);
+		appendArray(tangents,  chunk.tangents);
+		appendArray(binormals, chunk.binormals);
+
+		chunk.reset();
 	}
 
+	delete [] chunks;
+	if (str) unmapFile((void *) str, size);
+
 	materials[currMaterial].indices->add(currIndex);
 	materials[currMaterial].indices->add(vtxIndices.getCount() - currIndex);
 
@@ -812,115 +1329,267 @@ void tangentVectors(const vec3 &v0, const vec3 &v1, const vec3 &v2, const vec2 &
 	normal = normalize(cross(dv0, dv1));
 }
 
-bool Model::computeTangentSpace(const bool flat){
-	StreamID streams[2] = { findStream(TYPE_VERTEX), findStream(TYPE_TEXCOORD) };
+// The SIMD path does the same operations in the same order as tangentVectors() and normalize(), so the results are bit exact
+#ifdef USE_SSE
+// One divss per lane, with -ffast-math a packed 1 / x becomes an rcpps estimate that doesn't match the scalar divide
+static forceinline SIMD_EXACT __m128 reciprocalSIMD(const __m128 x){
+	__m128 one = _mm_set_ss(1.0f);
+	__m128 r0 = _mm_div_ss(one, x);
+	__m128 r1 = _mm_div_ss(one, _mm_shuffle_ps(x, x, _MM_SHUFFLE(1, 1, 1, 1)));
+	__m128 r2 = _mm_div_ss(one, _mm_shuffle_ps(x, x, _MM_SHUFFLE(2, 2, 2, 2)));
+	__m128 r3 = _mm_div_ss(one, _mm_shuffle_ps(x, x, _MM_SHUFFLE(3, 3, 3, 3)));
+	return _mm_movelh_ps(_mm_unpacklo_ps(r0, r1), _mm_unpacklo_ps(r2, r3));
+}
 
-	if (streams[0] < 0 || streams[1] < 0) return false;
+static forceinline SIMD_EXACT void normalizeSIMD(__m128 &x, __m128 &y, __m128 &z){
+	__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+	__m128 invLen = reciprocalSIMD(_mm_sqrt_ps(d));
+	x = _mm_mul_ps(x, invLen);
+	y = _mm_mul_ps(y, invLen);
+	z = _mm_mul_ps(z, invLen);
+}
 
-	float *vertexArrays[2];
-	uint *indices;
+static forceinline SIMD_EXACT void storeSIMD(vec3 *dest, const __m128 &x, const __m128 &y, const __m128 &z){
+	alignment(16) float px[4], py[4], pz[4];
+	_mm_store_ps(px, x);
+	_mm_store_ps(py, y);
+	_mm_store_ps(pz, z);
+	for (int k = 0; k < 4; k++){
+		dest[k] = vec3(px[k], py[k], pz[k]);
+	}
+}
+#endif
+
+// Normalized tangent, binormal and normal of faces [first, last), a flat tangent space normalizes the tangents twice like it always has
+static SIMD_EXACT void faceTangents(const vec3 *vertices, const vec2 *texCoords, const uint *indices, const uint first, const uint last, const bool flat, const bool useSIMD, vec3 *sdirs, vec3 *tdirs, vec3 *normals){
+	uint i = first;
+
+#ifdef USE_SSE
+	for (; useSIMD && i + 4 <= last; i += 4){
+		const uint *ind = indices + 3 * i;
+
+		__m128 v0x = _mm_setr_ps(vertices[ind[0]].x, vertices[ind[3]].x, vertices[ind[6]].x, vertices[ind[9]].x);
+		__m128 v0y = _mm_setr_ps(vertices[ind[0]].y, vertices[ind[3]].y, vertices[ind[6]].y, vertices[ind[9]].y);
+		__m128 v0z = _mm_setr_ps(vertices[ind[0]].z, vertices[ind[3]].z, vertices[ind[6]].z, vertices[ind[9]].z);
+
+		__m128 dv0x = _mm_sub_ps(_mm_setr_ps(vertices[ind[1]].x, vertices[ind[4]].x, vertices[ind[7]].x, vertices[ind[10]].x), v0x);
+		__m128 dv0y = _mm_sub_ps(_mm_setr_ps(vertices[ind[1]].y, vertices[ind[4]].y, vertices[ind[7]].y, vertices[ind[10]].y), v0y);
+		__m128 dv0z = _mm_sub_ps(_mm_setr_ps(vertices[ind[1]].z, vertices[ind[4]].z, vertices[ind[7]].z, vertices[ind[10]].z), v0z);
+		__m128 dv1x = _mm_sub_ps(_mm_setr_ps(vertices[ind[2]].x, vertices[ind[5]].x, vertices[ind[8]].x, vertices[ind[11]].x), v0x);
+		__m128 dv1y = _mm_sub_ps(_mm_setr_ps(vertices[ind[2]].y, vertices[ind[5]].y, vertices[ind[8]].y, vertices[ind[11]].y), v0y);
+		__m128 dv1z = _mm_sub_ps(_mm_setr_ps(vertices[ind[2]].z, vertices[ind[5]].z, vertices[ind[8]].z, vertices[ind[11]].z), v0z);
+
+		__m128 t0x = _mm_setr_ps(texCoords[ind[0]].x, texCoords[ind[3]].x, texCoords[ind[6]].x, texCoords[ind[9]].x);
+		__m128 t0y = _mm_setr_ps(texCoords[ind[0]].y, texCoords[ind[3]].y, texCoords[ind[6]].y, texCoords[ind[9]].y);
+
+		__m128 dt0x = _mm_sub_ps(_mm_setr_ps(texCoords[ind[1]].x, texCoords[ind[4]].x, texCoords[ind[7]].x, texCoords[ind[10]].x), t0x);
+		__m128 dt0y = _mm_sub_ps(_mm_setr_ps(texCoords[ind[1]].y, texCoords[ind[4]].y, texCoords[ind[7]].y, texCoords[ind[10]].y), t0y);
+		__m128 dt1x = _mm_sub_ps(_mm_setr_ps(texCoords[ind[2]].x, texCoords[ind[5]].x, texCoords[ind[8]].x, texCoords[ind[11]].x), t0x);
+		__m128 dt1y = _mm_sub_ps(_mm_setr_ps(texCoords[ind[2]].y, texCoords[ind[5]].y, texCoords[ind[8]].y, texCoords[ind[11]].y), t0y);
+
+		__m128 r = reciprocalSIMD(_mm_sub_ps(_mm_mul_ps(dt0x, dt1y), _mm_mul_ps(dt1x, dt0y)));
+
+		__m128 sx = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(dt1y, dv0x), _mm_mul_ps(dt0y, dv1x)), r);
+		__m128 sy = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(dt1y, dv0y), _mm_mul_ps(dt0y, dv1y)), r);
+		__m128 sz = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(dt1y, dv0z), _mm_mul_ps(dt0y, dv1z)), r);
+		__m128 tx = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(dt0x, dv1x), _mm_mul_ps(dt1x, dv0x)), r);
+		__m128 ty = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(dt0x, dv1y), _mm_mul_ps(dt1x, dv0y)), r);
+		__m128 tz = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(dt0x, dv1z), _mm_mul_ps(dt1x, dv0z)), r);
+
+		__m128 nx = _mm_sub_ps(_mm_mul_ps(dv0y, dv1z), _mm_mul_ps(dv1y, dv0z));
+		__m128 ny = _mm_sub_ps(_mm_mul_ps(dv0z, dv1x), _mm_mul_ps(dv0x, dv1z));
+		__m128 nz = _mm_sub_ps(_mm_mul_ps(dv0x, dv1y), _mm_mul_ps(dv0y, dv1x));
+
+		normalizeSIMD(sx, sy, sz);
+		normalizeSIMD(tx, ty, tz);
+		normalizeSIMD(nx, ny, nz);
+		if (flat){
+			normalizeSIMD(sx, sy, sz);
+			normalizeSIMD(tx, ty, tz);
+		}
 
-	uint nVertices = assemble(streams, 2, vertexArrays, &indices, true);
+		storeSIMD(sdirs   + i, sx, sy, sz);
+		storeSIMD(tdirs   + i, tx, ty, tz);
+		storeSIMD(normals + i, nx, ny, nz);
+	}
+#endif
 
-	vec3 *vertices  = (vec3 *) vertexArrays[0];
-	vec2 *texCoords = (vec2 *) vertexArrays[1];
+	for (; i < last; i++){
+		const uint *ind = indices + 3 * i;
 
-	if (flat){
-		uint nFaces = nIndices / 3;
+		vec3 sdir, tdir, normal;
+		tangentVectors(vertices[ind[0]], vertices[ind[1]], vertices[ind[2]], texCoords[ind[0]], texCoords[ind[1]], texCoords[ind[2]], sdir, tdir, normal);
 
-		vec3 *tangents  = new vec3[nFaces];
-		vec3 *binormals = new vec3[nFaces];
-		vec3 *normals   = new vec3[nFaces];
+		sdir = normalize(sdir);
+		tdir = normalize(tdir);
+		if (flat){
+			sdir = normalize(sdir);
+			tdir = normalize(tdir);
+		}
 
-		uint *indicesS = new uint[nIndices];
-		uint *indicesT = new uint[nIndices];
-		uint *indicesN = new uint[nIndices];
+		sdirs  [i] = sdir;
+		tdirs  [i] = tdir;
+		normals[i] = normal;
+	}
+}
 
-		for (uint i = 0; i < nFaces; i++){
-			vec3 v0 = vertices[indices[3 * i    ]];
-			vec3 v1 = vertices[indices[3 * i + 1]];
-			vec3 v2 = vertices[indices[3 * i + 2]];
+#define TANGENT_CHUNK_SIZE 4096
 
-			vec2 t0 = texCoords[indices[3 * i    ]];
-			vec2 t1 = texCoords[indices[3 * i + 1]];
-			vec2 t2 = texCoords[indices[3 * i + 2]];
+struct TangentJob {
+	const vec3 *vertices;
+	const vec2 *texCoords;
+	const uint *indices;
+	uint nFaces;
+	bool flat;
+	bool useSIMD;
 
-			vec3 sdir, tdir, normal;
-			tangentVectors(v0, v1, v2, t0, t1, t2, sdir, tdir, normal);
+	vec3 *faceTangents;
+	vec3 *faceBinormals;
+	vec3 *faceNormals;
 
-			sdir = normalize(sdir);
-			tdir = normalize(tdir);
+	// Faces around each vertex in CSR form, in the order the faces come in the index list
+	const uint *vertexStart;
+	const uint *vertexFaces;
+	uint nVertices;
 
-			tangents [i] = normalize(sdir);
-			binormals[i] = normalize(tdir);
-			normals  [i] = normal;
+	vec3 *tangents;
+	vec3 *binormals;
+	vec3 *normals;
+};
 
-			indicesS[3 * i] = indicesS[3 * i + 1] = indicesS[3 * i + 2] = i;
-			indicesT[3 * i] = indicesT[3 * i + 1] = indicesT[3 * i + 2] = i;
-			indicesN[3 * i] = indicesN[3 * i + 1] = indicesN[3 * i + 2] = i;
-		}
+static void faceTangentProc(void *data, const uint index){
+	TangentJob *job = (TangentJob *) data;
 
-		addStream(TYPE_TANGENT,  3, nFaces, (float *) tangents,  indicesS, false);
-		addStream(TYPE_BINORMAL, 3, nFaces, (float *) binormals, indicesT, false);
-		addStream(TYPE_NORMAL,   3, nFaces, (float *) normals,   indicesN, false);
+	uint first = index * TANGENT_CHUNK_SIZE;
+	uint last = min(first + TANGENT_CHUNK_SIZE, job->nFaces);
+	faceTangents(job->vertices, job->texCoords, job->indices, first, last, job->flat, job->useSIMD, job->faceTangents, job->faceBinormals, job->faceNormals);
+}
 
-		delete indices;
+static void vertexTangentProc(void *data, const uint index){
+	TangentJob *job = (TangentJob *) data;
+
+	uint first = index * TANGENT_CHUNK_SIZE;
+	uint last = min(first + TANGENT_CHUNK_SIZE, job->nVertices);
+	for (uint j = first; j < last; j++){
+		// Sums start from zero and add the faces in index order, just like scattering into the vertices would
+		vec3 tangent(0, 0, 0), binormal(0, 0, 0), normal(0, 0, 0);
+		for (uint k = job->vertexStart[j]; k < job->vertexStart[j + 1]; k++){
+			uint face = job->vertexFaces[k];
+			tangent  += job->faceTangents [face];
+			binormal += job->faceBinormals[face];
+			normal   += job->faceNormals  [face];
+		}
 
+		job->tangents [j] = normalize(tangent);
+		job->binormals[j] = normalize(binormal);
+		job->normals  [j] = normalize(normal);
+	}
+}
+
+static void runTangentJob(WorkerProc proc, TangentJob *job, const uint count, WorkerPool *pool){
+	uint nChunks = (count + TANGENT_CHUNK_SIZE - 1) / TANGENT_CHUNK_SIZE;
+	if (pool){
+		pool->run(proc, job, nChunks);
 	} else {
-		vec3 *tangents  = new vec3[nVertices];
-		vec3 *binormals = new vec3[nVertices];
-		vec3 *normals   = new vec3[nVertices];
+		for (uint i = 0; i < nChunks; i++){
+			proc(job, i);
+		}
+	}
+}
 
-		memset(tangents,  0, nVertices * sizeof(vec3));
-		memset(binormals, 0, nVertices * sizeof(vec3));
-		memset(normals,   0, nVertices * sizeof(vec3));
+bool Model::computeTangentSpace(const bool flat, WorkerPool *pool, const bool useSIMD){
+	StreamID streams[2] = { findStream(TYPE_VERTEX), findStream(TYPE_TEXCOORD) };
 
-		for (uint i = 0; i < nIndices; i += 3){
-			vec3 v0 = vertices[indices[i    ]];
-			vec3 v1 = vertices[indices[i + 1]];
-			vec3 v2 = vertices[indices[i + 2]];
+	if (streams[0] < 0 || streams[1] < 0) return false;
+
+	float *vertexArrays[2];
+	uint *indices;
 
-			vec2 t0 = texCoords[indices[i    ]];
-			vec2 t1 = texCoords[indices[i + 1]];
-			vec2 t2 = texCoords[indices[i + 2]];
+	uint nVertices = assemble(streams, 2, vertexArrays, &indices, true);
 
-			vec3 sdir, tdir, normal;
-			tangentVectors(v0, v1, v2, t0, t1, t2, sdir, tdir, normal);
+	uint nFaces = nIndices / 3;
 
-			sdir = normalize(sdir);
-			tdir = normalize(tdir);
+	TangentJob job;
+	job.vertices  = (vec3 *) vertexArrays[0];
+	job.texCoords = (vec2 *) vertexArrays[1];
+	job.indices   = indices;
+	job.nFaces    = nFaces;
+	job.flat      = flat;
+	job.useSIMD   = useSIMD;
+	job.nVertices = nVertices;
+
+	if (flat){
+		vec3 *tangents  = new vec3[nFaces];
+		vec3 *binormals = new vec3[nFaces];
+		vec3 *normals   = new vec3[nFaces];
 
-			tangents[indices[i    ]] += sdir;
-			tangents[indices[i + 1]] += sdir;
-			tangents[indices[i + 2]] += sdir;
+		job.faceTangents  = tangents;
+		job.faceBinormals = binormals;
+		job.faceNormals   = normals;
+		runTangentJob(faceTangentProc, &job, nFaces, pool);
 
-			binormals[indices[i    ]] += tdir;
-			binormals[indices[i + 1]] += tdir;
-			binormals[indices[i + 2]] += tdir;
+		uint *indicesS = new uint[nIndices];
+		uint *indicesT = new uint[nIndices];
+		uint *indicesN = new uint[nIndices];
 
-			normals[indices[i    ]] += normal;
-			normals[indices[i + 1]] += normal;
-			normals[indices[i + 2]] += normal;
+		for (uint i = 0; i < nFaces; i++){
+			indicesS[3 * i] = indicesS[3 * i + 1] = indicesS[3 * i + 2] = i;
+			indicesT[3 * i] = indicesT[3 * i + 1] = indicesT[3 * i + 2] = i;
+			indicesN[3 * i] = indicesN[3 * i + 1] = indicesN[3 * i + 2] = i;
+		}
+
+		addStream(TYPE_TANGENT,  3, nFaces, (float *) tangents,  indicesS, false);
+		addStream(TYPE_BINORMAL, 3, nFaces, (float *) binormals, indicesT, false);
+		addStream(TYPE_NORMAL,   3, nFaces, (float *) normals,   indicesN, false);
+
+		delete indices;
+
+	} else {
+		vec3 *faceVectors = new vec3[3 * nFaces];
+		job.faceTangents  = faceVectors;
+		job.faceBinormals = faceVectors + nFaces;
+		job.faceNormals   = faceVectors + 2 * nFaces;
+		runTangentJob(faceTangentProc, &job, nFaces, pool);
+
+		// Counting sort of the corners by vertex, after the fill pass each start has moved to the next vertex's start
+		uint *vertexStart = new uint[nVertices + 1];
+		uint *vertexFaces = new uint[3 * nFaces];
+		memset(vertexStart, 0, (nVertices + 1) * sizeof(uint));
+		for (uint i = 0; i < 3 * nFaces; i++){
+			vertexStart[indices[i] + 1]++;
 		}
-		
 		for (uint j = 0; j < nVertices; j++){
-			tangents [j] = normalize(tangents [j]);
-			binormals[j] = normalize(binormals[j]);
-			normals  [j] = normalize(normals  [j]);
+			vertexStart[j + 1] += vertexStart[j];
 		}
+		for (uint i = 0; i < 3 * nFaces; i++){
+			vertexFaces[vertexStart[indices[i]]++] = i / 3;
+		}
+		memmove(vertexStart + 1, vertexStart, nVertices * sizeof(uint));
+		vertexStart[0] = 0;
+
+		job.vertexStart = vertexStart;
+		job.vertexFaces = vertexFaces;
+		job.tangents  = new vec3[nVertices];
+		job.binormals = new vec3[nVertices];
+		job.normals   = new vec3[nVertices];
+		runTangentJob(vertexTangentProc, &job, nVertices, pool);
+
+		delete [] vertexFaces;
+		delete [] vertexStart;
+		delete [] faceVectors;
 
 		uint *indicesS = new uint[nIndices];
 		uint *indicesT = new uint[nIndices];
 		memcpy(indicesS, indices, nIndices * sizeof(uint));
 		memcpy(indicesT, indices, nIndices * sizeof(uint));
 
-		addStream(TYPE_TANGENT,  3, nVertices, (float *) tangents,  indicesS, false);
-		addStream(TYPE_BINORMAL, 3, nVertices, (float *) binormals, indicesT, false);
-		addStream(TYPE_NORMAL,   3, nVertices, (float *) normals,   indices,  false);
+		addStream(TYPE_TANGENT,  3, nVertices, (float *) job.tangents,  indicesS, false);
+		addStream(TYPE_BINORMAL, 3, nVertices, (float *) job.binormals, indicesT, false);
+		addStream(TYPE_NORMAL,   3, nVertices, (float *) job.normals,   indices,  false);
 	}
 
-	delete vertices;
-	delete texCoords;
+	delete [] vertexArrays[0];
+	delete [] vertexArrays[1];
 //	delete indices;
 
 	return true;
@@ -1010,7 +1679,7 @@ bool Model::addStencilVolume(){
 
 struct Triangle {
 	vec3 pos[3];
-	float *attributes[3];
+	uint attributes[3];
 	int batch;
 };
 
@@ -1018,6 +1687,145 @@ int compareTriangles(const Triangle &elem0, const Triangle &elem1){
 	return elem0.batch - elem1.batch;
 }
 
+// Returns true if the vertex lies on the inside of the edge, this is the test cleanUp() does for each vertex
+static inline bool splitsEdge(const vec3 &v0, const vec3 &v1, const vec3 &vertex, float &c){
+	vec3 vVec = v1 - v0;
+	vec3 lVec = vertex - v0;
+
+	c = dot(lVec, vVec) / dot(vVec, vVec);
+	if (c > 0.00001f && c < 0.99999f){
+		vec3 pl = c * vVec - lVec;
+		return (dot(pl, pl) < 0.0001f);
+	}
+	return false;
+}
+
+// Uniform grid over the vertices, so that only the vertices close to an edge need to be tested
+struct VertexGrid {
+	VertexGrid(const vec3 *vertices, const uint nVertices){
+		vec3 maxBound;
+		minBound = maxBound = (nVertices > 0)? vertices[0] : vec3(0, 0, 0);
+		for (uint i = 1; i < nVertices; i++){
+			for (uint k = 0; k < 3; k++){
+				if (vertices[i][k] < minBound[k]) minBound[k] = vertices[i][k];
+				if (vertices[i][k] > maxBound[k]) maxBound[k] = vertices[i][k];
+			}
+		}
+
+		// Around one vertex per cell
+		vec3 extent = maxBound - minBound;
+		float maxExtent = max(max(extent.x, extent.y), extent.z);
+		cellSize = maxExtent / powf((float) max(nVertices, 1U), 1.0f / 3.0f);
+		if (cellSize <= 0) cellSize = 1;
+
+		for (uint i = 0; i < 3; i++){
+			size[i] = min((int) (extent[i] / cellSize) + 1, 1024);
+		}
+
+		// A vertex passing the edge test is within 0.01 units of the edge, the rest covers rounding
+		float maxCoord = max(length(minBound), length(maxBound));
+		margin = 0.01f + 0.0001f + maxCoord * 0.00001f;
+
+		// Bucket the vertices with a counting sort, which keeps them in index order within each cell
+		uint nCells = size[0] * size[1] * size[2];
+		cellStart = new uint[nCells + 1];
+		memset(cellStart, 0, (nCells + 1) * sizeof(uint));
+
+		uint *cells = new uint[nVertices];
+		for (uint i = 0; i < nVertices; i++){
+			cells[i] = getCell(vertices[i]);
+			cellStart[cells[i] + 1]++;
+		}
+		for (uint i = 0; i < nCells; i++){
+			cellStart[i + 1] += cellStart[i];
+		}
+
+		cellVertices = new uint[nVertices];
+		for (uint i = 0; i < nVertices; i++){
+			cellVertices[cellStart[cells[i]]++] = i;
+		}
+		for (uint i = nCells; i > 0; i--){
+			cellStart[i] = cellStart[i - 1];
+		}
+		cellStart[0] = 0;
+
+		delete [] cells;
+
+		this->vertices = vertices;
+		this->nVertices = nVertices;
+	}
+
+	~VertexGrid(){
+		delete [] cellStart;
+		delete [] cellVertices;
+	}
+
+	int getCoord(const float x, const uint axis) const {
+		int c = (int) floorf((x - minBound[axis]) / cellSize);
+		return (c < 0)? 0 : (c >= size[axis])? size[axis] - 1 : c;
+	}
+
+	uint getCell(const vec3 &pos) const {
+		return (getCoord(pos.z, 2) * size[1] + getCoord(pos.y, 1)) * size[0] + getCoord(pos.x, 0);
+	}
+
+	// Returns the lowest index of a vertex splitting the edge, or -1 if there's none
+	int findSplit(const vec3 &v0, const vec3 &v1, float &splitC) const {
+		int lo[3], hi[3];
+		uint nCells = 1;
+		for (uint i = 0; i < 3; i++){
+			lo[i] = getCoord(min(v0[i], v1[i]) - margin, i);
+			hi[i] = getCoord(max(v0[i], v1[i]) + margin, i);
+			nCells *= hi[i] - lo[i] + 1;
+		}
+
+		// Long edges cover too many cells, then it's quicker to go through all vertices in order
+		if (nCells > nVertices){
+			for (uint k = 0; k < nVertices; k++){
+				if (splitsEdge(v0, v1, vertices[k], splitC)) return k;
+			}
+			return -1;
+		}
+
+		uint best = nVertices;
+		for (int z = lo[2]; z <= hi[2]; z++){
+			for (int y = lo[1]; y <= hi[1]; y++){
+				uint cell = (z * size[1] + y) * size[0];
+				for (uint k = cellStart[cell + lo[0]]; k < cellStart[cell + hi[0] + 1]; k++){
+					uint index = cellVertices[k];
+
+					float c;
+					if (index < best && splitsEdge(v0, v1, vertices[index], c)){
+						best = index;
+						splitC = c;
+					}
+				}
+			}
+		}
+
+		return (best < nVertices)? best : -1;
+	}
+
+	const vec3 *vertices;
+	uint nVertices;
+
+	vec3 minBound;
+	float cellSize;
+	float margin;
+	int size[3];
+
+	uint *cellStart;
+	uint *cellVertices;
+};
+
+static uint copyAttributes(Array <float> &attributes, const uint src, const uint nAttrib){
+	uint dest = attributes.getCount();
+	for (uint i = 0; i < nAttrib; i++){
+		attributes.add(attributes[src + i]);
+	}
+	return dest;
+}
+
 void Model::cleanUp(){
 	StreamID vertexStream = findStream(TYPE_VERTEX);
 	if (vertexStream < 0) return;
@@ -1030,7 +1838,10 @@ void Model::cleanUp(){
 
 	Array <Triangle> triangles;
 
-	uint nAttrib = getComponentCount();
+	// The attributes of all triangle corners are stored in one array and referenced by offset
+	Array <float> attributes;
+
+	uint nAttrib = getComponentCount() - streams[vertexStream].nComponents;
 
 	for (uint n = 0; n < batches.getCount(); n++){
 		uint endIndex = batches[n].startIndex + batches[n].nIndices;
@@ -1040,14 +1851,15 @@ void Model::cleanUp(){
 
 			for (uint j = 0; j < 3; j++){
 				tri.pos[j] = vertices[indices[i + j]];
-				tri.attributes[j] = new float[nAttrib];
+				tri.attributes[j] = attributes.getCount();
 
-				float *dest = tri.attributes[j];
 				for (uint k = 0; k < streams.getCount(); k++){
 					if (signed(k) != vertexStream){
 						int nComp = streams[k].nComponents;
-						memcpy(dest, streams[k].vertices + nComp * streams[k].indices[i + j], nComp * sizeof(float));
-						dest += nComp;
+						const float *src = streams[k].vertices + nComp * streams[k].indices[i + j];
+						for (int c = 0; c < nComp; c++){
+							attributes.add(src[c]);
+						}
 					}
 				}
 			}
@@ -1056,61 +1868,63 @@ void Model::cleanUp(){
 		}
 	}
 
-	for (uint i = 0; i < triangles.getCount(); i++){
-
-restart:
+	VertexGrid grid(vertices, nVertices);
 
+	for (uint i = 0; i < triangles.getCount(); i++){
 		uint prev = 2;
-		for (uint j = 0; j < 3; j++){
-			vec3 v0 = triangles[i].pos[prev];
-			vec3 v1 = triangles[i].pos[j];
-
-			for (uint k = 0; k < nVertices; k++){
-				vec3 vVec = v1 - v0;
-				vec3 lVec = vertices[k] - v0;
-
-				float c = dot(lVec, vVec) / dot(vVec, vVec);
-				if (c > 0.00001f && c < 0.99999f){
-					vec3 pl = c * vVec - lVec;
-					if (dot(pl, pl) < 0.0001f){
-
-						// Copy current triangle
-						Triangle tri;
-						tri.batch = triangles[i].batch;
-						for (uint x = 0; x < 3; x++){
-							tri.pos[x] = triangles[i].pos[x];
-							tri.attributes[x] = new float[nAttrib];
-							memcpy(tri.attributes[x], triangles[i].attributes[x], nAttrib * sizeof(float));
-						}
+		uint j = 0;
+		while (j < 3){
+			float c;
+			int k = grid.findSplit(triangles[i].pos[prev], triangles[i].pos[j], c);
+			if (k < 0){
+				prev = j;
+				j++;
+				continue;
+			}
 
-						// Assign new position for the splitted edge
-						triangles[i].pos[j] = vertices[k];
-						tri.pos[prev] = vertices[k];
+			// Copy current triangle
+			Triangle tri;
+			tri.batch = triangles[i].batch;
+			for (uint x = 0; x < 3; x++){
+				tri.pos[x] = triangles[i].pos[x];
+				tri.attributes[x] = copyAttributes(attributes, triangles[i].attributes[x], nAttrib);
+			}
 
-						// Interpolate the other attributes
-						for (uint x = 0; x < nAttrib; x++){
-							float ip = lerp(tri.attributes[prev][x], tri.attributes[j][x], c);
+			// Assign new position for the splitted edge
+			triangles[i].pos[j] = vertices[k];
+			tri.pos[prev] = vertices[k];
 
-							triangles[i].attributes[j][x] = ip;
-							tri.attributes[prev][x] = ip;
-						}
+			// Interpolate the other attributes
+			float *attribs = attributes.getArray();
+			for (uint x = 0; x < nAttrib; x++){
+				float ip = lerp(attribs[tri.attributes[prev] + x], attribs[tri.attributes[j] + x], c);
 
-						triangles.add(tri);
+				attribs[triangles[i].attributes[j] + x] = ip;
+				attribs[tri.attributes[prev] + x] = ip;
+			}
 
+			triangles.add(tri);
 
-						goto restart;
-					}
-				}
+			// Only the split edge and the edge after it have changed, so the edges before it
+			// don't need to be tested again, except the first edge when the last one was split
+			if (j == 2){
+				prev = 2;
+				j = 0;
 			}
-
-			prev = j;
 		}
 	}
 
-	triangles.sort(compareTriangles);
+	// The sort leaves triangles already in batch order in place, but is quadratic on equal keys
+	uint sorted = 1;
+	while (sorted < triangles.getCount() && triangles[sorted - 1].batch <= triangles[sorted].batch) sorted++;
+	if (sorted < triangles.getCount()){
+		triangles.sort(compareTriangles);
+	}
 
 	nIndices = 3 * triangles.getCount();
 
+	const float *attribs = attributes.getArray();
+
 	uint currComp = 0;
 	for (uint i = 0; i < streams.getCount(); i++){
 		delete streams[i].vertices;
@@ -1132,7 +1946,7 @@ restart:
 			float *dest = streams[i].vertices;
 			for (uint j = 0; j < triangles.getCount(); j++){
 				for (uint k = 0; k < 3; k++){
-					memcpy(dest, triangles[j].attributes[k] + currComp, nComp * sizeof(float));
+					memcpy(dest, attribs + triangles[j].attributes[k] + currComp, nComp * sizeof(float));
 					dest += nComp;
 				}
 			}
@@ -1156,9 +1970,6 @@ restart:
 	uint startIndex = 0;
 	while (i < triangles.getCount()){
 		while (i < triangles.getCount() && triangles[i].batch == currBatch){
-			for (int j = 0; j < 3; j++){
-				delete triangles[i].attributes[j];
-			}
 			i++;
 		}
 
@@ -1397,41 +2208,47 @@ void Model::clear(){
 	lastVertices = NULL;
 	lastIndices = NULL;
 	lastFormat = NULL;
+	lastFormatCount = 0;
+	lastVertexSize = 0;
+
+	positionRanges.clear();
+
+	if (compiled){
+		unmapFile((void *) compiled, compiledSize);
+		compiled = NULL;
+		compiledSize = 0;
+	}
 }
 
-void Model::optimize(){
+uint Model::optimize(const float epsilon, WorkerPool *pool){
+	uint nMerged = 0;
 	for (uint i = 0; i < streams.getCount(); i++){
-		optimizeStream(i);
+		nMerged += optimizeStream(i, epsilon, pool);
 	}
+	return nMerged;
 }
 
-void Model::optimizeStream(const StreamID streamID){
-	if (streams[streamID].optimized) return;
+uint Model::optimizeStream(const StreamID streamID, const float epsilon, WorkerPool *pool){
+	if (streams[streamID].optimized && epsilon <= 0) return 0;
 
 	uint nComp = streams[streamID].nComponents;
 	uint nVert = streams[streamID].nVertices;
 
-	KdTree <float> kdTree(nComp, nVert);
-
 	uint *indexRemap = new uint[nVert];
 	float *vertices = streams[streamID].vertices;
-	for (uint i = 0; i < nVert; i++){
-		float *vertex = vertices + i * nComp;
-		uint index = kdTree.addUnique(vertex);
-
-		indexRemap[i] = index;
-		memcpy(vertices + index * nComp, vertex, nComp * sizeof(float));
-	}
+	uint nKept = weldVertices(vertices, nVert, nComp, indexRemap, epsilon, pool);
 
 	uint *indices = streams[streamID].indices;
 	for (uint j = 0; j < nIndices; j++){
 		indices[j] = indexRemap[indices[j]];
 	}
 
-	delete indexRemap;
-	streams[streamID].nVertices = kdTree.getCount();
-	streams[streamID].vertices = (float *) realloc(vertices, kdTree.getCount() * nComp * sizeof(float));
+	delete [] indexRemap;
+	streams[streamID].nVertices = nKept;
+	streams[streamID].vertices = (float *) realloc(vertices, nKept * nComp * sizeof(float));
 	streams[streamID].optimized = true;
+
+	return nVert - nKept;
 }
 
 uint Model::assemble(const StreamID *aStreams, const uint nStreams, float **destVertices, uint **destIndices, bool separateArrays){
@@ -1450,7 +2267,7 @@ uint Model::assemble(const StreamID *aStreams, const uint nStreams, float **dest
 	uint *iDest = *destIndices = new uint[nIndices];
 
 	uint *iIndex = new uint[nStreams];
-	Hash hash(nStreams, nIndices >> 3, nIndices);
+	TupleHash <uint> hash(nStreams, nIndices >> 2);
 	for (j = 0; j < nIndices; j++){
 		for (i = 0; i < nStreams; i++){
 			iIndex[i] = streams[aStreams[i]].indices[j];
@@ -1508,55 +2325,563 @@ void convertToShorts(const uint *src, int nIndices, const uint nVertices){
 	}
 }
 
-uint Model::makeDrawable(Renderer *renderer, const bool useCache, const ShaderID shader){
-	if (streams.getCount() == 0) return 0;
+static void computeVertexRanges(Batch *batches, const uint nBatches, const uint *indices){
+	for (uint j = 0; j < nBatches; j++){
+		uint minVertex = 0xFFFFFFFF;
+		uint maxVertex = 0;
+
+		uint first = batches[j].startIndex;
+		uint last  = first + batches[j].nIndices;
+		if (first < last){
+			for (uint i = first; i < last; i++){
+				if (indices[i] < minVertex) minVertex = indices[i];
+				if (indices[i] > maxVertex) maxVertex = indices[i];
+			}
 
-	int vertexSize = getVertexSize();
+			batches[j].startVertex = minVertex;
+			batches[j].nVertices = maxVertex - minVertex + 1;
+		} else {
+			// Empty batch
+			batches[j].startVertex = 0;
+			batches[j].nVertices = 0;
+		}
+	}
+}
 
-	if (useCache && lastVertices){
-		if ((vertexFormat = renderer->addVertexFormat(lastFormat, streams.getCount(), shader)) == VF_NONE) return 0;
-		if ((vertexBuffer = renderer->addVertexBuffer(lastVertexCount * vertexSize, STATIC, lastVertices)) == VB_NONE) return 0;
+void Model::computeBatchRanges(const uint *indices){
+	computeVertexRanges(batches.getArray(), batches.getCount(), indices);
+}
+
+void Model::setOptimizeOrder(const bool enable, const float *viewPosition){
+	optimizeOrder = enable;
+	orderViewSet = (viewPosition != NULL);
+	if (viewPosition) memcpy(orderView, viewPosition, sizeof(orderView));
+}
+
+uint Model::optimizeDrawOrder(float *vertices, uint *indices, const uint nVertices){
+	orderStats[0] = getVertexCacheStats(indices, nIndices, nVertices);
+
+	// Positions are read in place from the interleaved vertices
+	StreamID vertexStream = findStream(TYPE_VERTEX);
+	uint stride = getComponentCount();
+	uint offset = 0;
+	for (int i = 0; i < vertexStream; i++){
+		offset += streams[i].nComponents;
+	}
+
+	// Triangles are only reordered within each batch, batches that are already in a better order for the cache are kept
+	uint *clusters = new uint[nIndices / 3 + 1];
+	uint *original = new uint[nIndices];
+	for (uint j = 0; j < batches.getCount(); j++){
+		uint *batchIndices = indices + batches[j].startIndex;
+		uint nBatchIndices = batches[j].nIndices;
+		memcpy(original, batchIndices, nBatchIndices * sizeof(uint));
+
+		uint nClusters = optimizeVertexCache(batchIndices, nBatchIndices, nVertices, clusters);
+		if (vertexStream >= 0 && streams[vertexStream].nComponents >= 3){
+			optimizeOverdraw(batchIndices, nBatchIndices, nVertices, vertices + offset, stride, clusters, nClusters, orderViewSet? orderView : NULL);
+		}
+
+		if (getVertexCacheStats(batchIndices, nBatchIndices, nVertices).acmr > getVertexCacheStats(original, nBatchIndices, nVertices).acmr){
+			memcpy(batchIndices, original, nBatchIndices * sizeof(uint));
+		}
+	}
+	delete [] original;
+	delete [] clusters;
 
-		if (lastVertexCount > 65535){
-			if ((indexBuffer = renderer->addIndexBuffer(nIndices, 4, STATIC, lastIndices)) == IB_NONE) return 0;
+	uint nUsed = optimizeVertexFetch(vertices, indices, nIndices, nVertices, getVertexSize());
+
+	orderStats[1] = getVertexCacheStats(indices, nIndices, nUsed);
+
+	return nUsed;
+}
+
+enum PackMode {
+	PACK_FLOAT,
+	PACK_POSITION,
+	PACK_HALF,
+	PACK_OCTAHEDRAL,
+	PACK_TANGENT_FRAME,
+};
+
+struct PackedAttrib {
+	PackMode mode;
+	uint offset[3]; // Components into the assembled vertex, the tangent, binormal and normal for a tangent frame
+	uint nComponents;
+	uint destOffset;
+	FormatDesc format;
+};
+
+uint Model::getPackedFormat(PackedAttrib *attribs, uint &vertexSize) const {
+	static const uint formatSize[] = { sizeof(float), sizeof(half), sizeof(ubyte), sizeof(short) };
+
+	StreamID vertex   = findStream(TYPE_VERTEX);
+	StreamID tangent  = findStream(TYPE_TANGENT);
+	StreamID binormal = findStream(TYPE_BINORMAL);
+	StreamID normal   = findStream(TYPE_NORMAL);
+	bool packFrame = (compression & COMPRESS_TANGENT_FRAME) && tangent >= 0 && binormal >= 0 && normal >= 0 &&
+		streams[tangent].nComponents == 3 && streams[binormal].nComponents == 3 && streams[normal].nComponents == 3;
+
+	uint *offsets = new uint[streams.getCount()];
+	uint offset = 0;
+	for (uint i = 0; i < streams.getCount(); i++){
+		offsets[i] = offset;
+		offset += streams[i].nComponents;
+	}
+
+	// The position goes first so that it aliases with gl_Vertex
+	uint nAttribs = 0;
+	for (int k = -1; k < (int) streams.getCount(); k++){
+		int i = (k < 0)? vertex : k;
+		if (i < 0 || (k >= 0 && i == vertex)) continue;
+		if (packFrame && (i == binormal || i == normal)) continue;
+
+		PackedAttrib &attrib = attribs[nAttribs++];
+		attrib.mode = PACK_FLOAT;
+		attrib.offset[0] = offsets[i];
+		attrib.nComponents = streams[i].nComponents;
+		attrib.format.format = FORMAT_FLOAT;
+
+		if (i == vertex){
+			if ((compression & COMPRESS_POSITION) && streams[i].nComponents == 3){
+				attrib.mode = PACK_POSITION;
+				attrib.nComponents = 4;
+				attrib.format.format = FORMAT_SHORT;
+			}
+		} else if (packFrame && i == tangent){
+			attrib.mode = PACK_TANGENT_FRAME;
+			attrib.offset[1] = offsets[binormal];
+			attrib.offset[2] = offsets[normal];
+			attrib.nComponents = 4;
+			attrib.format.format = FORMAT_SHORT;
+		} else if ((compression & COMPRESS_NORMAL) && streams[i].type == TYPE_NORMAL && streams[i].nComponents == 3){
+			attrib.mode = PACK_OCTAHEDRAL;
+			attrib.nComponents = 2;
+			attrib.format.format = FORMAT_SHORT;
+		} else if ((compression & COMPRESS_TEXCOORD) && streams[i].type == TYPE_TEXCOORD && (streams[i].nComponents == 2 || streams[i].nComponents == 4)){
+			attrib.mode = PACK_HALF;
+			attrib.format.format = FORMAT_HALF;
+		}
+
+		attrib.format.stream = 0;
+		attrib.format.type = TYPE_GENERIC;
+		attrib.format.size = attrib.nComponents;
+	}
+
+	// All formats are a multiple of four bytes
+	vertexSize = 0;
+	for (uint i = 0; i < nAttribs; i++){
+		attribs[i].destOffset = vertexSize;
+		vertexSize += attribs[i].nComponents * formatSize[attribs[i].format.format];
+	}
+
+	delete [] offsets;
+
+	return nAttribs;
+}
+
+uint Model::getCompressedVertexSize() const {
+	if (compression == 0) return getVertexSize();
+
+	PackedAttrib *attribs = new PackedAttrib[streams.getCount()];
+	uint vertexSize;
+	getPackedFormat(attribs, vertexSize);
+	delete [] attribs;
+
+	return vertexSize;
+}
+
+uint Model::separateBatches(float **vertices, uint *indices, const uint nVertices){
+	// Every batch gets its own copy of the vertices it uses, in the order they are first used
+	uint nBatches = batches.getCount();
+	uint nRanges = max(nBatches, 1);
+	uint nComponents = getComponentCount();
+
+	uint *stamp = new uint[nVertices];
+	uint *remap = new uint[nVertices];
+	memset(stamp, 0xFF, nVertices * sizeof(uint));
+
+	uint nNewVertices = 0;
+	for (uint j = 0; j < nRanges; j++){
+		uint first = nBatches? batches[j].startIndex : 0;
+		uint last  = nBatches? first + batches[j].nIndices : nIndices;
+		for (uint i = first; i < last; i++){
+			if (stamp[indices[i]] != j){
+				stamp[indices[i]] = j;
+				nNewVertices++;
+			}
+		}
+	}
+
+	// Indices outside the batches are never drawn with compressed positions
+	float *newVertices = new float[nNewVertices * nComponents];
+	uint *newIndices = new uint[nIndices];
+	memset(newIndices, 0, nIndices * sizeof(uint));
+	memset(stamp, 0xFF, nVertices * sizeof(uint));
+
+	nNewVertices = 0;
+	for (uint j = 0; j < nRanges; j++){
+		uint first = nBatches? batches[j].startIndex : 0;
+		uint last  = nBatches? first + batches[j].nIndices : nIndices;
+		for (uint i = first; i < last; i++){
+			uint v = indices[i];
+			if (stamp[v] != j){
+				stamp[v] = j;
+				remap[v] = nNewVertices;
+				memcpy(newVertices + nNewVertices * nComponents, *vertices + v * nComponents, nComponents * sizeof(float));
+				nNewVertices++;
+			}
+			newIndices[i] = remap[v];
+		}
+	}
+	memcpy(indices, newIndices, nIndices * sizeof(uint));
+
+	delete [] *vertices;
+	*vertices = newVertices;
+
+	delete [] newIndices;
+	delete [] remap;
+	delete [] stamp;
+
+	return nNewVertices;
+}
+
+void Model::computePositionRanges(const float *vertices, const uint nVertices, Array <PositionRange> &ranges) const {
+	StreamID vertex = findStream(TYPE_VERTEX);
+	uint nComponents = getComponentCount();
+	uint offset = 0;
+	for (int i = 0; i < vertex; i++){
+		offset += streams[i].nComponents;
+	}
+
+	// One range per batch, as the batches don't share vertices
+	uint nRanges = max(batches.getCount(), 1);
+	for (uint j = 0; j < nRanges; j++){
+		uint first = batches.getCount()? batches[j].startVertex : 0;
+		uint count = batches.getCount()? batches[j].nVertices : nVertices;
+
+		vec3 minPos(FLT_MAX, FLT_MAX, FLT_MAX);
+		vec3 maxPos(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		for (uint v = first; v < first + count; v++){
+			const float *pos = vertices + v * nComponents + offset;
+			for (uint k = 0; k < 3; k++){
+				if (pos[k] < minPos[k]) minPos[k] = pos[k];
+				if (pos[k] > maxPos[k]) maxPos[k] = pos[k];
+			}
+		}
+
+		PositionRange range;
+		if (count > 0){
+			range.scale = 0.5f * (maxPos - minPos);
+			range.bias  = 0.5f * (maxPos + minPos);
 		} else {
-			if ((indexBuffer = renderer->addIndexBuffer(nIndices, 2, STATIC, lastIndices)) == IB_NONE) return 0;
+			range.scale = vec3(0, 0, 0);
+			range.bias  = vec3(0, 0, 0);
 		}
+		ranges.add(range);
+	}
+}
 
-		return lastVertexCount;
+static void packVertex(const float *src, ubyte *dest, const PackedAttrib *attribs, const uint nAttribs, const PositionRange *range){
+	for (uint i = 0; i < nAttribs; i++){
+		const float *s = src + attribs[i].offset[0];
+		ubyte *d = dest + attribs[i].destOffset;
+
+		switch (attribs[i].mode){
+		case PACK_FLOAT:
+			memcpy(d, s, attribs[i].nComponents * sizeof(float));
+			break;
+		case PACK_POSITION:
+			for (uint k = 0; k < 3; k++){
+				float x = (range->scale[k] > 0)? (s[k] - range->bias[k]) / range->scale[k] : 0;
+				((short *) d)[k] = packSnorm16(x);
+			}
+			((short *) d)[3] = 32767;
+			break;
+		case PACK_HALF:
+			for (uint k = 0; k < attribs[i].nComponents; k++){
+				((half *) d)[k] = half(s[k]);
+			}
+			break;
+		case PACK_OCTAHEDRAL:
+			packOctahedral(*(const vec3 *) s, (short *) d);
+			break;
+		case PACK_TANGENT_FRAME:
+			packTangentFrame(*(const vec3 *) s, *(const vec3 *) (src + attribs[i].offset[1]), *(const vec3 *) (src + attribs[i].offset[2]), (short *) d);
+			break;
+		}
+	}
+}
+
+static void unpackVertex(const ubyte *src, float *dest, const PackedAttrib *attribs, const uint nAttribs, const PositionRange *range){
+	for (uint i = 0; i < nAttribs; i++){
+		const ubyte *s = src + attribs[i].destOffset;
+		float *d = dest + attribs[i].offset[0];
+
+		switch (attribs[i].mode){
+		case PACK_FLOAT:
+			memcpy(d, s, attribs[i].nComponents * sizeof(float));
+			break;
+		case PACK_POSITION:
+			for (uint k = 0; k < 3; k++){
+				d[k] = unpackSnorm16(((const short *) s)[k]) * range->scale[k] + range->bias[k];
+			}
+			break;
+		case PACK_HALF:
+			for (uint k = 0; k < attribs[i].nComponents; k++){
+				d[k] = ((const half *) s)[k];
+			}
+			break;
+		case PACK_OCTAHEDRAL:
+			*(vec3 *) d = unpackOctahedral((const short *) s);
+			break;
+		case PACK_TANGENT_FRAME:
+			unpackTangentFrame((const short *) s, *(vec3 *) d, *(vec3 *) (dest + attribs[i].offset[1]), *(vec3 *) (dest + attribs[i].offset[2]));
+			break;
+		}
+	}
+}
+
+float *Model::packVertices(const float *vertices, const uint nVertices, const PackedAttrib *attribs, const uint nAttribs, const uint vertexSize, const Array <PositionRange> &ranges) const {
+	uint nComponents = getComponentCount();
+	float *packed = new float[nVertices * vertexSize / sizeof(float)];
+	ubyte *dest = (ubyte *) packed;
+
+	if (ranges.getCount() == 0){
+		for (uint v = 0; v < nVertices; v++){
+			packVertex(vertices + v * nComponents, dest + v * vertexSize, attribs, nAttribs, NULL);
+		}
 	} else {
-		StreamID *aStreams = new StreamID[streams.getCount()];
+		// The batches own separate vertex ranges
+		for (uint j = 0; j < ranges.getCount(); j++){
+			uint first = batches.getCount()? batches[j].startVertex : 0;
+			uint count = batches.getCount()? batches[j].nVertices : nVertices;
+			for (uint v = first; v < first + count; v++){
+				packVertex(vertices + v * nComponents, dest + v * vertexSize, attribs, nAttribs, &ranges[j]);
+			}
+		}
+	}
 
-		for (uint i = 0; i < streams.getCount(); i++){
-			aStreams[i] = i;
+	return packed;
+}
+
+static float angleBetween(const vec3 &u, const vec3 &v){
+	return atan2f(length(cross(u, v)), dot(u, v));
+}
+
+// About four steps of the snorm16 components
+#define UNIT_VECTOR_BOUND (4.0f / 32767.0f)
+
+void Model::setCompression(const uint flags){
+	// The vertices cached by makeDrawable() are packed for the old flags
+	if (flags != compression){
+		delete [] lastVertices;
+		delete [] lastIndices;
+		delete [] lastFormat;
+
+		lastVertices = NULL;
+		lastIndices = NULL;
+		lastFormat = NULL;
+	}
+	compression = flags;
+}
+
+bool Model::validateCompression(CompressionError &error, CompressionError &bound){
+	memset(&error, 0, sizeof(error));
+	memset(&bound, 0, sizeof(bound));
+	if (compiled || streams.getCount() == 0) return false;
+
+	StreamID *aStreams = new StreamID[streams.getCount()];
+	for (uint i = 0; i < streams.getCount(); i++){
+		aStreams[i] = i;
+	}
+	float *vertices;
+	uint *indices;
+	uint nVertices = assemble(aStreams, streams.getCount(), &vertices, &indices, false);
+	if (compression & COMPRESS_POSITION) nVertices = separateBatches(&vertices, indices, nVertices);
+	computeBatchRanges(indices);
+
+	PackedAttrib *attribs = new PackedAttrib[streams.getCount()];
+	uint vertexSize;
+	uint nAttribs = getPackedFormat(attribs, vertexSize);
+
+	Array <PositionRange> ranges;
+	if (compression & COMPRESS_POSITION) computePositionRanges(vertices, nVertices, ranges);
+	float *packed = packVertices(vertices, nVertices, attribs, nAttribs, vertexSize, ranges);
+
+	uint nComponents = getComponentCount();
+	float *decoded = new float[nComponents];
+
+	bool valid = true;
+	bound.normal = UNIT_VECTOR_BOUND;
+	bound.frame = UNIT_VECTOR_BOUND;
+	for (uint v = 0; v < nVertices; v++){
+		const PositionRange *range = NULL;
+		for (uint j = 0; j < ranges.getCount(); j++){
+			uint first = batches.getCount()? batches[j].startVertex : 0;
+			uint count = batches.getCount()? batches[j].nVertices : nVertices;
+			if (v >= first && v < first + count) range = &ranges[j];
 		}
-		float *vertices;
-		uint *indices;
 
-		uint nVertices = assemble(aStreams, streams.getCount(), &vertices, &indices, false);
+		const float *src = vertices + v * nComponents;
+		unpackVertex(((ubyte *) packed) + v * vertexSize, decoded, attribs, nAttribs, range);
 
-		// Compute ranges for batches
-		for (uint j = 0; j < batches.getCount(); j++){
-			uint minVertex = 0xFFFFFFFF;
-			uint maxVertex = 0;
-
-			uint first = batches[j].startIndex;
-			uint last  = first + batches[j].nIndices;
-			if (first < last){
-				for (uint i = first; i < last; i++){
-					if (indices[i] < minVertex) minVertex = indices[i];
-					if (indices[i] > maxVertex) maxVertex = indices[i];
+		for (uint i = 0; i < nAttribs; i++){
+			const float *s = src + attribs[i].offset[0];
+			const float *d = decoded + attribs[i].offset[0];
+
+			switch (attribs[i].mode){
+			case PACK_FLOAT:
+				break;
+			case PACK_POSITION:
+				// Half a step, and the float rounding when decoding
+				for (uint k = 0; k < 3; k++){
+					float e = fabsf(d[k] - s[k]);
+					float b = range->scale[k] * (0.5f / 32767.0f) + (fabsf(range->bias[k]) + range->scale[k]) * 2 * FLT_EPSILON;
+					if (e > error.position) error.position = e;
+					if (b > bound.position) bound.position = b;
+					if (e > b) valid = false;
+				}
+				break;
+			case PACK_HALF:
+				// Half the spacing of the 11 bit mantissa, or of the denormals
+				for (uint k = 0; k < attribs[i].nComponents; k++){
+					float e = fabsf(d[k] - s[k]);
+					float b = fabsf(s[k]) * (1.0f / 2048.0f) + (1.0f / 33554432.0f);
+					if (e > error.texCoord) error.texCoord = e;
+					if (b > bound.texCoord) bound.texCoord = b;
+					if (e > b) valid = false;
+				}
+				break;
+			case PACK_OCTAHEDRAL:
+				{
+					float e = angleBetween(*(const vec3 *) d, normalize(*(const vec3 *) s));
+					if (e > error.normal) error.normal = e;
+					if (e > bound.normal) valid = false;
+				}
+				break;
+			case PACK_TANGENT_FRAME:
+				{
+					const float *offsets[] = { s, src + attribs[i].offset[1], src + attribs[i].offset[2] };
+					vec3 frame[3];
+					orthonormalizeTangentFrame(*(const vec3 *) offsets[0], *(const vec3 *) offsets[1], *(const vec3 *) offsets[2], frame[0], frame[1], frame[2]);
+
+					for (uint k = 0; k < 3; k++){
+						float e = angleBetween(*(const vec3 *) (decoded + attribs[i].offset[k]), frame[k]);
+						if (e > error.normal) error.normal = e;
+						if (e > bound.normal) valid = false;
+
+						// Turning the frame changes the shading as much as a decoding error does
+						float f = angleBetween(normalize(*(const vec3 *) offsets[k]), frame[k]);
+						if (f > error.frame) error.frame = f;
+						if (f > bound.frame) valid = false;
+					}
 				}
+				break;
+			}
+		}
+	}
 
-				batches[j].startVertex = minVertex;
-				batches[j].nVertices = maxVertex - minVertex + 1;
-			} else {
-				// Empty batch
-				batches[j].startVertex = 0;
-				batches[j].nVertices = 0;
+	delete [] decoded;
+	delete [] packed;
+	delete [] attribs;
+	delete [] vertices;
+	delete [] indices;
+	delete [] aStreams;
+
+	return valid;
+}
+
+void Model::setPositionRange(Renderer *renderer, const uint range){
+	renderer->setShaderConstant3f("positionScale", positionRanges[range].scale);
+	renderer->setShaderConstant3f("positionBias",  positionRanges[range].bias);
+	renderer->applyConstants();
+}
+
+bool Model::makePositionBuffers(Renderer *renderer, const ubyte *vertices, const uint vertexSize, const void *indices, const uint indexSize, const ShaderID shader){
+	StreamID vertex = findStream(TYPE_VERTEX);
+	if (vertex < 0) return true;
+
+	// The positions are copied as they are in the full vertex, so both give the same depth
+	FormatDesc format;
+	uint offset = 0;
+	if (compression && !compiled){
+		PackedAttrib *attribs = new PackedAttrib[streams.getCount()];
+		uint packedSize;
+		getPackedFormat(attribs, packedSize);
+		format = attribs[0].format;
+		delete [] attribs;
+	} else {
+		for (int i = 0; i < vertex; i++){
+			offset += streams[i].nComponents * sizeof(float);
+		}
+		format.stream = 0;
+		format.type   = TYPE_VERTEX;
+		format.format = FORMAT_FLOAT;
+		format.size   = streams[vertex].nComponents;
+	}
+	uint size = format.size * ((format.format == FORMAT_SHORT)? sizeof(short) : sizeof(float));
+
+	// Positions with a range per batch can only be shared within their batch
+	bool perBatch = (positionRanges.getCount() > 1);
+	uint nRanges = perBatch? batches.getCount() : 1;
+
+	uint nKey = size / sizeof(uint) + 1;
+	uint *key = new uint[nKey];
+	uint *positionIndices = new uint[nIndices];
+	ubyte *positions = new ubyte[nIndices * size];
+	memset(positionIndices, 0, nIndices * sizeof(uint));
+
+	TupleHash <uint> hash(nKey, nIndices >> 2);
+	for (uint j = 0; j < nRanges; j++){
+		uint first = perBatch? batches[j].startIndex : 0;
+		uint last  = perBatch? first + batches[j].nIndices : nIndices;
+		for (uint i = first; i < last; i++){
+			uint v = (indexSize == 2)? ((const ushort *) indices)[i] : ((const uint *) indices)[i];
+
+			memcpy(key, vertices + v * vertexSize + offset, size);
+			key[nKey - 1] = j;
+
+			uint index;
+			if (!hash.insert(key, &index)){
+				memcpy(positions + index * size, key, size);
 			}
+			positionIndices[i] = index;
+		}
+	}
+	nPositions = hash.getCount();
+
+	positionBatches.setCount(batches.getCount());
+	memcpy(positionBatches.getArray(), batches.getArray(), batches.getCount() * sizeof(Batch));
+	computeVertexRanges(positionBatches.getArray(), positionBatches.getCount(), positionIndices);
+
+	bool result = false;
+	if ((positionFormat = renderer->addVertexFormat(&format, 1, shader)) != VF_NONE &&
+		(positionBuffer = renderer->addVertexBuffer(nPositions * size, STATIC, positions)) != VB_NONE){
+
+		if (nPositions > 65535){
+			positionIndexBuffer = renderer->addIndexBuffer(nIndices, 4, STATIC, positionIndices);
+		} else {
+			convertToShorts(positionIndices, nIndices, nPositions);
+			positionIndexBuffer = renderer->addIndexBuffer(nIndices, 2, STATIC, positionIndices);
 		}
+		result = (positionIndexBuffer != IB_NONE);
+	}
+
+	delete [] positions;
+	delete [] positionIndices;
+	delete [] key;
+
+	return result;
+}
+
+uint Model::makeDrawable(Renderer *renderer, const bool useCache, const ShaderID shader){
+	if (streams.getCount() == 0) return 0;
+
+	uint vertexSize = getVertexSize();
 
+	if (compiled){
+		// Upload straight from the mapped file
 		FormatDesc *format = new FormatDesc[streams.getCount()];
 		for (uint i = 0; i < streams.getCount(); i++){
 			format[i].stream = 0;
@@ -1565,7 +2890,73 @@ uint Model::makeDrawable(Renderer *renderer, const bool useCache, const ShaderID
 			format[i].size   = streams[i].nComponents;
 		}
 
-		if ((vertexFormat = renderer->addVertexFormat(format, streams.getCount(), shader)) == VF_NONE) return 0;
+		vertexFormat = renderer->addVertexFormat(format, streams.getCount(), shader);
+		delete [] format;
+		if (vertexFormat == VF_NONE) return 0;
+
+		const ubyte *data = (const ubyte *) compiled;
+		if ((vertexBuffer = renderer->addVertexBuffer(compiled->nVertices * vertexSize, STATIC, data + compiled->vertexOffset)) == VB_NONE) return 0;
+		if ((indexBuffer = renderer->addIndexBuffer(nIndices, compiled->indexSize, STATIC, data + compiled->indexOffset)) == IB_NONE) return 0;
+
+		if (positionOnly && !makePositionBuffers(renderer, data + compiled->vertexOffset, vertexSize, data + compiled->indexOffset, compiled->indexSize, shader)) return 0;
+
+		return compiled->nVertices;
+	}
+
+	if (useCache && lastVertices){
+		if ((vertexFormat = renderer->addVertexFormat(lastFormat, lastFormatCount, shader)) == VF_NONE) return 0;
+		if ((vertexBuffer = renderer->addVertexBuffer(lastVertexCount * lastVertexSize, STATIC, lastVertices)) == VB_NONE) return 0;
+
+		uint indexSize = (lastVertexCount > 65535)? 4 : 2;
+		if ((indexBuffer = renderer->addIndexBuffer(nIndices, indexSize, STATIC, lastIndices)) == IB_NONE) return 0;
+
+		if (positionOnly && !makePositionBuffers(renderer, (ubyte *) lastVertices, lastVertexSize, lastIndices, indexSize, shader)) return 0;
+
+		return lastVertexCount;
+	} else {
+		StreamID *aStreams = new StreamID[streams.getCount()];
+
+		for (uint i = 0; i < streams.getCount(); i++){
+			aStreams[i] = i;
+		}
+		float *vertices;
+		uint *indices;
+
+		uint nVertices = assemble(aStreams, streams.getCount(), &vertices, &indices, false);
+		if (optimizeOrder) nVertices = optimizeDrawOrder(vertices, indices, nVertices);
+		if (compression & COMPRESS_POSITION) nVertices = separateBatches(&vertices, indices, nVertices);
+
+		// Compute ranges for batches
+		computeBatchRanges(indices);
+
+		FormatDesc *format;
+		uint nFormats = streams.getCount();
+		positionRanges.clear();
+		if (compression){
+			PackedAttrib *attribs = new PackedAttrib[streams.getCount()];
+			nFormats = getPackedFormat(attribs, vertexSize);
+
+			if (compression & COMPRESS_POSITION) computePositionRanges(vertices, nVertices, positionRanges);
+			float *packed = packVertices(vertices, nVertices, attribs, nFormats, vertexSize, positionRanges);
+			delete [] vertices;
+			vertices = packed;
+
+			format = new FormatDesc[nFormats];
+			for (uint i = 0; i < nFormats; i++){
+				format[i] = attribs[i].format;
+			}
+			delete [] attribs;
+		} else {
+			format = new FormatDesc[streams.getCount()];
+			for (uint i = 0; i < streams.getCount(); i++){
+				format[i].stream = 0;
+				format[i].type   = streams[i].type;
+				format[i].format = FORMAT_FLOAT;
+				format[i].size   = streams[i].nComponents;
+			}
+		}
+
+		if ((vertexFormat = renderer->addVertexFormat(format, nFormats, shader)) == VF_NONE) return 0;
 		if ((vertexBuffer = renderer->addVertexBuffer(nVertices * vertexSize, STATIC, vertices)) == VB_NONE) return 0;
 
 		if (nVertices > 65535){
@@ -1576,6 +2967,8 @@ uint Model::makeDrawable(Renderer *renderer, const bool useCache, const ShaderID
 			if ((indexBuffer = renderer->addIndexBuffer(nIndices, 2, STATIC, indices)) == IB_NONE) return 0;
 		}
 
+		if (positionOnly && !makePositionBuffers(renderer, (ubyte *) vertices, vertexSize, indices, (nVertices > 65535)? 4 : 2, shader)) return 0;
+
 		delete aStreams;
 
 		if (useCache){
@@ -1584,6 +2977,8 @@ uint Model::makeDrawable(Renderer *renderer, const bool useCache, const ShaderID
 			delete lastIndices;
 
 			lastFormat = format;
+			lastFormatCount = nFormats;
+			lastVertexSize = vertexSize;
 			lastVertexCount = nVertices;
 			lastVertices = vertices;
 			lastIndices = indices;
@@ -1617,7 +3012,56 @@ void Model::draw(Renderer *renderer){
 	renderer->changeVertexBuffer(0, vertexBuffer);
 	renderer->changeIndexBuffer(indexBuffer);
 
-	renderer->drawElements(PRIM_TRIANGLES, 0, nIndices, 0, lastVertexCount);
+	if (positionRanges.getCount() > 1){
+		// Each batch has its own position range
+		for (uint j = 0; j < batches.getCount(); j++){
+			setPositionRange(renderer, j);
+			renderer->drawElements(PRIM_TRIANGLES, batches[j].startIndex, batches[j].nIndices, batches[j].startVertex, batches[j].nVertices);
+		}
+	} else {
+		if (positionRanges.getCount()) setPositionRange(renderer, 0);
+		renderer->drawElements(PRIM_TRIANGLES, 0, nIndices, 0, lastVertexCount);
+	}
+}
+
+void Model::drawDepth(Renderer *renderer){
+	if (positionBuffer == VB_NONE){
+		draw(renderer);
+		return;
+	}
+
+	renderer->changeVertexFormat(positionFormat);
+	renderer->changeVertexBuffer(0, positionBuffer);
+	renderer->changeIndexBuffer(positionIndexBuffer);
+
+	if (positionRanges.getCount() > 1){
+		for (uint j = 0; j < batches.getCount(); j++){
+			setPositionRange(renderer, j);
+			renderer->drawElements(PRIM_TRIANGLES, batches[j].startIndex, batches[j].nIndices, positionBatches[j].startVertex, positionBatches[j].nVertices);
+		}
+	} else {
+		if (positionRanges.getCount()) setPositionRange(renderer, 0);
+		renderer->drawElements(PRIM_TRIANGLES, 0, nIndices, 0, nPositions);
+	}
+}
+
+void Model::drawInstanced(Renderer *renderer, const uint nInstances){
+	ASSERT(vertexBuffer != VB_NONE);
+	ASSERT(indexBuffer  != IB_NONE);
+
+	renderer->changeVertexFormat(vertexFormat);
+	renderer->changeVertexBuffer(0, vertexBuffer);
+	renderer->changeIndexBuffer(indexBuffer);
+
+	if (positionRanges.getCount() > 1){
+		for (uint j = 0; j < batches.getCount(); j++){
+			setPositionRange(renderer, j);
+			renderer->drawElementsInstanced(PRIM_TRIANGLES, batches[j].startIndex, batches[j].nIndices, batches[j].startVertex, batches[j].nVertices, nInstances);
+		}
+	} else {
+		if (positionRanges.getCount()) setPositionRange(renderer, 0);
+		renderer->drawElementsInstanced(PRIM_TRIANGLES, 0, nIndices, 0, lastVertexCount, nInstances);
+	}
 }
 
 void Model::drawBatch(Renderer *renderer, const uint batch){
@@ -1628,6 +3072,7 @@ void Model::drawBatch(Renderer *renderer, const uint batch){
 	renderer->changeVertexBuffer(0, vertexBuffer);
 	renderer->changeIndexBuffer(indexBuffer);
 
+	if (positionRanges.getCount()) setPositionRange(renderer, batch);
 	renderer->drawElements(PRIM_TRIANGLES, batches[batch].startIndex, batches[batch].nIndices, batches[batch].startVertex, batches[batch].nVertices);
 }
 
@@ -1642,6 +3087,7 @@ void Model::drawSubBatch(Renderer *renderer, const uint batch, const uint first,
 	int startIndex = batches[batch].startIndex + first;
 	int indexCount = min(count, batches[batch].nIndices - first);
 
+	if (positionRanges.getCount()) setPositionRange(renderer, batch);
 	renderer->drawElements(PRIM_TRIANGLES, startIndex, indexCount, batches[batch].startVertex, batches[batch].nVertices);
 }
 
@@ -17,12 +17,23 @@
 #define _MODEL_H_
 
 #include "../Platform.h"
-#include "KdTree.h"
+#include "MeshOptimizer.h"
 #include "../Renderer.h"
 
 typedef int StreamID;
 typedef int BatchID;
 
+struct CompiledModelHeader;
+struct PackedAttrib;
+class WorkerPool;
+
+// Vertex compression in makeDrawable(), compressed models bind all attributes as generic attributes with the position first
+#define COMPRESS_POSITION      0x1 // Four snorm16 relative to the bounding box of each batch, decoded with positionScale and positionBias
+#define COMPRESS_TEXCOORD      0x2 // Half floats, for two and four component texture coordinates
+#define COMPRESS_NORMAL        0x4 // Octahedral in two snorm16, for normals without a tangent frame
+#define COMPRESS_TANGENT_FRAME 0x8 // Tangent, binormal and normal as a quaternion in four snorm16
+#define COMPRESS_ALL           0xF
+
 struct Stream {
 	float *vertices;
 	uint *indices;
@@ -41,6 +52,18 @@ struct Batch {
 	uint nVertices;
 };
 
+struct PositionRange {
+	vec3 scale;
+	vec3 bias;
+};
+
+struct CompressionError {
+	float position; // Along any axis
+	float texCoord; // In any component
+	float normal;   // Angle in radians, of any vector in a tangent frame
+	float frame;    // Angle in radians a tangent frame was turned to be made orthonormal
+};
+
 class Model {
 public:
 	Model();
@@ -63,7 +86,19 @@ public:
 
 	bool load(const char *fileName);
 	bool save(const char *fileName);
-	bool loadObj(const char *fileName);
+
+	// Version 4 files store the final interleaved vertices and indices in the optimized order and are mapped by load().
+	// A compiled model only keeps the vertex format in its streams, it can be drawn but not modified.
+	// The source key identifies what the file was compiled from, see loadCached().
+	bool saveCompiled(const char *fileName, const uint64 sourceKey = 0);
+	static bool compileFile(const char *srcFileName, const char *destFileName);
+
+	// Maps the compiled file, which is compiled again first if it's missing or its source or the compile options changed
+	bool loadCached(const char *srcFileName, const char *compiledFileName);
+	bool isCompiled() const { return compiled != NULL; }
+
+	// Chunks of the file are parsed in parallel if a worker pool is passed
+	bool loadObj(const char *fileName, WorkerPool *pool = NULL);
 	bool saveObj(const char *fileName);
 	bool loadT3d(const char *fileName, const bool removePortals = true, const bool removeInvisible = true, const bool removeTwoSided = false, const float texSize = 256.0f);
 
@@ -84,7 +119,9 @@ public:
 	void reverseWinding();
 	bool flipNormals();
 	bool computeNormals(const bool flat = false);
-	bool computeTangentSpace(const bool flat = false);
+	// Faces and vertices are processed in parallel chunks if a worker pool is passed, the result is the same either way.
+	// The SSE face loop can be turned off with useSIMD to check it against the scalar code.
+	bool computeTangentSpace(const bool flat = false, WorkerPool *pool = NULL, const bool useSIMD = true);
 	bool addStencilVolume();
 
 	void cleanUp();
@@ -97,27 +134,63 @@ public:
 	void clear();
 	void copy(const Model *model);
 
-	void optimize();
-	void optimizeStream(const StreamID streamID);
+	// Welds the vertices of the streams and returns how many were merged, see weldVertices().
+	// Streams that were welded exactly are skipped unless an epsilon is given.
+	uint optimize(const float epsilon = 0, WorkerPool *pool = NULL);
+	uint optimizeStream(const StreamID streamID, const float epsilon = 0, WorkerPool *pool = NULL);
 	uint assemble(const StreamID *aStreams, const uint nStreams, float **destVertices, uint **destIndices, bool separateArrays);
 
+	// Reorders triangles within batches for the vertex cache and overdraw, and vertices for fetching, in makeDrawable() and saveCompiled().
+	// The overdraw order is for the given view position, or for viewing the model from the outside without one, see optimizeOverdraw().
+	void setOptimizeOrder(const bool enable, const float *viewPosition = NULL);
+	const VertexCacheStats &getOrderStats(const bool optimized) const { return orderStats[optimized]; }
+
+	void setCompression(const uint flags);
+	uint getCompressedVertexSize() const;
+	// Compresses and decodes all vertices, returns false if the error of any value is above the bound of its format
+	bool validateCompression(CompressionError &error, CompressionError &bound);
+
+	// Builds a deduplicated position only vertex and index buffer in makeDrawable(), which drawDepth() uses
+	void setPositionOnly(const bool enable){ positionOnly = enable; }
+	uint getPositionCount() const { return nPositions; }
+
 	uint makeDrawable(Renderer *renderer, const bool useCache = true, const ShaderID shader = SHADER_NONE);
 	void unmakeDrawable(Renderer *renderer);
 
 	void setBuffers(Renderer *renderer);
 
 	void draw(Renderer *renderer);
+	void drawDepth(Renderer *renderer);
+	void drawInstanced(Renderer *renderer, const uint nInstances);
 	void drawBatch(Renderer *renderer, const uint batch);
 	void drawSubBatch(Renderer *renderer, const uint batch, const uint first, const uint count);
 
 	static uint *getArrayIndices(const uint nVertices);
 protected:
+	bool loadCompiled(const char *fileName, const uint64 sourceKey = 0);
+	void computeBatchRanges(const uint *indices);
+	uint optimizeDrawOrder(float *vertices, uint *indices, const uint nVertices);
+
+	uint getPackedFormat(PackedAttrib *attribs, uint &vertexSize) const;
+	uint separateBatches(float **vertices, uint *indices, const uint nVertices);
+	void computePositionRanges(const float *vertices, const uint nVertices, Array <PositionRange> &ranges) const;
+	float *packVertices(const float *vertices, const uint nVertices, const PackedAttrib *attribs, const uint nAttribs, const uint vertexSize, const Array <PositionRange> &ranges) const;
+	void setPositionRange(Renderer *renderer, const uint range);
+	bool makePositionBuffers(Renderer *renderer, const ubyte *vertices, const uint vertexSize, const void *indices, const uint indexSize, const ShaderID shader);
 
 	uint nIndices;
 
 	VertexFormatID vertexFormat;
 	VertexBufferID vertexBuffer;
 	IndexBufferID indexBuffer;
+
+	// Position only buffers for depth passes
+	VertexFormatID positionFormat;
+	VertexBufferID positionBuffer;
+	IndexBufferID positionIndexBuffer;
+	Array <Batch> positionBatches;
+	uint nPositions;
+	bool positionOnly;
 	
 	Array <Stream> streams;
 	Array <Batch> batches;
@@ -127,6 +200,20 @@ protected:
 	float *lastVertices;
 	uint *lastIndices;
 	FormatDesc *lastFormat;
+	uint lastFormatCount;
+	uint lastVertexSize;
+
+	uint compression;
+	Array <PositionRange> positionRanges;
+
+	bool optimizeOrder;
+	bool orderViewSet;
+	float orderView[3];
+	VertexCacheStats orderStats[2];
+
+	// Mapped version 4 file
+	const CompiledModelHeader *compiled;
+	size_t compiledSize;
 };
 
 #endif // _MODEL_H_
@@ -16,22 +16,6 @@
 #include "Tokenizer.h"
 #include <stdio.h>
 
-bool isWhiteSpace(const char ch){
-	return (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n');
-}
-
-bool isNumeric(const char ch){
-	return (ch >= '0' && ch <= '9');
-}
-
-bool isAlphabetical(const char ch){
-	return ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_');
-}
-
-bool isNewLine(const char ch){
-	return (ch == '\r' || ch == '\n');
-}
-
 
 Tokenizer::Tokenizer(unsigned int nBuffers){
 	str = NULL;
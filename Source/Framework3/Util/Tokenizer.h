@@ -21,10 +21,21 @@
 
 typedef bool (*BOOLFUNC)(const char ch);
 
-bool isWhiteSpace(const char ch);
-bool isNumeric(const char ch);
-bool isAlphabetical(const char ch);
-bool isNewLine(const char ch);
+inline bool isWhiteSpace(const char ch){
+	return (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n');
+}
+
+inline bool isNumeric(const char ch){
+	return (ch >= '0' && ch <= '9');
+}
+
+inline bool isAlphabetical(const char ch){
+	return ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_');
+}
+
+inline bool isNewLine(const char ch){
+	return (ch == '\r' || ch == '\n');
+}
 
 struct TokBuffer {
 	char *buffer;
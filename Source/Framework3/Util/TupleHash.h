@@ -0,0 +1,206 @@
+/***********      .---.         .-"-.      *******************\
+* -------- *     /   ._.       /  ` \     * ---------------- *
+* Author's *     \_  (__\      \_v_/     * humus@rogers.com *
+*   note   *     //   \\       //   \\     * ICQ #47010716    *
+* -------- *    ((     ))     ((     ))    * ---------------- *
+*          ****--""---""-------""---""--****                  ********\
+* This file is a part of the work done by Humus. You are free to use  *
+* the code in any way you like, modified, unmodified or copy'n'pasted *
+* into your own work. However, I expect you to respect these points:  *
+*  @ If you use this file and its contents unmodified, or use a major *
+*    part of this file, please credit the author and leave this note. *
+*  @ For use in anything commercial, please request my approval.      *
+*  @ Share your work and ideas too as much as you can.                *
+\*********************************************************************/
+
+#ifndef _TUPLEHASH_H_
+#define _TUPLEHASH_H_
+
+#include "../Platform.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef USE_SSE
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#define TUPLE_GROUP_SIZE 16
+#define TUPLE_TAG_EMPTY  0
+
+static forceinline uint lowestBitIndex(const uint bits){
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, bits);
+	return index;
+#else
+	return __builtin_ctz(bits);
+#endif
+}
+
+/*
+	Maps tuples of dim integers to consecutive indices in the order they are first
+	inserted, like Hash, but it grows as needed. Slots are probed a group of 16 at a
+	time. Every slot has a tag byte holding 7 bits of the hash, so one SSE2 compare
+	checks a whole group and tuples are only compared when their tags match.
+	Tuples are never removed, so the first empty slot ends a probe.
+*/
+template <class TYPE>
+class TupleHash {
+public:
+	TupleHash(const uint dim, const uint expectedCount = 0){
+		nDim = dim;
+		count = 0;
+		capasity = 0;
+		keys = NULL;
+
+		nGroups = 0;
+		tags = NULL;
+		slots = NULL;
+
+		reserve(expectedCount);
+	}
+
+	~TupleHash(){
+		free(keys);
+		free(tags);
+		free(slots);
+	}
+
+	// Returns true if the tuple was already inserted, index gets its index either way
+	bool insert(const TYPE *tuple, uint *index){
+		if (count >= getMaxCount()) reserve(count + 1);
+
+		uint hash = hashTuple(tuple);
+		ubyte tag = ubyte(hash >> 25) | 0x80;
+
+		uint group = hash & (nGroups - 1);
+		while (true){
+			const ubyte *groupTags = tags + group * TUPLE_GROUP_SIZE;
+			uint matches = matchTag(groupTags, tag);
+			while (matches){
+				uint entry = slots[group * TUPLE_GROUP_SIZE + lowestBitIndex(matches)];
+				if (isEqual(keys + entry * nDim, tuple)){
+					*index = entry;
+					return true;
+				}
+				matches &= matches - 1;
+			}
+
+			uint empty = matchTag(groupTags, TUPLE_TAG_EMPTY);
+			if (empty){
+				uint slot = group * TUPLE_GROUP_SIZE + lowestBitIndex(empty);
+				tags[slot] = tag;
+				slots[slot] = count;
+
+				if (count >= capasity){
+					capasity += capasity;
+					keys = (TYPE *) realloc(keys, capasity * nDim * sizeof(TYPE));
+				}
+				memcpy(keys + count * nDim, tuple, nDim * sizeof(TYPE));
+
+				*index = count++;
+				return false;
+			}
+
+			group = (group + 1) & (nGroups - 1);
+		}
+	}
+
+	// Makes room for nTuples tuples without growing
+	void reserve(const uint nTuples){
+		if (nTuples > capasity){
+			capasity = max(nTuples, 8);
+			keys = (TYPE *) realloc(keys, capasity * nDim * sizeof(TYPE));
+		}
+
+		uint groups = max(nGroups, 1);
+		while (groups * (TUPLE_GROUP_SIZE * 7 / 8) < nTuples) groups += groups;
+		if (groups != nGroups) rehash(groups);
+	}
+
+	uint getCount() const { return count; }
+	const TYPE *getTuple(const uint index) const { return keys + index * nDim; }
+
+protected:
+	// The groups are kept at most 7/8 full
+	uint getMaxCount() const { return nGroups * (TUPLE_GROUP_SIZE * 7 / 8); }
+
+	// Murmur3 style mixing of every element and the finalizer, so tuples of small consecutive integers spread well
+	uint hashTuple(const TYPE *tuple) const {
+		uint h = nDim;
+		for (uint i = 0; i < nDim; i++){
+			uint k = uint(tuple[i]) * 0xCC9E2D51;
+			k = (k << 15) | (k >> 17);
+			h ^= k * 0x1B873593;
+			h = ((h << 13) | (h >> 19)) * 5 + 0xE6546B64;
+		}
+
+		h ^= h >> 16;
+		h *= 0x85EBCA6B;
+		h ^= h >> 13;
+		h *= 0xC2B2AE35;
+		h ^= h >> 16;
+
+		return h;
+	}
+
+	forceinline bool isEqual(const TYPE *key, const TYPE *tuple) const {
+		for (uint i = 0; i < nDim; i++){
+			if (key[i] != tuple[i]) return false;
+		}
+		return true;
+	}
+
+	static forceinline uint matchTag(const ubyte *groupTags, const ubyte tag){
+#ifdef USE_SSE
+		__m128i t = _mm_loadu_si128((const __m128i *) groupTags);
+		return _mm_movemask_epi8(_mm_cmpeq_epi8(t, _mm_set1_epi8((char) tag)));
+#else
+		uint bits = 0;
+		for (uint i = 0; i < TUPLE_GROUP_SIZE; i++){
+			if (groupTags[i] == tag) bits |= (1 << i);
+		}
+		return bits;
+#endif
+	}
+
+	void rehash(const uint groups){
+		free(tags);
+		free(slots);
+
+		nGroups = groups;
+		tags = (ubyte *) malloc(nGroups * TUPLE_GROUP_SIZE);
+		slots = (uint *) malloc(nGroups * TUPLE_GROUP_SIZE * sizeof(uint));
+		memset(tags, TUPLE_TAG_EMPTY, nGroups * TUPLE_GROUP_SIZE);
+
+		// The tuples are all different, so they only need an empty slot
+		for (uint entry = 0; entry < count; entry++){
+			uint hash = hashTuple(keys + entry * nDim);
+			uint group = hash & (nGroups - 1);
+
+			uint empty;
+			while ((empty = matchTag(tags + group * TUPLE_GROUP_SIZE, TUPLE_TAG_EMPTY)) == 0){
+				group = (group + 1) & (nGroups - 1);
+			}
+
+			uint slot = group * TUPLE_GROUP_SIZE + lowestBitIndex(empty);
+			tags[slot] = ubyte(hash >> 25) | 0x80;
+			slots[slot] = entry;
+		}
+	}
+
+	uint nDim;
+	uint count;
+	uint capasity;
+	TYPE *keys;
+
+	uint nGroups;
+	ubyte *tags;
+	uint *slots;
+};
+
+#endif // _TUPLEHASH_H_
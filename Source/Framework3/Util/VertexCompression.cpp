@@ -0,0 +1,144 @@
+/***********      .---.         .-"-.      *******************\
+* -------- *     /   ._.       /  ` \     * ---------------- *
+* Author's *     \_  (__\      \_v_/     * humus@rogers.com *
+*   note   *     //   \\       //   \\     * ICQ #47010716    *
+* -------- *    ((     ))     ((     ))    * ---------------- *
+*          ****--""---""-------""---""--****                  ********\
+* This file is a part of the work done by Humus. You are free to use  *
+* the code in any way you like, modified, unmodified or copy'n'pasted *
+* into your own work. However, I expect you to respect these points:  *
+*  @ If you use this file and its contents unmodified, or use a major *
+*    part of this file, please credit the author and leave this note. *
+*  @ For use in anything commercial, please request my approval.      *
+*  @ Share your work and ideas too as much as you can.                *
+\*********************************************************************/
+
+#include "VertexCompression.h"
+
+short packSnorm16(const float x){
+	float s = clamp(x, -1.0f, 1.0f) * 32767.0f;
+	return (short) ((s < 0)? s - 0.5f : s + 0.5f);
+}
+
+float unpackSnorm16(const short x){
+	return max(float(x) * (1.0f / 32767.0f), -1.0f);
+}
+
+static inline float signNotZero(const float x){
+	return (x < 0)? -1.0f : 1.0f;
+}
+
+void packOctahedral(const vec3 &v, short *dest){
+	float d = fabsf(v.x) + fabsf(v.y) + fabsf(v.z);
+	float x = v.x / d;
+	float y = v.y / d;
+	if (v.z < 0){
+		float fx = (1 - fabsf(y)) * signNotZero(x);
+		float fy = (1 - fabsf(x)) * signNotZero(y);
+		x = fx;
+		y = fy;
+	}
+	dest[0] = packSnorm16(x);
+	dest[1] = packSnorm16(y);
+}
+
+vec3 unpackOctahedral(const short *src){
+	vec3 v(unpackSnorm16(src[0]), unpackSnorm16(src[1]), 0);
+	v.z = 1 - fabsf(v.x) - fabsf(v.y);
+	if (v.z < 0){
+		float x = (1 - fabsf(v.y)) * signNotZero(v.x);
+		float y = (1 - fabsf(v.x)) * signNotZero(v.y);
+		v.x = x;
+		v.y = y;
+	}
+	return normalize(v);
+}
+
+bool orthonormalizeTangentFrame(const vec3 &tangent, const vec3 &binormal, const vec3 &normal, vec3 &t, vec3 &b, vec3 &n){
+	n = normalize(normal);
+
+	// Any perpendicular vector will do for a tangent along the normal
+	t = tangent - n * dot(n, tangent);
+	if (dot(t, t) < 1e-12f){
+		t = (fabsf(n.x) < 0.5f)? vec3(1, 0, 0) : vec3(0, 1, 0);
+		t -= n * dot(n, t);
+	}
+	t = normalize(t);
+	b = cross(n, t);
+
+	bool reflected = (dot(b, binormal) < 0);
+	if (reflected) b = -b;
+
+	return reflected;
+}
+
+void packTangentFrame(const vec3 &tangent, const vec3 &binormal, const vec3 &normal, short *dest){
+	vec3 t, b, n;
+	bool reflected = orthonormalizeTangentFrame(tangent, binormal, normal, t, b, n);
+	if (reflected) b = -b;
+
+	// Quaternion for the rotation with t, b and n as columns
+	float q[4];
+	float trace = t.x + b.y + n.z;
+	if (trace > 0){
+		float s = 0.5f / sqrtf(trace + 1);
+		q[0] = (b.z - n.y) * s;
+		q[1] = (n.x - t.z) * s;
+		q[2] = (t.y - b.x) * s;
+		q[3] = 0.25f / s;
+	} else if (t.x > b.y && t.x > n.z){
+		float s = 2 * sqrtf(1 + t.x - b.y - n.z);
+		q[0] = 0.25f * s;
+		q[1] = (b.x + t.y) / s;
+		q[2] = (n.x + t.z) / s;
+		q[3] = (b.z - n.y) / s;
+	} else if (b.y > n.z){
+		float s = 2 * sqrtf(1 + b.y - t.x - n.z);
+		q[0] = (b.x + t.y) / s;
+		q[1] = 0.25f * s;
+		q[2] = (n.y + b.z) / s;
+		q[3] = (n.x - t.z) / s;
+	} else {
+		float s = 2 * sqrtf(1 + n.z - t.x - b.y);
+		q[0] = (n.x + t.z) / s;
+		q[1] = (n.y + b.z) / s;
+		q[2] = 0.25f * s;
+		q[3] = (t.y - b.x) / s;
+	}
+
+	float len = sqrtf(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+	float sign = (q[3] < 0)? -1.0f : 1.0f;
+	for (uint k = 0; k < 4; k++){
+		q[k] *= sign / len;
+	}
+
+	// Keep w at least one step above zero
+	const float bias = 1.0f / 32767.0f;
+	if (q[3] < bias){
+		float xyz = sqrtf(q[0] * q[0] + q[1] * q[1] + q[2] * q[2]);
+		float f = sqrtf(1 - bias * bias) / xyz;
+		q[0] *= f;
+		q[1] *= f;
+		q[2] *= f;
+		q[3] = bias;
+	}
+
+	if (reflected){
+		for (uint k = 0; k < 4; k++){
+			q[k] = -q[k];
+		}
+	}
+
+	for (uint k = 0; k < 4; k++){
+		dest[k] = packSnorm16(q[k]);
+	}
+}
+
+void unpackTangentFrame(const short *src, vec3 &tangent, vec3 &binormal, vec3 &normal){
+	vec4 q(unpackSnorm16(src[0]), unpackSnorm16(src[1]), unpackSnorm16(src[2]), unpackSnorm16(src[3]));
+	q = normalize(q);
+
+	tangent = vec3(1 - 2 * (q.y * q.y + q.z * q.z), 2 * (q.x * q.y + q.w * q.z), 2 * (q.x * q.z - q.w * q.y));
+	normal  = vec3(2 * (q.x * q.z + q.w * q.y), 2 * (q.y * q.z - q.w * q.x), 1 - 2 * (q.x * q.x + q.y * q.y));
+	binormal = cross(normal, tangent) * signNotZero(q.w);
+}
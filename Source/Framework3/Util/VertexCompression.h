@@ -0,0 +1,40 @@
+/***********      .---.         .-"-.      *******************\
+* -------- *     /   ._.       /  ` \     * ---------------- *
+* Author's *     \_  (__\      \_v_/     * humus@rogers.com *
+*   note   *     //   \\       //   \\     * ICQ #47010716    *
+* -------- *    ((     ))     ((     ))    * ---------------- *
+*          ****--""---""-------""---""--****                  ********\
+* This file is a part of the work done by Humus. You are free to use  *
+* the code in any way you like, modified, unmodified or copy'n'pasted *
+* into your own work. However, I expect you to respect these points:  *
+*  @ If you use this file and its contents unmodified, or use a major *
+*    part of this file, please credit the author and leave this note. *
+*  @ For use in anything commercial, please request my approval.      *
+*  @ Share your work and ideas too as much as you can.                *
+\*********************************************************************/
+
+#ifndef _VERTEXCOMPRESSION_H_
+#define _VERTEXCOMPRESSION_H_
+
+#include "../Math/Vector.h"
+
+// 16 bit signed normalized, -1 and 1 map to -32767 and 32767
+short packSnorm16(const float x);
+float unpackSnorm16(const short x);
+
+// Unit vector mapped to the octahedron with the lower half folded over, in two snorm16
+void packOctahedral(const vec3 &v, short *dest);
+vec3 unpackOctahedral(const short *src);
+
+// Gram-Schmidt keeping the normal, the binormal becomes cross(n, t) or its negation for a reflected frame. Returns true for a reflected frame.
+bool orthonormalizeTangentFrame(const vec3 &tangent, const vec3 &binormal, const vec3 &normal, vec3 &t, vec3 &b, vec3 &n);
+
+/*
+	Tangent frame as a quaternion in four snorm16. The frame is made orthonormal
+	first, and the binormal is rebuilt from the normal and tangent when unpacking. A reflected frame is stored with a negative w, which is kept away
+	from zero so that its sign survives the quantization.
+*/
+void packTangentFrame(const vec3 &tangent, const vec3 &binormal, const vec3 &normal, short *dest);
+void unpackTangentFrame(const short *src, vec3 &tangent, vec3 &binormal, vec3 &normal);
+
+#endif // _VERTEXCOMPRESSION_H_
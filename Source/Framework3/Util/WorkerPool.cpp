@@ -0,0 +1,135 @@
+/***********      .---.         .-"-.      *******************\
+* -------- *     /   ._.       /  ` \     * ---------------- *
+* Author's *     \_  (__\      \_v_/     * humus@rogers.com *
+*   note   *     //   \\       //   \\     * ICQ #47010716    *
+* -------- *    ((     ))     ((     ))    * ---------------- *
+*          ****--""---""-------""---""--****                  ********\
+* This file is a part of the work done by Humus. You are free to use  *
+* the code in any way you like, modified, unmodified or copy'n'pasted *
+* into your own work. However, I expect you to respect these points:  *
+*  @ If you use this file and its contents unmodified, or use a major *
+*    part of this file, please credit the author and leave this note. *
+*  @ For use in anything commercial, please request my approval.      *
+*  @ Share your work and ideas too as much as you can.                *
+\*********************************************************************/
+
+#include "WorkerPool.h"
+
+WorkerPool::WorkerPool(){
+	threads = NULL;
+	nThreads = 0;
+
+	proc = NULL;
+	data = NULL;
+	count = 0;
+	next = 0;
+	finished = 0;
+	generation = 0;
+	quit = false;
+}
+
+WorkerPool::~WorkerPool(){
+	stop();
+}
+
+void WorkerPool::start(const uint threadCount){
+	stop();
+
+	createMutex(mutex);
+	createCondition(workReady);
+	createCondition(workDone);
+	quit = false;
+
+	threads = new ThreadHandle[threadCount];
+	for (nThreads = 0; nThreads < threadCount; nThreads++){
+		threads[nThreads] = createThread(threadFunc, this);
+	}
+}
+
+void WorkerPool::stop(){
+	if (threads == NULL) return;
+
+	lockMutex(mutex);
+	quit = true;
+	broadcastCondition(workReady);
+	unlockMutex(mutex);
+
+	for (uint i = 0; i < nThreads; i++){
+		waitOnThread(threads[i]);
+		deleteThread(threads[i]);
+	}
+	delete threads;
+	threads = NULL;
+	nThreads = 0;
+
+	deleteCondition(workDone);
+	deleteCondition(workReady);
+	deleteMutex(mutex);
+}
+
+void WorkerPool::run(WorkerProc proc, void *data, const uint count){
+	if (threads == NULL){
+		for (uint i = 0; i < count; i++){
+			proc(data, i);
+		}
+		return;
+	}
+
+	lockMutex(mutex);
+	this->proc = proc;
+	this->data = data;
+	this->count = count;
+	next = 0;
+	finished = 0;
+	generation++;
+	broadcastCondition(workReady);
+	unlockMutex(mutex);
+
+	execute();
+
+	lockMutex(mutex);
+	while (finished < count){
+		waitCondition(workDone, mutex);
+	}
+	unlockMutex(mutex);
+}
+
+void WorkerPool::threadFunc(void *param){
+	WorkerPool *pool = (WorkerPool *) param;
+
+	uint lastGeneration = 0;
+
+	lockMutex(pool->mutex);
+	while (true){
+		while (!pool->quit && pool->generation == lastGeneration){
+			waitCondition(pool->workReady, pool->mutex);
+		}
+		if (pool->quit) break;
+		lastGeneration = pool->generation;
+
+		unlockMutex(pool->mutex);
+		pool->execute();
+		lockMutex(pool->mutex);
+	}
+	unlockMutex(pool->mutex);
+}
+
+void WorkerPool::execute(){
+	while (true){
+		lockMutex(mutex);
+		if (next >= count){
+			unlockMutex(mutex);
+			return;
+		}
+		uint index = next++;
+		WorkerProc itemProc = proc;
+		void *itemData = data;
+		unlockMutex(mutex);
+
+		itemProc(itemData, index);
+
+		lockMutex(mutex);
+		if (++finished == count) signalCondition(workDone);
+		unlockMutex(mutex);
+	}
+}
@@ -0,0 +1,61 @@
+/***********      .---.         .-"-.      *******************\
+* -------- *     /   ._.       /  ` \     * ---------------- *
+* Author's *     \_  (__\      \_v_/     * humus@rogers.com *
+*   note   *     //   \\       //   \\     * ICQ #47010716    *
+* -------- *    ((     ))     ((     ))    * ---------------- *
+*          ****--""---""-------""---""--****                  ********\
+* This file is a part of the work done by Humus. You are free to use  *
+* the code in any way you like, modified, unmodified or copy'n'pasted *
+* into your own work. However, I expect you to respect these points:  *
+*  @ If you use this file and its contents unmodified, or use a major *
+*    part of this file, please credit the author and leave this note. *
+*  @ For use in anything commercial, please request my approval.      *
+*  @ Share your work and ideas too as much as you can.                *
+\*********************************************************************/
+
+#ifndef _WORKERPOOL_H_
+#define _WORKERPOOL_H_
+
+#include "Thread.h"
+
+typedef void (*WorkerProc)(void *data, const uint index);
+
+/*
+	A fixed set of threads that share the items of a job. The calling thread
+	works on the job too, so a pool started with zero threads runs everything
+	serially. Items are handed out one at a time, so they should be coarse.
+*/
+class WorkerPool {
+public:
+	WorkerPool();
+	~WorkerPool();
+
+	void start(const uint threadCount);
+	void stop();
+
+	// Calls proc(data, i) for every i in [0, count) and returns once all calls are done
+	void run(WorkerProc proc, void *data, const uint count);
+
+	uint getThreadCount() const { return nThreads; }
+
+protected:
+	static void threadFunc(void *param);
+	void execute();
+
+	ThreadHandle *threads;
+	uint nThreads;
+
+	Mutex mutex;
+	Condition workReady;
+	Condition workDone;
+
+	WorkerProc proc;
+	void *data;
+	uint count;
+	uint next;
+	uint finished;
+	uint generation;
+	bool quit;
+};
+
+#endif // _WORKERPOOL_H_